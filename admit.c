@@ -0,0 +1,102 @@
+#include "admit.h"
+
+#include <stdatomic.h>
+#include <sys/random.h>
+
+#define ADMIT_SLOTS (1u << ADMIT_SLOTS_BITS)
+#define ADMIT_SCALE 1000        /* a token, levels are kept in thousandths */
+#define ADMIT_SKEW 1000         /* ms another thread's clock may be ahead by */
+
+/*
+ A bucket word is the time it was last charged, the low 32 bits of the
+ millisecond clock plus one, over its level. Zero is a bucket nobody has
+ touched yet, which counts as full. At ADMIT_SCALE per token, rate
+ tokens a second is rate thousandths a millisecond.
+ */
+struct admit_s {
+    uint64_t key;               /* odd multiplier for the hash */
+    uint32_t rate;
+    uint32_t capacity;          /* burst, scaled */
+    _Atomic uint64_t refused;
+    _Atomic uint64_t slots[ADMIT_SLOTS];
+};
+
+static unsigned admit_hash(admit_s *a, uint32_t ip);
+
+admit_s *admit_s_(unsigned rate, unsigned burst)
+{
+    admit_s *a = del_allocz(sizeof *a);
+    
+    if(getrandom(&a->key, sizeof a->key, 0) != sizeof a->key)
+        a->key = (uint64_t)rand() << 32 | (uint64_t)rand();
+    a->key |= 1;
+    a->rate = rate;
+    if(burst < 1)
+        burst = 1;
+    if(burst > UINT32_MAX / ADMIT_SCALE)
+        burst = UINT32_MAX / ADMIT_SCALE;
+    a->capacity = burst * ADMIT_SCALE;
+    return a;
+}
+
+void admit_destroy(admit_s *a)
+{
+    free(a);
+}
+
+bool admit_take(admit_s *a, uint32_t ip, uint64_t now)
+{
+    _Atomic uint64_t *slot = &a->slots[admit_hash(a, ip)];
+    uint64_t old, level, refill;
+    uint32_t t, last;
+    int32_t elapsed;
+    
+    /* Wraps every 49 days, elapsed time is taken modulo that */
+    t = (uint32_t)now + 1;
+    if(!t)
+        t = 1;
+    
+    old = atomic_load_explicit(slot, memory_order_relaxed);
+    do {
+        if(!old) {
+            last = t;
+            level = a->capacity;
+        }
+        else {
+            last = (uint32_t)(old >> 32);
+            level = (uint32_t)old;
+            /*
+             Another thread may have charged it with a slightly later
+             clock. Much further back means the clock wrapped since.
+             */
+            elapsed = (int32_t)(t - last);
+            if(elapsed > 0) {
+                refill = (uint64_t)elapsed * a->rate;
+                level = refill >= a->capacity - level ? a->capacity : level + refill;
+                last = t;
+            }
+            else if(elapsed < -ADMIT_SKEW) {
+                level = a->capacity;
+                last = t;
+            }
+        }
+        
+        /* Left as is, so what has trickled in since last is kept */
+        if(level < ADMIT_SCALE) {
+            atomic_fetch_add_explicit(&a->refused, 1, memory_order_relaxed);
+            return false;
+        }
+    } while(!atomic_compare_exchange_weak_explicit(slot, &old, (uint64_t)last << 32 | (level - ADMIT_SCALE),
+                                                   memory_order_relaxed, memory_order_relaxed));
+    return true;
+}
+
+uint64_t admit_refused(admit_s *a)
+{
+    return atomic_exchange_explicit(&a->refused, 0, memory_order_relaxed);
+}
+
+unsigned admit_hash(admit_s *a, uint32_t ip)
+{
+    return (unsigned)((ip * a->key) >> (64 - ADMIT_SLOTS_BITS));
+}
@@ -0,0 +1,29 @@
+
+#ifndef __TCPDelegate__admit__
+#define __TCPDelegate__admit__
+
+#include "general.h"
+
+#define ADMIT_SLOTS_BITS 16
+
+typedef struct admit_s admit_s;
+
+/*
+ Token buckets keyed by client IPv4 address, refilling at rate tokens a
+ second up to burst. Each bucket is a single 64 bit word updated with
+ compare and swap, so every thread can charge it without a lock. There
+ is no per address allocation: addresses hash into a fixed array of
+ buckets and ones that collide share a bucket, which can only make the
+ limit stricter for them. The hash is keyed at random so collisions
+ can't be picked by a client.
+ */
+extern admit_s *admit_s_(unsigned rate, unsigned burst);
+extern void admit_destroy(admit_s *a);
+
+/* Charges a token to ip as of now in milliseconds, false if it has none left. */
+extern bool admit_take(admit_s *a, uint32_t ip, uint64_t now);
+
+/* Refusals since the last call. */
+extern uint64_t admit_refused(admit_s *a);
+
+#endif /* defined(__TCPDelegate__admit__) */
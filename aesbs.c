@@ -0,0 +1,506 @@
+/*
+ The layout and the S-box circuit are those of BearSSL's aes_ct64, which
+ takes the S-box from Boyar and Peralta's 113 gate circuit.
+
+ Each 64-bit word holds one bit of every byte of four blocks, q[0] the low
+ bits. Its four 16-bit quarters are the state's rows, each with one column
+ of each block in every nibble, so ShiftRows moves bits within a quarter
+ and MixColumns rotates whole quarters. Two of those words side by side in
+ a 128-bit register take eight blocks, GCC's vector extensions turn the
+ word operations into SSE2 on x86 and NEON on ARM.
+ */
+#include "aesbs.h"
+
+#include <string.h>
+
+#define AESBS_LANES 8       /* blocks a batch, four in each half of a register */
+
+#define GET32(p) ((uint32_t)(p)[0] | (uint32_t)(p)[1] << 8 | (uint32_t)(p)[2] << 16 | (uint32_t)(p)[3] << 24)
+
+#define SWAPN(cl, ch, s, x, y) do { \
+        bsword_v a = (x), b = (y); \
+        (x) = (a & (uint64_t)(cl)) | ((b & (uint64_t)(cl)) << (s)); \
+        (y) = ((a & (uint64_t)(ch)) >> (s)) | (b & (uint64_t)(ch)); \
+    } while(0)
+#define SWAP2(x, y) SWAPN(0x5555555555555555, 0xAAAAAAAAAAAAAAAA, 1, x, y)
+#define SWAP4(x, y) SWAPN(0x3333333333333333, 0xCCCCCCCCCCCCCCCC, 2, x, y)
+#define SWAP8(x, y) SWAPN(0x0F0F0F0F0F0F0F0F, 0xF0F0F0F0F0F0F0F0, 4, x, y)
+
+typedef uint64_t bsword_v __attribute__((vector_size(16)));
+typedef void (*aesbs_rounds_f)(bsword_v *q, const uint64_t *sk, unsigned rounds);
+
+static void aesbs_run(const aes_key_s *k, const uint8_t *in, uint8_t *out, size_t nblocks, aesbs_rounds_f rounds);
+static void aesbs_batch(const aes_key_s *k, const uint8_t *in, uint8_t *out, aesbs_rounds_f rounds);
+static void encrypt_rounds(bsword_v *q, const uint64_t *sk, unsigned rounds);
+static void decrypt_rounds(bsword_v *q, const uint64_t *sk, unsigned rounds);
+static inline void interleave_in(bsword_v *q0, bsword_v *q1, const uint8_t *a, const uint8_t *b);
+static inline void interleave_out(uint8_t *a, uint8_t *b, bsword_v q0, bsword_v q1);
+static inline void ortho(bsword_v *q);
+static inline void add_round_key(bsword_v *q, const uint64_t *sk);
+static inline void sbox(bsword_v *q);
+static inline void inv_sbox(bsword_v *q);
+static inline void inv_affine(bsword_v *q);
+static inline void shift_rows(bsword_v *q);
+static inline void inv_shift_rows(bsword_v *q);
+static inline bsword_v rotr32(bsword_v x);
+static inline void mix_columns(bsword_v *q);
+static inline void inv_mix_columns(bsword_v *q);
+
+/* Every round key goes to all four blocks of a word, both halves alike. */
+void aesbs_key_init(aes_key_s *k)
+{
+    bsword_v q[8];
+    unsigned r, i;
+    
+    for(r = 0; r <= k->rounds; r++) {
+        for(i = 0; i < 4; i++)
+            interleave_in(&q[i], &q[i+4], k->enc[r].b[0], k->enc[r].b[0]);
+        ortho(q);
+        for(i = 0; i < 8; i++)
+            k->bs[8*r + i] = q[i][0];
+    }
+}
+
+uint32_t aesbs_sub_word(uint32_t w)
+{
+    bsword_v q[8];
+    
+    memset(q, 0, sizeof(q));
+    q[0][0] = w;
+    ortho(q);
+    sbox(q);
+    ortho(q);
+    return q[0][0];
+}
+
+void aesbs_encrypt(const aes_key_s *k, const uint8_t *in, uint8_t *out, size_t nblocks)
+{
+    aesbs_run(k, in, out, nblocks, encrypt_rounds);
+}
+
+void aesbs_decrypt(const aes_key_s *k, const uint8_t *in, uint8_t *out, size_t nblocks)
+{
+    aesbs_run(k, in, out, nblocks, decrypt_rounds);
+}
+
+/* A short last batch is filled out with zeros on the stack. */
+void aesbs_run(const aes_key_s *k, const uint8_t *in, uint8_t *out, size_t nblocks, aesbs_rounds_f rounds)
+{
+    uint8_t buf[AESBS_LANES*AES_BLOCK_BYTELEN];
+    
+    for(; nblocks >= AESBS_LANES; nblocks -= AESBS_LANES) {
+        aesbs_batch(k, in, out, rounds);
+        in += sizeof(buf);
+        out += sizeof(buf);
+    }
+    if(nblocks) {
+        memset(buf, 0, sizeof(buf));
+        memcpy(buf, in, nblocks*AES_BLOCK_BYTELEN);
+        aesbs_batch(k, buf, buf, rounds);
+        memcpy(out, buf, nblocks*AES_BLOCK_BYTELEN);
+    }
+}
+
+/* Blocks 0 to 3 go in the low halves, 4 to 7 in the high ones. */
+void aesbs_batch(const aes_key_s *k, const uint8_t *in, uint8_t *out, aesbs_rounds_f rounds)
+{
+    bsword_v q[8];
+    unsigned i;
+    
+    for(i = 0; i < 4; i++)
+        interleave_in(&q[i], &q[i+4], &in[i*AES_BLOCK_BYTELEN], &in[(i+4)*AES_BLOCK_BYTELEN]);
+    ortho(q);
+    rounds(q, k->bs, k->rounds);
+    ortho(q);
+    for(i = 0; i < 4; i++)
+        interleave_out(&out[i*AES_BLOCK_BYTELEN], &out[(i+4)*AES_BLOCK_BYTELEN], q[i], q[i+4]);
+}
+
+void encrypt_rounds(bsword_v *q, const uint64_t *sk, unsigned rounds)
+{
+    unsigned r;
+    
+    add_round_key(q, sk);
+    for(r = 1; r < rounds; r++) {
+        sbox(q);
+        shift_rows(q);
+        mix_columns(q);
+        add_round_key(q, &sk[8*r]);
+    }
+    sbox(q);
+    shift_rows(q);
+    add_round_key(q, &sk[8*rounds]);
+}
+
+void decrypt_rounds(bsword_v *q, const uint64_t *sk, unsigned rounds)
+{
+    unsigned r;
+    
+    add_round_key(q, &sk[8*rounds]);
+    for(r = rounds - 1; r > 0; r--) {
+        inv_shift_rows(q);
+        inv_sbox(q);
+        add_round_key(q, &sk[8*r]);
+        inv_mix_columns(q);
+    }
+    inv_shift_rows(q);
+    inv_sbox(q);
+    add_round_key(q, sk);
+}
+
+/*
+ The block's bytes spread out to every other byte of q0 and q1, so that
+ ortho finds the four blocks' bytes in the order it wants them.
+ */
+inline void interleave_in(bsword_v *q0, bsword_v *q1, const uint8_t *a, const uint8_t *b)
+{
+    bsword_v x[4];
+    unsigned i;
+    
+    for(i = 0; i < 4; i++) {
+        x[i] = (bsword_v){GET32(&a[4*i]), GET32(&b[4*i])};
+        x[i] |= x[i] << 16;
+        x[i] &= 0x0000FFFF0000FFFFULL;
+        x[i] |= x[i] << 8;
+        x[i] &= 0x00FF00FF00FF00FFULL;
+    }
+    *q0 = x[0] | (x[2] << 8);
+    *q1 = x[1] | (x[3] << 8);
+}
+
+inline void interleave_out(uint8_t *a, uint8_t *b, bsword_v q0, bsword_v q1)
+{
+    bsword_v x[4];
+    unsigned i, j;
+    
+    x[0] = q0 & 0x00FF00FF00FF00FFULL;
+    x[1] = q1 & 0x00FF00FF00FF00FFULL;
+    x[2] = (q0 >> 8) & 0x00FF00FF00FF00FFULL;
+    x[3] = (q1 >> 8) & 0x00FF00FF00FF00FFULL;
+    for(i = 0; i < 4; i++) {
+        x[i] |= x[i] >> 8;
+        x[i] &= 0x0000FFFF0000FFFFULL;
+        x[i] |= x[i] >> 16;
+        for(j = 0; j < 4; j++) {
+            a[4*i + j] = x[i][0] >> 8*j;
+            b[4*i + j] = x[i][1] >> 8*j;
+        }
+    }
+}
+
+/* Transposes the eight words' bits in 8x8 squares, its own inverse. */
+inline void ortho(bsword_v *q)
+{
+    SWAP2(q[0], q[1]);
+    SWAP2(q[2], q[3]);
+    SWAP2(q[4], q[5]);
+    SWAP2(q[6], q[7]);
+    
+    SWAP4(q[0], q[2]);
+    SWAP4(q[1], q[3]);
+    SWAP4(q[4], q[6]);
+    SWAP4(q[5], q[7]);
+    
+    SWAP8(q[0], q[4]);
+    SWAP8(q[1], q[5]);
+    SWAP8(q[2], q[6]);
+    SWAP8(q[3], q[7]);
+}
+
+inline void add_round_key(bsword_v *q, const uint64_t *sk)
+{
+    unsigned i;
+    
+    for(i = 0; i < 8; i++)
+        q[i] ^= sk[i];
+}
+
+/*
+ SubBytes on all 128 bytes at once. A linear layer feeds the inversion in
+ GF(2^4) pieces, the only nonlinear gates, and another linear layer folds
+ in the affine map.
+ */
+inline void sbox(bsword_v *q)
+{
+    bsword_v x0, x1, x2, x3, x4, x5, x6, x7;
+    bsword_v y1, y2, y3, y4, y5, y6, y7, y8, y9;
+    bsword_v y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+    bsword_v y20, y21;
+    bsword_v z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+    bsword_v z10, z11, z12, z13, z14, z15, z16, z17;
+    bsword_v t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+    bsword_v t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+    bsword_v t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+    bsword_v t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+    bsword_v t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+    bsword_v t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+    bsword_v t60, t61, t62, t63, t64, t65, t66, t67;
+    bsword_v s0, s1, s2, s3, s4, s5, s6, s7;
+    
+    x0 = q[7];
+    x1 = q[6];
+    x2 = q[5];
+    x3 = q[4];
+    x4 = q[3];
+    x5 = q[2];
+    x6 = q[1];
+    x7 = q[0];
+    
+    /* Top linear transformation */
+    y14 = x3 ^ x5;
+    y13 = x0 ^ x6;
+    y9 = x0 ^ x3;
+    y8 = x0 ^ x5;
+    t0 = x1 ^ x2;
+    y1 = t0 ^ x7;
+    y4 = y1 ^ x3;
+    y12 = y13 ^ y14;
+    y2 = y1 ^ x0;
+    y5 = y1 ^ x6;
+    y3 = y5 ^ y8;
+    t1 = x4 ^ y12;
+    y15 = t1 ^ x5;
+    y20 = t1 ^ x1;
+    y6 = y15 ^ x7;
+    y10 = y15 ^ t0;
+    y11 = y20 ^ y9;
+    y7 = x7 ^ y11;
+    y17 = y10 ^ y11;
+    y19 = y10 ^ y8;
+    y16 = t0 ^ y11;
+    y21 = y13 ^ y16;
+    y18 = x0 ^ y16;
+    
+    /* Non-linear section */
+    t2 = y12 & y15;
+    t3 = y3 & y6;
+    t4 = t3 ^ t2;
+    t5 = y4 & x7;
+    t6 = t5 ^ t2;
+    t7 = y13 & y16;
+    t8 = y5 & y1;
+    t9 = t8 ^ t7;
+    t10 = y2 & y7;
+    t11 = t10 ^ t7;
+    t12 = y9 & y11;
+    t13 = y14 & y17;
+    t14 = t13 ^ t12;
+    t15 = y8 & y10;
+    t16 = t15 ^ t12;
+    t17 = t4 ^ t14;
+    t18 = t6 ^ t16;
+    t19 = t9 ^ t14;
+    t20 = t11 ^ t16;
+    t21 = t17 ^ y20;
+    t22 = t18 ^ y19;
+    t23 = t19 ^ y21;
+    t24 = t20 ^ y18;
+    
+    t25 = t21 ^ t22;
+    t26 = t21 & t23;
+    t27 = t24 ^ t26;
+    t28 = t25 & t27;
+    t29 = t28 ^ t22;
+    t30 = t23 ^ t24;
+    t31 = t22 ^ t26;
+    t32 = t31 & t30;
+    t33 = t32 ^ t24;
+    t34 = t23 ^ t33;
+    t35 = t27 ^ t33;
+    t36 = t24 & t35;
+    t37 = t36 ^ t34;
+    t38 = t27 ^ t36;
+    t39 = t29 & t38;
+    t40 = t25 ^ t39;
+    
+    t41 = t40 ^ t37;
+    t42 = t29 ^ t33;
+    t43 = t29 ^ t40;
+    t44 = t33 ^ t37;
+    t45 = t42 ^ t41;
+    z0 = t44 & y15;
+    z1 = t37 & y6;
+    z2 = t33 & x7;
+    z3 = t43 & y16;
+    z4 = t40 & y1;
+    z5 = t29 & y7;
+    z6 = t42 & y11;
+    z7 = t45 & y17;
+    z8 = t41 & y10;
+    z9 = t44 & y12;
+    z10 = t37 & y3;
+    z11 = t33 & y4;
+    z12 = t43 & y13;
+    z13 = t40 & y5;
+    z14 = t29 & y2;
+    z15 = t42 & y9;
+    z16 = t45 & y14;
+    z17 = t41 & y8;
+    
+    /* Bottom linear transformation */
+    t46 = z15 ^ z16;
+    t47 = z10 ^ z11;
+    t48 = z5 ^ z13;
+    t49 = z9 ^ z10;
+    t50 = z2 ^ z12;
+    t51 = z2 ^ z5;
+    t52 = z7 ^ z8;
+    t53 = z0 ^ z3;
+    t54 = z6 ^ z7;
+    t55 = z16 ^ z17;
+    t56 = z12 ^ t48;
+    t57 = t50 ^ t53;
+    t58 = z4 ^ t46;
+    t59 = z3 ^ t54;
+    t60 = t46 ^ t57;
+    t61 = z14 ^ t57;
+    t62 = t52 ^ t58;
+    t63 = t49 ^ t58;
+    t64 = z4 ^ t59;
+    t65 = t61 ^ t62;
+    t66 = z1 ^ t63;
+    s0 = t59 ^ t63;
+    s6 = t56 ^ ~t62;
+    s7 = t48 ^ ~t60;
+    t67 = t64 ^ t65;
+    s3 = t53 ^ t66;
+    s4 = t51 ^ t66;
+    s5 = t47 ^ t65;
+    s1 = t64 ^ ~s3;
+    s2 = t55 ^ ~t67;
+    
+    q[7] = s0;
+    q[6] = s1;
+    q[5] = s2;
+    q[4] = s3;
+    q[3] = s4;
+    q[2] = s5;
+    q[1] = s6;
+    q[0] = s7;
+}
+
+/*
+ The S-box is the affine map A after inversion, so with T(x) = A^-1(x ^ 0x63)
+ the inverse S-box is T, then the S-box, then T again.
+ */
+inline void inv_sbox(bsword_v *q)
+{
+    inv_affine(q);
+    sbox(q);
+    inv_affine(q);
+}
+
+/* Bit i of T(x) is bits i+2, i+5 and i+7 of x, and 0x05 flips bits 0 and 2. */
+inline void inv_affine(bsword_v *q)
+{
+    bsword_v x[8];
+    unsigned i;
+    
+    memcpy(x, q, sizeof(x));
+    for(i = 0; i < 8; i++)
+        q[i] = x[(i+2) & 7] ^ x[(i+5) & 7] ^ x[(i+7) & 7];
+    q[0] = ~q[0];
+    q[2] = ~q[2];
+}
+
+/* Row r turns r columns, four bits in its quarter for each. */
+inline void shift_rows(bsword_v *q)
+{
+    bsword_v x;
+    unsigned i;
+    
+    for(i = 0; i < 8; i++) {
+        x = q[i];
+        q[i] = (x & 0x000000000000FFFFULL)
+            | ((x & 0x00000000FFF00000ULL) >> 4)
+            | ((x & 0x00000000000F0000ULL) << 12)
+            | ((x & 0x0000FF0000000000ULL) >> 8)
+            | ((x & 0x000000FF00000000ULL) << 8)
+            | ((x & 0xF000000000000000ULL) >> 12)
+            | ((x & 0x0FFF000000000000ULL) << 4);
+    }
+}
+
+inline void inv_shift_rows(bsword_v *q)
+{
+    bsword_v x;
+    unsigned i;
+    
+    for(i = 0; i < 8; i++) {
+        x = q[i];
+        q[i] = (x & 0x000000000000FFFFULL)
+            | ((x & 0x000000000FFF0000ULL) << 4)
+            | ((x & 0x00000000F0000000ULL) >> 12)
+            | ((x & 0x000000FF00000000ULL) << 8)
+            | ((x & 0x0000FF0000000000ULL) >> 8)
+            | ((x & 0x000F000000000000ULL) << 12)
+            | ((x & 0xFFF0000000000000ULL) >> 4);
+    }
+}
+
+inline bsword_v rotr32(bsword_v x)
+{
+    return (x << 32) | (x >> 32);
+}
+
+/*
+ r holds each row's next, rotr32 the one two down. The 02 products of
+ q and r shift one word up, with the polynomial's bits 0, 1, 3 and 4 taking
+ what falls off the top.
+ */
+inline void mix_columns(bsword_v *q)
+{
+    bsword_v q0, q1, q2, q3, q4, q5, q6, q7;
+    bsword_v r0, r1, r2, r3, r4, r5, r6, r7;
+    
+    q0 = q[0];
+    q1 = q[1];
+    q2 = q[2];
+    q3 = q[3];
+    q4 = q[4];
+    q5 = q[5];
+    q6 = q[6];
+    q7 = q[7];
+    r0 = (q0 >> 16) | (q0 << 48);
+    r1 = (q1 >> 16) | (q1 << 48);
+    r2 = (q2 >> 16) | (q2 << 48);
+    r3 = (q3 >> 16) | (q3 << 48);
+    r4 = (q4 >> 16) | (q4 << 48);
+    r5 = (q5 >> 16) | (q5 << 48);
+    r6 = (q6 >> 16) | (q6 << 48);
+    r7 = (q7 >> 16) | (q7 << 48);
+    
+    q[0] = q7 ^ r7 ^ r0 ^ rotr32(q0 ^ r0);
+    q[1] = q0 ^ r0 ^ q7 ^ r7 ^ r1 ^ rotr32(q1 ^ r1);
+    q[2] = q1 ^ r1 ^ r2 ^ rotr32(q2 ^ r2);
+    q[3] = q2 ^ r2 ^ q7 ^ r7 ^ r3 ^ rotr32(q3 ^ r3);
+    q[4] = q3 ^ r3 ^ q7 ^ r7 ^ r4 ^ rotr32(q4 ^ r4);
+    q[5] = q4 ^ r4 ^ r5 ^ rotr32(q5 ^ r5);
+    q[6] = q5 ^ r5 ^ r6 ^ rotr32(q6 ^ r6);
+    q[7] = q6 ^ r6 ^ r7 ^ rotr32(q7 ^ r7);
+}
+
+/*
+ InvMixColumns is MixColumns after the circulant (05, 00, 04, 00), which
+ adds 04 times a row and the one two down to both of them.
+ */
+inline void inv_mix_columns(bsword_v *q)
+{
+    bsword_v s[8], t[8];
+    unsigned i;
+    
+    for(i = 0; i < 8; i++)
+        s[i] = q[i] ^ rotr32(q[i]);
+    /* s times 04, xtime twice over the bit planes */
+    t[0] = s[6];
+    t[1] = s[6] ^ s[7];
+    t[2] = s[0] ^ s[7];
+    t[3] = s[1] ^ s[6];
+    t[4] = s[2] ^ s[6] ^ s[7];
+    t[5] = s[3] ^ s[7];
+    t[6] = s[4];
+    t[7] = s[5];
+    for(i = 0; i < 8; i++)
+        q[i] ^= t[i];
+    mix_columns(q);
+}
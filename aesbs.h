@@ -0,0 +1,23 @@
+
+#ifndef __TCPDelegate__aesbs__
+#define __TCPDelegate__aesbs__
+
+#include "crypt.h"
+
+/*
+ Bitsliced AES, eight blocks at a time with no table lookups and no
+ branches on data or key, so its timing gives nothing away. A lone block
+ costs as much as eight, it is meant for CTR and the other modes that
+ have blocks to spare.
+ */
+
+/* k->enc bitsliced into k->bs, k->rounds is already set. */
+extern void aesbs_key_init(aes_key_s *k);
+
+/* SubWord of the key schedule, on the same circuit. */
+extern uint32_t aesbs_sub_word(uint32_t w);
+
+extern void aesbs_encrypt(const aes_key_s *k, const uint8_t *in, uint8_t *out, size_t nblocks);
+extern void aesbs_decrypt(const aes_key_s *k, const uint8_t *in, uint8_t *out, size_t nblocks);
+
+#endif /* defined(__TCPDelegate__aesbs__) */
@@ -0,0 +1,236 @@
+/*
+ Only this file is built for the AES instructions, the rest of the daemon
+ still runs on hosts without them.
+ */
+#include "aesni.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#pragma GCC target("aes,sse2")
+
+#include <wmmintrin.h>
+
+/*
+ Blocks in flight at once. aesenc has a latency of several cycles but
+ issues every cycle or two, independent blocks fill the gap.
+ */
+#define AESNI_LANES 8
+
+#define KEY_128(k, rcon) key_128(k, _mm_aeskeygenassist_si128(k, rcon))
+#define KEY_192(a, b, rcon) key_192(&(a), &(b), _mm_aeskeygenassist_si128(b, rcon))
+#define KEY_256(a, b, rcon) key_256(a, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(b, rcon), 0xff))
+#define KEY_256_ODD(a, b) key_256(b, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(a, 0), 0xaa))
+#define PAIR(lo, hi) ((__m128i)_mm_shuffle_pd((__m128d)(lo), (__m128d)(hi), 0))
+#define MID(a, b) ((__m128i)_mm_shuffle_pd((__m128d)(a), (__m128d)(b), 1))
+
+static __m128i key_prefix(__m128i k);
+static __m128i key_128(__m128i k, __m128i assist);
+static void key_192(__m128i *a, __m128i *b, __m128i assist);
+static __m128i key_256(__m128i k, __m128i word);
+static inline void aesni_enc_lanes(const __m128i *rk, unsigned rounds, const uint8_t *in, uint8_t *out, unsigned n);
+static inline void aesni_dec_lanes(const __m128i *rk, unsigned rounds, const uint8_t *in, uint8_t *out, unsigned n);
+
+bool aesni_supported(void)
+{
+    return __builtin_cpu_supports("aes");
+}
+
+/*
+ aeskeygenassist does the SubWord, RotWord and Rcon of the next word, the
+ rest of FIPS-197's expansion is the running xor key_prefix builds.
+ */
+void aesni_key_init(aes_key_s *k, const uint8_t *key, unsigned bits)
+{
+    __m128i rk[AES_MAX_ROUNDS+1], a, b;
+    unsigned i;
+    
+    a = _mm_loadu_si128((const __m128i *)key);
+    rk[0] = a;
+    if(bits == AES_128) {
+        rk[1] = KEY_128(rk[0], 0x01);
+        rk[2] = KEY_128(rk[1], 0x02);
+        rk[3] = KEY_128(rk[2], 0x04);
+        rk[4] = KEY_128(rk[3], 0x08);
+        rk[5] = KEY_128(rk[4], 0x10);
+        rk[6] = KEY_128(rk[5], 0x20);
+        rk[7] = KEY_128(rk[6], 0x40);
+        rk[8] = KEY_128(rk[7], 0x80);
+        rk[9] = KEY_128(rk[8], 0x1b);
+        rk[10] = KEY_128(rk[9], 0x36);
+    }
+    else if(bits == AES_192) {
+        /* Six words a step, so the round keys straddle the steps' halves */
+        b = _mm_loadl_epi64((const __m128i *)&key[16]);
+        rk[1] = b;
+        KEY_192(a, b, 0x01);
+        rk[1] = PAIR(rk[1], a);
+        rk[2] = MID(a, b);
+        KEY_192(a, b, 0x02);
+        rk[3] = a;
+        rk[4] = b;
+        KEY_192(a, b, 0x04);
+        rk[4] = PAIR(rk[4], a);
+        rk[5] = MID(a, b);
+        KEY_192(a, b, 0x08);
+        rk[6] = a;
+        rk[7] = b;
+        KEY_192(a, b, 0x10);
+        rk[7] = PAIR(rk[7], a);
+        rk[8] = MID(a, b);
+        KEY_192(a, b, 0x20);
+        rk[9] = a;
+        rk[10] = b;
+        KEY_192(a, b, 0x40);
+        rk[10] = PAIR(rk[10], a);
+        rk[11] = MID(a, b);
+        KEY_192(a, b, 0x80);
+        rk[12] = a;
+    }
+    else {
+        b = _mm_loadu_si128((const __m128i *)&key[16]);
+        rk[1] = b;
+        rk[2] = a = KEY_256(a, b, 0x01);
+        rk[3] = b = KEY_256_ODD(a, b);
+        rk[4] = a = KEY_256(a, b, 0x02);
+        rk[5] = b = KEY_256_ODD(a, b);
+        rk[6] = a = KEY_256(a, b, 0x04);
+        rk[7] = b = KEY_256_ODD(a, b);
+        rk[8] = a = KEY_256(a, b, 0x08);
+        rk[9] = b = KEY_256_ODD(a, b);
+        rk[10] = a = KEY_256(a, b, 0x10);
+        rk[11] = b = KEY_256_ODD(a, b);
+        rk[12] = a = KEY_256(a, b, 0x20);
+        rk[13] = b = KEY_256_ODD(a, b);
+        rk[14] = KEY_256(a, b, 0x40);
+    }
+    
+    /* aesdec wants InvMixColumns applied to all but the outer keys */
+    for(i = 0; i <= k->rounds; i++)
+        _mm_storeu_si128((__m128i *)&k->enc[i], rk[i]);
+    _mm_storeu_si128((__m128i *)&k->dec[0], rk[k->rounds]);
+    for(i = 1; i < k->rounds; i++)
+        _mm_storeu_si128((__m128i *)&k->dec[i], _mm_aesimc_si128(rk[k->rounds - i]));
+    _mm_storeu_si128((__m128i *)&k->dec[k->rounds], rk[0]);
+}
+
+/* Each word xored with all the ones before it. */
+__m128i key_prefix(__m128i k)
+{
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    return _mm_xor_si128(k, _mm_slli_si128(k, 4));
+}
+
+__m128i key_128(__m128i k, __m128i assist)
+{
+    return _mm_xor_si128(key_prefix(k), _mm_shuffle_epi32(assist, 0xff));
+}
+
+/* a holds four words of the previous step and the low half of b two more. */
+void key_192(__m128i *a, __m128i *b, __m128i assist)
+{
+    __m128i last;
+    
+    *a = _mm_xor_si128(key_prefix(*a), _mm_shuffle_epi32(assist, 0x55));
+    last = _mm_shuffle_epi32(*a, 0xff);
+    *b = _mm_xor_si128(*b, _mm_slli_si128(*b, 4));
+    *b = _mm_xor_si128(*b, last);
+}
+
+__m128i key_256(__m128i k, __m128i word)
+{
+    return _mm_xor_si128(key_prefix(k), word);
+}
+
+void aesni_encrypt(const aes_key_s *k, const uint8_t *in, uint8_t *out, size_t nblocks)
+{
+    __m128i rk[AES_MAX_ROUNDS+1];
+    unsigned i;
+    
+    for(i = 0; i <= k->rounds; i++)
+        rk[i] = _mm_loadu_si128((const __m128i *)&k->enc[i]);
+    for(; nblocks >= AESNI_LANES; nblocks -= AESNI_LANES) {
+        aesni_enc_lanes(rk, k->rounds, in, out, AESNI_LANES);
+        in += AESNI_LANES*AES_BLOCK_BYTELEN;
+        out += AESNI_LANES*AES_BLOCK_BYTELEN;
+    }
+    if(nblocks)
+        aesni_enc_lanes(rk, k->rounds, in, out, nblocks);
+}
+
+void aesni_decrypt(const aes_key_s *k, const uint8_t *in, uint8_t *out, size_t nblocks)
+{
+    __m128i rk[AES_MAX_ROUNDS+1];
+    unsigned i;
+    
+    for(i = 0; i <= k->rounds; i++)
+        rk[i] = _mm_loadu_si128((const __m128i *)&k->dec[i]);
+    for(; nblocks >= AESNI_LANES; nblocks -= AESNI_LANES) {
+        aesni_dec_lanes(rk, k->rounds, in, out, AESNI_LANES);
+        in += AESNI_LANES*AES_BLOCK_BYTELEN;
+        out += AESNI_LANES*AES_BLOCK_BYTELEN;
+    }
+    if(nblocks)
+        aesni_dec_lanes(rk, k->rounds, in, out, nblocks);
+}
+
+/* Each round goes to all n blocks before the next, n is at most AESNI_LANES. */
+inline void aesni_enc_lanes(const __m128i *rk, unsigned rounds, const uint8_t *in, uint8_t *out, unsigned n)
+{
+    __m128i b[AESNI_LANES];
+    unsigned r, i;
+    
+#pragma GCC unroll 8
+    for(i = 0; i < n; i++)
+        b[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in + i), rk[0]);
+    for(r = 1; r < rounds; r++) {
+#pragma GCC unroll 8
+        for(i = 0; i < n; i++)
+            b[i] = _mm_aesenc_si128(b[i], rk[r]);
+    }
+#pragma GCC unroll 8
+    for(i = 0; i < n; i++)
+        _mm_storeu_si128((__m128i *)out + i, _mm_aesenclast_si128(b[i], rk[rounds]));
+}
+
+inline void aesni_dec_lanes(const __m128i *rk, unsigned rounds, const uint8_t *in, uint8_t *out, unsigned n)
+{
+    __m128i b[AESNI_LANES];
+    unsigned r, i;
+    
+#pragma GCC unroll 8
+    for(i = 0; i < n; i++)
+        b[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in + i), rk[0]);
+    for(r = 1; r < rounds; r++) {
+#pragma GCC unroll 8
+        for(i = 0; i < n; i++)
+            b[i] = _mm_aesdec_si128(b[i], rk[r]);
+    }
+#pragma GCC unroll 8
+    for(i = 0; i < n; i++)
+        _mm_storeu_si128((__m128i *)out + i, _mm_aesdeclast_si128(b[i], rk[rounds]));
+}
+
+#else
+
+bool aesni_supported(void)
+{
+    return false;
+}
+
+void aesni_key_init(aes_key_s *k, const uint8_t *key, unsigned bits)
+{
+    abort();
+}
+
+void aesni_encrypt(const aes_key_s *k, const uint8_t *in, uint8_t *out, size_t nblocks)
+{
+    abort();
+}
+
+void aesni_decrypt(const aes_key_s *k, const uint8_t *in, uint8_t *out, size_t nblocks)
+{
+    abort();
+}
+
+#endif
@@ -0,0 +1,20 @@
+
+#ifndef __TCPDelegate__aesni__
+#define __TCPDelegate__aesni__
+
+#include "crypt.h"
+
+/*
+ AES on the x86 AES instructions, for crypt.c to dispatch to once cpuid
+ says they are there. Elsewhere aesni_supported is always false and the
+ rest is never called.
+ */
+extern bool aesni_supported(void);
+
+/* Fills in both k->enc and k->dec, k->rounds is already set. */
+extern void aesni_key_init(aes_key_s *k, const uint8_t *key, unsigned bits);
+
+extern void aesni_encrypt(const aes_key_s *k, const uint8_t *in, uint8_t *out, size_t nblocks);
+extern void aesni_decrypt(const aes_key_s *k, const uint8_t *in, uint8_t *out, size_t nblocks);
+
+#endif /* defined(__TCPDelegate__aesni__) */
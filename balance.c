@@ -0,0 +1,406 @@
+#include "balance.h"
+
+#include <string.h>
+#include <stdatomic.h>
+#include <netdb.h>
+
+typedef struct ring_point_s ring_point_s;
+
+struct ring_point_s {
+    uint64_t hash;
+    unsigned backend;
+};
+
+struct balancer_s {
+    balance_policy_e policy;
+    backend_s **backends;
+    unsigned nbackends;
+    ring_point_s *ring;             /* sorted by hash */
+    size_t npoints;
+    _Atomic unsigned next;          /* round robin, and where the others start looking */
+};
+
+static bool backend_usable(backend_s *be, uint64_t now);
+static uint64_t backend_latency(backend_s *be, uint64_t now);
+static uint64_t backend_cost(backend_s *be, uint64_t now);
+static void backend_publish(backend_s *be, uint64_t now);
+static void backend_eject(balancer_s *b, backend_s *be, uint64_t now, const char *why);
+static backend_s *balancer_round_robin(balancer_s *b, uint64_t now, bool all);
+static backend_s *balancer_least_conn(balancer_s *b, uint64_t now, bool all);
+static backend_s *balancer_ring(balancer_s *b, uint64_t key, uint64_t now, bool all);
+static backend_s *balancer_peak_ewma(balancer_s *b, uint64_t now, bool all);
+static bool balancer_outlier(balancer_s *b, backend_s *be, uint64_t now);
+static void balancer_build_ring(balancer_s *b);
+static int ring_point_cmp(const void *a, const void *b);
+static uint64_t mix64(uint64_t x);
+static uint64_t hash_name(const char *name);
+
+balancer_s *balancer_s_(balance_policy_e policy)
+{
+    balancer_s *b = del_allocz(sizeof *b);
+    
+    b->policy = policy;
+    atomic_init(&b->next, 0);
+    return b;
+}
+
+void balancer_destroy(balancer_s *b)
+{
+    unsigned i;
+    
+    for(i = 0; i < b->nbackends; i++) {
+        pthread_mutex_destroy(&b->backends[i]->lock);
+        free(b->backends[i]);
+    }
+    free(b->backends);
+    free(b->ring);
+    free(b);
+}
+
+bool balancer_add(balancer_s *b, const char *spec)
+{
+    struct addrinfo hints, *res;
+    char copy[BALANCE_NAME_MAX], *host, *port;
+    backend_s *be;
+    int status;
+    
+    if(strlen(spec) >= sizeof copy) {
+        log_error("Backend address %s is too long.", spec);
+        return false;
+    }
+    strcpy(copy, spec);
+    if(!split_hostport(copy, &host, &port)) {
+        log_error("Malformed backend address \"%s\".", spec);
+        return false;
+    }
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    status = getaddrinfo(host, port, &hints, &res);
+    if(status) {
+        log_error("Failed to resolve backend %s: %s.", spec, gai_strerror(status));
+        return false;
+    }
+    
+    be = del_allocz(sizeof *be);
+    strcpy(be->name, spec);
+    memcpy(&be->addr, res->ai_addr, res->ai_addrlen);
+    be->addrlen = res->ai_addrlen;
+    atomic_init(&be->conns, 0);
+    pthread_mutex_init(&be->lock, NULL);
+    atomic_init(&be->cost, 0);
+    atomic_init(&be->stamp, 0);
+    atomic_init(&be->ejected_until, 0);
+    freeaddrinfo(res);
+    
+    b->backends = del_realloc(b->backends, (b->nbackends + 1) * sizeof *b->backends);
+    b->backends[b->nbackends++] = be;
+    balancer_build_ring(b);
+    return true;
+}
+
+unsigned balancer_count(balancer_s *b)
+{
+    return b->nbackends;
+}
+
+backend_s *balancer_pick(balancer_s *b, uint64_t key, uint64_t now)
+{
+    backend_s *be;
+    bool all = true;
+    unsigned i;
+    
+    if(!b->nbackends)
+        return NULL;
+    for(i = 0; i < b->nbackends && all; i++)
+        all = !backend_usable(b->backends[i], now);
+    
+    switch(b->policy) {
+        case BALANCE_LEAST_CONN:
+            be = balancer_least_conn(b, now, all);
+            break;
+        case BALANCE_HASH:
+            be = balancer_ring(b, key, now, all);
+            break;
+        case BALANCE_PEAK_EWMA:
+            be = balancer_peak_ewma(b, now, all);
+            break;
+        default:
+            be = balancer_round_robin(b, now, all);
+            break;
+    }
+    atomic_fetch_add_explicit(&be->conns, 1, memory_order_relaxed);
+    return be;
+}
+
+backend_s *balancer_claim(balancer_s *b, const struct sockaddr *addr, socklen_t len)
+{
+    unsigned i;
+    
+    for(i = 0; i < b->nbackends; i++) {
+        if(b->backends[i]->addrlen == len && !memcmp(&b->backends[i]->addr, addr, len)) {
+            atomic_fetch_add_explicit(&b->backends[i]->conns, 1, memory_order_relaxed);
+            return b->backends[i];
+        }
+    }
+    return NULL;
+}
+
+void backend_release(backend_s *be)
+{
+    atomic_fetch_sub_explicit(&be->conns, 1, memory_order_relaxed);
+}
+
+/*
+ Peak EWMA, with e^-(dt/BACKEND_DECAY) taken as 1/(1 + dt/BACKEND_DECAY)
+ which is close enough for weighting and needs no libm.
+ */
+void balancer_report(balancer_s *b, backend_s *be, unsigned latency, uint64_t now)
+{
+    double w;
+    
+    pthread_mutex_lock(&be->lock);
+    be->failures = 0;
+    be->errors -= be->errors * BACKEND_ERROR_WEIGHT;
+    if(latency >= be->latency) {
+        be->latency = latency;
+    }
+    else {
+        w = (double)BACKEND_DECAY / (BACKEND_DECAY + (double)(now - atomic_load(&be->stamp)));
+        be->latency = be->latency * w + latency * (1 - w);
+    }
+    backend_publish(be, now);
+    
+    /* Forgiven one ejection for every BACKEND_EJECT_TIME back in without one */
+    if(be->ejections && now >= atomic_load(&be->ejected_until) + BACKEND_EJECT_TIME * (uint64_t)be->ejections)
+        be->ejections--;
+    if(balancer_outlier(b, be, now))
+        backend_eject(b, be, now, "slow");
+    pthread_mutex_unlock(&be->lock);
+}
+
+void balancer_fail(balancer_s *b, backend_s *be, uint64_t now)
+{
+    pthread_mutex_lock(&be->lock);
+    be->failures++;
+    be->errors += (1 - be->errors) * BACKEND_ERROR_WEIGHT;
+    if(be->failures >= BACKEND_EJECT_FAILURES)
+        backend_eject(b, be, now, "failing");
+    else if(be->errors >= BACKEND_EJECT_ERRORS)
+        backend_eject(b, be, now, "erroring");
+    pthread_mutex_unlock(&be->lock);
+}
+
+bool backend_usable(backend_s *be, uint64_t now)
+{
+    return atomic_load_explicit(&be->ejected_until, memory_order_relaxed) <= now;
+}
+
+/* In us, decayed for the time since the last sample. */
+uint64_t backend_latency(backend_s *be, uint64_t now)
+{
+    uint64_t cost = atomic_load_explicit(&be->cost, memory_order_relaxed);
+    uint64_t stamp = atomic_load_explicit(&be->stamp, memory_order_relaxed);
+    
+    if(now <= stamp)
+        return cost;
+    return cost * BACKEND_DECAY / (BACKEND_DECAY + (now - stamp));
+}
+
+/* Latency scaled by load, the +1s keep an unmeasured or idle backend comparable. */
+uint64_t backend_cost(backend_s *be, uint64_t now)
+{
+    return (backend_latency(be, now) + 1) * (atomic_load_explicit(&be->conns, memory_order_relaxed) + 1);
+}
+
+void backend_publish(backend_s *be, uint64_t now)
+{
+    atomic_store_explicit(&be->cost, (uint64_t)(be->latency * 1000), memory_order_relaxed);
+    atomic_store_explicit(&be->stamp, now, memory_order_relaxed);
+}
+
+/*
+ With be's lock held. Starts over once it's back, so it has to fail all
+ over again to be ejected again, for longer each time.
+ */
+void backend_eject(balancer_s *b, backend_s *be, uint64_t now, const char *why)
+{
+    unsigned i, out = 0;
+    uint64_t time;
+    
+    if(!backend_usable(be, now))
+        return;
+    for(i = 0; i < b->nbackends; i++)
+        out += !backend_usable(b->backends[i], now);
+    if((out + 1) * 100 > b->nbackends * BACKEND_EJECT_PERCENT)
+        return;
+    
+    if(be->ejections < BACKEND_EJECT_MAX)
+        be->ejections++;
+    time = BACKEND_EJECT_TIME * (uint64_t)be->ejections;
+    atomic_store(&be->ejected_until, now + time);
+    be->failures = 0;
+    be->errors = 0;
+    log_warn("Ejected %s backend %s for %lu ms.", why, be->name, (unsigned long)time);
+}
+
+backend_s *balancer_round_robin(balancer_s *b, uint64_t now, bool all)
+{
+    backend_s *be;
+    unsigned i;
+    
+    for(i = 0; i < b->nbackends; i++) {
+        be = b->backends[atomic_fetch_add_explicit(&b->next, 1, memory_order_relaxed) % b->nbackends];
+        if(all || backend_usable(be, now))
+            return be;
+    }
+    return b->backends[0];
+}
+
+/* Ties go to whichever comes first from a rotating start, so equal backends share the load. */
+backend_s *balancer_least_conn(balancer_s *b, uint64_t now, bool all)
+{
+    unsigned start = atomic_fetch_add_explicit(&b->next, 1, memory_order_relaxed);
+    unsigned i, conns, best = UINT32_MAX;
+    backend_s *be, *pick = b->backends[0];
+    
+    for(i = 0; i < b->nbackends; i++) {
+        be = b->backends[(start + i) % b->nbackends];
+        if(!all && !backend_usable(be, now))
+            continue;
+        conns = atomic_load_explicit(&be->conns, memory_order_relaxed);
+        if(conns < best) {
+            best = conns;
+            pick = be;
+        }
+    }
+    return pick;
+}
+
+/*
+ The first point at or after the key's hash, wrapping around. Keys of an
+ ejected backend carry on round the ring, spreading over the others.
+ */
+backend_s *balancer_ring(balancer_s *b, uint64_t key, uint64_t now, bool all)
+{
+    uint64_t h = mix64(key);
+    size_t lo = 0, hi = b->npoints, mid, i;
+    backend_s *be;
+    
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(b->ring[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for(i = 0; i < b->npoints; i++) {
+        be = b->backends[b->ring[(lo + i) % b->npoints].backend];
+        if(all || backend_usable(be, now))
+            return be;
+    }
+    return b->backends[0];
+}
+
+/* Power of two choices, which keeps one fast backend from taking everything. */
+backend_s *balancer_peak_ewma(balancer_s *b, uint64_t now, bool all)
+{
+    uint64_t r = mix64(atomic_fetch_add_explicit(&b->next, 1, memory_order_relaxed));
+    backend_s *x = b->backends[(uint32_t)r % b->nbackends];
+    backend_s *y = b->backends[(r >> 32) % b->nbackends];
+    backend_s *be, *pick = b->backends[0];
+    uint64_t cost, best = UINT64_MAX;
+    unsigned i;
+    
+    if(!all && !backend_usable(x, now))
+        x = NULL;
+    if(!all && !backend_usable(y, now))
+        y = NULL;
+    if(x && y)
+        return backend_cost(x, now) <= backend_cost(y, now) ? x : y;
+    if(x || y)
+        return x ? x : y;
+    
+    /* Both drawn were out, settle for the cheapest of the rest */
+    for(i = 0; i < b->nbackends; i++) {
+        be = b->backends[i];
+        if(!backend_usable(be, now))
+            continue;
+        cost = backend_cost(be, now);
+        if(cost < best) {
+            best = cost;
+            pick = be;
+        }
+    }
+    return pick;
+}
+
+/* Slower than BACKEND_EJECT_FACTOR times the mean of the others in rotation, once there are any measured. */
+bool balancer_outlier(balancer_s *b, backend_s *be, uint64_t now)
+{
+    uint64_t sum = 0, latency = backend_latency(be, now);
+    unsigned i, n = 0;
+    
+    if(latency < BACKEND_EJECT_FLOOR * 1000)
+        return false;
+    for(i = 0; i < b->nbackends; i++) {
+        if(b->backends[i] == be || !backend_usable(b->backends[i], now) || !atomic_load(&b->backends[i]->stamp))
+            continue;
+        sum += backend_latency(b->backends[i], now);
+        n++;
+    }
+    return n && latency * n > BACKEND_EJECT_FACTOR * sum;
+}
+
+/*
+ Points only depend on the backend's name, so a backend lands in the same
+ places whatever else is configured alongside it.
+ */
+void balancer_build_ring(balancer_s *b)
+{
+    uint64_t h;
+    unsigned i, j;
+    
+    b->npoints = (size_t)b->nbackends * BALANCE_VNODES;
+    b->ring = del_realloc(b->ring, b->npoints * sizeof *b->ring);
+    for(i = 0; i < b->nbackends; i++) {
+        h = hash_name(b->backends[i]->name);
+        for(j = 0; j < BALANCE_VNODES; j++) {
+            b->ring[i * BALANCE_VNODES + j].hash = mix64(h + j);
+            b->ring[i * BALANCE_VNODES + j].backend = i;
+        }
+    }
+    qsort(b->ring, b->npoints, sizeof *b->ring, ring_point_cmp);
+}
+
+int ring_point_cmp(const void *a, const void *b)
+{
+    const ring_point_s *pa = a, *pb = b;
+    
+    if(pa->hash != pb->hash)
+        return pa->hash < pb->hash ? -1 : 1;
+    return (int)pa->backend - (int)pb->backend;
+}
+
+/* splitmix64's finalizer, session ids are sequential and need spreading */
+uint64_t mix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* FNV-1a */
+uint64_t hash_name(const char *name)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    
+    while(*name) {
+        h ^= (unsigned char)*name++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
@@ -0,0 +1,89 @@
+
+#ifndef __TCPDelegate__balance__
+#define __TCPDelegate__balance__
+
+#include "general.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define BALANCE_VNODES 160      /* points on the hash ring per backend */
+#define BALANCE_NAME_MAX 64
+#define BACKEND_DECAY 10000             /* ms for the latency EWMA to forget about 2/3 of a sample */
+#define BACKEND_ERROR_WEIGHT 0.1        /* of each connect in the error EWMA */
+#define BACKEND_EJECT_FAILURES 5        /* in a row */
+#define BACKEND_EJECT_ERRORS 0.5        /* error EWMA */
+#define BACKEND_EJECT_FACTOR 3          /* times the mean latency of the others */
+#define BACKEND_EJECT_FLOOR 50          /* ms, never an outlier below this */
+#define BACKEND_EJECT_TIME 10000        /* ms, times the ejections so far */
+#define BACKEND_EJECT_MAX 6             /* cap on that multiplier */
+#define BACKEND_EJECT_PERCENT 50        /* of the set that may be out at once */
+
+typedef enum balance_policy_e balance_policy_e;
+typedef struct balancer_s balancer_s;
+typedef struct backend_s backend_s;
+
+enum balance_policy_e {
+    BALANCE_ROUND_ROBIN,
+    BALANCE_LEAST_CONN,
+    BALANCE_HASH,           /* consistent hashing on the session id */
+    BALANCE_PEAK_EWMA       /* cheaper of two, by latency times load */
+};
+
+struct backend_s {
+    char name[BALANCE_NAME_MAX];    /* "host:port" as configured */
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    _Atomic unsigned conns;         /* relays currently routed to it */
+    
+    /* Health, updated under lock by whichever loop has something to report */
+    pthread_mutex_t lock;
+    double latency;                 /* peak EWMA, ms */
+    double errors;                  /* EWMA of failed connects, 0 to 1 */
+    unsigned failures;              /* in a row */
+    unsigned ejections;
+    
+    /* Published for picking without the lock */
+    _Atomic uint64_t cost;          /* latency in us as of stamp */
+    _Atomic uint64_t stamp;
+    _Atomic uint64_t ejected_until; /* ms, 0 when in rotation */
+};
+
+/*
+ A fixed set of upstream backends shared by every event loop. Backends are
+ added before the loops start and the set is read only from then on, so
+ picking one takes no lock. The hash ring places every backend at
+ BALANCE_VNODES points, so adding or removing one moves only the keys
+ between its points and their neighbours, about 1/n of them.
+ 
+ Detection is passive, from what the relays see. Latency is a peak EWMA
+ of connect and first byte times: a slower sample is taken whole, faster
+ ones only pull it down gradually, and it keeps decaying between samples
+ so an idle backend earns its way back. A backend that fails too many
+ connects in a row, fails too often, or is BACKEND_EJECT_FACTOR times
+ slower than the rest is ejected for a while, every policy skipping it.
+ If every backend is out, all of them are back in.
+ */
+extern balancer_s *balancer_s_(balance_policy_e policy);
+extern void balancer_destroy(balancer_s *b);
+
+/* Takes a numeric "host:port". */
+extern bool balancer_add(balancer_s *b, const char *spec);
+extern unsigned balancer_count(balancer_s *b);
+
+/* Picks a backend for key as of now in ms, and counts a connection to it. */
+extern backend_s *balancer_pick(balancer_s *b, uint64_t key, uint64_t now);
+
+/* Counts a connection to the backend at addr, NULL if it isn't one. */
+extern backend_s *balancer_claim(balancer_s *b, const struct sockaddr *addr, socklen_t len);
+
+/* For every pick or claim. */
+extern void backend_release(backend_s *be);
+
+/* A connect or first byte that took latency ms. */
+extern void balancer_report(balancer_s *b, backend_s *be, unsigned latency, uint64_t now);
+
+/* A connect that failed, or a relay the backend broke. */
+extern void balancer_fail(balancer_s *b, backend_s *be, uint64_t now);
+
+#endif /* defined(__TCPDelegate__balance__) */
@@ -0,0 +1,190 @@
+/*
+ AES microbenchmark. Checks the FIPS-197 known answers first, then times
+ ECB over a buffer of whole blocks with each implementation this host has
+ and every key length, in cycles per byte off the time stamp counter.
+ Last, AES-128 throughput by message size, aes_encrypt with its key setup,
+ allocation and padding block against each implementation on whole blocks,
+ then aes_ctr on CTR_BYTES split over more and more threads.
+ crypt.c has to be built with -fno-strict-aliasing.
+
+ usage: aes_bench [buffer bytes]
+ */
+#include "../crypt.h"
+
+#include <string.h>
+#include <time.h>
+#include <x86intrin.h>
+
+#define DEFAULT_BYTES 65536
+#define BUDGET 0.25
+#define SIZE_BUDGET 0.1
+#define CTR_BYTES (16 << 20)
+
+static const char *impl_names[] = {"c", "t-table", "bitslice", "aes-ni"};
+
+static double now(void);
+static double cycles_per_byte(aes_key_s *k, uint8_t *buf, size_t len, bool decrypt);
+static void by_size(const uint8_t *key);
+static double encrypt_rate(const uint8_t *key, uint8_t *buf, size_t len);
+static double blocks_rate(aes_key_s *k, uint8_t *buf, size_t len);
+static void ctr_threads(const uint8_t *key);
+
+int main(int argc, const char *argv[])
+{
+    static const unsigned bits[] = {AES_128, AES_192, AES_256};
+    size_t len = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_BYTES;
+    uint8_t key[32], *buf;
+    aes_impl_e impl;
+    aes_key_s k;
+    double c, base[2];
+    unsigned i;
+    
+    if(!aes_selftest()) {
+        fprintf(stderr, "aes_selftest: known answer mismatch\n");
+        return 1;
+    }
+    printf("known answers ok\n");
+    
+    len -= len % AES_BLOCK_BYTELEN;
+    if(!len)
+        len = AES_BLOCK_BYTELEN;
+    buf = del_alloc(len);
+    for(i = 0; i < len; i++)
+        buf[i] = i * 131;
+    for(i = 0; i < sizeof(key); i++)
+        key[i] = i;
+    
+    printf("%zu byte buffer\n", len);
+    for(i = 0; i < sizeof(bits)/sizeof(bits[0]); i++) {
+        aes_key_init(&k, key, bits[i]);
+        printf("\nAES-%u\n", bits[i]);
+        for(impl = AES_IMPL_C; impl <= AES_IMPL_AESNI; impl++) {
+            if(!aes_impl_supported(impl))
+                continue;
+            k.impl = impl;
+            c = cycles_per_byte(&k, buf, len, false);
+            printf("  %-8s encrypt %10.2f cycles/byte", impl_names[impl], c);
+            if(impl == AES_IMPL_C)
+                base[0] = c;
+            else
+                printf(" %8.1fx", base[0] / c);
+            c = cycles_per_byte(&k, buf, len, true);
+            printf("\n  %-8s decrypt %10.2f cycles/byte", impl_names[impl], c);
+            if(impl == AES_IMPL_C)
+                base[1] = c;
+            else
+                printf(" %8.1fx", base[1] / c);
+            putchar('\n');
+        }
+    }
+    free(buf);
+    
+    by_size(key);
+    ctr_threads(key);
+    return 0;
+}
+
+void by_size(const uint8_t *key)
+{
+    static const size_t sizes[] = {16, 64, 256, 1024, 4096, 16384, 65536, 1048576};
+    aes_impl_e impl;
+    aes_key_s k;
+    uint8_t *buf;
+    unsigned i;
+    
+    printf("\nAES-128 MB/s by message size\n  %8s %12s", "bytes", "aes_encrypt");
+    for(impl = AES_IMPL_C; impl <= AES_IMPL_AESNI; impl++) {
+        if(aes_impl_supported(impl))
+            printf(" %10s", impl_names[impl]);
+    }
+    putchar('\n');
+    
+    aes_key_init(&k, key, AES_128);
+    for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+        buf = del_allocz(sizes[i]);
+        printf("  %8zu %12.1f", sizes[i], encrypt_rate(key, buf, sizes[i]));
+        for(impl = AES_IMPL_C; impl <= AES_IMPL_AESNI; impl++) {
+            if(!aes_impl_supported(impl))
+                continue;
+            k.impl = impl;
+            printf(" %10.1f", blocks_rate(&k, buf, sizes[i]));
+        }
+        putchar('\n');
+        free(buf);
+    }
+}
+
+double encrypt_rate(const uint8_t *key, uint8_t *buf, size_t len)
+{
+    double start = now(), elapsed;
+    uint64_t runs = 0;
+    
+    do {
+        free(aes_encrypt(buf, len, (char *)key));
+        runs++;
+    }
+    while((elapsed = now() - start) < SIZE_BUDGET);
+    return runs * len / elapsed / 1e6;
+}
+
+double blocks_rate(aes_key_s *k, uint8_t *buf, size_t len)
+{
+    double start = now(), elapsed;
+    uint64_t runs = 0;
+    
+    do {
+        aes_encrypt_blocks(k, buf, buf, len / AES_BLOCK_BYTELEN);
+        runs++;
+    }
+    while((elapsed = now() - start) < SIZE_BUDGET);
+    return runs * len / elapsed / 1e6;
+}
+
+double cycles_per_byte(aes_key_s *k, uint8_t *buf, size_t len, bool decrypt)
+{
+    double start = now();
+    uint64_t cycles, runs = 0;
+    
+    cycles = __rdtsc();
+    do {
+        if(decrypt)
+            aes_decrypt_blocks(k, buf, buf, len / AES_BLOCK_BYTELEN);
+        else
+            aes_encrypt_blocks(k, buf, buf, len / AES_BLOCK_BYTELEN);
+        runs++;
+    }
+    while(now() - start < BUDGET);
+    cycles = __rdtsc() - cycles;
+    return (double)cycles / (runs * len);
+}
+
+double now(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void ctr_threads(const uint8_t *key)
+{
+    uint8_t iv[AES_BLOCK_BYTELEN] = {0}, *buf = del_allocz(CTR_BYTES);
+    double start, elapsed;
+    unsigned nthreads;
+    uint64_t runs;
+    aes_key_s k;
+    
+    aes_key_init(&k, key, AES_128);
+    printf("\nAES-128 CTR over %d MB, %s\n", CTR_BYTES >> 20, impl_names[k.impl]);
+    for(nthreads = 1; nthreads <= 8; nthreads *= 2) {
+        start = now();
+        runs = 0;
+        do {
+            aes_ctr(&k, iv, buf, buf, CTR_BYTES, nthreads);
+            runs++;
+        }
+        while((elapsed = now() - start) < BUDGET);
+        printf("  %u threads %10.1f MB/s\n", nthreads, runs * (double)CTR_BYTES / elapsed / 1e6);
+    }
+    free(buf);
+}
@@ -0,0 +1,102 @@
+/*
+ Stand-in backend for trying out balancing and outlier ejection locally.
+ Echoes what it reads back prefixed with its port, after holding every
+ read for delay ms. With -r it resets every connection as soon as it's
+ accepted instead, which the delegate sees as the backend failing.
+
+ usage: backend [-d delay] [-r] port
+ */
+#include "../general.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define BUF_SIZE 65536
+
+static unsigned delay;
+static uint16_t port;
+
+static void *serve(void *arg);
+static void pause_ms(unsigned ms);
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in addr;
+    struct linger lg = {.l_onoff = 1, .l_linger = 0};
+    bool reset = false;
+    pthread_t thread;
+    int opt, one = 1, fd, client;
+    
+    while((opt = getopt(argc, argv, "d:r")) != -1) {
+        switch(opt) {
+            case 'd':
+                delay = (unsigned)atoi(optarg);
+                break;
+            case 'r':
+                reset = true;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-d delay] [-r] port\n", argv[0]);
+                return 1;
+        }
+    }
+    if(optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-d delay] [-r] port\n", argv[0]);
+        return 1;
+    }
+    port = (uint16_t)atoi(argv[optind]);
+    
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(fd, 1024) < 0) {
+        perror("Failed to listen");
+        return 1;
+    }
+    
+    while((client = accept(fd, NULL, NULL)) >= 0) {
+        if(reset) {
+            setsockopt(client, SOL_SOCKET, SO_LINGER, &lg, sizeof lg);
+            close(client);
+            continue;
+        }
+        if(pthread_create(&thread, NULL, serve, (void *)(intptr_t)client)) {
+            close(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
+
+void *serve(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    char buf[BUF_SIZE + 8];
+    ssize_t n;
+    int len;
+    
+    while((n = read(fd, buf + 8, BUF_SIZE)) > 0) {
+        pause_ms(delay);
+        len = sprintf(buf, "%u:", (unsigned)port);
+        memmove(buf + len, buf + 8, n);
+        if(write(fd, buf, len + n) < 0)
+            break;
+    }
+    close(fd);
+    return NULL;
+}
+
+void pause_ms(unsigned ms)
+{
+    struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000};
+    
+    while(ms && nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
@@ -0,0 +1,324 @@
+/*
+ Session table microbenchmark. Pits table_s against the recursive 19-way
+ reqtable tree it replaced, on the same sequential session ids the server
+ hands out. The tree degrades into 19 long chains on sequential ids, so
+ each of its phases gives up once it has used up BUDGET seconds and
+ reports the rate it managed until then.
+
+ usage: table_bench [nsessions] [nthreads]
+ */
+#include "../table.h"
+
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_SESSIONS 1000000
+#define DEFAULT_THREADS 4
+#define TREE_SIZE 19
+#define BUDGET 5.0
+#define CHECK_EVERY 1024
+
+typedef struct node_s node_s;
+typedef struct ops_s ops_s;
+typedef struct worker_s worker_s;
+
+struct node_s {
+    uint64_t session_id;
+    node_s *children[TREE_SIZE];
+};
+
+/* One structure under test */
+struct ops_s {
+    const char *name;
+    void (*insert)(uint64_t key, void *value);
+    void *(*get)(uint64_t key);
+    void (*remove)(uint64_t key);
+};
+
+struct worker_s {
+    pthread_t thread;
+    ops_s *ops;
+    unsigned index, nthreads;
+    uint64_t nsessions;
+    uint64_t done;
+    double elapsed;
+};
+
+static table_s *table;
+static node_s *tree[TREE_SIZE];
+static node_s *nodes;
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t start;
+
+static double now(void);
+static uint64_t next_rand(uint64_t *state);
+
+static void table_bench_insert(uint64_t key, void *value);
+static void *table_bench_get(uint64_t key);
+static void table_bench_remove(uint64_t key);
+
+static void tree_insert(uint64_t key, void *value);
+static void tree_insert_(node_s *node, node_s *base[]);
+static void *tree_get(uint64_t key);
+static void tree_remove(uint64_t key);
+static void tree_remove_(uint64_t key, node_s *base[]);
+static void tree_reparent(node_s *root);
+
+static void run(ops_s *ops, uint64_t nsessions, unsigned nthreads);
+static void report(const char *phase, uint64_t done, uint64_t total, double elapsed);
+static void *lookup_worker(void *arg);
+static void *churn_worker(void *arg);
+static void run_workers(ops_s *ops, uint64_t nkeys, unsigned nthreads, void *(*fn)(void *), const char *phase);
+
+int main(int argc, const char *argv[])
+{
+    uint64_t nsessions = argc > 1 ? strtoull(argv[1], NULL, 10) : DEFAULT_SESSIONS;
+    unsigned nthreads = argc > 2 ? atoi(argv[2]) : DEFAULT_THREADS;
+    ops_s ops[] = {
+        {"table_s", table_bench_insert, table_bench_get, table_bench_remove},
+        {"reqtable", tree_insert, tree_get, tree_remove}
+    };
+    unsigned i;
+    
+    printf("%llu sessions, %u threads\n", (unsigned long long)nsessions, nthreads);
+    
+    table = table_s_(TABLE_SHARDS, 0);
+    nodes = del_allocz((nsessions + 1) * sizeof *nodes);
+    
+    for(i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+        run(&ops[i], nsessions, nthreads);
+    
+    table_destroy(table);
+    free(nodes);
+    return 0;
+}
+
+void run(ops_s *ops, uint64_t nsessions, unsigned nthreads)
+{
+    uint64_t key, done;
+    double t0, elapsed;
+    
+    printf("\n%s\n", ops->name);
+    
+    t0 = now();
+    for(done = 0, key = 1; key <= nsessions; key++, done++) {
+        if(!(done % CHECK_EVERY) && now() - t0 > BUDGET)
+            break;
+        ops->insert(key, &nodes[key]);
+    }
+    elapsed = now() - t0;
+    report("insert", done, nsessions, elapsed);
+    
+    /* The rest of the phases only go over the keys that made it in */
+    run_workers(ops, done, 1, lookup_worker, "lookup, 1 thread");
+    run_workers(ops, done, nthreads, lookup_worker, "lookup, all threads");
+    run_workers(ops, done, nthreads, churn_worker, "90% lookup 10% delete+insert");
+    
+    nsessions = done;
+    t0 = now();
+    for(done = 0, key = 1; key <= nsessions; key++, done++) {
+        if(!(done % CHECK_EVERY) && now() - t0 > BUDGET)
+            break;
+        ops->remove(key);
+    }
+    elapsed = now() - t0;
+    report("delete", done, nsessions, elapsed);
+}
+
+void run_workers(ops_s *ops, uint64_t nkeys, unsigned nthreads, void *(*fn)(void *), const char *phase)
+{
+    worker_s *workers = del_allocz(nthreads * sizeof *workers);
+    uint64_t done = 0;
+    double elapsed = 0;
+    unsigned i;
+    
+    pthread_barrier_init(&start, NULL, nthreads);
+    for(i = 0; i < nthreads; i++) {
+        workers[i].ops = ops;
+        workers[i].index = i;
+        workers[i].nthreads = nthreads;
+        workers[i].nsessions = nkeys;
+        pthread_create(&workers[i].thread, NULL, fn, &workers[i]);
+    }
+    for(i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        done += workers[i].done;
+        if(workers[i].elapsed > elapsed)
+            elapsed = workers[i].elapsed;
+    }
+    pthread_barrier_destroy(&start);
+    free(workers);
+    
+    report(phase, done, nkeys, elapsed);
+}
+
+/* Random lookups over the whole key space, nsessions in total. */
+void *lookup_worker(void *arg)
+{
+    worker_s *w = arg;
+    uint64_t n = w->nsessions / w->nthreads, rng = w->index + 1, i;
+    double t0;
+    
+    pthread_barrier_wait(&start);
+    t0 = now();
+    for(i = 0; i < n; i++) {
+        if(!(i % CHECK_EVERY) && now() - t0 > BUDGET)
+            break;
+        if(!w->ops->get(next_rand(&rng) % w->nsessions + 1)) {
+            fprintf(stderr, "%s: lookup missed\n", w->ops->name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    w->elapsed = now() - t0;
+    w->done = i;
+    return NULL;
+}
+
+/*
+ Lookups anywhere, deletes and re-inserts only among the keys this worker
+ owns so the lookups always hit.
+ */
+void *churn_worker(void *arg)
+{
+    worker_s *w = arg;
+    uint64_t n = w->nsessions / w->nthreads, rng = w->index + 1, i, key;
+    double t0;
+    
+    pthread_barrier_wait(&start);
+    t0 = now();
+    for(i = 0; i < n; i++) {
+        if(!(i % CHECK_EVERY) && now() - t0 > BUDGET)
+            break;
+        if(i % 10 == 9) {
+            key = (next_rand(&rng) % n) * w->nthreads + w->index + 1;
+            w->ops->remove(key);
+            w->ops->insert(key, &nodes[key]);
+        }
+        else {
+            w->ops->get(next_rand(&rng) % w->nsessions + 1);
+        }
+    }
+    w->elapsed = now() - t0;
+    w->done = i;
+    return NULL;
+}
+
+void report(const char *phase, uint64_t done, uint64_t total, double elapsed)
+{
+    printf("  %-32s %10.1f ns/op %8.2f Mops/s%s\n", phase,
+           done ? elapsed * 1e9 / done : 0, done ? done / elapsed / 1e6 : 0,
+           done < total ? "  (budget hit)" : "");
+}
+
+double now(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t next_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+    
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+void table_bench_insert(uint64_t key, void *value)
+{
+    table_insert(table, key, value);
+}
+
+void *table_bench_get(uint64_t key)
+{
+    return table_get(table, key);
+}
+
+void table_bench_remove(uint64_t key)
+{
+    table_remove(table, key);
+}
+
+/*
+ The old reqtable as it was in server.c, less the two bugs that kept it
+ from working at all: the insert never stored anything and reparent()
+ took the already held lock again.
+ */
+void tree_insert(uint64_t key, void *value)
+{
+    node_s *node = value;
+    
+    node->session_id = key;
+    memset(node->children, 0, sizeof(node->children));
+    pthread_mutex_lock(&tree_lock);
+    tree_insert_(node, tree);
+    pthread_mutex_unlock(&tree_lock);
+}
+
+void tree_insert_(node_s *node, node_s *base[])
+{
+    node_s **prec = &base[node->session_id % TREE_SIZE], *rec = *prec;
+    
+    if(rec) {
+        if(node->session_id != rec->session_id)
+            tree_insert_(node, rec->children);
+    }
+    else {
+        *prec = node;
+    }
+}
+
+void *tree_get(uint64_t key)
+{
+    node_s *rec;
+    
+    pthread_mutex_lock(&tree_lock);
+    for(rec = tree[key % TREE_SIZE]; rec && rec->session_id != key; rec = rec->children[key % TREE_SIZE])
+        ;
+    pthread_mutex_unlock(&tree_lock);
+    return rec;
+}
+
+void tree_remove(uint64_t key)
+{
+    pthread_mutex_lock(&tree_lock);
+    tree_remove_(key, tree);
+    pthread_mutex_unlock(&tree_lock);
+}
+
+void tree_remove_(uint64_t key, node_s *base[])
+{
+    int i;
+    node_s **prec = &base[key % TREE_SIZE], *rec = *prec;
+    
+    if(rec) {
+        if(rec->session_id == key) {
+            *prec = NULL;
+            for(i = 0; i < TREE_SIZE; i++) {
+                if(rec->children[i])
+                    tree_reparent(rec->children[i]);
+            }
+        }
+        else {
+            tree_remove_(key, rec->children);
+        }
+    }
+}
+
+void tree_reparent(node_s *root)
+{
+    int i;
+    node_s *child;
+    
+    for(i = 0; i < TREE_SIZE; i++) {
+        child = root->children[i];
+        root->children[i] = NULL;
+        if(child)
+            tree_reparent(child);
+    }
+    tree_insert_(root, tree);
+}
@@ -0,0 +1,184 @@
+/*
+ Datagram relay throughput. Logs in over TCP, binds flows datagrams to a
+ sink of its own and blasts size byte datagrams through the delegate for
+ the given number of seconds, a batch at a time from each flow in turn.
+ Reports what went out and what reached the sink, in datagrams a second.
+
+ usage: udp_bench [-f flows] [-s size] [-t seconds] [server [port]]
+ */
+#include "../general.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define BATCH 64
+#define MAX_FLOWS 1024
+#define TOKEN_SIZE 16
+#define PASS "test"
+
+static int sink;
+static _Atomic bool running = true;
+static _Atomic uint64_t received;
+
+static void login(struct sockaddr_in *server, uint64_t *session_id, char *token);
+static int bind_flow(struct sockaddr_in *server, uint64_t session_id, const char *token, uint16_t sink_port);
+static void *drain(void *arg);
+static double now_s(void);
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in server, addr;
+    socklen_t addrlen = sizeof addr;
+    struct mmsghdr msgs[BATCH];
+    struct iovec iov;
+    unsigned nflows = 1, size = 64, seconds = 5, i;
+    int opt, flows[MAX_FLOWS], n;
+    uint64_t session_id, sent = 0;
+    char token[TOKEN_SIZE], buf[2048];
+    pthread_t thread;
+    double start, elapsed;
+    
+    while((opt = getopt(argc, argv, "f:s:t:")) != -1) {
+        switch(opt) {
+            case 'f':
+                nflows = (unsigned)atoi(optarg);
+                break;
+            case 's':
+                size = (unsigned)atoi(optarg);
+                break;
+            case 't':
+                seconds = (unsigned)atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-f flows] [-s size] [-t seconds] [server [port]]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(!nflows || nflows > MAX_FLOWS || !size || size > sizeof buf) {
+        fprintf(stderr, "Between 1 and %d flows of 1 to %lu bytes.\n", MAX_FLOWS, (unsigned long)sizeof buf);
+        return 1;
+    }
+    
+    memset(&server, 0, sizeof server);
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = inet_addr(optind < argc ? argv[optind] : "127.0.0.1");
+    server.sin_port = htons(optind + 1 < argc ? atoi(argv[optind + 1]) : 13370);
+    
+    sink = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(sink, (struct sockaddr *)&addr, sizeof addr);
+    getsockname(sink, (struct sockaddr *)&addr, &addrlen);
+    
+    login(&server, &session_id, token);
+    for(i = 0; i < nflows; i++)
+        flows[i] = bind_flow(&server, session_id, token, ntohs(addr.sin_port));
+    pthread_create(&thread, NULL, drain, NULL);
+    
+    memset(buf, 'x', sizeof buf);
+    iov.iov_base = buf;
+    iov.iov_len = size;
+    memset(msgs, 0, sizeof msgs);
+    for(i = 0; i < BATCH; i++) {
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    
+    start = now_s();
+    for(i = 0; (elapsed = now_s() - start) < seconds; i = (i + 1) % nflows) {
+        n = sendmmsg(flows[i], msgs, BATCH, 0);
+        if(n > 0)
+            sent += n;
+    }
+    sleep(1);
+    atomic_store(&running, false);
+    pthread_join(thread, NULL);
+    
+    printf("%u flows of %u byte datagrams: sent %.0f/s, relayed %.0f/s\n", nflows, size,
+           sent / elapsed, atomic_load(&received) / elapsed);
+    return 0;
+}
+
+void login(struct sockaddr_in *server, uint64_t *session_id, char *token)
+{
+    char buf[64] = {1, sizeof PASS - 1};
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    size_t got = 0;
+    ssize_t n;
+    
+    memcpy(&buf[2], PASS, sizeof PASS - 1);
+    if(connect(fd, (struct sockaddr *)server, sizeof *server) < 0 || write(fd, buf, 2 + sizeof PASS - 1) < 0) {
+        perror("Failed to log in");
+        exit(EXIT_FAILURE);
+    }
+    /* Type, length, then the session id and token */
+    while(got < 2 + sizeof *session_id + TOKEN_SIZE) {
+        n = read(fd, &buf[got], sizeof buf - got);
+        if(n <= 0) {
+            fprintf(stderr, "Login rejected\n");
+            exit(EXIT_FAILURE);
+        }
+        got += n;
+    }
+    memcpy(session_id, &buf[2], sizeof *session_id);
+    memcpy(token, &buf[2 + sizeof *session_id], TOKEN_SIZE);
+}
+
+int bind_flow(struct sockaddr_in *server, uint64_t session_id, const char *token, uint16_t sink_port)
+{
+    char buf[64];
+    struct timeval timeout = {.tv_sec = 1};
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int len;
+    
+    memcpy(buf, &session_id, sizeof session_id);
+    memcpy(&buf[sizeof session_id], token, TOKEN_SIZE);
+    len = sizeof session_id + TOKEN_SIZE;
+    len += sprintf(&buf[len], "127.0.0.1:%d", sink_port);
+    
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    if(connect(fd, (struct sockaddr *)server, sizeof *server) < 0 || send(fd, buf, len, 0) < 0 ||
+       recv(fd, buf, sizeof buf, 0) != sizeof session_id + 1 || !buf[sizeof session_id]) {
+        fprintf(stderr, "Flow refused\n");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+void *drain(void *arg)
+{
+    struct mmsghdr msgs[BATCH];
+    struct iovec iov[BATCH];
+    static char bufs[BATCH][2048];
+    struct timeval timeout = {.tv_usec = 100000};
+    int i, n;
+    
+    memset(msgs, 0, sizeof msgs);
+    for(i = 0; i < BATCH; i++) {
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = sizeof bufs[i];
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    setsockopt(sink, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    while(atomic_load(&running)) {
+        n = recvmmsg(sink, msgs, BATCH, 0, NULL);
+        if(n > 0)
+            atomic_fetch_add(&received, n);
+    }
+    return NULL;
+}
+
+double now_s(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -1,64 +1,552 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include "../lz.h"
+#include "../shm.h"
+
 #define DEFAULT_PORT 13370
 #define DEFAULT_SERVER "127.0.0.1"
 #define PASS "test"
+#define HEADER_MAX 6
+#define TOKEN_SIZE 16
+#define LOGIN_COMPRESS 0x01
+#define LOGIN_SHM 0x02
 
 enum client_pack_type_e {
     PACKET_INIT = 1,
     PACKET_TX,
-    PACKET_REESTAB
+    PACKET_REESTAB,
+    PACKET_SESSIONID
 };
 
-static void client_connect(const char *server, uint16_t port);
-static void init_write(int fd, const char *pass);
+static void client_connect(int fd, const char *remote, const char *resume, uint8_t options);
+static int client_socket(const char *server, uint16_t port, const char *path);
+static uint32_t reply_recv(int fd, uint8_t *type, void *buf, uint32_t len, int *fds, unsigned *nfds);
+static void client_resume(int fd, const char *resume);
+static void print_session(uint64_t session_id, const unsigned char *token);
+static size_t frame_put(char *out, uint8_t type, const void *payload, uint32_t len);
+static uint32_t frame_read(int fd, uint8_t *type, void *buf, uint32_t max);
+static void read_full(int fd, void *buf, size_t len);
+static void relay(int fd, bool compress);
+static void relay_block_up(int fd, const char *data, size_t len);
+static bool relay_block_down(int fd);
+static void ring_write_full(int fd, shm_channel_s *c, const void *data, size_t len);
+static void ring_read_full(int fd, shm_channel_s *c, void *buf, size_t len);
+static void ring_wait(int fd, shm_channel_s *c);
+static void relay_ring(int fd, shm_channel_s *c);
+
+/* Stream history for a compressed relay, one per direction */
+static lz_encoder_s encoder;
+static lz_decoder_s decoder;
 
 
+/*
+ usage: client [-z] [-r session:token] [server [port [host:port]]], an empty
+ host:port relays to the server's backends and -z asks for compression.
+ With -x path the server is reached on its Unix socket and only host:port
+ is given, -m then asks to go over shared memory instead.
+ */
 int main(int argc, const char *argv[]) {
-    client_connect(DEFAULT_SERVER, DEFAULT_PORT);
+    const char *server, *resume = NULL, *path = NULL;
+    uint8_t options = 0;
+    uint16_t port;
+    int opt, fd;
+    
+    while((opt = getopt(argc, (char *const *)argv, "r:zx:m")) != -1) {
+        if(opt == 'r') {
+            resume = optarg;
+        }
+        else if(opt == 'z') {
+            options |= LOGIN_COMPRESS;
+        }
+        else if(opt == 'x') {
+            path = optarg;
+        }
+        else if(opt == 'm') {
+            options |= LOGIN_SHM;
+        }
+        else {
+            fprintf(stderr, "usage: %s [-z] [-r session:token] [server [port [host:port]]]\n"
+                    "       %s -x path [-m] [-z] [-r session:token] [host:port]\n", argv[0], argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if((options & LOGIN_SHM) && !path) {
+        fprintf(stderr, "Error: Shared memory needs the server's Unix socket\n");
+        exit(EXIT_FAILURE);
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    
+    if(path) {
+        fd = client_socket(NULL, 0, path);
+        client_connect(fd, argc > 1 ? argv[1] : NULL, resume, options);
+        return 0;
+    }
+    server = argc > 1 ? argv[1] : DEFAULT_SERVER;
+    port = argc > 2 ? atoi(argv[2]) : DEFAULT_PORT;
+    
+    fd = client_socket(server, port, NULL);
+    client_connect(fd, argc > 3 ? argv[3] : NULL, resume, options);
     return 0;
 }
 
-void client_connect(const char *server, uint16_t port)
+/* Connected to server:port, or to the Unix socket at path if given. */
+int client_socket(const char *server, uint16_t port, const char *path)
 {
     int fd, status;
     struct sockaddr_in serv_addr;
+    struct sockaddr_un unix_addr;
     
-    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    fd = socket(path ? AF_UNIX : AF_INET, SOCK_STREAM, 0);
     if(fd < 0) {
         perror("Error: Failed to create socket");
         exit(EXIT_FAILURE);
     }
     
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = inet_addr(server);
-    serv_addr.sin_port = htons(DEFAULT_PORT);
-    
-    status = connect(fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
-    if(connect < 0) {
+    if(path) {
+        if(strlen(path) >= sizeof(unix_addr.sun_path)) {
+            fprintf(stderr, "Error: Socket path too long\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(&unix_addr, 0, sizeof(unix_addr));
+        unix_addr.sun_family = AF_UNIX;
+        strcpy(unix_addr.sun_path, path);
+        status = connect(fd, (struct sockaddr *)&unix_addr, sizeof(unix_addr));
+    }
+    else {
+        memset(&serv_addr, 0, sizeof(serv_addr));
+        serv_addr.sin_family = AF_INET;
+        serv_addr.sin_addr.s_addr = inet_addr(server);
+        serv_addr.sin_port = htons(port);
+        status = connect(fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+    }
+    if(status < 0) {
         perror("Connection Error");
         exit(EXIT_FAILURE);
     }
+    return fd;
+}
+
+void client_connect(int fd, const char *remote, const char *resume, uint8_t options)
+{
+    char buf[2 * HEADER_MAX + sizeof(PASS) + 1 + 256];
+    char login[sizeof(PASS) + 1] = PASS;
+    size_t len;
+    uint32_t rlen;
+    uint8_t type, taken = 0;
+    uint64_t session_id;
+    unsigned char reply[sizeof(session_id) + TOKEN_SIZE + 1];
+    int fds[SHM_FDS];
+    unsigned nfds = 0;
+    shm_channel_s channel;
+    
+    /* A compressed session dies with its connection, there's nothing to resume */
+    if(resume) {
+        client_resume(fd, resume);
+        relay(fd, false);
+        close(fd);
+        return;
+    }
+    if(remote && strlen(remote) > 255) {
+        fprintf(stderr, "Error: Remote address too long\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    /*
+     The PACKET_TX goes out right behind the login, in the same write, unless
+     it has to wait to go over shared memory. Options follow the password and
+     a NUL.
+     */
+    login[sizeof(PASS)] = options;
+    len = frame_put(buf, PACKET_INIT, login, options ? sizeof(login) : strlen(PASS));
+    if(remote && !(options & LOGIN_SHM))
+        len += frame_put(&buf[len], PACKET_TX, remote, strlen(remote));
+    write(fd, buf, len);
+    
+    if(options & LOGIN_SHM)
+        rlen = reply_recv(fd, &type, reply, sizeof(reply), fds, &nfds);
+    else
+        rlen = frame_read(fd, &type, reply, sizeof(reply));
+    if(rlen != sizeof(reply) - (options ? 0 : 1) || type != PACKET_SESSIONID) {
+        fprintf(stderr, "Error: Login rejected\n");
+        exit(EXIT_FAILURE);
+    }
+    if(options)
+        taken = reply[sizeof(reply) - 1];
+    if((options & LOGIN_COMPRESS) && !(taken & LOGIN_COMPRESS))
+        fprintf(stderr, "Warning: Server declined compression\n");
+    if((options & LOGIN_SHM) && (!(taken & LOGIN_SHM) || nfds != SHM_FDS)) {
+        fprintf(stderr, "Warning: Server declined shared memory\n");
+        while(nfds)
+            close(fds[--nfds]);
+        taken &= ~LOGIN_SHM;
+    }
+    memcpy(&session_id, reply, sizeof(session_id));
+    print_session(session_id, &reply[sizeof(session_id)]);
     
-    init_write(fd, PASS);
+    /* The socket stays open only to say either end is still there */
+    if(taken & LOGIN_SHM) {
+        if(!shm_channel_attach(&channel, fds)) {
+            perror("Error: Failed to map the shared memory channel");
+            exit(EXIT_FAILURE);
+        }
+        if(remote) {
+            ring_write_full(fd, &channel, buf, frame_put(buf, PACKET_TX, remote, strlen(remote)));
+            ring_read_full(fd, &channel, buf, 2);
+            if(buf[0] != PACKET_TX || buf[1]) {
+                fprintf(stderr, "Error: Relay to %s refused\n", remote);
+                exit(EXIT_FAILURE);
+            }
+            relay_ring(fd, &channel);
+        }
+        shm_channel_destroy(&channel);
+        close(fd);
+        return;
+    }
+    
+    if(remote) {
+        if(options & LOGIN_SHM)
+            write(fd, buf, frame_put(buf, PACKET_TX, remote, strlen(remote)));
+        frame_read(fd, &type, buf, sizeof(buf));
+        if(type != PACKET_TX) {
+            fprintf(stderr, "Error: Relay to %s refused\n", remote);
+            exit(EXIT_FAILURE);
+        }
+        relay(fd, taken & LOGIN_COMPRESS);
+    }
     
     close(fd);
 }
 
-void init_write(int fd, const char *pass)
+/*
+ The login reply with the shared memory channel's descriptors, which come
+ with its first byte. It is short enough to arrive whole, and its length
+ fits in one varint byte.
+ */
+uint32_t reply_recv(int fd, uint8_t *type, void *buf, uint32_t len, int *fds, unsigned *nfds)
+{
+    char data[2 + len];
+    char control[CMSG_SPACE(sizeof(int) * SHM_FDS)];
+    struct iovec iov = {.iov_base = data, .iov_len = sizeof(data)};
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    ssize_t status;
+    
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    
+    status = recvmsg(fd, &mh, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    for(cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+        if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS && cm->cmsg_len == CMSG_LEN(sizeof(int) * SHM_FDS)) {
+            memcpy(fds, CMSG_DATA(cm), sizeof(int) * SHM_FDS);
+            *nfds = SHM_FDS;
+        }
+    }
+    if(status != (ssize_t)sizeof(data)) {
+        fprintf(stderr, "Error: Login rejected\n");
+        exit(EXIT_FAILURE);
+    }
+    *type = data[0];
+    memcpy(buf, &data[2], len);
+    return (uint8_t)data[1];
+}
+
+/* Picks up a session dropped by an earlier connection, given as printed by print_session. */
+void client_resume(int fd, const char *resume)
+{
+    char buf[HEADER_MAX + sizeof(uint64_t) + TOKEN_SIZE];
+    unsigned char payload[sizeof(uint64_t) + TOKEN_SIZE];
+    unsigned long long id;
+    uint64_t session_id;
+    unsigned byte;
+    uint8_t type;
+    const char *hex = strchr(resume, ':');
+    int i;
+    
+    if(!hex || strlen(hex + 1) != 2 * TOKEN_SIZE) {
+        fprintf(stderr, "Error: Expected session:token\n");
+        exit(EXIT_FAILURE);
+    }
+    id = strtoull(resume, NULL, 10);
+    session_id = id;
+    memcpy(payload, &session_id, sizeof(session_id));
+    for(i = 0; i < TOKEN_SIZE; i++) {
+        sscanf(&hex[1 + 2 * i], "%2x", &byte);
+        payload[sizeof(session_id) + i] = byte;
+    }
+    
+    write(fd, buf, frame_put(buf, PACKET_REESTAB, payload, sizeof(payload)));
+    if(frame_read(fd, &type, payload, TOKEN_SIZE) != TOKEN_SIZE || type != PACKET_REESTAB) {
+        fprintf(stderr, "Error: Resumption refused\n");
+        exit(EXIT_FAILURE);
+    }
+    print_session(session_id, payload);
+}
+
+/* The token changes with every resumption, only the latest one is good. */
+void print_session(uint64_t session_id, const unsigned char *token)
 {
-    char buf[128];
+    int i;
     
-    buf[0] = PACKET_INIT;
-    strcpy(&buf[1], pass);
+    fprintf(stderr, "Session: %llu:", (unsigned long long)session_id);
+    for(i = 0; i < TOKEN_SIZE; i++)
+        fprintf(stderr, "%02x", token[i]);
+    fprintf(stderr, "\n");
+}
+
+/* A frame is a type byte, the payload length as a LEB128 varint, then the payload. */
+size_t frame_put(char *out, uint8_t type, const void *payload, uint32_t len)
+{
+    size_t n = 0;
+    uint32_t v = len;
     
-    write(fd, buf, strlen(buf) + 1);
+    out[n++] = type;
+    do {
+        out[n++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+        v >>= 7;
+    } while(v);
+    
+    memcpy(&out[n], payload, len);
+    return n + len;
+}
+
+/*
+ Reads one frame a byte at a time up to its payload, so nothing that
+ follows it gets read. Payload beyond max is discarded.
+ */
+uint32_t frame_read(int fd, uint8_t *type, void *buf, uint32_t max)
+{
+    unsigned char c;
+    uint32_t len = 0, left;
+    unsigned shift = 0;
+    char skip[256];
+    
+    read_full(fd, type, 1);
+    do {
+        read_full(fd, &c, 1);
+        if(shift > 28) {
+            fprintf(stderr, "Error: Malformed frame\n");
+            exit(EXIT_FAILURE);
+        }
+        len |= (uint32_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while(c & 0x80);
+    
+    read_full(fd, buf, len < max ? len : max);
+    for(left = len < max ? 0 : len - max; left; left -= left < sizeof(skip) ? left : sizeof(skip))
+        read_full(fd, skip, left < sizeof(skip) ? left : sizeof(skip));
+    return len;
+}
+
+void read_full(int fd, void *buf, size_t len)
+{
+    ssize_t status;
+    char *bptr = buf;
+    
+    while(len) {
+        status = read(fd, bptr, len);
+        if(status <= 0) {
+            fprintf(stderr, "Error: Server closed the connection\n");
+            exit(EXIT_FAILURE);
+        }
+        bptr += status;
+        len -= status;
+    }
+}
+
+/*
+ Copies stdin to the relay and the relay to stdout until both sides are
+ done. Compressed, both ways are PACKET_TX frames each holding a block.
+ */
+void relay(int fd, bool compress)
+{
+    char buf[65536];
+    ssize_t status;
+    struct pollfd fds[2] = {
+        {.fd = STDIN_FILENO, .events = POLLIN},
+        {.fd = fd, .events = POLLIN}
+    };
+    
+    while(fds[1].fd >= 0) {
+        if(poll(fds, 2, -1) < 0) {
+            perror("Error: poll failed");
+            exit(EXIT_FAILURE);
+        }
+        if(fds[0].revents) {
+            status = read(STDIN_FILENO, buf, sizeof(buf) < LZ_BLOCK_MAX ? sizeof(buf) : LZ_BLOCK_MAX);
+            if(status > 0 && compress) {
+                relay_block_up(fd, buf, status);
+            }
+            else if(status > 0) {
+                write(fd, buf, status);
+            }
+            else {
+                shutdown(fd, SHUT_WR);
+                fds[0].fd = -1;
+            }
+        }
+        if(fds[1].revents && compress) {
+            if(!relay_block_down(fd))
+                fds[1].fd = -1;
+        }
+        else if(fds[1].revents) {
+            status = read(fd, buf, sizeof(buf));
+            if(status > 0)
+                write(STDOUT_FILENO, buf, status);
+            else
+                fds[1].fd = -1;
+        }
+    }
+}
+
+void ring_write_full(int fd, shm_channel_s *c, const void *data, size_t len)
+{
+    size_t n;
+    
+    while(len) {
+        n = shm_write(c, data, len);
+        data = (const char *)data + n;
+        len -= n;
+        if(len && !shm_wait_write(c))
+            ring_wait(fd, c);
+    }
+}
+
+void ring_read_full(int fd, shm_channel_s *c, void *buf, size_t len)
+{
+    const char *data;
+    size_t n;
+    
+    while(len) {
+        data = shm_peek(c, &n);
+        if(n > len)
+            n = len;
+        memcpy(buf, data, n);
+        shm_consume(c, n);
+        buf = (char *)buf + n;
+        len -= n;
+        if(len && !shm_wait_read(c))
+            ring_wait(fd, c);
+    }
+}
+
+/* Blocks until kicked. The socket only turns readable once the server has gone. */
+void ring_wait(int fd, shm_channel_s *c)
+{
+    struct pollfd fds[2] = {
+        {.fd = c->wake, .events = POLLIN},
+        {.fd = fd, .events = POLLIN}
+    };
+    
+    poll(fds, 2, -1);
+    if(fds[1].revents) {
+        fprintf(stderr, "Error: Server closed the connection\n");
+        exit(EXIT_FAILURE);
+    }
+    shm_ack(c);
+}
+
+/*
+ relay over the shared memory channel. stdin is read straight into the
+ ring while it has room, and the other ring written out as it fills.
+ Done once the server closes its ring, what it left there still counts
+ if the socket goes first.
+ */
+void relay_ring(int fd, shm_channel_s *c)
+{
+    struct pollfd fds[3] = {
+        {.fd = STDIN_FILENO, .events = POLLIN},
+        {.fd = c->wake, .events = POLLIN},
+        {.fd = fd, .events = POLLIN}
+    };
+    const char *data;
+    size_t len, room = 0;
+    ssize_t status;
+    bool input = true;
+    char *p = NULL;
+    
+    for(;;) {
+        data = shm_peek(c, &len);
+        if(len) {
+            write(STDOUT_FILENO, data, len);
+            shm_consume(c, len);
+            continue;
+        }
+        if(shm_eof(c))
+            return;
+        if(fds[2].fd < 0) {
+            fprintf(stderr, "Error: Server closed the connection\n");
+            exit(EXIT_FAILURE);
+        }
+        if(shm_wait_read(c))
+            continue;
+        
+        /* Off the poll set while the ring is full, a closed pipe would keep waking it */
+        if(input) {
+            p = shm_reserve(c, &room);
+            if(!p && shm_wait_write(c))
+                continue;
+            fds[0].fd = p ? STDIN_FILENO : -1;
+        }
+        if(poll(fds, 3, -1) < 0) {
+            perror("Error: poll failed");
+            exit(EXIT_FAILURE);
+        }
+        if(fds[1].revents)
+            shm_ack(c);
+        if(fds[2].revents)
+            fds[2].fd = -1;
+        if(fds[0].fd >= 0 && fds[0].revents) {
+            status = read(STDIN_FILENO, p, room);
+            if(status > 0) {
+                shm_commit(c, status);
+            }
+            else {
+                shm_close(c);
+                fds[0].fd = -1;
+                input = false;
+            }
+        }
+    }
+}
+
+void relay_block_up(int fd, const char *data, size_t len)
+{
+    static char block[LZ_BOUND(LZ_BLOCK_MAX)], out[HEADER_MAX + sizeof(block)];
+    
+    write(fd, out, frame_put(out, PACKET_TX, block, lz_encode(&encoder, data, len, block)));
+}
+
+/* False once the relay has closed, between frames. */
+bool relay_block_down(int fd)
+{
+    static char block[LZ_BOUND(LZ_BLOCK_MAX)];
+    const char *out;
+    size_t outlen;
+    uint32_t len;
+    uint8_t type;
+    char c;
+    
+    if(recv(fd, &c, 1, MSG_PEEK) <= 0)
+        return false;
+    len = frame_read(fd, &type, block, sizeof(block));
+    if(type != PACKET_TX || len > sizeof(block) || !(out = lz_decode(&decoder, block, len, &outlen))) {
+        fprintf(stderr, "Error: Corrupt compressed stream\n");
+        exit(EXIT_FAILURE);
+    }
+    write(STDOUT_FILENO, out, outlen);
+    return true;
 }
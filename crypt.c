@@ -11,8 +11,11 @@
 #include <string.h>
 #include <assert.h>
 #include <time.h>
+#include <endian.h>
 
 #include "crypt.h"
+#include "aesni.h"
+#include "aesbs.h"
 
 typedef struct block_s block_s;
 
@@ -36,6 +39,7 @@ static inline uint64_t s_512_1(uint64_t x);
 static inline uint64_t to_big_endian64(uint64_t w);
 static inline uint32_t to_big_endian32(uint32_t w);
 static void print_word(uint64_t w);
+static void sha512_bytes(sha512_s *digest, sha512_s *bytes);
 
 void sha512(void *message, size_t len, sha512_s *digest)
 {
@@ -280,20 +284,81 @@ int sha512_equal(sha512_s *d1, sha512_s *d2)
     return 1;
 }
 
-void PBKDF(char *pass, salt_s salt, unsigned C, size_t kLen)
+/*
+ HMAC as in RFC 2104, keys longer than a block are hashed first. The
+ message is copied in behind the padded key since sha512() only takes
+ its input whole.
+ */
+void hmac_sha512(const void *key, size_t klen, const void *message, size_t len, sha512_s *mac)
 {
-    unsigned i, Ti, U0;
-    size_t r, len;
+    uint8_t pad[128 + sizeof(sha512_s)], *inner;
+    sha512_s keyhash, ihash;
+    unsigned i;
     
-    len = (kLen / sizeof(uint64_t[8])) + !!(kLen / sizeof(uint64_t[8]));
-    r = kLen - (len - 1) * (sizeof(uint64_t[8]));
+    if(klen > 128) {
+        sha512((void *)key, klen, &keyhash);
+        sha512_bytes(&keyhash, &keyhash);
+        key = &keyhash;
+        klen = sizeof(keyhash);
+    }
     
-    for(i = 1; i <= len; i++) {
-        Ti = 0;
-        //U0 =
+    inner = del_alloc(128 + len);
+    memset(inner, 0x36, 128);
+    for(i = 0; i < klen; i++)
+        inner[i] ^= ((const uint8_t *)key)[i];
+    memcpy(&inner[128], message, len);
+    sha512(inner, 128 + len, &ihash);
+    sha512_bytes(&ihash, &ihash);
+    
+    memset(pad, 0x5c, 128);
+    for(i = 0; i < klen; i++)
+        pad[i] ^= ((const uint8_t *)key)[i];
+    memcpy(&pad[128], &ihash, sizeof(ihash));
+    sha512(pad, sizeof(pad), mac);
+    sha512_bytes(mac, mac);
+    
+    for(i = 0; i < 128 + len; i++)
+        ((volatile uint8_t *)inner)[i] = 0;
+    free(inner);
+}
+
+/* PBKDF2 with HMAC-SHA512 as the PRF (RFC 8018), the salt taken as its 8 bytes. */
+void PBKDF(const char *pass, size_t plen, salt_s salt, unsigned C, void *key, size_t kLen)
+{
+    uint8_t block[sizeof(salt) + 4], *out = key;
+    sha512_s U, T;
+    uint32_t i, j, w;
+    size_t n;
+    
+    memcpy(block, salt.oct, sizeof(salt));
+    for(i = 1; kLen; i++) {
+        block[8] = i >> 24;
+        block[9] = i >> 16;
+        block[10] = i >> 8;
+        block[11] = i;
+        hmac_sha512(pass, plen, block, sizeof(block), &U);
+        T = U;
+        for(j = 1; j < C; j++) {
+            hmac_sha512(pass, plen, &U, sizeof(U), &U);
+            for(w = 0; w < 8; w++)
+                T.word[w] ^= U.word[w];
+        }
+        n = kLen < sizeof(T) ? kLen : sizeof(T);
+        memcpy(out, &T, n);
+        out += n;
+        kLen -= n;
     }
 }
 
+/* Turns a digest into its byte string, the order everything else hashes it in. */
+void sha512_bytes(sha512_s *digest, sha512_s *bytes)
+{
+    unsigned i;
+    
+    for(i = 0; i < 8; i++)
+        bytes->word[i] = to_big_endian64(digest->word[i]);
+}
+
 /*
 
  CALL srand() at beginning of program!
@@ -319,8 +384,6 @@ salt_s get_salt(void)
 
 /*AES Implementation as specified by nist*/
 
-#define INIT_AES_BUF_SIZE (2*AES_BLOCK_BYTELEN)
-
 typedef union word_u word_u;
 
 union word_u
@@ -329,6 +392,20 @@ union word_u
     uint8_t b[4];
 };
 
+typedef struct aes_ctr_part_s aes_ctr_part_s;
+
+/* One thread's counter range of an aes_ctr call */
+struct aes_ctr_part_s
+{
+    const aes_key_s *key;
+    uint64_t hi, lo;
+    const uint8_t *in;
+    uint8_t *out;
+    size_t len;
+    pthread_t thread;
+    bool threaded;
+};
+
 static uint8_t sbox[16][16] = {
     { 0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76 },
     { 0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0 },
@@ -516,84 +593,285 @@ static inline word_u RotWord(word_u word);
 static inline void SubBytes(aesblock_s *state);
 static inline void ShiftRows(aesblock_s *state);
 static inline void MixColumns(aesblock_s *state);
-static inline void AddRoundKey(aesblock_s *state, word_u *w);
-static inline void KeyExpansion(uint8_t *key, word_u *w);
-static void aes_block_encrypt(aesblock_s *state, word_u *w);
-static aesblock_s *newblock(aes_digest_s **d, size_t *bufsize);
-
-
-static void aes_block_decrypt(aesblock_s *state, word_u *w);
+static inline void AddRoundKey(aesblock_s *state, const word_u *w);
+static inline void KeyExpansion(const uint8_t *key, unsigned nk, word_u *w);
+static void aes_block_encrypt(aesblock_s *state, const word_u *w, unsigned nr);
+static void aes_load(aesblock_s *state, const uint8_t *in);
+static void aes_store(const aesblock_s *state, uint8_t *out);
+static void aes_inverse_keys(aes_key_s *k);
+static bool aes_check(const aes_key_s *k, const uint8_t *plain, const uint8_t *cipher);
+static bool aes_ctr_check(const aes_key_s *k);
+static void aes_ctr_start(aes_ctr_s *c, const aes_key_s *k, uint64_t hi, uint64_t lo);
+static void aes_ctr_part(aes_ctr_part_s *p);
+static void *aes_ctr_thread(void *arg);
+static inline void ctr_add(uint64_t *hi, uint64_t *lo, uint64_t n);
+static inline void ctr_xor(uint8_t *out, const uint8_t *in, const uint8_t *ks, size_t len);
+
+
+static void aes_block_decrypt(aesblock_s *state, const word_u *w, unsigned nr);
 static inline uint8_t InvSubByte(uint8_t b);
 static inline void InvShiftRows(aesblock_s *state);
 static inline void InvSubBytes(aesblock_s *state);
 static inline void InvMixColumns(aesblock_s *state);
 
+#ifdef AES_TTABLE
+
+#define ROTL32(w, n) ((w) << (n) | (w) >> (32 - (n)))
+#define GET32(p) ((uint32_t)(p)[0] | (uint32_t)(p)[1] << 8 | (uint32_t)(p)[2] << 16 | (uint32_t)(p)[3] << 24)
+#define BYTE(w, r) (((w) >> (8*(r))) & 0xff)
+
+/*
+ Te[r][x] is what byte x in row r adds to its column after SubBytes and
+ MixColumns, Td[r][x] the same through InvSubBytes and InvMixColumns. A
+ column's bytes go from the low end of the word up.
+ */
+static uint32_t Te[4][256];
+static uint32_t Td[4][256];
+static pthread_once_t ttable_once = PTHREAD_ONCE_INIT;
+
+static void ttable_init(void);
+static void ttable_encrypt(const aes_key_s *k, const uint8_t *in, uint8_t *out, size_t nblocks);
+static void ttable_decrypt(const aes_key_s *k, const uint8_t *in, uint8_t *out, size_t nblocks);
+static inline void ttable_put(uint8_t *out, uint32_t w);
+
+#endif
+
 aes_digest_s *aes_encrypt(void *message, size_t len, char *key)
 {
-    uint8_t diff;
-    size_t i, j;
+    size_t whole = len / AES_BLOCK_BYTELEN, rest = len % AES_BLOCK_BYTELEN;
     aes_digest_s *enc;
-    aesblock_s *digest;
-    word_u keysched[Nb*(Nr+1)];
-    size_t bufsize = INIT_AES_BUF_SIZE;
+    uint8_t *last;
+    aes_key_s k;
     
+    aes_key_init(&k, key, KEY_LENGTH);
+    
+    enc = del_alloc(sizeof(*enc) + (whole+1)*AES_BLOCK_BYTELEN);
+    enc->size = (whole+1)*AES_BLOCK_BYTELEN;
+    aes_encrypt_blocks(&k, message, enc->data, whole);
+    
+    /* Apply PKCS5 padding, a whole block of it when len is a multiple */
+    last = enc->data[whole].b[0];
+    memcpy(last, (uint8_t *)message + whole*AES_BLOCK_BYTELEN, rest);
+    memset(&last[rest], AES_BLOCK_BYTELEN - rest, AES_BLOCK_BYTELEN - rest);
+    aes_encrypt_blocks(&k, last, last, 1);
+    return enc;
+}
+
+void aes_key_init(aes_key_s *k, const void *key, unsigned bits)
+{
 #ifndef STATIC_RCON
-    if(!Rcon[0].b[0]) /* At least cache it */
-        for (i = 1, Rcon[0].b[0] = 1; i < 256; i++)
-            Rcon[i].b[0] = xtime(Rcon[i-1].b[0]);
+    unsigned i;
+    uint8_t rc;
+    
+    if(!Rcon[0].b[0]) { /* At least cache it, the first entry goes in last */
+        for(i = 1, rc = 1; i < 256; i++)
+            Rcon[i].b[0] = rc = xtime(rc);
+        Rcon[0].b[0] = 1;
+    }
 #endif
     
-    KeyExpansion((uint8_t *)key, keysched);
+#ifdef AES_TTABLE
+    pthread_once(&ttable_once, ttable_init);
+#endif
     
-    enc = del_alloc(sizeof(*enc)+INIT_AES_BUF_SIZE);
-    enc->size = 0;
+    assert(bits == AES_128 || bits == AES_192 || bits == AES_256);
+    k->rounds = bits/32 + 6;
+    if(aesni_supported()) {
+        k->impl = AES_IMPL_AESNI;
+        aesni_key_init(k, key, bits);
+    }
+    else {
+        /* The tables are faster on lone blocks but their timing depends on the data */
+        k->impl = AES_IMPL_BITSLICE;
+        KeyExpansion(key, bits/32, (word_u *)k->enc);
+        aes_inverse_keys(k);
+    }
+    aesbs_key_init(k);
+}
+
+bool aes_impl_supported(aes_impl_e impl)
+{
+    switch(impl) {
+        case AES_IMPL_C:
+            return true;
+        case AES_IMPL_TTABLE:
+#ifdef AES_TTABLE
+            return true;
+#else
+            return false;
+#endif
+        case AES_IMPL_BITSLICE:
+            return true;
+        case AES_IMPL_AESNI:
+            return aesni_supported();
+    }
+    return false;
+}
+
+void aes_encrypt_blocks(const aes_key_s *k, const void *in, void *out, size_t nblocks)
+{
+    aesblock_s state;
+    size_t i;
     
-    while(len >= AES_BLOCK_BYTELEN) {
-        digest = newblock(&enc, &bufsize);
-        for(i = 0; i < 4; i++) {
-            for(j = 0; j < 4; j++)
-                digest->b[j][i] = ((uint8_t *)message)[4*i + j];
-        }
-        aes_block_encrypt(digest, keysched);
-        len -= AES_BLOCK_BYTELEN;
-        message += AES_BLOCK_BYTELEN;
+    if(k->impl == AES_IMPL_AESNI) {
+        aesni_encrypt(k, in, out, nblocks);
+        return;
+    }
+    if(k->impl == AES_IMPL_BITSLICE) {
+        aesbs_encrypt(k, in, out, nblocks);
+        return;
+    }
+#ifdef AES_TTABLE
+    if(k->impl == AES_IMPL_TTABLE) {
+        ttable_encrypt(k, in, out, nblocks);
+        return;
+    }
+#endif
+    for(i = 0; i < nblocks; i++) {
+        aes_load(&state, (const uint8_t *)in + i*AES_BLOCK_BYTELEN);
+        aes_block_encrypt(&state, (const word_u *)k->enc, k->rounds);
+        aes_store(&state, (uint8_t *)out + i*AES_BLOCK_BYTELEN);
+    }
+}
+
+void aes_decrypt_blocks(const aes_key_s *k, const void *in, void *out, size_t nblocks)
+{
+    aesblock_s state;
+    size_t i;
+    
+    if(k->impl == AES_IMPL_AESNI) {
+        aesni_decrypt(k, in, out, nblocks);
+        return;
+    }
+    if(k->impl == AES_IMPL_BITSLICE) {
+        aesbs_decrypt(k, in, out, nblocks);
+        return;
+    }
+#ifdef AES_TTABLE
+    if(k->impl == AES_IMPL_TTABLE) {
+        ttable_decrypt(k, in, out, nblocks);
+        return;
     }
+#endif
+    for(i = 0; i < nblocks; i++) {
+        aes_load(&state, (const uint8_t *)in + i*AES_BLOCK_BYTELEN);
+        aes_block_decrypt(&state, (const word_u *)k->enc, k->rounds);
+        aes_store(&state, (uint8_t *)out + i*AES_BLOCK_BYTELEN);
+    }
+}
+
+/* The state is rows by columns, the byte string goes down the columns. */
+void aes_load(aesblock_s *state, const uint8_t *in)
+{
+    unsigned i, j;
     
-    digest = newblock(&enc, &bufsize);
-    /* Apply PKCS5 padding */
     for(i = 0; i < 4; i++) {
-        for(j = 0; j < 4; j++) {
-            if(i*4 + j < len)
-                digest->b[j][i] = ((uint8_t *)message)[4*i + j];
-            else
-                goto pkcs5;
-        }
+        for(j = 0; j < Nb; j++)
+            state->b[j][i] = in[4*i + j];
+    }
+}
+
+void aes_store(const aesblock_s *state, uint8_t *out)
+{
+    unsigned i, j;
+    
+    for(i = 0; i < 4; i++) {
+        for(j = 0; j < Nb; j++)
+            out[4*i + j] = state->b[j][i];
+    }
+}
+
+/*
+ The equivalent inverse cipher's keys, decryption can then take its rounds
+ in the same order as encryption with InvMixColumns folded into them.
+ */
+void aes_inverse_keys(aes_key_s *k)
+{
+    aesblock_s state;
+    unsigned i;
+    
+    k->dec[0] = k->enc[k->rounds];
+    for(i = 1; i < k->rounds; i++) {
+        aes_load(&state, k->enc[k->rounds - i].b[0]);
+        InvMixColumns(&state);
+        aes_store(&state, k->dec[i].b[0]);
     }
+    k->dec[k->rounds] = k->enc[0];
+}
+
+/*
+ FIPS-197 appendix C, one plaintext under the first 16, 24 and 32 bytes of
+ the same key, through each implementation in turn.
+ */
+bool aes_selftest(void)
+{
+    static const uint8_t key[32] = {
+        0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+        0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f
+    };
+    static const uint8_t plain[AES_BLOCK_BYTELEN] = {
+        0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+    };
+    static const struct {
+        unsigned bits;
+        uint8_t cipher[AES_BLOCK_BYTELEN];
+    } kat[] = {
+        {AES_128, {0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a}},
+        {AES_192, {0xdd, 0xa9, 0x7c, 0xa4, 0x86, 0x4c, 0xdf, 0xe0, 0x6e, 0xaf, 0x70, 0xa0, 0xec, 0x0d, 0x71, 0x91}},
+        {AES_256, {0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf, 0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89}}
+    };
+    static const uint8_t ctr_key[16] = {
+        0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+    };
+    aes_impl_e impl;
+    aes_key_s k;
+    unsigned i;
     
-pkcs5:
-    diff = AES_BLOCK_BYTELEN - (i*4 + j);
-    for(; i < 4; i++) {
-        for(; j < 4; j++) {
-            if(i*4 + j < AES_BLOCK_BYTELEN)
-                digest->b[j][i] = diff;
-            else
-                goto pkcs5_encrypt;
+    for(i = 0; i < sizeof(kat)/sizeof(kat[0]); i++) {
+        aes_key_init(&k, key, kat[i].bits);
+        for(impl = AES_IMPL_C; impl <= AES_IMPL_AESNI; impl++) {
+            k.impl = impl;
+            if(aes_impl_supported(impl) && !aes_check(&k, plain, kat[i].cipher))
+                return false;
         }
-        j = 0;
     }
+    
+    aes_key_init(&k, ctr_key, AES_128);
+    for(impl = AES_IMPL_C; impl <= AES_IMPL_AESNI; impl++) {
+        k.impl = impl;
+        if(aes_impl_supported(impl) && !aes_ctr_check(&k))
+            return false;
+    }
+    return true;
+}
 
-pkcs5_encrypt:
-    aes_block_encrypt(digest, keysched);
-    enc = del_realloc(enc, sizeof(*enc)+enc->size);
-    return enc;
+/* Enough copies of the block to go through the widest batch and a tail. */
+bool aes_check(const aes_key_s *k, const uint8_t *plain, const uint8_t *cipher)
+{
+    uint8_t buf[11][AES_BLOCK_BYTELEN];
+    unsigned i;
+    
+    for(i = 0; i < 11; i++)
+        memcpy(buf[i], plain, AES_BLOCK_BYTELEN);
+    aes_encrypt_blocks(k, buf, buf, 11);
+    for(i = 0; i < 11; i++) {
+        if(memcmp(buf[i], cipher, AES_BLOCK_BYTELEN))
+            return false;
+    }
+    aes_decrypt_blocks(k, buf, buf, 11);
+    for(i = 0; i < 11; i++) {
+        if(memcmp(buf[i], plain, AES_BLOCK_BYTELEN))
+            return false;
+    }
+    return true;
 }
 
-void aes_block_encrypt(aesblock_s *state, word_u *w)
+void aes_block_encrypt(aesblock_s *state, const word_u *w, unsigned nr)
 {
     unsigned round;
     
     AddRoundKey(state, w);
-    for(round = 1; round < Nr; round++) {
+    for(round = 1; round < nr; round++) {
         SubBytes(state);
         ShiftRows(state);
         MixColumns(state);
@@ -601,26 +879,26 @@ void aes_block_encrypt(aesblock_s *state, word_u *w)
     }
     SubBytes(state);
     ShiftRows(state);
-    AddRoundKey(state, &w[Nr*Nb]);
+    AddRoundKey(state, &w[nr*Nb]);
 }
 
+/* Branch free, round keys go through here */
 inline uint8_t xtime(uint8_t b)
 {
-    if(b & 0x80)
-        return (b << 1) ^ 0x1b;
-    return b << 1;
+    return (b << 1) ^ (0x1b & -(b >> 7));
 }
 
+/* b is always the constant, so the loop only ever branches on that */
 inline uint8_t multx(uint8_t b, uint8_t x)
 {
-    uint8_t prod = 0, shift = 1, xt = b;
+    uint8_t prod = 0, shift = 1, xt = x;
     do {
-        if(x & shift)
+        if(b & shift)
             prod ^= xt;
         xt = xtime(xt);
         shift <<= 1;
     }
-    while(shift != 0 && ((uint16_t)shift & 0x00ff) <= ((uint16_t)x & 0x00ff));
+    while(shift != 0 && ((uint16_t)shift & 0x00ff) <= ((uint16_t)b & 0x00ff));
     return prod;
 }
 
@@ -629,14 +907,10 @@ inline uint8_t SubByte(uint8_t b)
     return sbox[b >> 4][b & 0x0f];
 }
 
+/* On the bitsliced S-box, a table lookup would show the key in the cache */
 inline word_u SubWord(word_u word)
 {
-    return (word_u) {
-        .b[0] = SubByte(word.b[0]),
-        .b[1] = SubByte(word.b[1]),
-        .b[2] = SubByte(word.b[2]),
-        .b[3] = SubByte(word.b[3])
-    };
+    return (word_u) {.word = aesbs_sub_word(word.word)};
 }
 
 inline word_u RotWord(word_u word)
@@ -713,7 +987,7 @@ inline void MixColumns(aesblock_s *state)
     
 }
 
-inline void AddRoundKey(aesblock_s *state, word_u *w)
+inline void AddRoundKey(aesblock_s *state, const word_u *w)
 {
 #define ADDROUND_COL(C) state->b[0][C] ^= w[C].b[0]; \
                         state->b[1][C] ^= w[C].b[1]; \
@@ -728,62 +1002,48 @@ inline void AddRoundKey(aesblock_s *state, word_u *w)
 #undef ADDROUND_COL
 }
 
-inline void KeyExpansion(uint8_t *key, word_u *w)
+inline void KeyExpansion(const uint8_t *key, unsigned nk, word_u *w)
 {
     unsigned i = 0;
     word_u temp;
     
-    for(i = 0; i < Nk; i++) {
+    for(i = 0; i < nk; i++) {
         w[i].b[0] = key[4*i+0];
         w[i].b[1] = key[4*i+1];
         w[i].b[2] = key[4*i+2];
         w[i].b[3] = key[4*i+3];
     }
     
-    for(i = Nk; i < Nb*(Nr+1); i++) {
+    for(i = nk; i < Nb*(nk+7); i++) {
         temp = w[i-1];
-        if(!(i % Nk))
-            temp.word = SubWord(RotWord(temp)).word ^ Rcon[(i-1)/Nk].word;
-#if Nk > 6
-        else if((i ^ Nk) == 4)
+        if(!(i % nk))
+            temp.word = SubWord(RotWord(temp)).word ^ Rcon[(i-1)/nk].word;
+        else if(nk > 6 && i % nk == 4)
             temp = SubWord(temp);
-#endif
-        w[i].word = w[i-Nk].word ^ temp.word;
+        w[i].word = w[i-nk].word ^ temp.word;
     }
 }
 
 aes_digest_s *aes_decrypt(void *message, size_t len, char *key)
 {
-    size_t i, j;
-    size_t buffsize = INIT_AES_BUF_SIZE;
-    aesblock_s *digest;
-    aes_digest_s *enc;
-    word_u keysched[Nb*(Nr+1)];
+    size_t whole = len / AES_BLOCK_BYTELEN;
+    aes_digest_s *dec;
+    aes_key_s k;
     
-    KeyExpansion((uint8_t *)key, keysched);
+    aes_key_init(&k, key, KEY_LENGTH);
 
-    enc = del_alloc(sizeof(*enc)+INIT_AES_BUF_SIZE);
-    enc->size = 0;
-    while(len >= AES_BLOCK_BYTELEN) {
-        digest = newblock(&enc, &buffsize);
-        for(i = 0; i < 4; i++) {
-            for(j = 0; j < 4; j++)
-                digest->b[i][j] = ((uint8_t *)message)[4*i + j];
-        }
-        aes_block_decrypt(digest, keysched);
-        message += AES_BLOCK_BYTELEN;
-        len -= AES_BLOCK_BYTELEN;
-    }
-    
-    return enc;
+    dec = del_alloc(sizeof(*dec) + whole*AES_BLOCK_BYTELEN);
+    dec->size = whole*AES_BLOCK_BYTELEN;
+    aes_decrypt_blocks(&k, message, dec->data, whole);
+    return dec;
 }
 
-void aes_block_decrypt(aesblock_s *state, word_u *w)
+void aes_block_decrypt(aesblock_s *state, const word_u *w, unsigned nr)
 {
     unsigned round;
     
-    AddRoundKey(state, &w[Nr*Nb]);
-    for(round = Nr-1; round >= 1; round--) {
+    AddRoundKey(state, &w[nr*Nb]);
+    for(round = nr-1; round >= 1; round--) {
         InvShiftRows(state);
         InvSubBytes(state);
         AddRoundKey(state, &w[round*Nb]);
@@ -866,16 +1126,278 @@ inline void InvMixColumns(aesblock_s *state)
     }
 }
 
-aesblock_s *newblock(aes_digest_s **d, size_t *bufsize)
+/*
+ SP 800-38A F.5.1, whose counter carries out of its last byte after the
+ first block. Taken in uneven pieces, some prepared ahead, the stream has
+ to come out the same as in one go.
+ */
+bool aes_ctr_check(const aes_key_s *k)
+{
+    static const uint8_t iv[AES_BLOCK_BYTELEN] = {
+        0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+    };
+    static const uint8_t plain[4*AES_BLOCK_BYTELEN] = {
+        0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+        0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+        0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+        0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10
+    };
+    static const uint8_t cipher[4*AES_BLOCK_BYTELEN] = {
+        0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26, 0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+        0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff, 0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff,
+        0x5a, 0xe4, 0xdf, 0x3e, 0xdb, 0xd5, 0xd3, 0x5e, 0x5b, 0x4f, 0x09, 0x02, 0x0d, 0xb0, 0x3e, 0xab,
+        0x1e, 0x03, 0x1d, 0xda, 0x2f, 0xbe, 0x03, 0xd1, 0x79, 0x21, 0x70, 0xa0, 0xf3, 0x00, 0x9c, 0xee
+    };
+    uint8_t buf[sizeof(plain)];
+    aes_ctr_s c;
+    
+    aes_ctr(k, iv, plain, buf, sizeof(buf), 1);
+    if(memcmp(buf, cipher, sizeof(buf)))
+        return false;
+    
+    aes_ctr_init(&c, k, iv);
+    aes_ctr_xor(&c, cipher, buf, 5);
+    aes_ctr_prepare(&c, 20);
+    aes_ctr_xor(&c, &cipher[5], &buf[5], 27);
+    aes_ctr_prepare(&c, 1);
+    aes_ctr_xor(&c, &cipher[32], &buf[32], 32);
+    return !memcmp(buf, plain, sizeof(buf));
+}
+
+void aes_ctr_init(aes_ctr_s *c, const aes_key_s *k, const uint8_t *iv)
+{
+    uint64_t hi = 0, lo = 0;
+    unsigned i;
+    
+    for(i = 0; i < 8; i++) {
+        hi = hi << 8 | iv[i];
+        lo = lo << 8 | iv[8 + i];
+    }
+    aes_ctr_start(c, k, hi, lo);
+}
+
+void aes_ctr_start(aes_ctr_s *c, const aes_key_s *k, uint64_t hi, uint64_t lo)
+{
+    c->key = k;
+    c->hi = hi;
+    c->lo = lo;
+    c->pos = c->avail = 0;
+}
+
+/* What is left over moves to the front, then counter blocks fill the rest and go through in one batch. */
+void aes_ctr_prepare(aes_ctr_s *c, size_t len)
+{
+    size_t have = c->avail - c->pos, nblocks, i;
+    uint64_t be[2];
+    uint8_t *block;
+    
+    if(have >= len)
+        return;
+    memmove(c->stream, &c->stream[c->pos], have);
+    c->pos = 0;
+    c->avail = have;
+    
+    nblocks = (len - have + AES_BLOCK_BYTELEN - 1) / AES_BLOCK_BYTELEN;
+    if(nblocks > (sizeof(c->stream) - have) / AES_BLOCK_BYTELEN)
+        nblocks = (sizeof(c->stream) - have) / AES_BLOCK_BYTELEN;
+    block = &c->stream[have];
+    for(i = 0; i < nblocks; i++, block += AES_BLOCK_BYTELEN) {
+        be[0] = htobe64(c->hi);
+        be[1] = htobe64(c->lo);
+        memcpy(block, be, sizeof(be));
+        ctr_add(&c->hi, &c->lo, 1);
+    }
+    aes_encrypt_blocks(c->key, &c->stream[have], &c->stream[have], nblocks);
+    c->avail += nblocks*AES_BLOCK_BYTELEN;
+}
+
+void aes_ctr_xor(aes_ctr_s *c, const void *in, void *out, size_t len)
+{
+    size_t n;
+    
+    while(len) {
+        if(c->pos == c->avail)
+            aes_ctr_prepare(c, len);
+        n = c->avail - c->pos < len ? c->avail - c->pos : len;
+        ctr_xor(out, in, &c->stream[c->pos], n);
+        c->pos += n;
+        in = (const uint8_t *)in + n;
+        out = (uint8_t *)out + n;
+        len -= n;
+    }
+}
+
+/*
+ Parts start on block boundaries, each from iv plus the blocks before it.
+ A thread that can't be started leaves its part to the caller.
+ */
+void aes_ctr(const aes_key_s *k, const uint8_t *iv, const void *in, void *out, size_t len, unsigned nthreads)
+{
+    aes_ctr_part_s *parts;
+    aes_ctr_s first;
+    size_t nparts, per, done;
+    unsigned i;
+    
+    aes_ctr_init(&first, k, iv);
+    nparts = len / AES_CTR_SPLIT_MIN;
+    if(nparts > nthreads)
+        nparts = nthreads;
+    if(nparts < 2) {
+        aes_ctr_xor(&first, in, out, len);
+        return;
+    }
+    
+    parts = del_alloc(nparts * sizeof(*parts));
+    per = (len / nparts + AES_BLOCK_BYTELEN - 1) / AES_BLOCK_BYTELEN * AES_BLOCK_BYTELEN;
+    for(i = 0, done = 0; i < nparts; i++, done += per) {
+        parts[i].key = k;
+        parts[i].hi = first.hi;
+        parts[i].lo = first.lo;
+        ctr_add(&parts[i].hi, &parts[i].lo, done / AES_BLOCK_BYTELEN);
+        parts[i].in = (const uint8_t *)in + done;
+        parts[i].out = (uint8_t *)out + done;
+        parts[i].len = i == nparts - 1 ? len - done : per;
+        parts[i].threaded = i > 0 && !pthread_create(&parts[i].thread, NULL, aes_ctr_thread, &parts[i]);
+    }
+    for(i = 0; i < nparts; i++) {
+        if(!parts[i].threaded)
+            aes_ctr_part(&parts[i]);
+    }
+    for(i = 1; i < nparts; i++) {
+        if(parts[i].threaded)
+            pthread_join(parts[i].thread, NULL);
+    }
+    free(parts);
+}
+
+void aes_ctr_part(aes_ctr_part_s *p)
+{
+    aes_ctr_s c;
+    
+    aes_ctr_start(&c, p->key, p->hi, p->lo);
+    aes_ctr_xor(&c, p->in, p->out, p->len);
+}
+
+void *aes_ctr_thread(void *arg)
+{
+    aes_ctr_part((aes_ctr_part_s *)arg);
+    return NULL;
+}
+
+/* The counter wraps at 2^128 */
+inline void ctr_add(uint64_t *hi, uint64_t *lo, uint64_t n)
+{
+    *lo += n;
+    if(*lo < n)
+        (*hi)++;
+}
+
+/* A word at a time, memcpy keeps it clear of alignment */
+inline void ctr_xor(uint8_t *out, const uint8_t *in, const uint8_t *ks, size_t len)
+{
+    uint64_t a, b;
+    size_t i;
+    
+    for(i = 0; i + sizeof(a) <= len; i += sizeof(a)) {
+        memcpy(&a, &in[i], sizeof(a));
+        memcpy(&b, &ks[i], sizeof(b));
+        a ^= b;
+        memcpy(&out[i], &a, sizeof(a));
+    }
+    for(; i < len; i++)
+        out[i] = in[i] ^ ks[i];
+}
+
+#ifdef AES_TTABLE
+
+/* The other rows' tables are the first's rotated, row r's product lands r bytes up */
+void ttable_init(void)
+{
+    unsigned i, r;
+    uint8_t s;
+    
+    for(i = 0; i < 256; i++) {
+        s = SubByte(i);
+        Te[0][i] = (uint32_t)multx(0x02, s) | (uint32_t)s << 8 | (uint32_t)s << 16 |
+                   (uint32_t)multx(0x03, s) << 24;
+        s = InvSubByte(i);
+        Td[0][i] = (uint32_t)multx(0x0e, s) | (uint32_t)multx(0x09, s) << 8 |
+                   (uint32_t)multx(0x0d, s) << 16 | (uint32_t)multx(0x0b, s) << 24;
+        for(r = 1; r < 4; r++) {
+            Te[r][i] = ROTL32(Te[r-1][i], 8);
+            Td[r][i] = ROTL32(Td[r-1][i], 8);
+        }
+    }
+}
+
+/*
+ Column c of the next state takes row r from column c+r, which is
+ ShiftRows, and its four table entries make up SubBytes and MixColumns.
+ The last round has no MixColumns and goes through the sbox alone.
+ */
+void ttable_encrypt(const aes_key_s *k, const uint8_t *in, uint8_t *out, size_t nblocks)
+{
+    uint32_t rk[4*(AES_MAX_ROUNDS+1)], s[4], t[4];
+    const uint32_t *w;
+    unsigned i, c, round;
+    
+    for(i = 0; i < 4*(k->rounds+1); i++)
+        rk[i] = GET32((const uint8_t *)k->enc + 4*i);
+    
+    for(; nblocks; nblocks--, in += AES_BLOCK_BYTELEN, out += AES_BLOCK_BYTELEN) {
+        for(c = 0; c < 4; c++)
+            s[c] = GET32(&in[4*c]) ^ rk[c];
+        for(round = 1, w = &rk[4]; round < k->rounds; round++, w += 4) {
+            for(c = 0; c < 4; c++)
+                t[c] = Te[0][BYTE(s[c], 0)] ^ Te[1][BYTE(s[(c+1) & 3], 1)] ^
+                       Te[2][BYTE(s[(c+2) & 3], 2)] ^ Te[3][BYTE(s[(c+3) & 3], 3)] ^ w[c];
+            memcpy(s, t, sizeof(s));
+        }
+        for(c = 0; c < 4; c++)
+            ttable_put(&out[4*c], ((uint32_t)SubByte(BYTE(s[c], 0)) |
+                                   (uint32_t)SubByte(BYTE(s[(c+1) & 3], 1)) << 8 |
+                                   (uint32_t)SubByte(BYTE(s[(c+2) & 3], 2)) << 16 |
+                                   (uint32_t)SubByte(BYTE(s[(c+3) & 3], 3)) << 24) ^ w[c]);
+    }
+}
+
+/* The same on dec, with InvShiftRows taking row r from column c-r instead. */
+void ttable_decrypt(const aes_key_s *k, const uint8_t *in, uint8_t *out, size_t nblocks)
 {
-    (*d)->size += AES_BLOCK_BYTELEN;
-    if((*d)->size == *bufsize) {
-        *bufsize *= 2;
-        *d = del_realloc(*d, sizeof(**d) + *bufsize);
+    uint32_t rk[4*(AES_MAX_ROUNDS+1)], s[4], t[4];
+    const uint32_t *w;
+    unsigned i, c, round;
+    
+    for(i = 0; i < 4*(k->rounds+1); i++)
+        rk[i] = GET32((const uint8_t *)k->dec + 4*i);
+    
+    for(; nblocks; nblocks--, in += AES_BLOCK_BYTELEN, out += AES_BLOCK_BYTELEN) {
+        for(c = 0; c < 4; c++)
+            s[c] = GET32(&in[4*c]) ^ rk[c];
+        for(round = 1, w = &rk[4]; round < k->rounds; round++, w += 4) {
+            for(c = 0; c < 4; c++)
+                t[c] = Td[0][BYTE(s[c], 0)] ^ Td[1][BYTE(s[(c+3) & 3], 1)] ^
+                       Td[2][BYTE(s[(c+2) & 3], 2)] ^ Td[3][BYTE(s[(c+1) & 3], 3)] ^ w[c];
+            memcpy(s, t, sizeof(s));
+        }
+        for(c = 0; c < 4; c++)
+            ttable_put(&out[4*c], ((uint32_t)InvSubByte(BYTE(s[c], 0)) |
+                                   (uint32_t)InvSubByte(BYTE(s[(c+3) & 3], 1)) << 8 |
+                                   (uint32_t)InvSubByte(BYTE(s[(c+2) & 3], 2)) << 16 |
+                                   (uint32_t)InvSubByte(BYTE(s[(c+1) & 3], 3)) << 24) ^ w[c]);
     }
-    return &(*d)->data[(*d)->size/AES_BLOCK_BYTELEN - 1];
 }
 
+inline void ttable_put(uint8_t *out, uint32_t w)
+{
+    out[0] = w;
+    out[1] = w >> 8;
+    out[2] = w >> 16;
+    out[3] = w >> 24;
+}
+
+#endif
+
 void print_block(aesblock_s *bl)
 {
     unsigned i, j;
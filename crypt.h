@@ -35,7 +35,18 @@ extern int sha512_equal(sha512_s *d1, sha512_s *d2);
 
 extern void print_sha512digest(sha512_s *digest);
 
-extern void PBKDF(char *pass, salt_s salt, unsigned C, size_t kLen);
+/*
+ HMAC-SHA512 of message under key. The mac comes back as the digest's
+ byte string rather than host order words, so it can be compared or
+ passed on as bytes.
+ */
+extern void hmac_sha512(const void *key, size_t klen, const void *message, size_t len, sha512_s *mac);
+
+/*
+ PBKDF2-HMAC-SHA512 of pass with C iterations, writing kLen bytes of
+ derived key to key. Deliberately slow, keep it off the event loops.
+ */
+extern void PBKDF(const char *pass, size_t plen, salt_s salt, unsigned C, void *key, size_t kLen);
 
 extern salt_s get_salt(void);
         
@@ -63,6 +74,9 @@ extern salt_s get_salt(void);
     
 //#define STATIC_RCON
 
+/* Portable rounds on 32-bit lookup tables, undefine for the byte-wise code */
+#define AES_TTABLE
+
 #if KEY_LENGTH == AES_128
     #define Nr 10
 #elif KEY_LENGTH == AES_192
@@ -73,6 +87,11 @@ extern salt_s get_salt(void);
     #error "Invalid Key Length"
 #endif
     
+#define AES_MAX_ROUNDS 14
+    
+#define AES_CTR_AHEAD 256               /* blocks of keystream aes_ctr_s holds, an outq chunk's worth */
+#define AES_CTR_SPLIT_MIN (256*1024)    /* bytes aes_ctr gives each thread at the least */
+    
 typedef union aesblock_s aesblock_s;
     
 typedef struct aes_digest_s aes_digest_s;
@@ -99,9 +118,90 @@ struct aes_digest_s
     aesblock_s data[];
 };
 
+typedef enum aes_impl_e aes_impl_e;
+typedef struct aes_key_s aes_key_s;
+typedef struct aes_ctr_s aes_ctr_s;
+
+enum aes_impl_e
+{
+    AES_IMPL_C,         /* portable, byte by byte */
+    AES_IMPL_TTABLE,    /* portable, four table lookups a column, with AES_TTABLE */
+    AES_IMPL_BITSLICE,  /* portable, eight blocks at a time in constant time */
+    AES_IMPL_AESNI      /* the x86 AES instructions, when cpuid has them */
+};
+
+/*
+ An expanded key of any of the three lengths. Round keys are FIPS-197 byte
+ strings, so every implementation shares enc, dec holds the equivalent
+ inverse cipher's keys and bs enc bitsliced. impl is the fastest constant
+ time one aes_key_init found, it may be changed afterwards to any other
+ aes_impl_supported says is there. Setting up the key takes the same time
+ whatever the key.
+ */
+struct aes_key_s
+{
+    unsigned rounds;
+    aes_impl_e impl;
+    aesblock_s enc[AES_MAX_ROUNDS+1];
+    aesblock_s dec[AES_MAX_ROUNDS+1];
+    uint64_t bs[8*(AES_MAX_ROUNDS+1)];
+};
+
+/*
+ A CTR mode stream as in SP 800-38A, the whole counter block counting up
+ as one big-endian number. Keystream is made a batch of blocks at a time,
+ so every implementation gets to run its blocks side by side, and what a
+ call leaves over goes to the next, there is no padding and no need to
+ stay on block boundaries. key has to outlive the stream.
+ */
+struct aes_ctr_s
+{
+    const aes_key_s *key;
+    uint64_t hi, lo;        /* the next counter block to encrypt */
+    size_t pos, avail;      /* keystream bytes used and made so far */
+    uint8_t stream[AES_CTR_AHEAD*AES_BLOCK_BYTELEN];
+};
+
+/*
+ Message and digest are byte strings as in FIPS-197. The digest is padded
+ PKCS5 style, so it always has one block more than whole blocks in message.
+ key is KEY_LENGTH bits.
+ */
 extern aes_digest_s *aes_encrypt(void *message, size_t len, char *key);
 extern aes_digest_s *aes_decrypt(void *message, size_t len, char *key);
 
+/* bits is one of AES_128, AES_192 or AES_256. */
+extern void aes_key_init(aes_key_s *k, const void *key, unsigned bits);
+
+/* ECB over nblocks whole blocks, in and out may be the same buffer. */
+extern void aes_encrypt_blocks(const aes_key_s *k, const void *in, void *out, size_t nblocks);
+extern void aes_decrypt_blocks(const aes_key_s *k, const void *in, void *out, size_t nblocks);
+
+extern bool aes_impl_supported(aes_impl_e impl);
+
+/* iv is the first counter block, AES_BLOCK_BYTELEN bytes. */
+extern void aes_ctr_init(aes_ctr_s *c, const aes_key_s *k, const uint8_t *iv);
+
+/*
+ Makes keystream for the next len bytes ahead of time, up to AES_CTR_AHEAD
+ blocks of it, so the aes_ctr_xor that takes them is only xors. Say while
+ waiting on the data.
+ */
+extern void aes_ctr_prepare(aes_ctr_s *c, size_t len);
+
+/* Encrypts or decrypts, it's the same, len bytes of in to out. They may be the same buffer. */
+extern void aes_ctr_xor(aes_ctr_s *c, const void *in, void *out, size_t len);
+
+/*
+ One buffer from counter block iv on. Long enough buffers are split by
+ counter range over up to nthreads threads, the caller's included, giving
+ each at least AES_CTR_SPLIT_MIN bytes. 0 or 1 keeps it on the caller's.
+ */
+extern void aes_ctr(const aes_key_s *k, const uint8_t *iv, const void *in, void *out, size_t len, unsigned nthreads);
+
+/* Runs the FIPS-197 and SP 800-38A CTR known answers through every implementation this host has. */
+extern bool aes_selftest(void);
+
 extern void print_block(aesblock_s *b);
 extern void print_aesdigest(aes_digest_s *digest);
     
@@ -0,0 +1,373 @@
+#include "evloop.h"
+
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#define MAX_EVENTS 256
+
+typedef struct evtask_s evtask_s;
+
+struct evtask_s {
+    evtask_f fn;
+    void *arg;
+    evtask_s *next;
+};
+
+struct evloop_s {
+    unsigned id;
+    int epfd;
+    int wakefd;
+    volatile bool running;
+    pthread_t thread;
+    evhandler_s wake;
+    uring_s *ring;
+    uring_op_s epop;
+    pthread_mutex_t task_lock;
+    evtask_s *tasks;
+    evtask_s **tasktail;
+    evtask_s *deferred;
+    evtask_s **defertail;
+    slab_s *deferslab;          /* deferred tasks never leave the loop thread */
+    uint64_t now;
+    timerwheel_s timers;
+    unsigned tick_interval;
+    uint64_t next_tick;
+    evtask_f on_tick;
+    void *tick_arg;
+};
+
+static void *evloop_run(void *arg);
+static int evloop_poll(evloop_s *loop, int timeout);
+static int evloop_timeout(evloop_s *loop);
+static void evloop_tick(evloop_s *loop);
+static void evloop_epoll_ready(uring_s *ring, uring_op_s *op, int res, uint32_t flags);
+static void evloop_wake(evloop_s *loop, evhandler_s *h, uint32_t events);
+static void evloop_run_tasks(evloop_s *loop);
+static void evloop_run_deferred(evloop_s *loop);
+
+evloop_s *evloop_s_(unsigned id)
+{
+    evloop_s *loop = del_allocz(sizeof *loop);
+    
+    loop->id = id;
+    loop->now = evloop_now();
+    timerwheel_init(&loop->timers, loop->now);
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(loop->epfd < 0) {
+        perror("Error creating epoll instance");
+        exit(EXIT_FAILURE);
+    }
+    
+    loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(loop->wakefd < 0) {
+        perror("Error creating eventfd");
+        exit(EXIT_FAILURE);
+    }
+    
+    pthread_mutex_init(&loop->task_lock, NULL);
+    loop->tasktail = &loop->tasks;
+    loop->defertail = &loop->deferred;
+    loop->deferslab = slab_s_("deferred", sizeof(evtask_s), false);
+    loop->wake.on_event = evloop_wake;
+    
+    if(!evloop_add(loop, loop->wakefd, EPOLLIN | EPOLLET, &loop->wake)) {
+        exit(EXIT_FAILURE);
+    }
+    return loop;
+}
+
+unsigned evloop_id(evloop_s *loop)
+{
+    return loop->id;
+}
+
+bool evloop_use_uring(evloop_s *loop, unsigned bufsize)
+{
+    loop->ring = uring_s_(URING_ENTRIES, bufsize);
+    if(!loop->ring)
+        return false;
+    
+    loop->epop.on_complete = evloop_epoll_ready;
+    return uring_poll_multishot(loop->ring, loop->epfd, POLLIN, &loop->epop);
+}
+
+uring_s *evloop_uring(evloop_s *loop)
+{
+    return loop->ring;
+}
+
+uint64_t evloop_now(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t evloop_time(evloop_s *loop)
+{
+    return loop->now;
+}
+
+void evloop_timer_arm(evloop_s *loop, timer_s *t, unsigned timeout)
+{
+    timer_arm(&loop->timers, t, loop->now + timeout);
+}
+
+bool evloop_add(evloop_s *loop, int fd, uint32_t events, evhandler_s *h)
+{
+    struct epoll_event ev = {.events = events, .data.ptr = h};
+    
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_error("Failed to register socket %d with event loop %u. Errno: %d.", fd, loop->id, errno);
+        return false;
+    }
+    return true;
+}
+
+bool evloop_mod(evloop_s *loop, int fd, uint32_t events, evhandler_s *h)
+{
+    struct epoll_event ev = {.events = events, .data.ptr = h};
+    
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        log_error("Failed to modify socket %d on event loop %u. Errno: %d.", fd, loop->id, errno);
+        return false;
+    }
+    return true;
+}
+
+void evloop_del(evloop_s *loop, int fd)
+{
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+void evloop_post(evloop_s *loop, evtask_f fn, void *arg)
+{
+    uint64_t one = 1;
+    evtask_s *task = del_alloc(sizeof *task);
+    
+    task->fn = fn;
+    task->arg = arg;
+    task->next = NULL;
+    
+    pthread_mutex_lock(&loop->task_lock);
+    *loop->tasktail = task;
+    loop->tasktail = &task->next;
+    pthread_mutex_unlock(&loop->task_lock);
+    
+    if(write(loop->wakefd, &one, sizeof one) < 0 && errno != EAGAIN) {
+        log_error("Failed to wake event loop %u.", loop->id);
+    }
+}
+
+void evloop_defer(evloop_s *loop, evtask_f fn, void *arg)
+{
+    evtask_s *task = slab_alloc(loop->deferslab);
+    
+    task->fn = fn;
+    task->arg = arg;
+    task->next = NULL;
+    *loop->defertail = task;
+    loop->defertail = &task->next;
+}
+
+void evloop_set_tick(evloop_s *loop, unsigned interval, evtask_f fn, void *arg)
+{
+    loop->tick_interval = interval;
+    loop->next_tick = evloop_now() + interval;
+    loop->on_tick = fn;
+    loop->tick_arg = arg;
+}
+
+void evloop_start(evloop_s *loop)
+{
+    loop->running = true;
+    if(pthread_create(&loop->thread, NULL, evloop_run, loop)) {
+        perror("Error creating event loop thread");
+        exit(EXIT_FAILURE);
+    }
+}
+
+unsigned evloop_ncpus(void)
+{
+    cpu_set_t set;
+    
+    if(sched_getaffinity(0, sizeof set, &set) < 0)
+        return 1;
+    return CPU_COUNT(&set);
+}
+
+bool evloop_pin(evloop_s *loop, unsigned index)
+{
+    int cpu;
+    unsigned n = 0;
+    cpu_set_t set, pinned;
+    
+    if(sched_getaffinity(0, sizeof set, &set) < 0 || !CPU_COUNT(&set))
+        return false;
+    
+    index %= CPU_COUNT(&set);
+    for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if(CPU_ISSET(cpu, &set) && n++ == index)
+            break;
+    }
+    
+    CPU_ZERO(&pinned);
+    CPU_SET(cpu, &pinned);
+    if(pthread_setaffinity_np(loop->thread, sizeof pinned, &pinned)) {
+        log_warn("Failed to pin event loop %u to cpu %d.", loop->id, cpu);
+        return false;
+    }
+    log_info("Event loop %u pinned to cpu %d.", loop->id, cpu);
+    return true;
+}
+
+void evloop_stop(evloop_s *loop)
+{
+    uint64_t one = 1;
+    
+    loop->running = false;
+    if(write(loop->wakefd, &one, sizeof one) < 0 && errno != EAGAIN) {
+        log_error("Failed to wake event loop %u.", loop->id);
+    }
+}
+
+void evloop_join(evloop_s *loop)
+{
+    pthread_join(loop->thread, NULL);
+}
+
+void *evloop_run(void *arg)
+{
+    evloop_s *loop = arg;
+    
+    log_info("Event loop %u running%s.", loop->id, loop->ring ? " on io_uring" : "");
+    
+    while(loop->running) {
+        if(loop->ring) {
+            if(uring_wait(loop->ring, evloop_timeout(loop)) < 0)
+                break;
+            loop->now = evloop_now();
+            uring_dispatch(loop->ring);
+        }
+        else {
+            if(evloop_poll(loop, evloop_timeout(loop)) < 0)
+                break;
+        }
+        loop->now = evloop_now();
+        timerwheel_advance(&loop->timers, loop->now);
+        evloop_tick(loop);
+        evloop_run_deferred(loop);
+    }
+    
+    log_info("Event loop %u exiting.", loop->id);
+    return NULL;
+}
+
+int evloop_poll(evloop_s *loop, int timeout)
+{
+    int i, n;
+    evhandler_s *h;
+    struct epoll_event events[MAX_EVENTS];
+    
+    n = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout);
+    if(n < 0) {
+        if(errno == EINTR)
+            return 0;
+        log_error("epoll_wait failed on event loop %u. Errno: %d.", loop->id, errno);
+        return -1;
+    }
+    
+    /* Handlers arm timers off now, which can't be from before the wait */
+    if(n)
+        loop->now = evloop_now();
+    for(i = 0; i < n; i++) {
+        h = events[i].data.ptr;
+        h->on_event(loop, h, events[i].events);
+    }
+    return n;
+}
+
+int evloop_timeout(evloop_s *loop)
+{
+    uint64_t now = evloop_now();
+    int timeout = timerwheel_timeout(&loop->timers, now), tick;
+    
+    if(!loop->on_tick)
+        return timeout;
+    
+    tick = loop->next_tick > now ? (int)(loop->next_tick - now) : 0;
+    return timeout < 0 || tick < timeout ? tick : timeout;
+}
+
+void evloop_tick(evloop_s *loop)
+{
+    if(!loop->on_tick)
+        return;
+    
+    if(loop->now >= loop->next_tick) {
+        loop->next_tick = loop->now + loop->tick_interval;
+        loop->on_tick(loop, loop->tick_arg);
+    }
+}
+
+/*
+ The epoll set became readable while running on io_uring. Drain it
+ without blocking and rearm if the kernel dropped the multishot poll.
+ */
+void evloop_epoll_ready(uring_s *ring, uring_op_s *op, int res, uint32_t flags)
+{
+    evloop_s *loop = CONTAINER_OF(op, evloop_s, epop);
+    
+    while(evloop_poll(loop, 0) == MAX_EVENTS)
+        ;
+    
+    if(!(flags & IORING_CQE_F_MORE) && loop->running && !uring_poll_multishot(ring, loop->epfd, POLLIN, &loop->epop)) {
+        log_error("Event loop %u stopped watching its epoll descriptor.", loop->id);
+    }
+}
+
+void evloop_wake(evloop_s *loop, evhandler_s *h, uint32_t events)
+{
+    uint64_t count;
+    
+    while(read(loop->wakefd, &count, sizeof count) > 0)
+        ;
+    evloop_run_tasks(loop);
+}
+
+void evloop_run_tasks(evloop_s *loop)
+{
+    evtask_s *task, *next;
+    
+    pthread_mutex_lock(&loop->task_lock);
+    task = loop->tasks;
+    loop->tasks = NULL;
+    loop->tasktail = &loop->tasks;
+    pthread_mutex_unlock(&loop->task_lock);
+    
+    for(; task; task = next) {
+        next = task->next;
+        task->fn(loop, task->arg);
+        free(task);
+    }
+}
+
+void evloop_run_deferred(evloop_s *loop)
+{
+    evtask_s *task, *next;
+    
+    while((task = loop->deferred)) {
+        loop->deferred = NULL;
+        loop->defertail = &loop->deferred;
+        for(; task; task = next) {
+            next = task->next;
+            task->fn(loop, task->arg);
+            slab_free(loop->deferslab, task);
+        }
+    }
+}
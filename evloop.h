@@ -0,0 +1,78 @@
+
+#ifndef __TCPDelegate__evloop__
+#define __TCPDelegate__evloop__
+
+#include "general.h"
+#include "uring.h"
+#include "timer.h"
+#include "slab.h"
+
+#include <sys/epoll.h>
+
+typedef struct evloop_s evloop_s;
+typedef struct evhandler_s evhandler_s;
+
+typedef void (*evhandler_f)(evloop_s *loop, evhandler_s *h, uint32_t events);
+typedef void (*evtask_f)(evloop_s *loop, void *arg);
+
+/*
+ Embedded in whatever object owns a descriptor. The loop hands back
+ the handler on readiness and the owner recovers itself with CONTAINER_OF.
+ */
+struct evhandler_s {
+    evhandler_f on_event;
+};
+
+extern evloop_s *evloop_s_(unsigned id);
+extern unsigned evloop_id(evloop_s *loop);
+extern uint64_t evloop_now(void);
+
+/* evloop_now() as of the current iteration, cheap enough to call per event. */
+extern uint64_t evloop_time(evloop_s *loop);
+
+/*
+ Switches the loop over to io_uring. Descriptors added with evloop_add keep
+ working, their epoll set is itself polled through the ring. Returns false
+ if the kernel can't support it, leaving the loop on plain epoll.
+ */
+extern bool evloop_use_uring(evloop_s *loop, unsigned bufsize);
+extern uring_s *evloop_uring(evloop_s *loop);
+
+/*
+ Descriptors are registered edge-triggered, so handlers must drain
+ reads and writes until EAGAIN.
+ */
+extern bool evloop_add(evloop_s *loop, int fd, uint32_t events, evhandler_s *h);
+extern bool evloop_mod(evloop_s *loop, int fd, uint32_t events, evhandler_s *h);
+extern void evloop_del(evloop_s *loop, int fd);
+
+/* Safe to call from any thread; fn runs on the loop's own thread. */
+extern void evloop_post(evloop_s *loop, evtask_f fn, void *arg);
+
+/*
+ Runs fn on the loop thread once the current batch of events has been
+ dispatched, in the order deferred. Lets a handler free an object other
+ pending events may still point at, or batch work up per iteration.
+ */
+extern void evloop_defer(evloop_s *loop, evtask_f fn, void *arg);
+
+/*
+ Arms t on the loop's timer wheel to fire timeout milliseconds from now.
+ Timers belong to the loop thread, arm and cancel them only from there.
+ */
+extern void evloop_timer_arm(evloop_s *loop, timer_s *t, unsigned timeout);
+
+/* Calls fn roughly every interval milliseconds from the loop thread. */
+extern void evloop_set_tick(evloop_s *loop, unsigned interval, evtask_f fn, void *arg);
+
+/* Number of cpus this process may run on. */
+extern unsigned evloop_ncpus(void);
+
+extern void evloop_start(evloop_s *loop);
+
+/* Pins a started loop to the index-th cpu it is allowed to run on. */
+extern bool evloop_pin(evloop_s *loop, unsigned index);
+extern void evloop_stop(evloop_s *loop);
+extern void evloop_join(evloop_s *loop);
+
+#endif /* defined(__TCPDelegate__evloop__) */
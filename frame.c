@@ -0,0 +1,101 @@
+#include "frame.h"
+
+static bool frame_header_byte(frame_parser_s *p, unsigned char byte);
+
+void frame_parser_init(frame_parser_s *p, uint32_t max)
+{
+    p->max = max;
+    p->type = 0;
+    p->hlen = 0;
+    p->total = 0;
+    p->offset = 0;
+    p->body = false;
+}
+
+frame_status_e frame_next(frame_parser_s *p, const char **buf, size_t *len, frame_chunk_s *chunk)
+{
+    const char *in = *buf;
+    size_t n = *len, take;
+    
+    while(!p->body) {
+        if(!n) {
+            *buf = in;
+            *len = 0;
+            return FRAME_MORE;
+        }
+        if(!frame_header_byte(p, (unsigned char)*in))
+            return FRAME_ERROR;
+        in++;
+        n--;
+    }
+    
+    take = p->total - p->offset;
+    if(take > n)
+        take = n;
+    if(!take && p->total) {
+        *buf = in;
+        *len = 0;
+        return FRAME_MORE;
+    }
+    
+    chunk->type = p->type;
+    chunk->data = in;
+    chunk->len = take;
+    chunk->offset = p->offset;
+    chunk->total = (uint32_t)p->total;
+    
+    p->offset += take;
+    chunk->last = p->offset == p->total;
+    if(chunk->last) {
+        p->body = false;
+        p->hlen = 0;
+    }
+    
+    *buf = in + take;
+    *len = n - take;
+    return FRAME_CHUNK;
+}
+
+/* Takes the type byte, then the length a varint byte at a time. */
+bool frame_header_byte(frame_parser_s *p, unsigned char byte)
+{
+    if(!p->hlen) {
+        p->type = byte;
+        p->total = 0;
+        p->hlen = 1;
+        return true;
+    }
+    if(p->hlen == FRAME_HEADER_MAX)
+        return false;
+    
+    p->total |= (uint64_t)(byte & 0x7f) << (7 * (p->hlen - 1));
+    p->hlen++;
+    if(byte & 0x80)
+        return true;
+    
+    if(p->total > p->max)
+        return false;
+    p->offset = 0;
+    p->body = true;
+    return true;
+}
+
+bool frame_pending(frame_parser_s *p)
+{
+    return p->hlen != 0;
+}
+
+size_t frame_header(char *out, uint8_t type, uint32_t len)
+{
+    size_t n = 0;
+    
+    out[n++] = type;
+    do {
+        out[n] = len & 0x7f;
+        len >>= 7;
+        if(len)
+            out[n] |= 0x80;
+        n++;
+    } while(len);
+    return n;
+}
@@ -0,0 +1,81 @@
+
+#ifndef __TCPDelegate__frame__
+#define __TCPDelegate__frame__
+
+#include "general.h"
+
+#define FRAME_VARINT_MAX 5
+#define FRAME_HEADER_MAX (1 + FRAME_VARINT_MAX)
+#define SESSION_TOKEN_SIZE 16   /* resumes a session, see PACKET_REESTAB */
+
+/* Options a PACKET_INIT may carry after the password and a NUL, the PACKET_SESSIONID answers with those taken */
+#define LOGIN_COMPRESS 0x01     /* relayed PACKET_TX payloads are lz blocks, see relay_dir_s */
+#define LOGIN_SHM 0x02          /* over a Unix socket, move to a shared memory channel, see shm.h */
+
+typedef enum client_pack_type_e client_pack_type_e;
+typedef enum frame_status_e frame_status_e;
+typedef struct frame_chunk_s frame_chunk_s;
+typedef struct frame_parser_s frame_parser_s;
+
+enum client_pack_type_e {
+    PACKET_INIT = 1,
+    PACKET_TX,
+    PACKET_REESTAB,
+    PACKET_SESSIONID,
+    PACKET_OPEN,        /* multiplexed streams, see mux.h */
+    PACKET_DATA,
+    PACKET_CLOSE,
+    PACKET_WINDOW
+};
+
+enum frame_status_e {
+    FRAME_MORE,     /* input used up, feed in the next read */
+    FRAME_CHUNK,    /* a chunk was filled in */
+    FRAME_ERROR     /* malformed or oversized header, the stream is lost */
+};
+
+/*
+ On the wire a frame is a type byte, the payload length as an unsigned
+ LEB128 varint of at most FRAME_VARINT_MAX bytes, then the payload.
+ */
+struct frame_chunk_s {
+    uint8_t type;
+    const char *data;       /* points into the buffer being parsed */
+    size_t len;
+    uint32_t offset;        /* of data within the payload */
+    uint32_t total;         /* payload length */
+    bool last;
+};
+
+/*
+ Incremental parser. All it keeps between reads is the header decoded so
+ far and how much of the payload is left, so payloads are handed out as
+ chunks pointing straight into the caller's read buffer. A frame split
+ across reads comes out as several chunks, a read holding several frames
+ gives one chunk per frame. Zero length payloads still give one chunk.
+ */
+struct frame_parser_s {
+    uint32_t max;           /* largest payload accepted */
+    uint8_t type;
+    unsigned hlen;          /* header bytes consumed, 0 between frames */
+    uint64_t total;
+    uint32_t offset;
+    bool body;
+};
+
+extern void frame_parser_init(frame_parser_s *p, uint32_t max);
+
+/*
+ Consumes input from *buf and *len up to the end of the next chunk and
+ advances both past it. Returns FRAME_MORE with *len at 0 when the input
+ ran out first.
+ */
+extern frame_status_e frame_next(frame_parser_s *p, const char **buf, size_t *len, frame_chunk_s *chunk);
+
+/* True from the first byte of a frame until its last chunk is out. */
+extern bool frame_pending(frame_parser_s *p);
+
+/* Writes the header of a frame into out, which needs FRAME_HEADER_MAX bytes. Returns its length. */
+extern size_t frame_header(char *out, uint8_t type, uint32_t len);
+
+#endif /* defined(__TCPDelegate__frame__) */
@@ -1,5 +1,7 @@
 #include "general.h"
 
+#include <string.h>
+
 #define MAX_NUMLEN 512
 
 void buf_init(buf_s *b)
@@ -87,4 +89,22 @@ void *del_realloc(void *p, size_t size)
         exit(EXIT_FAILURE);
     }
     return np;
-}
\ No newline at end of file
+}
+
+bool split_hostport(char *spec, char **host, char **port)
+{
+    size_t hostlen;
+    
+    *host = spec;
+    *port = strrchr(spec, ':');
+    if(!*port)
+        return false;
+    *(*port)++ = '\0';
+    
+    hostlen = strlen(*host);
+    if(hostlen >= 2 && (*host)[0] == '[' && (*host)[hostlen - 1] == ']') {
+        (*host)[hostlen - 1] = '\0';
+        (*host)++;
+    }
+    return true;
+}
@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <assert.h>
@@ -12,6 +13,9 @@
 
 #include "log.h"
 
+#define CONTAINER_OF(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
 typedef struct buf_s buf_s;
 
 struct buf_s {
@@ -31,4 +35,7 @@ extern void *del_alloc(size_t size);
 extern void *del_allocz(size_t size);
 extern void *del_realloc(void *p, size_t size);
 
+/* Splits "host:port" in place, with IPv6 hosts in brackets. */
+extern bool split_hostport(char *spec, char **host, char **port);
+
 #endif /* defined(__TCPDelegate__general__) */
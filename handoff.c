@@ -0,0 +1,114 @@
+#include "handoff.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static bool handoff_addr(const char *path, struct sockaddr_un *addr);
+
+int handoff_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+    
+    if(!handoff_addr(path, &addr))
+        return -1;
+    
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return -1;
+    unlink(path);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+    
+    if(!handoff_addr(path, &addr))
+        return -1;
+    
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return -1;
+    if(connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool handoff_send(int sock, const void *msg, size_t len, const int *fds, unsigned nfds)
+{
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct iovec iov = {.iov_base = (void *)msg, .iov_len = len};
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    ssize_t status;
+    
+    assert(nfds <= HANDOFF_MAX_FDS);
+    memset(&mh, 0, sizeof mh);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if(nfds) {
+        memset(control, 0, sizeof control);
+        mh.msg_control = control;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+    }
+    
+    do {
+        status = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    } while(status < 0 && errno == EINTR);
+    return status == (ssize_t)len;
+}
+
+ssize_t handoff_recv(int sock, void *msg, size_t len, int *fds, unsigned *nfds)
+{
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct iovec iov = {.iov_base = msg, .iov_len = len};
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    ssize_t status;
+    
+    memset(&mh, 0, sizeof mh);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof control;
+    
+    do {
+        status = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+    } while(status < 0 && errno == EINTR);
+    
+    *nfds = 0;
+    for(cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+        if(cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+            continue;
+        *nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cm), sizeof(int) * *nfds);
+    }
+    return status;
+}
+
+bool handoff_addr(const char *path, struct sockaddr_un *addr)
+{
+    if(strlen(path) >= sizeof addr->sun_path) {
+        log_error("Upgrade socket path %s is too long.", path);
+        return false;
+    }
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return true;
+}
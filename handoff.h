@@ -0,0 +1,32 @@
+
+#ifndef __TCPDelegate__handoff__
+#define __TCPDelegate__handoff__
+
+#include "general.h"
+
+#include <sys/types.h>
+
+#define HANDOFF_MAX_FDS 4   /* per message */
+
+/*
+ Passing descriptors between processes over a Unix socket with
+ SCM_RIGHTS. The socket is SOCK_SEQPACKET, so every message arrives
+ whole and on its own, along with the descriptors sent with it.
+ */
+
+/* Binds and listens on path, replacing whatever socket file is there. Returns -1 on failure. */
+extern int handoff_listen(const char *path);
+
+/* Returns -1 if nothing is listening on path. */
+extern int handoff_connect(const char *path);
+
+extern bool handoff_send(int sock, const void *msg, size_t len, const int *fds, unsigned nfds);
+
+/*
+ Receives one message of up to len bytes and the descriptors that came
+ with it, which are close-on-exec. Returns the message length, 0 when
+ the peer has gone, -1 on error.
+ */
+extern ssize_t handoff_recv(int sock, void *msg, size_t len, int *fds, unsigned *nfds);
+
+#endif /* defined(__TCPDelegate__handoff__) */
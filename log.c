@@ -2,6 +2,7 @@
 #include "log.h"
 #include <stdarg.h>
 #include <string.h>
+#include <sched.h>
 
 #define MAX_QUEUE_SIZE 64
 #define TQ(p) ((p) % MAX_QUEUE_SIZE)
@@ -156,7 +157,7 @@ void log_flush(void)
         pthread_cond_broadcast(&queue_fullcond);
         pthread_cond_broadcast(&queue_emptycond);
         pthread_mutex_unlock(&queuelock);
-        pthread_yield_np();
+        sched_yield();
     } while(overflow);
 }
 
@@ -270,9 +271,9 @@ buf_s mk_logstr(const char *type, const char *format, va_list args)
             switch(*(ptr + 1)) {
                 case 's':
                     val.s = va_arg(args, char *);
-                    do {
-                        buf_addc(&buf, *val.s);
-                    } while(*++val.s);
+                    while(*val.s) {
+                        buf_addc(&buf, *val.s++);
+                    }
                     ptr += 2;
                     break;
                 case 'd':
@@ -0,0 +1,251 @@
+#include "lz.h"
+
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5      /* a packed block always ends on literals */
+#define LZ_MF_LIMIT 12          /* and no match starts closer than this to its end */
+#define LZ_MIN_BLOCK 64         /* shorter blocks aren't worth trying */
+#define LZ_MIN_GAIN 16
+#define LZ_BACKOFF_MAX 64       /* blocks */
+#define LZ_SKIP_TRIGGER 6       /* misses before the search starts stepping faster */
+
+static size_t lz_pack(lz_encoder_s *e, size_t base, size_t len, unsigned char *out, size_t cap);
+static bool lz_sequence(unsigned char *out, size_t *op, size_t cap, const unsigned char *lit, size_t litlen, size_t offset, size_t mlen);
+static size_t lz_put_length(unsigned char *out, size_t op, size_t n);
+static bool lz_get_length(const unsigned char **ip, const unsigned char *iend, size_t *n);
+static size_t lz_slide(char *hist, size_t *histlen, size_t room);
+static uint32_t lz_read32(const unsigned char *p);
+static unsigned lz_hash(const unsigned char *p);
+
+size_t lz_encode(lz_encoder_s *e, const char *src, size_t len, char *out)
+{
+    size_t base, shift, n = 0;
+    unsigned i;
+    
+    shift = lz_slide(e->hist, &e->histlen, len);
+    if(shift) {
+        for(i = 0; i < 1 << LZ_HASH_BITS; i++)
+            e->table[i] = e->table[i] > shift ? e->table[i] - shift : 0;
+    }
+    base = e->histlen;
+    memcpy(&e->hist[base], src, len);
+    e->histlen += len;
+    
+    if(e->skip) {
+        e->skip--;
+    }
+    else if(len >= LZ_MIN_BLOCK) {
+        n = lz_pack(e, base, len, (unsigned char *)&out[1], len - len / LZ_MIN_GAIN - 1);
+        if(n) {
+            e->backoff = 0;
+        }
+        else {
+            e->backoff = e->backoff ? e->backoff * 2 : 1;
+            if(e->backoff > LZ_BACKOFF_MAX)
+                e->backoff = LZ_BACKOFF_MAX;
+            e->skip = e->backoff;
+        }
+    }
+    
+    if(n) {
+        out[0] = LZ_PACKED;
+        n++;
+    }
+    else {
+        out[0] = LZ_RAW;
+        memcpy(&out[1], src, len);
+        n = 1 + len;
+    }
+    e->in += len;
+    e->out += n;
+    return n;
+}
+
+/*
+ Greedy single probe search, a match is whatever the hash table last saw
+ with the same 4 bytes. Gives up, returning 0, as soon as the output
+ would go past cap.
+ */
+size_t lz_pack(lz_encoder_s *e, size_t base, size_t len, unsigned char *out, size_t cap)
+{
+    const unsigned char *h = (const unsigned char *)e->hist;
+    size_t ip = base, anchor = base, end = base + len;
+    size_t mflimit = end - LZ_MF_LIMIT, matchlimit = end - LZ_LAST_LITERALS;
+    size_t op = 0, cand, mlen;
+    unsigned misses = 0, hv;
+    
+    while(ip < mflimit) {
+        hv = lz_hash(&h[ip]);
+        cand = e->table[hv];
+        e->table[hv] = (uint32_t)ip;
+        if(cand >= ip || ip - cand > LZ_WINDOW || lz_read32(&h[cand]) != lz_read32(&h[ip])) {
+            ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+            continue;
+        }
+        
+        while(ip > anchor && cand > 0 && h[ip - 1] == h[cand - 1]) {
+            ip--;
+            cand--;
+        }
+        for(mlen = LZ_MIN_MATCH; ip + mlen < matchlimit && h[cand + mlen] == h[ip + mlen]; mlen++)
+            ;
+        if(!lz_sequence(out, &op, cap, &h[anchor], ip - anchor, ip - cand, mlen))
+            return 0;
+        
+        ip += mlen;
+        anchor = ip;
+        misses = 0;
+        if(ip < mflimit)
+            e->table[lz_hash(&h[ip - 2])] = (uint32_t)(ip - 2);
+    }
+    
+    if(!lz_sequence(out, &op, cap, &h[anchor], end - anchor, 0, 0))
+        return 0;
+    return op;
+}
+
+/* A token, the literals and, unless mlen is 0 for the closing literals, the match. */
+bool lz_sequence(unsigned char *out, size_t *op, size_t cap, const unsigned char *lit, size_t litlen, size_t offset, size_t mlen)
+{
+    size_t o = *op, token;
+    
+    if(o + 1 + litlen + litlen / 255 + 1 + 2 + mlen / 255 + 1 > cap)
+        return false;
+    
+    token = o++;
+    out[token] = (litlen < 15 ? litlen : 15) << 4;
+    if(litlen >= 15)
+        o = lz_put_length(out, o, litlen - 15);
+    memcpy(&out[o], lit, litlen);
+    o += litlen;
+    
+    if(mlen) {
+        out[o++] = offset & 0xff;
+        out[o++] = offset >> 8;
+        mlen -= LZ_MIN_MATCH;
+        out[token] |= mlen < 15 ? mlen : 15;
+        if(mlen >= 15)
+            o = lz_put_length(out, o, mlen - 15);
+    }
+    *op = o;
+    return true;
+}
+
+size_t lz_put_length(unsigned char *out, size_t op, size_t n)
+{
+    for(; n >= 255; n -= 255)
+        out[op++] = 255;
+    out[op++] = n;
+    return op;
+}
+
+/* Every length and offset is checked, blocks come straight off the network. */
+const char *lz_decode(lz_decoder_s *d, const char *in, size_t len, size_t *outlen)
+{
+    const unsigned char *ip = (const unsigned char *)in + 1, *iend = (const unsigned char *)in + len;
+    unsigned char *h = (unsigned char *)d->hist;
+    size_t base, op, oend, litlen, mlen, offset;
+    unsigned token;
+    
+    if(!len)
+        return NULL;
+    lz_slide(d->hist, &d->histlen, LZ_BLOCK_MAX);
+    base = op = d->histlen;
+    oend = base + LZ_BLOCK_MAX;
+    
+    if(in[0] == LZ_RAW) {
+        if(len - 1 > LZ_BLOCK_MAX)
+            return NULL;
+        memcpy(&h[op], ip, len - 1);
+        op += len - 1;
+    }
+    else if(in[0] == LZ_PACKED) {
+        for(;;) {
+            if(ip >= iend)
+                return NULL;
+            token = *ip++;
+            
+            litlen = token >> 4;
+            if(litlen == 15 && !lz_get_length(&ip, iend, &litlen))
+                return NULL;
+            if(litlen > (size_t)(iend - ip) || litlen > oend - op)
+                return NULL;
+            memcpy(&h[op], ip, litlen);
+            op += litlen;
+            ip += litlen;
+            if(ip == iend)
+                break;
+            
+            if(iend - ip < 2)
+                return NULL;
+            offset = ip[0] | (size_t)ip[1] << 8;
+            ip += 2;
+            mlen = token & 15;
+            if(mlen == 15 && !lz_get_length(&ip, iend, &mlen))
+                return NULL;
+            mlen += LZ_MIN_MATCH;
+            if(!offset || offset > op || mlen > oend - op)
+                return NULL;
+            
+            /* Overlapping matches repeat the bytes just written */
+            if(offset >= mlen) {
+                memcpy(&h[op], &h[op - offset], mlen);
+                op += mlen;
+            }
+            else {
+                for(; mlen; mlen--, op++)
+                    h[op] = h[op - offset];
+            }
+        }
+    }
+    else {
+        return NULL;
+    }
+    
+    *outlen = op - base;
+    d->histlen = op;
+    return &d->hist[base];
+}
+
+bool lz_get_length(const unsigned char **ip, const unsigned char *iend, size_t *n)
+{
+    unsigned b;
+    
+    do {
+        if(*ip >= iend)
+            return false;
+        b = *(*ip)++;
+        *n += b;
+        if(*n > LZ_BLOCK_MAX)
+            return false;
+    } while(b == 255);
+    return true;
+}
+
+/* Makes room for room more bytes by dropping all but the last window's worth. Returns how far it moved. */
+size_t lz_slide(char *hist, size_t *histlen, size_t room)
+{
+    size_t keep, shift;
+    
+    if(*histlen + room <= LZ_HISTORY)
+        return 0;
+    keep = *histlen < LZ_WINDOW ? *histlen : LZ_WINDOW;
+    shift = *histlen - keep;
+    memmove(hist, &hist[shift], keep);
+    *histlen = keep;
+    return shift;
+}
+
+uint32_t lz_read32(const unsigned char *p)
+{
+    uint32_t v;
+    
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+unsigned lz_hash(const unsigned char *p)
+{
+    return (lz_read32(p) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
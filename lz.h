@@ -0,0 +1,59 @@
+
+#ifndef __TCPDelegate__lz__
+#define __TCPDelegate__lz__
+
+#include "general.h"
+
+#define LZ_BLOCK_MAX 65536                  /* uncompressed bytes in one block */
+#define LZ_WINDOW 65535                     /* farthest back a match can reach */
+#define LZ_HISTORY (2 * LZ_BLOCK_MAX)
+#define LZ_HASH_BITS 14
+#define LZ_BOUND(n) (1 + (n))               /* largest encoding of an n byte block */
+
+typedef enum lz_block_e lz_block_e;
+typedef struct lz_encoder_s lz_encoder_s;
+typedef struct lz_decoder_s lz_decoder_s;
+
+/* First byte of an encoded block */
+enum lz_block_e {
+    LZ_RAW,         /* the bytes as they are */
+    LZ_PACKED       /* LZ4 style sequences */
+};
+
+/*
+ One direction of a compressed stream. Blocks are LZ4 style sequences of
+ literals and matches, and a match may reach back into earlier blocks, up
+ to LZ_WINDOW bytes, so both ends keep the stream's recent history and
+ each has to see every block in order. Raw blocks count towards history
+ just the same.
+
+ Data that doesn't compress is sent raw without spending more time on it.
+ A block that doesn't come out at least 1/LZ_MIN_GAIN smaller is sent raw
+ and the next blocks are sent raw untried, twice as many every time it
+ happens again, until one compresses again.
+ */
+struct lz_encoder_s {
+    char hist[LZ_HISTORY];
+    size_t histlen;
+    uint32_t table[1 << LZ_HASH_BITS];  /* where each 4 byte hash was last seen in hist */
+    unsigned skip;                      /* blocks left to send raw untried */
+    unsigned backoff;
+    uint64_t in, out;                   /* bytes encoded and what they came to */
+};
+
+struct lz_decoder_s {
+    char hist[LZ_HISTORY];
+    size_t histlen;
+};
+
+/* Encodes len bytes, at most LZ_BLOCK_MAX, into out which needs LZ_BOUND(len). Returns the encoded length. */
+extern size_t lz_encode(lz_encoder_s *e, const char *src, size_t len, char *out);
+
+/*
+ Decodes a block. The result points into the decoder's history and is
+ good until the next call, NULL if the block was corrupt, after which the
+ stream can't be decoded any further.
+ */
+extern const char *lz_decode(lz_decoder_s *d, const char *in, size_t len, size_t *outlen);
+
+#endif /* defined(__TCPDelegate__lz__) */
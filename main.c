@@ -1,21 +1,159 @@
 #include "general.h"
 #include "server.h"
 
+#include <string.h>
+#include <unistd.h>
+
+static void usage(const char *prog);
+static bool parse_rate(const char *arg, unsigned *rate, unsigned *burst);
+
 int main(int argc, const char *argv[])
 {
+    int opt;
+    server_conf_s conf;
+    
     log_init();
+    server_conf_init(&conf);
+    
+    while((opt = getopt(argc, (char *const *)argv, "m:e:l:b:w:H:L:c:R:A:u:B:p:d:x:SUP")) != -1) {
+        switch(opt) {
+            case 'm':
+                if(!strcmp(optarg, "thread")) {
+                    conf.mode = SERVER_MODE_THREAD;
+                }
+                else if(!strcmp(optarg, "evloop")) {
+                    conf.mode = SERVER_MODE_EVLOOP;
+                }
+                else {
+                    usage(argv[0]);
+                    goto exit;
+                }
+                break;
+            case 'e':
+                if(!strcmp(optarg, "epoll")) {
+                    conf.engine = SERVER_ENGINE_EPOLL;
+                }
+                else if(!strcmp(optarg, "uring")) {
+                    conf.engine = SERVER_ENGINE_URING;
+                }
+                else {
+                    usage(argv[0]);
+                    goto exit;
+                }
+                break;
+            case 'l':
+                conf.nloops = (unsigned)atoi(optarg);
+                break;
+            case 'b':
+                conf.backlog = atoi(optarg);
+                break;
+            case 'w':
+                conf.pool_warm = (unsigned)atoi(optarg);
+                break;
+            case 'H':
+                conf.hiwat = (size_t)atol(optarg);
+                break;
+            case 'L':
+                conf.lowat = (size_t)atol(optarg);
+                break;
+            case 'c':
+                conf.workers = (unsigned)atoi(optarg);
+                break;
+            case 'R':
+                if(!parse_rate(optarg, &conf.conn_rate, &conf.conn_burst)) {
+                    usage(argv[0]);
+                    goto exit;
+                }
+                break;
+            case 'A':
+                if(!parse_rate(optarg, &conf.auth_rate, &conf.auth_burst)) {
+                    usage(argv[0]);
+                    goto exit;
+                }
+                break;
+            case 'u':
+                conf.upgrade_path = optarg;
+                break;
+            case 'B':
+                conf.backends = optarg;
+                break;
+            case 'p':
+                if(!strcmp(optarg, "rr")) {
+                    conf.balance = BALANCE_ROUND_ROBIN;
+                }
+                else if(!strcmp(optarg, "least")) {
+                    conf.balance = BALANCE_LEAST_CONN;
+                }
+                else if(!strcmp(optarg, "hash")) {
+                    conf.balance = BALANCE_HASH;
+                }
+                else if(!strcmp(optarg, "ewma")) {
+                    conf.balance = BALANCE_PEAK_EWMA;
+                }
+                else {
+                    usage(argv[0]);
+                    goto exit;
+                }
+                break;
+            case 'd':
+                conf.udp_port = (uint16_t)atoi(optarg);
+                break;
+            case 'x':
+                conf.unix_path = optarg;
+                break;
+            case 'S':
+                conf.reuseport = false;
+                break;
+            case 'U':
+                conf.pin = false;
+                break;
+            case 'P':
+                conf.hugepages = true;
+                break;
+            default:
+                usage(argv[0]);
+                goto exit;
+        }
+    }
     
-    if(argc == 1) {
-        server_start(DEFAULT_PORT);
+    if(!conf.hiwat || conf.lowat >= conf.hiwat) {
+        log_error("The low watermark must be below the high watermark.");
+        goto exit;
     }
-    else if(argc == 2) {
-        uint16_t port = (uint16_t)atoi(argv[1]);
-        server_start(port);
+    
+    if(argc - optind == 1) {
+        conf.port = (uint16_t)atoi(argv[optind]);
     }
-    else {
+    else if(argc - optind > 1) {
         log_error("Invalid number of args supplied on startup");
+        goto exit;
     }
     
+    server_start(&conf);
+    
+exit:
     log_deinit();
     return 0;
 }
+
+void usage(const char *prog)
+{
+    log_error("usage: %s [-m thread|evloop] [-e epoll|uring] [-l nloops] [-b backlog] [-w warm] [-H hiwat] [-L lowat] [-c workers] [-R rate[:burst]] [-A rate[:burst]] [-u upgrade_socket] [-B host:port,...] [-p rr|least|hash|ewma] [-d udp_port] [-x unix_socket] [-S] [-U] [-P] [port]", prog);
+}
+
+/* "rate" or "rate:burst", a burst left out stays as it was. */
+bool parse_rate(const char *arg, unsigned *rate, unsigned *burst)
+{
+    char *end;
+    
+    *rate = (unsigned)strtoul(arg, &end, 10);
+    if(end == arg)
+        return false;
+    if(*end == ':') {
+        arg = end + 1;
+        *burst = (unsigned)strtoul(arg, &end, 10);
+        if(end == arg)
+            return false;
+    }
+    return !*end;
+}
@@ -0,0 +1,411 @@
+#include "mux.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define MUX_HEAD_MAX (MUX_ID_SIZE + 4)
+#define MUX_READ_SIZE (FRAME_HEADER_MAX + MUX_ID_SIZE + MUX_DATA_MAX)
+
+typedef struct mux_stream_s mux_stream_s;
+
+struct mux_stream_s {
+    mux_s *mux;
+    mux_stream_s *next;         /* in its bucket */
+    uint32_t id;
+    int fd;
+    evhandler_s ev;
+    backend_s *backend;
+    uint64_t opened_at;         /* connect started, 0 for a pooled spare */
+    bool connected;
+    bool closed;
+    bool in_fin;                /* the client sent its PACKET_CLOSE */
+    bool shut;                  /* and the remote was sent the FIN */
+    bool out_fin;               /* the remote's EOF went out as a PACKET_CLOSE */
+    char *buf;                  /* from the client, waiting on the remote */
+    size_t bufpos, buflen, bufsize;
+    uint32_t send_window;       /* PACKET_DATA bytes the client will still take */
+    uint32_t recv_window;       /* and that it may still send */
+    uint32_t credit;            /* taken by the remote and not yet handed back */
+};
+
+struct mux_s {
+    evloop_s *loop;
+    balancer_s *balancer;
+    void *owner;
+    mux_send_f send;
+    mux_lend_f lend;
+    mux_connect_f connect;
+    mux_stream_s *buckets[MUX_BUCKETS];
+    char *rbuf;                 /* streams read into it, a new one once it's lent */
+    unsigned nstreams;
+    bool closed;
+    
+    /* The frame being parsed */
+    char head[MUX_HEAD_MAX];
+    size_t headlen;
+    mux_stream_s *cur;          /* NULL if its stream is gone */
+    char remote[MUX_REMOTE_MAX];
+    size_t remotelen;
+};
+
+static bool mux_open(mux_s *mux, uint32_t id);
+static mux_stream_s *mux_find(mux_s *mux, uint32_t id);
+static void mux_send_frame(mux_s *mux, uint8_t type, uint32_t id, const void *data, size_t len);
+static void mux_send_window(mux_s *mux, uint32_t id, uint32_t increment);
+static bool mux_stream_data(mux_stream_s *s, const char *data, size_t len);
+static void mux_stream_on_event(evloop_s *evloop, evhandler_s *h, uint32_t events);
+static void mux_stream_pump(mux_stream_s *s);
+static bool mux_stream_write(mux_stream_s *s);
+static bool mux_stream_read(mux_stream_s *s);
+static void mux_stream_close(mux_stream_s *s, bool failed);
+static void mux_stream_free(evloop_s *evloop, void *arg);
+
+mux_s *mux_s_(evloop_s *loop, balancer_s *balancer, void *owner, mux_send_f send, mux_lend_f lend, mux_connect_f connect)
+{
+    mux_s *mux = del_allocz(sizeof *mux);
+    
+    mux->loop = loop;
+    mux->balancer = balancer;
+    mux->owner = owner;
+    mux->send = send;
+    mux->lend = lend;
+    mux->connect = connect;
+    return mux;
+}
+
+void mux_close(mux_s *mux)
+{
+    unsigned i;
+    
+    mux->closed = true;
+    for(i = 0; i < MUX_BUCKETS; i++) {
+        while(mux->buckets[i])
+            mux_stream_close(mux->buckets[i], false);
+    }
+}
+
+void mux_destroy(mux_s *mux)
+{
+    free(mux->rbuf);
+    free(mux);
+}
+
+unsigned mux_count(mux_s *mux)
+{
+    return mux->nstreams;
+}
+
+/*
+ The id, and the increment of a PACKET_WINDOW, are gathered first since a
+ chunk can end anywhere. Everything after them goes to the stream as it
+ comes.
+ */
+bool mux_input(mux_s *mux, frame_chunk_s *chunk)
+{
+    size_t want = chunk->type == PACKET_WINDOW ? MUX_HEAD_MAX : MUX_ID_SIZE;
+    const char *data = chunk->data;
+    size_t len = chunk->len, n;
+    uint32_t id, increment;
+    
+    if(mux->closed)
+        return false;
+    if(!chunk->offset) {
+        mux->headlen = 0;
+        mux->remotelen = 0;
+        mux->cur = NULL;
+    }
+    
+    if(mux->headlen < want) {
+        n = want - mux->headlen < len ? want - mux->headlen : len;
+        memcpy(&mux->head[mux->headlen], data, n);
+        mux->headlen += n;
+        data += n;
+        len -= n;
+        if(mux->headlen < want)
+            return !chunk->last;
+        memcpy(&id, mux->head, MUX_ID_SIZE);
+        mux->cur = mux_find(mux, id);
+    }
+    memcpy(&id, mux->head, MUX_ID_SIZE);
+    
+    switch(chunk->type) {
+        case PACKET_OPEN:
+            if(len > MUX_REMOTE_MAX - 1 - mux->remotelen)
+                return false;
+            memcpy(&mux->remote[mux->remotelen], data, len);
+            mux->remotelen += len;
+            return !chunk->last || mux_open(mux, id);
+        case PACKET_DATA:
+            return !mux->cur || mux_stream_data(mux->cur, data, len);
+        case PACKET_CLOSE:
+            if(!chunk->last || !mux->cur)
+                return true;
+            if(mux->cur->in_fin)
+                return false;
+            mux->cur->in_fin = true;
+            mux_stream_pump(mux->cur);
+            return true;
+        case PACKET_WINDOW:
+            if(!chunk->last || !mux->cur)
+                return true;
+            memcpy(&increment, &mux->head[MUX_ID_SIZE], sizeof increment);
+            if(increment > UINT32_MAX - mux->cur->send_window)
+                return false;
+            mux->cur->send_window += increment;
+            mux_stream_pump(mux->cur);
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Past the stream limit or without a remote the stream is refused, the connection carries on. */
+bool mux_open(mux_s *mux, uint32_t id)
+{
+    mux_stream_s *s;
+    bool pooled;
+    int fd;
+    
+    if(mux_find(mux, id))
+        return false;
+    mux->remote[mux->remotelen] = '\0';
+    if(mux->nstreams >= MUX_MAX_STREAMS) {
+        log_warn("Refused a stream past the limit of %u.", (unsigned)MUX_MAX_STREAMS);
+        mux_send_frame(mux, PACKET_CLOSE, id, NULL, 0);
+        return true;
+    }
+    
+    s = del_allocz(sizeof *s);
+    fd = mux->connect(mux->owner, mux->remote, &s->backend, &pooled);
+    if(fd < 0) {
+        mux_send_frame(mux, PACKET_CLOSE, id, NULL, 0);
+        free(s);
+        return true;
+    }
+    s->mux = mux;
+    s->id = id;
+    s->fd = fd;
+    s->opened_at = pooled ? 0 : evloop_time(mux->loop);
+    s->send_window = s->recv_window = MUX_WINDOW;
+    s->ev.on_event = mux_stream_on_event;
+    s->next = mux->buckets[id % MUX_BUCKETS];
+    mux->buckets[id % MUX_BUCKETS] = s;
+    mux->nstreams++;
+    
+    if(!evloop_add(mux->loop, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &s->ev))
+        mux_stream_close(s, true);
+    return true;
+}
+
+mux_stream_s *mux_find(mux_s *mux, uint32_t id)
+{
+    mux_stream_s *s;
+    
+    for(s = mux->buckets[id % MUX_BUCKETS]; s; s = s->next) {
+        if(s->id == id)
+            return s;
+    }
+    return NULL;
+}
+
+void mux_send_frame(mux_s *mux, uint8_t type, uint32_t id, const void *data, size_t len)
+{
+    char buf[FRAME_HEADER_MAX + MUX_ID_SIZE];
+    size_t n = frame_header(buf, type, (uint32_t)(MUX_ID_SIZE + len));
+    
+    memcpy(&buf[n], &id, MUX_ID_SIZE);
+    mux->send(mux->owner, buf, n + MUX_ID_SIZE);
+    if(len)
+        mux->send(mux->owner, data, len);
+}
+
+void mux_send_window(mux_s *mux, uint32_t id, uint32_t increment)
+{
+    mux_send_frame(mux, PACKET_WINDOW, id, &increment, sizeof increment);
+}
+
+/* Written straight through while the remote keeps up, buffered otherwise. */
+bool mux_stream_data(mux_stream_s *s, const char *data, size_t len)
+{
+    if(s->in_fin || len > s->recv_window)
+        return false;
+    s->recv_window -= len;
+    
+    if(s->buflen + len > s->bufsize) {
+        if(s->bufpos) {
+            memmove(s->buf, &s->buf[s->bufpos], s->buflen - s->bufpos);
+            s->buflen -= s->bufpos;
+            s->bufpos = 0;
+        }
+        if(s->buflen + len > s->bufsize) {
+            s->bufsize = s->buflen + len;
+            s->buf = del_realloc(s->buf, s->bufsize);
+        }
+    }
+    memcpy(&s->buf[s->buflen], data, len);
+    s->buflen += len;
+    
+    if(s->connected)
+        mux_stream_pump(s);
+    return true;
+}
+
+void mux_stream_on_event(evloop_s *evloop, evhandler_s *h, uint32_t events)
+{
+    mux_stream_s *s = CONTAINER_OF(h, mux_stream_s, ev);
+    socklen_t len = sizeof(int);
+    int err = 0;
+    
+    if(s->closed)
+        return;
+    if(!s->connected) {
+        if(getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+            err = errno;
+        if(err) {
+            log_warn("Stream %u failed to connect. Errno: %d.", s->id, err);
+            mux_stream_close(s, true);
+            return;
+        }
+        if(!(events & EPOLLOUT))
+            return;
+        s->connected = true;
+        if(s->backend && s->opened_at)
+            balancer_report(s->mux->balancer, s->backend, (unsigned)(evloop_time(evloop) - s->opened_at), evloop_time(evloop));
+        mux_send_frame(s->mux, PACKET_OPEN, s->id, NULL, 0);
+    }
+    mux_stream_pump(s);
+}
+
+void mux_stream_pump(mux_stream_s *s)
+{
+    if(s->closed || !s->connected)
+        return;
+    if(!mux_stream_write(s) || !mux_stream_read(s)) {
+        mux_stream_close(s, true);
+        return;
+    }
+    if(s->shut && s->out_fin)
+        mux_stream_close(s, false);
+}
+
+/*
+ Client to remote. Window goes back once half of it has been taken, so
+ the client isn't sent a PACKET_WINDOW for every write.
+ */
+bool mux_stream_write(mux_stream_s *s)
+{
+    ssize_t n;
+    
+    while(s->bufpos < s->buflen) {
+        n = write(s->fd, &s->buf[s->bufpos], s->buflen - s->bufpos);
+        if(n > 0) {
+            s->bufpos += n;
+            s->credit += n;
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        }
+        else if(errno != EINTR) {
+            return false;
+        }
+    }
+    if(s->bufpos == s->buflen)
+        s->bufpos = s->buflen = 0;
+    
+    if(s->credit >= MUX_WINDOW / 2 && !s->in_fin) {
+        s->recv_window += s->credit;
+        mux_send_window(s->mux, s->id, s->credit);
+        s->credit = 0;
+    }
+    if(s->in_fin && !s->shut && !s->buflen) {
+        shutdown(s->fd, SHUT_WR);
+        s->shut = true;
+    }
+    return true;
+}
+
+/*
+ Remote to client, only as far as the client's window goes. A frame the
+ owner will take by reference leaves the read buffer with it.
+ */
+bool mux_stream_read(mux_stream_s *s)
+{
+    mux_s *mux = s->mux;
+    char head[FRAME_HEADER_MAX], *data, *frame;
+    size_t want, hlen, flen;
+    ssize_t n;
+    
+    while(!s->out_fin && s->send_window) {
+        if(!mux->rbuf)
+            mux->rbuf = del_alloc(MUX_READ_SIZE);
+        data = &mux->rbuf[FRAME_HEADER_MAX + MUX_ID_SIZE];
+        want = s->send_window < MUX_DATA_MAX ? s->send_window : MUX_DATA_MAX;
+        n = read(s->fd, data, want);
+        if(n > 0) {
+            /* The header goes right in front of the data, for a single copy into the queue or none */
+            hlen = frame_header(head, PACKET_DATA, (uint32_t)(MUX_ID_SIZE + n));
+            memcpy(data - MUX_ID_SIZE, &s->id, MUX_ID_SIZE);
+            memcpy(data - MUX_ID_SIZE - hlen, head, hlen);
+            frame = data - MUX_ID_SIZE - hlen;
+            flen = hlen + MUX_ID_SIZE + n;
+            if(mux->lend(mux->owner, mux->rbuf, frame, flen))
+                mux->rbuf = NULL;
+            else
+                mux->send(mux->owner, frame, flen);
+            s->send_window -= n;
+        }
+        else if(n == 0) {
+            s->out_fin = true;
+            mux_send_frame(s->mux, PACKET_CLOSE, s->id, NULL, 0);
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        }
+        else if(errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ Failed, the client is told with a PACKET_CLOSE unless it already had
+ one, and the remote's backend is charged for it.
+ */
+void mux_stream_close(mux_stream_s *s, bool failed)
+{
+    mux_s *mux = s->mux;
+    mux_stream_s **p;
+    
+    if(s->closed)
+        return;
+    s->closed = true;
+    if(failed) {
+        if(s->backend)
+            balancer_fail(mux->balancer, s->backend, evloop_time(mux->loop));
+        if(!s->out_fin && !mux->closed)
+            mux_send_frame(mux, PACKET_CLOSE, s->id, NULL, 0);
+    }
+    
+    for(p = &mux->buckets[s->id % MUX_BUCKETS]; *p != s; p = &(*p)->next)
+        ;
+    *p = s->next;
+    mux->nstreams--;
+    if(mux->cur == s)
+        mux->cur = NULL;
+    
+    evloop_del(mux->loop, s->fd);
+    close(s->fd);
+    if(s->backend)
+        backend_release(s->backend);
+    evloop_defer(mux->loop, mux_stream_free, s);
+}
+
+void mux_stream_free(evloop_s *evloop, void *arg)
+{
+    mux_stream_s *s = arg;
+    
+    free(s->buf);
+    free(s);
+}
@@ -0,0 +1,66 @@
+
+#ifndef __TCPDelegate__mux__
+#define __TCPDelegate__mux__
+
+#include "general.h"
+#include "evloop.h"
+#include "frame.h"
+#include "balance.h"
+
+#define MUX_ID_SIZE 4
+#define MUX_WINDOW (256 * 1024)     /* initial flow control window, per stream and direction */
+#define MUX_MAX_STREAMS 256
+#define MUX_DATA_MAX 16384          /* payload of one PACKET_DATA the server sends */
+#define MUX_REMOTE_MAX 256
+#define MUX_BUCKETS 64
+
+typedef struct mux_s mux_s;
+
+/* Queues bytes to the client. */
+typedef bool (*mux_send_f)(void *owner, const void *data, size_t len);
+
+/*
+ The same by reference, for data lying within block, a del_alloc'd buffer.
+ Returns true if it took block, to free once the bytes are sent, or false
+ to have them copied with mux_send_f instead.
+ */
+typedef bool (*mux_lend_f)(void *owner, void *block, const void *data, size_t len);
+
+/* Starts a non-blocking connect to remote, as for PACKET_TX. Returns the socket or -1. */
+typedef int (*mux_connect_f)(void *owner, char *remote, backend_s **backend, bool *pooled);
+
+/*
+ Many streams over one logged in connection, each relayed to a remote of
+ its own. Every stream frame starts with the stream's id, MUX_ID_SIZE
+ bytes in host order like the session id, which the client picks.
+ 
+ PACKET_OPEN    id, then "host:port" or nothing for the backend set.
+                Answered with a bare PACKET_OPEN once the remote is
+                connected, or a PACKET_CLOSE if it can't be.
+ PACKET_DATA    id, then bytes for the stream.
+ PACKET_CLOSE   id. The sender has nothing more to send on the stream,
+                which is gone once both sides have sent one. Only then
+                may the client reuse the id. Frames for a stream that is
+                gone are ignored.
+ PACKET_WINDOW  id, then a 4 byte increment to the receiver's window.
+ 
+ Each side may have at most its window of PACKET_DATA bytes outstanding
+ on a stream, both starting at MUX_WINDOW. The server hands window back
+ as the remote takes the bytes, and stops reading from a remote while
+ the client owes it window, so a slow reader on either end only ever
+ holds up its own stream.
+ */
+extern mux_s *mux_s_(evloop_s *loop, balancer_s *balancer, void *owner, mux_send_f send, mux_lend_f lend, mux_connect_f connect);
+
+/* Closes every stream, the connection is going away. */
+extern void mux_close(mux_s *mux);
+
+/* After mux_close, once nothing that ran in the same batch can use it. */
+extern void mux_destroy(mux_s *mux);
+
+/* A chunk of a stream frame. Returns false if the client broke the protocol. */
+extern bool mux_input(mux_s *mux, frame_chunk_s *chunk);
+
+extern unsigned mux_count(mux_s *mux);
+
+#endif /* defined(__TCPDelegate__mux__) */
@@ -0,0 +1,249 @@
+#include "outq.h"
+
+#include <string.h>
+#include <linux/errqueue.h>
+
+static void outq_push(outq_s *q, outq_seg_s *seg);
+static void outq_release(outq_s *q, outq_seg_s *seg);
+
+void outq_init(outq_s *q, slab_s *chunks)
+{
+    memset(q, 0, sizeof *q);
+    q->chunks = chunks;
+}
+
+void outq_destroy(outq_s *q)
+{
+    outq_seg_s *seg;
+    
+    while((seg = q->head)) {
+        q->head = seg->next;
+        outq_release(q, seg);
+    }
+    while((seg = q->held)) {
+        q->held = seg->next;
+        outq_release(q, seg);
+    }
+    q->tail = NULL;
+    q->len = 0;
+}
+
+bool outq_zerocopy(outq_s *q, int fd)
+{
+    int one = 1;
+    
+    if(!q->zcasked) {
+        q->zcasked = true;
+        q->zerocopy = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    }
+    return q->zerocopy;
+}
+
+/* Fills the tail chunk before starting a new one, chunks never move once allocated. */
+void outq_copy(outq_s *q, const void *data, size_t len)
+{
+    const char *p = data;
+    outq_seg_s *seg = q->tail;
+    size_t n;
+    
+    q->len += len;
+    while(len) {
+        if(!seg || seg->release || seg->len == OUTQ_CHUNK) {
+            seg = q->chunks ? slab_alloc(q->chunks) : del_alloc(OUTQ_CHUNK_ALLOC);
+            seg->data = (char *)(seg + 1);
+            seg->len = seg->pos = 0;
+            seg->release = NULL;
+            seg->arg = NULL;
+            outq_push(q, seg);
+        }
+        n = OUTQ_CHUNK - seg->len;
+        if(n > len)
+            n = len;
+        memcpy((char *)seg->data + seg->len, p, n);
+        seg->len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+void outq_borrow(outq_s *q, const void *data, size_t len, outq_release_f release, void *arg)
+{
+    outq_seg_s *seg;
+    
+    if(!len) {
+        if(release)
+            release(arg);
+        return;
+    }
+    
+    seg = del_alloc(sizeof *seg);
+    seg->data = data;
+    seg->len = len;
+    seg->pos = 0;
+    seg->release = release;
+    seg->arg = arg;
+    outq_push(q, seg);
+    q->len += len;
+}
+
+bool outq_empty(outq_s *q)
+{
+    return !q->len;
+}
+
+int outq_prepare(outq_s *q)
+{
+    outq_seg_s *seg;
+    int flags = MSG_NOSIGNAL;
+    size_t n = 0;
+    
+    for(seg = q->head; seg && n < OUTQ_IOV; seg = seg->next, n++) {
+        q->iov[n].iov_base = (char *)seg->data + seg->pos;
+        q->iov[n].iov_len = seg->len - seg->pos;
+        if(q->zerocopy && seg->release && seg->len - seg->pos >= OUTQ_ZEROCOPY_MIN)
+            flags |= MSG_ZEROCOPY;
+    }
+    
+    memset(&q->msg, 0, sizeof q->msg);
+    q->msg.msg_iov = q->iov;
+    q->msg.msg_iovlen = n;
+    return flags;
+}
+
+/*
+ Everything a MSG_ZEROCOPY send touched stays pinned by the kernel, copied
+ chunks included, so fully sent segments from such a send are held back
+ until the completion for it comes in.
+ */
+void outq_sent(outq_s *q, size_t n, int flags)
+{
+    outq_seg_s *seg, **held;
+    uint32_t id = q->zcnext;
+    size_t take;
+    
+    if(flags & MSG_ZEROCOPY)
+        q->zcnext++;
+    q->len -= n;
+    
+    for(held = &q->held; *held; held = &(*held)->next)
+        ;
+    
+    while(n && (seg = q->head)) {
+        take = seg->len - seg->pos;
+        if(take > n)
+            take = n;
+        seg->pos += take;
+        n -= take;
+        if(flags & MSG_ZEROCOPY) {
+            seg->zerocopy = true;
+            seg->zcid = id;
+        }
+        if(seg->pos < seg->len)
+            break;
+        
+        q->head = seg->next;
+        if(!q->head)
+            q->tail = NULL;
+        if(seg->zerocopy) {
+            seg->next = NULL;
+            *held = seg;
+            held = &seg->next;
+        }
+        else {
+            outq_release(q, seg);
+        }
+    }
+}
+
+bool outq_flush(outq_s *q, int fd)
+{
+    ssize_t status;
+    int flags;
+    
+    while(q->head) {
+        flags = outq_prepare(q);
+        status = sendmsg(fd, &q->msg, flags);
+        if(status >= 0) {
+            outq_sent(q, status, flags);
+        }
+        else if(errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+            /* Out of optmem for notifications, copy from here on */
+            q->zerocopy = false;
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return true;
+        }
+        else if(errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ Each completion covers the range of sends [ee_info, ee_data]. TCP
+ completes them in order, so it's enough to track the highest one seen.
+ */
+bool outq_reap(outq_s *q, int fd)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct sock_extended_err *ee;
+    struct cmsghdr *cm;
+    struct msghdr msg;
+    outq_seg_s *seg;
+    bool reaped = false;
+    
+    for(;;) {
+        memset(&msg, 0, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+        
+        cm = CMSG_FIRSTHDR(&msg);
+        if(!cm)
+            continue;
+        ee = (struct sock_extended_err *)CMSG_DATA(cm);
+        if(ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            return false;
+        
+        if((int32_t)(ee->ee_data + 1 - q->zcdone) > 0)
+            q->zcdone = ee->ee_data + 1;
+        /* The kernel copied anyway, as it does over loopback, so stop paying for the bookkeeping */
+        if(ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            q->zerocopy = false;
+        reaped = true;
+    }
+    
+    while((seg = q->held) && (int32_t)(seg->zcid - q->zcdone) < 0) {
+        q->held = seg->next;
+        outq_release(q, seg);
+    }
+    return reaped;
+}
+
+void outq_push(outq_s *q, outq_seg_s *seg)
+{
+    seg->zerocopy = false;
+    seg->zcid = 0;
+    seg->next = NULL;
+    if(q->tail)
+        q->tail->next = seg;
+    else
+        q->head = seg;
+    q->tail = seg;
+}
+
+void outq_release(outq_s *q, outq_seg_s *seg)
+{
+    if(seg->release) {
+        seg->release(seg->arg);
+        free(seg);
+    }
+    else if(q->chunks) {
+        slab_free(q->chunks, seg);
+    }
+    else {
+        free(seg);
+    }
+}
@@ -0,0 +1,95 @@
+
+#ifndef __TCPDelegate__outq__
+#define __TCPDelegate__outq__
+
+#include "general.h"
+#include "slab.h"
+
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#define OUTQ_CHUNK 4096
+#define OUTQ_IOV 64
+#define OUTQ_ZEROCOPY_MIN 10240     /* below this MSG_ZEROCOPY costs more than the copy */
+#define OUTQ_CHUNK_ALLOC (sizeof(outq_seg_s) + OUTQ_CHUNK)    /* object size for the chunk slab */
+
+typedef struct outq_s outq_s;
+typedef struct outq_seg_s outq_seg_s;
+
+typedef void (*outq_release_f)(void *arg);
+
+struct outq_seg_s {
+    const char *data;
+    size_t len, pos;
+    outq_release_f release;     /* NULL for a chunk of copied bytes */
+    void *arg;
+    uint32_t zcid;              /* last MSG_ZEROCOPY send that took from it */
+    bool zerocopy;
+    outq_seg_s *next;
+};
+
+/*
+ Per connection output queue. Small frames are copied into chunks of
+ OUTQ_CHUNK bytes, large payloads can be queued by reference instead, and
+ the lot goes out in one sendmsg() with up to OUTQ_IOV segments. Once
+ enabled, sends that carry a borrowed payload of OUTQ_ZEROCOPY_MIN bytes
+ or more use MSG_ZEROCOPY, and those payloads are only released when the
+ kernel reports it is done with them on the socket's error queue. The
+ queue stops using it for good when the kernel runs short of memory for
+ completions or reports it copied anyway, as it does over loopback.
+ */
+struct outq_s {
+    slab_s *chunks;             /* NULL to malloc them */
+    outq_seg_s *head, *tail;
+    outq_seg_s *held;           /* sent with MSG_ZEROCOPY, waiting on the kernel */
+    size_t len;                 /* bytes still to send */
+    bool zerocopy;
+    bool zcasked;               /* SO_ZEROCOPY was tried on the socket */
+    uint32_t zcnext;            /* id of the next MSG_ZEROCOPY send */
+    uint32_t zcdone;            /* sends below this one have completed */
+    struct iovec iov[OUTQ_IOV];
+    struct msghdr msg;
+};
+
+/* Copy chunks come from chunks when given, a slab of OUTQ_CHUNK_ALLOC objects. */
+extern void outq_init(outq_s *q, slab_s *chunks);
+
+/* Releases everything still queued or held. */
+extern void outq_destroy(outq_s *q);
+
+/*
+ Turns on SO_ZEROCOPY for fd the first time it's called, then says whether
+ borrowed payloads still go out with MSG_ZEROCOPY.
+ */
+extern bool outq_zerocopy(outq_s *q, int fd);
+
+extern void outq_copy(outq_s *q, const void *data, size_t len);
+
+/* Queues data by reference, release is called once the data is no longer needed. */
+extern void outq_borrow(outq_s *q, const void *data, size_t len, outq_release_f release, void *arg);
+
+extern bool outq_empty(outq_s *q);
+
+/*
+ Points q->msg at the head of the queue for a send, returns the flags to
+ send it with. The queue must not change until outq_sent is called.
+ */
+extern int outq_prepare(outq_s *q);
+
+/* Consumes the bytes a send prepared with flags managed to write. */
+extern void outq_sent(outq_s *q, size_t n, int flags);
+
+/*
+ Sends until the queue is empty or the socket would block. Returns false
+ on any other error.
+ */
+extern bool outq_flush(outq_s *q, int fd);
+
+/*
+ Drains MSG_ZEROCOPY completions from fd's error queue, releasing the
+ payloads they cover. Returns false if what raised EPOLLERR was a real
+ socket error rather than a completion.
+ */
+extern bool outq_reap(outq_s *q, int fd);
+
+#endif /* defined(__TCPDelegate__outq__) */
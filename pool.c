@@ -0,0 +1,307 @@
+#include "pool.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <netinet/in.h>
+
+#define POOL_BUCKETS 256
+#define POOL_MAX_REMOTES 1024
+
+typedef struct remote_s remote_s;
+typedef struct spare_s spare_s;
+
+struct spare_s {
+    int fd;                 /* -1 once checked out or closed */
+    bool connected;
+    evhandler_s ev;
+    remote_s *remote;
+    spare_s *prev, *next;
+};
+
+struct remote_s {
+    struct sockaddr_storage addr;
+    socklen_t len;
+    pool_s *pool;
+    spare_s *idle;          /* connected, most recent first */
+    spare_s *connecting;
+    unsigned nidle, nconnecting;
+    unsigned checkouts;
+    bool backend;
+    uint64_t last_used;
+    timer_s timer;
+    remote_s *next;
+};
+
+struct pool_s {
+    evloop_s *loop;
+    unsigned warm;
+    unsigned nremotes;
+    remote_s *buckets[POOL_BUCKETS];
+};
+
+static remote_s *remote_get(pool_s *pool, const struct sockaddr *addr, socklen_t len);
+static void remote_fill(remote_s *r);
+static void remote_on_timeout(timer_s *t, uint64_t now);
+static void remote_destroy(remote_s *r);
+static unsigned pool_hash(const struct sockaddr *addr, socklen_t len);
+static void spare_on_event(evloop_s *loop, evhandler_s *h, uint32_t events);
+static bool spare_healthy(spare_s *s);
+static void spare_push(spare_s **list, spare_s *s);
+static void spare_unlink(spare_s **list, spare_s *s);
+static void spare_drop(spare_s *s);
+static void spare_free(evloop_s *loop, void *arg);
+
+/* Spares open across all pools, held under POOL_MAX_SPARES */
+static _Atomic unsigned nspares;
+
+pool_s *pool_s_(evloop_s *loop, unsigned warm)
+{
+    pool_s *pool = del_allocz(sizeof *pool);
+    
+    pool->loop = loop;
+    pool->warm = warm;
+    return pool;
+}
+
+int pool_get(pool_s *pool, const struct sockaddr *addr, socklen_t len, bool backend)
+{
+    remote_s *r = remote_get(pool, addr, len);
+    spare_s *s;
+    int fd = -1;
+    
+    if(!r)
+        return -1;
+    
+    r->last_used = evloop_time(pool->loop);
+    r->backend |= backend;
+    r->checkouts++;
+    while((s = r->idle)) {
+        if(spare_healthy(s)) {
+            spare_unlink(&r->idle, s);
+            r->nidle--;
+            atomic_fetch_sub_explicit(&nspares, 1, memory_order_relaxed);
+            evloop_del(pool->loop, s->fd);
+            fd = s->fd;
+            s->fd = -1;
+            evloop_defer(pool->loop, spare_free, s);
+            break;
+        }
+        spare_drop(s);
+    }
+    
+    remote_fill(r);
+    return fd;
+}
+
+remote_s *remote_get(pool_s *pool, const struct sockaddr *addr, socklen_t len)
+{
+    remote_s **pr = &pool->buckets[pool_hash(addr, len)], *r;
+    
+    for(r = *pr; r; r = r->next) {
+        if(r->len == len && !memcmp(&r->addr, addr, len))
+            return r;
+    }
+    
+    if(pool->nremotes == POOL_MAX_REMOTES || len > sizeof(r->addr))
+        return NULL;
+    
+    r = del_allocz(sizeof *r);
+    memcpy(&r->addr, addr, len);
+    r->len = len;
+    r->pool = pool;
+    r->next = *pr;
+    *pr = r;
+    pool->nremotes++;
+    
+    timer_init(&r->timer, remote_on_timeout);
+    evloop_timer_arm(pool->loop, &r->timer, POOL_IDLE_TIMEOUT);
+    return r;
+}
+
+/*
+ Spares that die on their own aren't replaced until the next checkout, so
+ a remote that drops idle connections can't keep the pool reconnecting.
+ A client naming a remote once doesn't get the proxy to connect to it on
+ its own.
+ */
+void remote_fill(remote_s *r)
+{
+    pool_s *pool = r->pool;
+    spare_s *s;
+    int fd;
+    
+    if(!r->backend && r->checkouts < 2)
+        return;
+    
+    while(r->nidle + r->nconnecting < pool->warm) {
+        if(atomic_fetch_add_explicit(&nspares, 1, memory_order_relaxed) >= POOL_MAX_SPARES)
+            goto unreserve;
+        fd = socket(r->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+        if(fd < 0) {
+            log_warn("Failed to create pooled socket. Errno: %d.", errno);
+            goto unreserve;
+        }
+        if(connect(fd, (struct sockaddr *)&r->addr, r->len) < 0 && errno != EINPROGRESS) {
+            close(fd);
+            goto unreserve;
+        }
+        
+        s = del_allocz(sizeof *s);
+        s->fd = fd;
+        s->remote = r;
+        s->ev.on_event = spare_on_event;
+        if(!evloop_add(pool->loop, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &s->ev)) {
+            close(fd);
+            free(s);
+            goto unreserve;
+        }
+        spare_push(&r->connecting, s);
+        r->nconnecting++;
+    }
+    return;
+    
+unreserve:
+    atomic_fetch_sub_explicit(&nspares, 1, memory_order_relaxed);
+}
+
+void remote_on_timeout(timer_s *t, uint64_t now)
+{
+    remote_s *r = CONTAINER_OF(t, remote_s, timer);
+    
+    if(now - r->last_used < POOL_IDLE_TIMEOUT) {
+        evloop_timer_arm(r->pool->loop, t, POOL_IDLE_TIMEOUT - (unsigned)(now - r->last_used));
+        return;
+    }
+    remote_destroy(r);
+}
+
+void remote_destroy(remote_s *r)
+{
+    pool_s *pool = r->pool;
+    remote_s **pr;
+    
+    while(r->idle)
+        spare_drop(r->idle);
+    while(r->connecting)
+        spare_drop(r->connecting);
+    
+    for(pr = &pool->buckets[pool_hash((struct sockaddr *)&r->addr, r->len)]; *pr != r; pr = &(*pr)->next)
+        ;
+    *pr = r->next;
+    pool->nremotes--;
+    
+    timer_cancel(&r->timer);
+    free(r);
+}
+
+/* FNV-1a over the raw address, port included. */
+unsigned pool_hash(const struct sockaddr *addr, socklen_t len)
+{
+    const unsigned char *p = (const unsigned char *)addr;
+    uint32_t h = 2166136261u;
+    socklen_t i;
+    
+    for(i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h % POOL_BUCKETS;
+}
+
+/*
+ A close, an error or bytes the remote sent unasked take a spare out of
+ the pool. Those bytes were meant for no client in particular, so a
+ remote that greets first never keeps spares.
+ */
+void spare_on_event(evloop_s *loop, evhandler_s *h, uint32_t events)
+{
+    spare_s *s = CONTAINER_OF(h, spare_s, ev);
+    remote_s *r = s->remote;
+    socklen_t len = sizeof(int);
+    int err = 0;
+    
+    if(s->fd < 0)
+        return;
+    
+    if(events & (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+        spare_drop(s);
+        return;
+    }
+    
+    if(!s->connected && (events & EPOLLOUT)) {
+        if(getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+            spare_drop(s);
+            return;
+        }
+        spare_unlink(&r->connecting, s);
+        r->nconnecting--;
+        s->connected = true;
+        spare_push(&r->idle, s);
+        r->nidle++;
+    }
+}
+
+/*
+ The checkout health check: no pending error and nothing to read. EOF or
+ a reset means the remote is gone, and bytes it sent unasked would reach
+ whichever client the spare went to.
+ */
+bool spare_healthy(spare_s *s)
+{
+    socklen_t len = sizeof(int);
+    int err = 0;
+    ssize_t n;
+    char c;
+    
+    if(getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+        return false;
+    n = recv(s->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void spare_push(spare_s **list, spare_s *s)
+{
+    s->prev = NULL;
+    s->next = *list;
+    if(*list)
+        (*list)->prev = s;
+    *list = s;
+}
+
+void spare_unlink(spare_s **list, spare_s *s)
+{
+    if(s->prev)
+        s->prev->next = s->next;
+    else
+        *list = s->next;
+    if(s->next)
+        s->next->prev = s->prev;
+    s->prev = s->next = NULL;
+}
+
+/* Closes a spare wherever it is, events already queued for it will see fd -1. */
+void spare_drop(spare_s *s)
+{
+    remote_s *r = s->remote;
+    
+    if(s->connected) {
+        spare_unlink(&r->idle, s);
+        r->nidle--;
+    }
+    else {
+        spare_unlink(&r->connecting, s);
+        r->nconnecting--;
+    }
+    
+    atomic_fetch_sub_explicit(&nspares, 1, memory_order_relaxed);
+    evloop_del(r->pool->loop, s->fd);
+    close(s->fd);
+    s->fd = -1;
+    evloop_defer(r->pool->loop, spare_free, s);
+}
+
+void spare_free(evloop_s *loop, void *arg)
+{
+    free(arg);
+}
@@ -0,0 +1,38 @@
+
+#ifndef __TCPDelegate__pool__
+#define __TCPDelegate__pool__
+
+#include "general.h"
+#include "evloop.h"
+
+#include <sys/socket.h>
+
+#define DEFAULT_POOL_WARM 2
+#define POOL_IDLE_TIMEOUT 30000
+#define POOL_MAX_SPARES 256     /* across every loop's pool */
+
+typedef struct pool_s pool_s;
+
+/*
+ Per event loop pool of upstream connections keyed by remote address and
+ port. A relayed connection carries its session in the byte stream and is
+ never handed back, so what the pool keeps are spares: up to warm already
+ connected sockets per remote, opened ahead of the sessions that will
+ want them. A remote that goes POOL_IDLE_TIMEOUT without a checkout has
+ its spares closed.
+ 
+ Remotes are named by clients, so only configured backends get spares
+ from the start. Any other remote has to be checked out a second time
+ first, and no more than POOL_MAX_SPARES are open at once.
+ */
+extern pool_s *pool_s_(evloop_s *loop, unsigned warm);
+
+/*
+ Returns the most recently connected spare to addr that still looks
+ healthy, or -1 if there is none. Either way the remote's spares are
+ topped back up in the background once it has earned them, backend says
+ addr is a configured one.
+ */
+extern int pool_get(pool_s *pool, const struct sockaddr *addr, socklen_t len, bool backend);
+
+#endif /* defined(__TCPDelegate__pool__) */
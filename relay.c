@@ -0,0 +1,388 @@
+#include "relay.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define RELAY_BUF_SIZE 16384
+#define RELAY_CHUNK 65536   /* largest single splice, a default pipe's worth */
+
+static bool relay_drain(relay_dir_s *d, int dst);
+static ssize_t relay_fill(relay_dir_s *d, int src, size_t room);
+static bool relay_again(void);
+static void relay_reserve(relay_dir_s *d, size_t size);
+static void relay_fallback(relay_dir_s *d);
+static void relay_unsplice(relay_dir_s *d);
+static void relay_compact(relay_dir_s *d);
+static ssize_t relay_encode(relay_dir_s *d, int src, size_t room);
+static ssize_t relay_decode(relay_dir_s *d, int src, size_t room);
+
+void relay_dir_init(relay_dir_s *d, bool use_splice, size_t hiwat, size_t lowat)
+{
+    memset(d, 0, sizeof *d);
+    d->pipe[0] = d->pipe[1] = -1;
+    d->hiwat = hiwat;
+    d->lowat = lowat;
+    
+    if(use_splice && pipe2(d->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        log_warn("Failed to create relay pipe, falling back to buffered copies. Errno: %d.", errno);
+        d->pipe[0] = d->pipe[1] = -1;
+    }
+    if(d->pipe[0] < 0) {
+        relay_reserve(d, hiwat);
+    }
+    else if(hiwat > RELAY_CHUNK) {
+        /* Best effort, the pipe stays at its default size past pipe-max-size */
+        fcntl(d->pipe[1], F_SETPIPE_SZ, (int)hiwat);
+    }
+}
+
+void relay_dir_destroy(relay_dir_s *d)
+{
+    if(d->pipe[0] >= 0) {
+        close(d->pipe[0]);
+        close(d->pipe[1]);
+        d->pipe[0] = d->pipe[1] = -1;
+    }
+    free(d->buf);
+    d->buf = NULL;
+    free(d->enc);
+    free(d->dec);
+    free(d->block);
+    d->enc = NULL;
+    d->dec = NULL;
+    d->block = NULL;
+}
+
+void relay_dir_compress(relay_dir_s *d)
+{
+    relay_unsplice(d);
+    d->enc = del_allocz(sizeof *d->enc);
+    d->block = del_alloc(LZ_BLOCK_MAX + LZ_BOUND(LZ_BLOCK_MAX));
+}
+
+void relay_dir_decompress(relay_dir_s *d)
+{
+    relay_unsplice(d);
+    d->dec = del_allocz(sizeof *d->dec);
+    d->block = del_alloc(LZ_BOUND(LZ_BLOCK_MAX));
+    frame_parser_init(&d->parser, LZ_BOUND(LZ_BLOCK_MAX));
+}
+
+void relay_carry(relay_dir_s *d, const void *data, size_t len)
+{
+    relay_reserve(d, d->buflen + len);
+    memcpy(&d->buf[d->buflen], data, len);
+    d->buflen += len;
+}
+
+bool relay_feed(relay_dir_s *d, const char *data, size_t len)
+{
+    frame_chunk_s chunk;
+    const char *out;
+    size_t outlen, n;
+    
+    if(!d->dec) {
+        relay_carry(d, data, len);
+        return true;
+    }
+    
+    relay_compact(d);
+    if(d->raw) {
+        n = len < d->raw ? len : d->raw;
+        relay_carry(d, data, n);
+        d->raw -= n;
+        data += n;
+        len -= n;
+    }
+    while(len) {
+        switch(frame_next(&d->parser, &data, &len, &chunk)) {
+            case FRAME_MORE:
+                break;
+            case FRAME_CHUNK:
+                if(chunk.type != PACKET_TX)
+                    goto corrupt;
+                memcpy(&d->block[chunk.offset], chunk.data, chunk.len);
+                if(!chunk.last)
+                    break;
+                if(!(out = lz_decode(d->dec, d->block, chunk.total, &outlen)))
+                    goto corrupt;
+                relay_carry(d, out, outlen);
+                break;
+            case FRAME_ERROR:
+                goto corrupt;
+        }
+    }
+    return true;
+    
+corrupt:
+    d->corrupt = true;
+    return false;
+}
+
+/*
+ Reading carries on while dst is blocked, so EAGAIN from a splice into a
+ pipe that still holds data may mean the pipe is full rather than src
+ dry. Either way dst is blocked too and its EPOLLOUT brings us back.
+ */
+relay_status_e relay_pump(relay_dir_s *d, int src, int dst)
+{
+    size_t buffered;
+    ssize_t n;
+    
+    for(;;) {
+        if(!relay_drain(d, dst))
+            return RELAY_ERROR;
+        buffered = relay_buffered(d);
+        
+        if(d->eof) {
+            if(buffered)
+                return RELAY_OK;
+            break;
+        }
+        
+        if(buffered >= d->hiwat)
+            d->paused = true;
+        else if(buffered <= d->lowat)
+            d->paused = false;
+        if(d->paused)
+            return RELAY_OK;
+        
+        n = relay_fill(d, src, d->hiwat - buffered);
+        if(n == 0) {
+            d->eof = true;
+        }
+        else if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return relay_again() ? RELAY_OK : RELAY_ERROR;
+        }
+    }
+    
+    if(!d->shut) {
+        shutdown(dst, SHUT_WR);
+        d->shut = true;
+    }
+    return RELAY_DONE;
+}
+
+/* Writes come straight out of the ring, nothing is copied on the way. */
+relay_status_e relay_from_ring(relay_dir_s *d, shm_channel_s *c, int dst)
+{
+    const char *data;
+    size_t len;
+    ssize_t n;
+    
+    for(;;) {
+        if(!relay_drain(d, dst))
+            return RELAY_ERROR;
+        data = shm_peek(c, &len);
+        if(c->broken) {
+            errno = EPROTO;
+            return RELAY_ERROR;
+        }
+        if(!len) {
+            if(shm_eof(c))
+                break;
+            if(shm_wait_read(c))
+                continue;
+            return RELAY_OK;
+        }
+        
+        n = write(dst, data, len);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return relay_again() ? RELAY_OK : RELAY_ERROR;
+        }
+        shm_consume(c, n);
+        d->nbytes += n;
+    }
+    
+    if(!d->shut) {
+        shutdown(dst, SHUT_WR);
+        d->shut = true;
+    }
+    return RELAY_DONE;
+}
+
+/* Reads land straight in the ring. */
+relay_status_e relay_to_ring(relay_dir_s *d, int src, shm_channel_s *c)
+{
+    size_t room;
+    ssize_t n;
+    char *p;
+    
+    while(!d->eof) {
+        p = shm_reserve(c, &room);
+        if(c->broken) {
+            errno = EPROTO;
+            return RELAY_ERROR;
+        }
+        if(!p) {
+            if(shm_wait_write(c))
+                continue;
+            return RELAY_OK;
+        }
+        
+        n = read(src, p, room);
+        if(n == 0) {
+            d->eof = true;
+        }
+        else if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return relay_again() ? RELAY_OK : RELAY_ERROR;
+        }
+        else {
+            shm_commit(c, n);
+            d->nbytes += n;
+        }
+    }
+    
+    if(!d->shut) {
+        shm_close(c);
+        d->shut = true;
+    }
+    return RELAY_DONE;
+}
+
+size_t relay_buffered(relay_dir_s *d)
+{
+    return d->pending + d->buflen - d->bufpos;
+}
+
+/* Writes out what's buffered, carried bytes first. Stopping on EAGAIN is not a failure. */
+bool relay_drain(relay_dir_s *d, int dst)
+{
+    ssize_t n;
+    
+    while(d->bufpos < d->buflen) {
+        n = write(dst, &d->buf[d->bufpos], d->buflen - d->bufpos);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return relay_again();
+        }
+        d->bufpos += n;
+        d->nbytes += n;
+    }
+    d->bufpos = d->buflen = 0;
+    
+    while(d->pending) {
+        n = splice(d->pipe[0], NULL, dst, NULL, d->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return relay_again();
+        }
+        d->pending -= n;
+        d->nbytes += n;
+    }
+    return true;
+}
+
+/* Reads at most room more bytes from src, returning what read() or splice() did. */
+ssize_t relay_fill(relay_dir_s *d, int src, size_t room)
+{
+    ssize_t n;
+    
+    if(d->enc)
+        return relay_encode(d, src, room);
+    if(d->dec)
+        return relay_decode(d, src, room);
+    
+    if(d->pipe[0] >= 0) {
+        n = splice(src, NULL, d->pipe[1], NULL, room < RELAY_CHUNK ? room : RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n < 0 && errno == EINVAL && !d->pending) {
+            relay_fallback(d);
+            return relay_fill(d, src, room);
+        }
+        if(n > 0)
+            d->pending += n;
+        return n;
+    }
+    
+    relay_compact(d);
+    if(room > d->bufsize - d->buflen)
+        room = d->bufsize - d->buflen;
+    n = read(src, &d->buf[d->buflen], room);
+    if(n > 0)
+        d->buflen += n;
+    return n;
+}
+
+/* Reads up to a block's worth and queues it as one frame. */
+ssize_t relay_encode(relay_dir_s *d, int src, size_t room)
+{
+    char header[FRAME_HEADER_MAX];
+    char *out = &d->block[LZ_BLOCK_MAX];
+    size_t len;
+    ssize_t n;
+    
+    n = read(src, d->block, room < LZ_BLOCK_MAX ? room : LZ_BLOCK_MAX);
+    if(n <= 0)
+        return n;
+    len = lz_encode(d->enc, d->block, n, out);
+    relay_compact(d);
+    relay_carry(d, header, frame_header(header, PACKET_TX, len));
+    relay_carry(d, out, len);
+    return n;
+}
+
+/* Corrupt input fails the read with EPROTO. */
+ssize_t relay_decode(relay_dir_s *d, int src, size_t room)
+{
+    char buf[RELAY_BUF_SIZE];
+    ssize_t n;
+    
+    n = read(src, buf, room < sizeof buf ? room : sizeof buf);
+    if(n > 0 && !relay_feed(d, buf, n)) {
+        errno = EPROTO;
+        return -1;
+    }
+    return n;
+}
+
+bool relay_again(void)
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+/* Only ever called with an empty pipe, so nothing is lost on the switch. */
+void relay_fallback(relay_dir_s *d)
+{
+    log_warn("splice() unsupported on relay, falling back to buffered copies.");
+    relay_unsplice(d);
+}
+
+void relay_unsplice(relay_dir_s *d)
+{
+    if(d->pipe[0] >= 0) {
+        close(d->pipe[0]);
+        close(d->pipe[1]);
+        d->pipe[0] = d->pipe[1] = -1;
+    }
+    relay_reserve(d, d->hiwat);
+}
+
+/* Moves what's left to write to the front of the buffer. */
+void relay_compact(relay_dir_s *d)
+{
+    if(!d->bufpos)
+        return;
+    memmove(d->buf, &d->buf[d->bufpos], d->buflen - d->bufpos);
+    d->buflen -= d->bufpos;
+    d->bufpos = 0;
+}
+
+void relay_reserve(relay_dir_s *d, size_t size)
+{
+    if(size <= d->bufsize)
+        return;
+    if(size < RELAY_BUF_SIZE)
+        size = RELAY_BUF_SIZE;
+    d->buf = del_realloc(d->buf, size);
+    d->bufsize = size;
+}
@@ -0,0 +1,84 @@
+
+#ifndef __TCPDelegate__relay__
+#define __TCPDelegate__relay__
+
+#include "general.h"
+#include "frame.h"
+#include "lz.h"
+#include "shm.h"
+
+typedef enum relay_status_e relay_status_e;
+typedef struct relay_dir_s relay_dir_s;
+
+enum relay_status_e {
+    RELAY_OK,       /* drained until one side would block */
+    RELAY_DONE,     /* source hit EOF and everything was passed on */
+    RELAY_ERROR
+};
+
+/*
+ One direction of a relayed connection. Bytes normally travel socket to
+ pipe to socket with splice() and never enter user space. If the kernel
+ refuses to splice the direction switches over to a plain read/write
+ buffer for the rest of its life.
+ 
+ Reading from the source keeps going while the destination is blocked
+ until hiwat bytes are buffered, then pauses until the destination has
+ taken enough that no more than lowat are left.
+ 
+ On a compressed session the client's side of the relay is a stream of
+ PACKET_TX frames, each carrying one lz block. Those directions always
+ run on the buffer, one compressing what it reads into frames and the
+ other decoding them, and hiwat counts the bytes on their way out.
+ */
+struct relay_dir_s {
+    int pipe[2];            /* -1 once running on the fallback buffer */
+    size_t pending;         /* bytes sitting in the pipe */
+    char *buf;              /* fallback buffer, also holds carried bytes */
+    size_t bufpos, buflen, bufsize;
+    size_t hiwat, lowat;
+    bool paused;
+    bool eof;
+    bool shut;              /* EOF forwarded with shutdown(SHUT_WR) */
+    uint64_t nbytes;
+    
+    /* Compressed sessions only */
+    lz_encoder_s *enc;      /* set when dst takes frames */
+    lz_decoder_s *dec;      /* set when src sends them */
+    frame_parser_s parser;
+    char *block;            /* block being read or gathered */
+    size_t raw;             /* bytes still due from a frame that's carried, not decoded */
+    bool corrupt;           /* src sent something that didn't decode */
+};
+
+extern void relay_dir_init(relay_dir_s *d, bool use_splice, size_t hiwat, size_t lowat);
+extern void relay_dir_destroy(relay_dir_s *d);
+
+/* Switches the direction to compressing what it reads, or decoding it, for good. */
+extern void relay_dir_compress(relay_dir_s *d);
+extern void relay_dir_decompress(relay_dir_s *d);
+
+/* Queues bytes that were already read ahead of the destination, regardless of hiwat. */
+extern void relay_carry(relay_dir_s *d, const void *data, size_t len);
+
+/*
+ The same for bytes read from src, decoded first when it sends frames.
+ False if they were corrupt. The first raw bytes are carried as they are.
+ */
+extern bool relay_feed(relay_dir_s *d, const char *data, size_t len);
+
+/* Moves bytes from src to dst until src would block or the direction pauses. */
+extern relay_status_e relay_pump(relay_dir_s *d, int src, int dst);
+
+/*
+ The same with the client's side a shared memory channel, whose rings take
+ the place of the buffering so hiwat and lowat don't apply. Carried bytes
+ still go to dst first. Returns RELAY_OK once waiting on a kick.
+ */
+extern relay_status_e relay_from_ring(relay_dir_s *d, shm_channel_s *c, int dst);
+extern relay_status_e relay_to_ring(relay_dir_s *d, int src, shm_channel_s *c);
+
+/* Bytes read from src that dst has yet to take. */
+extern size_t relay_buffered(relay_dir_s *d);
+
+#endif /* defined(__TCPDelegate__relay__) */
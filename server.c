@@ -1,30 +1,75 @@
-
 #include "server.h"
 #include "general.h"
+#include "evloop.h"
+#include "relay.h"
+#include "frame.h"
+#include "outq.h"
+#include "table.h"
+#include "timer.h"
+#include "pool.h"
+#include "slab.h"
+#include "work.h"
+#include "crypt.h"
+#include "admit.h"
+#include "handoff.h"
+#include "balance.h"
+#include "mux.h"
+#include "udp.h"
+#include "shm.h"
 #include "log.h"
 
 #include <string.h>
+#include <stdatomic.h>
+#include <signal.h>
 #include <unistd.h>
 #include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/random.h>
 
 
-#define MAX_TIMEOUT 10000
+#define MAX_TIMEOUT 10000           /* idle */
+#define HANDSHAKE_TIMEOUT 5000
+#define SESSION_LIFETIME 86400000
+#define RESUME_TIMEOUT 30000        /* how long a dropped session waits for its client */
 #define BUF_SIZE 256
-#define TABLE_SIZE 19
+#define SESSION_CAPACITY 4096
+#define FRAME_MAX_PAYLOAD (1 << 24)
+#define SESSION_LOOP_BITS 8         /* low bits of a session id name its loop */
+#define SESSION_MAX_LOOPS (1 << SESSION_LOOP_BITS)
+#define STATS_INTERVAL 60000        /* slab counters and admission refusals */
+#define LOGIN_KDF_ROUNDS 512
+#define LOGIN_KEY_SIZE 64
+#define UPGRADE_VERSION 1
+#define UPGRADE_TIMEOUT 5000        /* per message on the control socket */
+#define UPGRADE_SESSION_GAP (1 << 16)   /* ids left for logins still finishing in the old process */
+#define DRAIN_CHECK 200
+#define DRAIN_TIMEOUT 300000        /* connections left after this are dropped */
 
-typedef enum client_pack_type_e client_pack_type_e;
+typedef enum request_state_e request_state_e;
+typedef enum upgrade_type_e upgrade_type_e;
 
 typedef struct request_s request_s;
+typedef struct loopctx_s loopctx_s;
+typedef struct upgrade_msg_s upgrade_msg_s;
+typedef struct upgrade_session_s upgrade_session_s;
+typedef struct udp_check_s udp_check_s;
 
-enum client_pack_type_e {
-    PACKET_INIT = 1,
-    PACKET_TX,
-    PACKET_REESTAB,
-    PACKET_SESSIONID
+enum request_state_e {
+    REQ_HANDSHAKE,      /* waiting on the PACKET_INIT/PACKET_REESTAB packet */
+    REQ_AUTHENTICATING, /* password being checked on a worker, input held */
+    REQ_ESTABLISHED,    /* waiting on the PACKET_TX naming the remote */
+    REQ_CONNECTING,     /* connect to the remote in flight */
+    REQ_RELAY,
+    REQ_MUX,            /* carrying multiplexed streams, frames all the way */
+    REQ_RESUMING,       /* PACKET_REESTAB read, moving to the session's loop */
+    REQ_DETACHED,       /* client gone, the relay waits RESUME_TIMEOUT for it */
+    REQ_CLOSING         /* close once the output buffer drains */
 };
 
 struct request_s {
@@ -33,52 +78,326 @@ struct request_s {
     struct sockaddr_in client_ip;
     char ipstr[INET_ADDRSTRLEN];
     pthread_t thread;
+    uint64_t session_id;        /* 0 until logged in */
+    uint64_t resume_id;         /* session a PACKET_REESTAB asked for */
+    char token[SESSION_TOKEN_SIZE];
+    bool negotiated;            /* the PACKET_INIT carried options */
+    bool compress;              /* the relay's client side is compressed */
+    bool local;                 /* came in on the Unix socket */
+    bool shared;                /* asked for a shared memory channel and can have one */
+    
+    /* Event loop mode only, loop is NULL for thread-per-connection */
+    loopctx_s *loop;
+    evhandler_s ev;
+    request_state_e state;
+    uint64_t last_active;
+    timer_s timer;              /* handshake deadline, then idle timeout */
+    timer_s expiry;
+    frame_parser_s parser;
+    size_t inlen;               /* payload of the frame being gathered */
+    char in[BUF_SIZE];
+    outq_s outq;
+    mux_s *mux;                 /* from the first PACKET_OPEN */
+    shm_channel_s *shm;         /* once logged in over one, the socket only says the client is there */
+    evhandler_s sev;            /* the channel's wake eventfd */
+    bool flushing;              /* flush deferred to the end of the iteration */
+    bool closed;
+    
+    /* Login check on the worker pool, the request outlives the job */
+    work_s work;
+    bool working;
+    char key[LOGIN_KEY_SIZE];   /* derived from the password in in */
+    char *held;                 /* input that came in behind the PACKET_INIT */
+    size_t heldlen;
+    
+    /* Relay to the remote, upfd is -1 until a PACKET_TX names one */
+    int upfd;
+    evhandler_s uev;
+    relay_dir_s up, down;
+    backend_s *backend;         /* NULL unless the remote came from the backend set */
+    uint64_t connect_at;        /* backend connect started, 0 once timed or pooled */
+    uint64_t ask_at;            /* first bytes went up to the backend */
+    bool answered;              /* and the first came back, timed */
+    bool relay_live;
+    request_s *prev, *next;     /* on the loop's relays while relay_live */
+    
+    /*
+     io_uring engine only. At most one sendmsg of the output queue is in
+     flight, and the request can't be freed while any operation is.
+     */
+    uring_op_s rop, wop;
+    bool rarmed;
+    unsigned wflight;
+};
+
+/* Per event loop bookkeeping */
+struct loopctx_s {
+    evloop_s *evloop;
+    uring_s *ring;          /* NULL when the loop runs on epoll */
+    int listen_fd;
+    bool shared;            /* listen_fd is shared with the other loops */
+    evhandler_s lev;
+    uring_op_s aop;
+    evhandler_s ulev;       /* the Unix listener, shared by every loop */
+    pool_s *pool;           /* NULL when pooling is off */
+    size_t hiwat, lowat;
+    slab_s *reqs;           /* request_s */
+    slab_s *chunks;         /* output queue chunks */
+    request_s *relays;
+    udp_relay_s *udp;       /* NULL unless relaying datagrams */
+    bool draining;          /* handed over, no longer accepting */
+    _Atomic size_t live;    /* requests allocated and not yet freed */
+};
+
+/*
+ Hot upgrade. A new process connects to the control socket of the running
+ one and sends UPGRADE_TAKE. The old process answers with UPGRADE_HELLO
+ and its listening sockets, one UPGRADE_LISTENER each, stops accepting,
+ passes every idle relay over as an UPGRADE_SESSION and finishes with
+ UPGRADE_DONE. Then it drains whatever it still has and exits.
+ */
+enum upgrade_type_e {
+    UPGRADE_TAKE,
+    UPGRADE_HELLO,
+    UPGRADE_LISTENER,   /* the listening socket */
+    UPGRADE_SESSION,    /* the remote socket, then the client's unless detached */
+    UPGRADE_DONE
+};
+
+/* Every message on the control socket is one of these */
+struct upgrade_msg_s {
+    uint32_t version;
+    uint32_t type;
+    uint32_t nloops;
+    uint32_t nlisteners;
+    bool shared;
+    uint64_t counter;           /* session_counter of the old process */
+    uint64_t session_id;
+    char token[SESSION_TOKEN_SIZE];
+    struct sockaddr_in client_ip;
+    uint64_t sent, received;
+    uint64_t lifetime;          /* ms left before the session expires */
+    bool detached;
+};
+
+/* A session on its way to the loop that adopts it */
+struct upgrade_session_s {
+    upgrade_msg_s msg;
+    int fd, upfd;
+};
+
+/* A datagram flow's bind on its way to the loop that owns the session, and back */
+struct udp_check_s {
+    udp_flow_s *flow;
+    evloop_s *from;
     uint64_t session_id;
-    int nchildren;
-    request_s *children[TABLE_SIZE];
+    char token[SESSION_TOKEN_SIZE];
+    bool ok;
 };
 
 #define PASSWORD "test"
 
 static time_t base_time;
-static uint64_t session_counter;
-
-static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
-static request_s *reqtable[TABLE_SIZE];
+static _Atomic uint64_t session_counter;
+static table_s *sessions;
+static loopctx_s *loops;
+static unsigned nloops;
+static slab_s *thread_reqs;     /* thread mode, allocated by the accepting thread */
+static workpool_s *workers;
+static salt_s login_salt;
+static char login_key[LOGIN_KEY_SIZE];
+static admit_s *conn_admit;     /* NULL when not limited */
+static admit_s *auth_admit;
+static balancer_s *balancer;    /* NULL when no backends are configured */
+static int unix_fd = -1;        /* co-located clients, every loop accepts on it */
+static int upgrade_fd = -1;     /* control listener, on loop 0 */
+static evhandler_s upgrade_ev;
+static int upgrade_ctl = -1;    /* connection to the process taking over */
+static _Atomic unsigned upgrade_left;   /* loops yet to hand their relays over */
+static timer_s drain_timer;
+static uint64_t drain_deadline;
 
 static bool isrunning;
+static int listen_socket(uint16_t port, int backlog, int flags, bool reuseport);
+static int unix_socket(const char *path, int backlog);
+static void server_start_threads(int sock_fd);
+static void server_start_evloop(server_conf_s *conf);
+static bool server_backends(server_conf_s *conf);
 static void *serve_client(void *arg);
-static request_s *request_s_(int fd, struct sockaddr_in *client_ip);
+static request_s *request_s_(loopctx_s *ctx, int fd, struct sockaddr_in *client_ip);
 static bool check_request(request_s *req);
-static bool authenticate(request_s *req);
-static bool pass_correct(char *pass);
-static uint64_t new_session_id(void);
-static void tx_new_session_id(request_s *req);
-static void resolve_remote(request_s *req);
+static bool request_frame(request_s *req, frame_chunk_s *chunk);
+static void request_options(request_s *req);
+static bool request_gather(request_s *req, const char *data, size_t len);
+static bool admit_connection(int fd, struct sockaddr_in *client_ip, uint64_t now);
+static bool admit_attempt(request_s *req);
+static void admit_log(void);
+static bool request_authenticate(request_s *req);
+static void request_derive(work_s *w);
+static void request_on_derived(evloop_s *evloop, void *arg);
+static bool request_login(request_s *req);
+static void request_hold(request_s *req, const char *data, size_t len);
+static bool key_equal(const char *a, const char *b);
+static uint64_t new_session_id(request_s *req);
+static bool tx_new_session_id(request_s *req);
+static int request_share(request_s *req);
+static bool new_token(request_s *req);
+static bool token_equal(const char *a, const char *b);
+static bool request_send(request_s *req, const void *data, size_t len);
+static bool request_lend(request_s *req, void *block, const void *data, size_t len);
+static bool resolve_remote(request_s *req, char *remote);
+static bool request_mux(request_s *req, frame_chunk_s *chunk);
+static bool mux_on_send(void *owner, const void *data, size_t len);
+static bool mux_on_lend(void *owner, void *block, const void *data, size_t len);
+static int mux_on_connect(void *owner, char *remote, backend_s **backend, bool *pooled);
+static int open_remote(request_s *req, char *remote, backend_s **backend, bool *pooled);
+static int connect_remote(request_s *req, const struct sockaddr *addr, socklen_t addrlen, const char *label, bool backend, bool *pooled);
+static void udp_on_bind(evloop_s *loop, udp_flow_s *flow, uint64_t session_id, const char *token, const struct sockaddr_in *client);
+static void udp_check(evloop_s *evloop, void *arg);
+static void udp_on_checked(evloop_s *evloop, void *arg);
+
+static void request_attach(evloop_s *evloop, void *arg);
+static void request_on_event(evloop_s *evloop, evhandler_s *h, uint32_t events);
+static bool request_fill(request_s *req);
+static bool request_flush(request_s *req);
+static void request_on_shm(evloop_s *evloop, evhandler_s *h, uint32_t events);
+static bool request_shm_fill(request_s *req);
+static bool request_shm_flush(request_s *req);
+static void request_on_flush(evloop_s *evloop, void *arg);
+static void request_close(request_s *req);
+static void request_free(evloop_s *evloop, void *arg);
+static void request_touch(request_s *req);
+static void request_on_timeout(timer_s *t, uint64_t now);
+static void request_on_expiry(timer_s *t, uint64_t now);
+static bool request_client_lost(request_s *req);
+static bool request_detach(request_s *req);
+static void request_migrate(request_s *req);
+static void request_handoff(evloop_s *evloop, void *arg);
+static void request_resume(evloop_s *evloop, void *arg);
+
+static void upstream_on_event(evloop_s *evloop, evhandler_s *h, uint32_t events);
+static void relay_begin(request_s *req);
+static void relay_run(request_s *req);
+static void relay_time_backend(request_s *req);
 
-static void table_insert_request(request_s *req);
-static void table_insert_request_(request_s *req, request_s *base[]);
-static void table_delete_request(request_s *req);
-static void table_delete_request_(request_s *req, request_s *base[]);
-static void reparent(request_s *root);
+static void listener_arm(evloop_s *evloop, void *arg);
+static void loop_on_tick(evloop_s *evloop, void *arg);
+static void listener_on_event(evloop_s *evloop, evhandler_s *h, uint32_t events);
+static void listener_on_accept(uring_s *ring, uring_op_s *op, int res, uint32_t flags);
+static void unix_on_event(evloop_s *evloop, evhandler_s *h, uint32_t events);
+static void request_arm_recv(request_s *req);
+static void request_on_recv(uring_s *ring, uring_op_s *op, int res, uint32_t flags);
+static void request_on_send(uring_s *ring, uring_op_s *op, int res, uint32_t flags);
+static void request_input(request_s *req, const char *buf, size_t len);
+static bool request_uring_flush(request_s *req);
+static void request_release(request_s *req);
+static void session_remove(request_s *req);
 
-void server_start(uint16_t port)
+static void relay_track(request_s *req);
+static void relay_untrack(request_s *req);
+static void upgrade_timeouts(int fd);
+static int upgrade_recv(int fd, upgrade_msg_s *msg, int *fds);
+static bool upgrade_take(int fd, upgrade_msg_s *hello, int *lfds);
+static void upgrade_adopt(int fd);
+static void upgrade_listen(const char *path);
+static void upgrade_arm(evloop_s *evloop, void *arg);
+static void upgrade_on_event(evloop_s *evloop, evhandler_s *h, uint32_t events);
+static bool upgrade_give(int fd);
+static void upgrade_loop(evloop_s *evloop, void *arg);
+static bool request_transferable(request_s *req);
+static bool request_hand_over(request_s *req);
+static void request_adopt(evloop_s *evloop, void *arg);
+static void drain_start(evloop_s *evloop, void *arg);
+static void drain_on_timer(timer_s *t, uint64_t now);
+
+void server_conf_init(server_conf_s *conf)
 {
-    struct sockaddr_in sock_addr;
+    conf->port = DEFAULT_PORT;
+    conf->mode = SERVER_MODE_EVLOOP;
+    conf->engine = SERVER_ENGINE_EPOLL;
+    conf->nloops = DEFAULT_NLOOPS;
+    conf->backlog = DEFAULT_BACKLOG;
+    conf->reuseport = true;
+    conf->pin = true;
+    conf->pool_warm = DEFAULT_POOL_WARM;
+    conf->hiwat = DEFAULT_HIWAT;
+    conf->lowat = DEFAULT_LOWAT;
+    conf->hugepages = false;
+    conf->workers = DEFAULT_WORKERS;
+    conf->conn_rate = DEFAULT_CONN_RATE;
+    conf->conn_burst = DEFAULT_CONN_BURST;
+    conf->auth_rate = DEFAULT_AUTH_RATE;
+    conf->auth_burst = DEFAULT_AUTH_BURST;
+    conf->upgrade_path = NULL;
+    conf->udp_port = 0;
+    conf->unix_path = NULL;
+    conf->backends = NULL;
+    conf->balance = BALANCE_ROUND_ROBIN;
+}
+
+void server_start(server_conf_s *conf)
+{
+    int sock_fd;
     
     base_time = time(NULL);
     
-    log_info("Starting Server on port: %d.", port);
+    log_info("Starting Server on port: %d.", conf->port);
     
     signal(SIGPIPE, SIG_IGN);
     
-    int sock_fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sessions = table_s_(TABLE_SHARDS, SESSION_CAPACITY);
+    isrunning = true;
+    
+    /* Logins are checked by deriving a key the same way and comparing */
+    if(getrandom(&login_salt, sizeof login_salt, 0) != sizeof login_salt)
+        login_salt = get_salt();
+    PBKDF(PASSWORD, strlen(PASSWORD), login_salt, LOGIN_KDF_ROUNDS, login_key, LOGIN_KEY_SIZE);
+    
+    if(conf->conn_rate)
+        conn_admit = admit_s_(conf->conn_rate, conf->conn_burst);
+    if(conf->auth_rate)
+        auth_admit = admit_s_(conf->auth_rate, conf->auth_burst);
+    
+    if(conf->backends && !server_backends(conf))
+        exit(EXIT_FAILURE);
+    
+    if(conf->mode == SERVER_MODE_EVLOOP) {
+        server_start_evloop(conf);
+    }
+    else {
+        if(conf->upgrade_path)
+            log_warn("Hot upgrades need the event loop mode, ignoring %s.", conf->upgrade_path);
+        if(conf->udp_port)
+            log_warn("Relaying datagrams needs the event loop mode, ignoring UDP port %d.", conf->udp_port);
+        if(conf->unix_path)
+            log_warn("Local clients need the event loop mode, ignoring %s.", conf->unix_path);
+        sock_fd = listen_socket(conf->port, conf->backlog, 0, false);
+        thread_reqs = slab_s_("requests", sizeof(request_s), conf->hugepages);
+        
+        log_info("Server is now listening on port: %d.", conf->port);
+        
+        server_start_threads(sock_fd);
+        close(sock_fd);
+    }
+}
+
+int listen_socket(uint16_t port, int backlog, int flags, bool reuseport)
+{
+    struct sockaddr_in sock_addr;
+    int one = 1;
+    
+    int sock_fd = socket(PF_INET, SOCK_STREAM | flags, IPPROTO_TCP);
 
     if(sock_fd == -1) {
         perror("Error Creating socket");
         exit(EXIT_FAILURE);
     }
     
+    if(reuseport && setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+        perror("Error setting SO_REUSEPORT");
+        exit(EXIT_FAILURE);
+    }
+    
     memset(&sock_addr, 0, sizeof(sock_addr));
     sock_addr.sin_family = AF_INET;
     sock_addr.sin_port = htons(port);
@@ -90,15 +409,49 @@ void server_start(uint16_t port)
         exit(EXIT_FAILURE);
     }
     
-    status = listen(sock_fd, MAX_CLIENTS);
+    status = listen(sock_fd, backlog);
     if(status == -1) {
         perror("call to listen() failed");
         close(sock_fd);
     }
+    return sock_fd;
+}
+
+/*
+ Replaces whatever socket file is at path, a server taking over leaves the
+ old one's listener to drain unreachable. Access is whatever the directory
+ and umask allow.
+ */
+int unix_socket(const char *path, int backlog)
+{
+    struct sockaddr_un addr;
+    int fd;
+    
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("Unix socket path too long: %s.", path);
+        exit(EXIT_FAILURE);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
     
-    isrunning = true;
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1) {
+        perror("Error creating Unix socket");
+        exit(EXIT_FAILURE);
+    }
+    unlink(path);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, backlog) == -1) {
+        perror("Error listening on Unix socket");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
     
-    log_info("Server is now listening on port: %d.", port);
+void server_start_threads(int sock_fd)
+{
+    int status;
+    struct timeval timeout = {.tv_sec = MAX_TIMEOUT / 1000};
 
     while(isrunning) {
         request_s *req;
@@ -106,23 +459,158 @@ void server_start(uint16_t port)
         socklen_t len = sizeof(client_ip);
         int client_fd = accept(sock_fd, (struct sockaddr *)&client_ip, &len);
         
-        req = request_s_(client_fd, &client_ip);
+        if(client_fd >= 0 && !admit_connection(client_fd, &client_ip, evloop_now()))
+            continue;
+        req = request_s_(NULL, client_fd, &client_ip);
 
         if(client_fd < 0) {
             perror("Client failed on Connection Attempt");
             log_error("Client [%s] experienced connection error.", req->ipstr);
-            free(req);
+            request_free(NULL, req);
         }
         else {
             log_info("Client [%s] Connected with socket descriptor: %d.", req->ipstr, client_fd);
 
+            /* Bounds the blocking handshake read in check_request */
+            setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
             status = pthread_create(&req->thread, NULL, serve_client, req);
             if(status < 0) {
                 log_error("Failure to create thread for client [%s].", req->ipstr);
             }
         }
     }
-    close(sock_fd);
+}
+
+/*
+ Every loop owns its own SO_REUSEPORT listener and accepts for itself, so
+ a connection is handled start to finish on the core that accepted it.
+ Without reuseport the loops share one listener, woken exclusively.
+ 
+ Taking over from a running server, its listeners are used as they are
+ and there are at least as many loops as it had, so every session it
+ passes over lands on the loop its id names.
+ */
+void server_start_evloop(server_conf_s *conf)
+{
+    unsigned i, nlisteners = 0;
+    bool uring = conf->engine == SERVER_ENGINE_URING;
+    bool shared = !conf->reuseport;
+    upgrade_msg_s hello;
+    int lfds[SESSION_MAX_LOOPS];
+    int ctl = -1;
+    
+    nloops = conf->nloops ? conf->nloops : evloop_ncpus();
+    if(nloops > SESSION_MAX_LOOPS) {
+        log_warn("Limiting the server to %u event loops.", (unsigned)SESSION_MAX_LOOPS);
+        nloops = SESSION_MAX_LOOPS;
+    }
+    
+    if(conf->upgrade_path && (ctl = handoff_connect(conf->upgrade_path)) >= 0) {
+        if(upgrade_take(ctl, &hello, lfds)) {
+            log_info("Taking over %u listeners from the running server.", hello.nlisteners);
+            nlisteners = hello.nlisteners;
+            shared = hello.shared;
+            if(hello.nloops > nloops)
+                nloops = hello.nloops;
+            atomic_store(&session_counter, hello.counter + UPGRADE_SESSION_GAP);
+        }
+        else {
+            log_warn("Failed to take over from the running server, starting afresh.");
+            close(ctl);
+            ctl = -1;
+        }
+    }
+    loops = del_allocz(nloops * sizeof *loops);
+    workers = workpool_s_(conf->workers);
+    if(conf->unix_path)
+        unix_fd = unix_socket(conf->unix_path, conf->backlog);
+    
+    if(uring && !uring_supported()) {
+        log_warn("io_uring is not supported by this kernel, falling back to epoll.");
+        uring = false;
+    }
+    
+    for(i = 0; i < nloops; i++) {
+        if(i < nlisteners) {
+            loops[i].listen_fd = lfds[i];
+        }
+        else if(!shared || !i) {
+            loops[i].listen_fd = listen_socket(conf->port, conf->backlog, SOCK_NONBLOCK | SOCK_CLOEXEC, !shared);
+        }
+        else {
+            loops[i].listen_fd = loops[0].listen_fd;
+        }
+        loops[i].shared = shared;
+        
+        loops[i].evloop = evloop_s_(i);
+        if(uring) {
+            if(!evloop_use_uring(loops[i].evloop, BUF_SIZE)) {
+                log_error("Failed to set up io_uring for event loop %u.", i);
+                exit(EXIT_FAILURE);
+            }
+            loops[i].ring = evloop_uring(loops[i].evloop);
+        }
+        if(conf->pool_warm)
+            loops[i].pool = pool_s_(loops[i].evloop, conf->pool_warm);
+        loops[i].hiwat = conf->hiwat;
+        loops[i].lowat = conf->lowat;
+        loops[i].reqs = slab_s_("requests", sizeof(request_s), conf->hugepages);
+        loops[i].chunks = slab_s_("output chunks", OUTQ_CHUNK_ALLOC, conf->hugepages);
+        if(conf->udp_port && !(loops[i].udp = udp_relay_s_(loops[i].evloop, conf->udp_port, balancer, udp_on_bind)))
+            exit(EXIT_FAILURE);
+        evloop_set_tick(loops[i].evloop, STATS_INTERVAL, loop_on_tick, &loops[i]);
+        evloop_post(loops[i].evloop, listener_arm, &loops[i]);
+        evloop_start(loops[i].evloop);
+        if(conf->pin)
+            evloop_pin(loops[i].evloop, i);
+    }
+    
+    log_info("Server is now listening on port: %d with %u event loops.", conf->port, nloops);
+    if(conf->udp_port)
+        log_info("Relaying datagrams on UDP port: %d.", conf->udp_port);
+    if(conf->unix_path)
+        log_info("Accepting local clients on %s.", conf->unix_path);
+    
+    if(ctl >= 0)
+        upgrade_adopt(ctl);
+    if(conf->upgrade_path)
+        upgrade_listen(conf->upgrade_path);
+    
+    for(i = 0; i < nloops; i++) {
+        evloop_join(loops[i].evloop);
+        if(!shared || !i)
+            close(loops[i].listen_fd);
+        slab_destroy(loops[i].reqs);
+        slab_destroy(loops[i].chunks);
+        if(loops[i].udp)
+            udp_relay_destroy(loops[i].udp);
+    }
+    workpool_destroy(workers);
+    if(unix_fd >= 0)
+        close(unix_fd);
+    if(upgrade_fd >= 0)
+        close(upgrade_fd);
+    free(loops);
+}
+
+/* conf->backends is a comma separated list of "host:port". */
+bool server_backends(server_conf_s *conf)
+{
+    char *list = strdup(conf->backends), *spec, *save;
+    bool ok = true;
+    
+    balancer = balancer_s_(conf->balance);
+    for(spec = strtok_r(list, ",", &save); spec && ok; spec = strtok_r(NULL, ",", &save))
+        ok = balancer_add(balancer, spec);
+    free(list);
+    
+    if(ok && !balancer_count(balancer)) {
+        log_error("No backends given.");
+        ok = false;
+    }
+    if(ok)
+        log_info("Balancing empty remotes over %u backends.", balancer_count(balancer));
+    return ok;
 }
 
 void *serve_client(void *arg)
@@ -162,273 +650,1866 @@ void *serve_client(void *arg)
     }
 
 exit:
+    session_remove(req);
     close(req->fd);
-    free(req);
+    request_free(NULL, req);
     pthread_exit(NULL);
 }
 
-request_s *request_s_(int fd, struct sockaddr_in *client_ip)
+request_s *request_s_(loopctx_s *ctx, int fd, struct sockaddr_in *client_ip)
 {
-    int ip = client_ip->sin_addr.s_addr, i;
-    request_s *req = del_alloc(sizeof *req);
+    int ip = client_ip->sin_addr.s_addr;
+    request_s *req = slab_alloc(ctx ? ctx->reqs : thread_reqs);
     req->fd = fd;
     req->isactive = true;
     req->client_ip = *client_ip;
+    req->session_id = req->resume_id = 0;
+    req->negotiated = req->compress = false;
+    req->local = req->shared = false;
+    req->loop = ctx;
+    req->state = REQ_HANDSHAKE;
+    req->last_active = 0;
+    timer_init(&req->timer, request_on_timeout);
+    timer_init(&req->expiry, request_on_expiry);
+    frame_parser_init(&req->parser, FRAME_MAX_PAYLOAD);
+    req->inlen = 0;
+    outq_init(&req->outq, ctx ? ctx->chunks : NULL);
+    req->mux = NULL;
+    req->shm = NULL;
+    req->rarmed = req->closed = req->flushing = false;
+    req->upfd = -1;
+    req->backend = NULL;
+    req->connect_at = req->ask_at = 0;
+    req->answered = false;
+    req->relay_live = false;
+    req->wflight = 0;
+    req->working = false;
+    req->held = NULL;
+    req->heldlen = 0;
     
-    for(i = 0; i < TABLE_SIZE; i++)
-        req->children[i] = NULL;
+    if(ctx)
+        atomic_fetch_add_explicit(&ctx->live, 1, memory_order_relaxed);
     
     inet_ntop(AF_INET, &ip, req->ipstr, INET_ADDRSTRLEN);
     return req;
 }
 
+/* Thread mode only logs in, reading until the first frame is through. */
 bool check_request(request_s *req)
 {
+    char buf[BUF_SIZE];
     ssize_t status;
-    char buf[BUF_SIZE], pass[BUF_SIZE];
-    static const char fail[] = "/-------------FAIL!!!--------------/\a\n";
     
-    status = read(req->fd, buf, BUF_SIZE);
-    if(status < 0) {
-        log_error("Failure during read during validation of new connection. Socket: %d, Client: %s.", req->fd, req->ipstr);
-        goto exit;
+    while(req->state == REQ_HANDSHAKE) {
+        status = read(req->fd, buf, sizeof(buf));
+        if(status <= 0) {
+            log_error("Failure during read during validation of new connection. Socket: %d, Client: %s.", req->fd, req->ipstr);
+            goto exit;
+        }
+        request_input(req, buf, status);
     }
     
-    buf[BUF_SIZE - 1] = '\0';
+exit:
+    //possible clean up code here(?)
+    return false;
+}
+
+/*
+ Handles a chunk of a handshake frame. PACKET_INIT carries the password,
+ optionally followed by a NUL and a byte of LOGIN_ options. PACKET_TX
+ carries the "host:port" to relay to, optionally followed by a NUL and
+ the first bytes for the remote, which are never compressed. Returns
+ false to reject the connection.
+ */
+bool request_frame(request_s *req, frame_chunk_s *chunk)
+{
+    const char *end;
+    size_t len;
     
-    switch(buf[0]) {
+    switch(chunk->type) {
         case PACKET_INIT:
-            log_info("Testing: %s", &buf[1]);
-            if(pass_correct(&buf[1])) {
-                log_info("Login Success for [%s]", req->ipstr);
-                tx_new_session_id(req);
-                table_insert_request(req);
+            if(req->state != REQ_HANDSHAKE)
+                break;
+            if(!request_gather(req, chunk->data, chunk->len))
+                return false;
+            if(!chunk->last)
+                return true;
+            request_options(req);
+            return request_authenticate(req);
+        case PACKET_TX:
+            /* Thread mode doesn't relay */
+            if(req->state != REQ_ESTABLISHED || !req->loop)
+                break;
+            end = memchr(chunk->data, '\0', chunk->len);
+            len = end ? (size_t)(end - chunk->data) : chunk->len;
+            if(!request_gather(req, chunk->data, len))
+                return false;
+            if(!end && !chunk->last)
+                return true;
+            req->inlen = 0;
+            if(!resolve_remote(req, req->in))
+                return false;
+            if(end)
+                relay_carry(&req->up, end + 1, chunk->len - len - 1);
+            /* The rest of the frame is early data too and arrives after the state has moved on */
+            req->up.raw = chunk->total - chunk->offset - chunk->len;
+            return true;
+        case PACKET_OPEN:
+        case PACKET_DATA:
+        case PACKET_CLOSE:
+        case PACKET_WINDOW:
+            if((req->state != REQ_ESTABLISHED && req->state != REQ_MUX) || !req->loop)
+                break;
+            return request_mux(req, chunk);
+        case PACKET_REESTAB:
+            /* A session id followed by its resumption token */
+            if(req->state != REQ_HANDSHAKE || !req->loop)
+                break;
+            if(!request_gather(req, chunk->data, chunk->len))
+                return false;
+            if(!chunk->last)
+                return true;
+            if(req->inlen != sizeof req->resume_id + SESSION_TOKEN_SIZE) {
+                log_warn("Malformed PACKET_REESTAB from [%s].", req->ipstr);
+                return false;
             }
-            else {
-                log_warn("Login Attempt failed for [%s]", req->ipstr);
+            if(!admit_attempt(req))
+                return false;
+            memcpy(&req->resume_id, req->in, sizeof req->resume_id);
+            memcpy(req->token, &req->in[sizeof req->resume_id], SESSION_TOKEN_SIZE);
+            req->inlen = 0;
+            if((req->resume_id & (SESSION_MAX_LOOPS - 1)) >= nloops) {
+                log_warn("PACKET_REESTAB from [%s] names an unknown session.", req->ipstr);
+                return false;
             }
-            break;
-        case PACKET_REESTAB:
-            
-            break;
+            req->state = REQ_RESUMING;
+            if(req->loop->ring && req->rarmed)
+                uring_cancel(req->loop->ring, &req->rop);
+            request_migrate(req);
+            return true;
         default:
-            //fail
             break;
     }
-    
-exit:
-    //possible clean up code here(?)
+    log_warn("Unexpected packet type %d from [%s].", chunk->type, req->ipstr);
     return false;
 }
 
-bool pass_correct(char *pass)
+/*
+ Splits the options off the password gathered in in. Thread mode never
+ relays, so takes none. A shared memory channel is only set up on epoll
+ loops, and compressing what goes through one would only cost time.
+ */
+void request_options(request_s *req)
 {
-    int i;
-    const char *pptr = PASSWORD;
+    const char *end = memchr(req->in, '\0', req->inlen);
+    uint8_t options;
     
-    for(i = 0; i < BUF_SIZE; i++) {
-        if(*pptr) {
-            if(*pass == *pptr) {
-                pass++;
-                pptr++;
-            }
-        }
-        else {
-            break;
-        }
+    if(!end)
+        return;
+    options = end + 1 < &req->in[req->inlen] ? end[1] : 0;
+    req->inlen = end - req->in;
+    req->negotiated = true;
+    req->shared = req->local && req->loop && !req->loop->ring && (options & LOGIN_SHM);
+    req->compress = req->loop && !req->shared && (options & LOGIN_COMPRESS);
+}
+
+/* Collects a short payload into in, kept NUL terminated. */
+bool request_gather(request_s *req, const char *data, size_t len)
+{
+    if(len >= BUF_SIZE - req->inlen) {
+        log_warn("Oversized handshake frame from [%s].", req->ipstr);
+        return false;
     }
-    if(!(*pass || *pptr))
+    memcpy(&req->in[req->inlen], data, len);
+    req->inlen += len;
+    req->in[req->inlen] = '\0';
+    return true;
+}
+
+/*
+ Over the limit is refused before anything is allocated or logged for the
+ connection, the one close is all it costs.
+ */
+bool admit_connection(int fd, struct sockaddr_in *client_ip, uint64_t now)
+{
+    if(!conn_admit || admit_take(conn_admit, client_ip->sin_addr.s_addr, now))
         return true;
-    else
-        return false;
+    close(fd);
+    return false;
 }
 
-void tx_new_session_id(request_s *req)
+/* Charged for every PACKET_INIT and PACKET_REESTAB, ahead of any key derivation. */
+bool admit_attempt(request_s *req)
 {
-    uint64_t sid = new_session_id();
-    ssize_t status;
-    char buf[9];
- 
-    req->session_id = sid;
-    
-    buf[0] = PACKET_SESSIONID;
-    memcpy(&buf[1], &sid, sizeof sid);
+    uint64_t now = req->loop ? evloop_time(req->loop->evloop) : evloop_now();
     
-    status = write(req->fd, buf, sizeof buf);
-    if(status < 0) {
-        log_error("Failed to send new session id");
-    }
+    return !auth_admit || admit_take(auth_admit, req->client_ip.sin_addr.s_addr, now);
 }
 
-uint64_t new_session_id(void)
+/* Refusals are only counted as they happen, and summed up here. */
+void admit_log(void)
 {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    uint64_t conns = conn_admit ? admit_refused(conn_admit) : 0;
+    uint64_t attempts = auth_admit ? admit_refused(auth_admit) : 0;
     
-    uint64_t newid;
-    
-    pthread_mutex_lock(&lock);
-    newid = session_counter++;
-    pthread_mutex_unlock(&lock);
+    if(conns || attempts)
+        log_warn("Admission control refused %lu connections and %lu login attempts.", (unsigned long)conns, (unsigned long)attempts);
+}
+
+/*
+ Deriving the key is slow on purpose, so on an event loop it's handed to
+ the worker pool and whatever the client sent after the PACKET_INIT is
+ held until the verdict is in. Thread mode has its own thread to block.
+ */
+bool request_authenticate(request_s *req)
+{
+    if(!admit_attempt(req))
+        return false;
+    if(!req->loop) {
+        request_derive(&req->work);
+        return request_login(req);
+    }
     
-    return newid;
+    req->state = REQ_AUTHENTICATING;
+    req->working = true;
+    if(req->loop->ring && req->rarmed)
+        uring_cancel(req->loop->ring, &req->rop);
+    workpool_submit(workers, req->loop->evloop, &req->work, request_derive, request_on_derived);
+    return true;
 }
 
+void request_derive(work_s *w)
+{
+    request_s *req = CONTAINER_OF(w, request_s, work);
+    size_t i;
+    
+    PBKDF(req->in, req->inlen, login_salt, LOGIN_KDF_ROUNDS, req->key, LOGIN_KEY_SIZE);
+    for(i = 0; i < req->inlen; i++)
+        ((volatile char *)req->in)[i] = 0;
+    req->inlen = 0;
+}
 
-bool authenticate(request_s *req)
+/* Back on the request's loop, picks up where request_frame left off. */
+void request_on_derived(evloop_s *evloop, void *arg)
 {
-    enum {NFAILS = 50000, NINITS = 3};
-    static const char message[] =
-    "/----------------------------------/\n"
-    "/--------AUTHENTICATE BITCH--------/\n"
-    "/----------------------------------/\a\n>"
-    ;
+    request_s *req = CONTAINER_OF(arg, request_s, work);
+    char *held = req->held;
+    size_t heldlen = req->heldlen;
     
-    static const char fail[] = "/-------------FAIL!!!--------------/\a\n";
+    req->working = false;
+    if(req->closed) {
+        if(req->loop->ring)
+            request_release(req);
+        else
+            evloop_defer(evloop, request_free, req);
+        return;
+    }
     
-    static const char success[] = "success.";
-    int i;
-    char buf[BUF_SIZE] = {0};
-    ssize_t status;
+    req->state = REQ_HANDSHAKE;
+    if(!request_login(req)) {
+        request_close(req);
+        return;
+    }
+    
+    req->held = NULL;
+    req->heldlen = 0;
+    if(heldlen)
+        request_input(req, held, heldlen);
+    free(held);
     
-    status = read(req->fd, buf, sizeof(buf));
-    log_info("Read %lu bytes", (unsigned long)status);
-    if(status < 0) {
-        log_error("Failed to read on socket %d from client [%s]", req->fd, req->ipstr);
+    /* Reading stopped or the recv was cancelled while the job ran */
+    if(req->loop->ring) {
+        if(!req->rarmed && (req->state == REQ_HANDSHAKE || req->state == REQ_ESTABLISHED))
+            request_arm_recv(req);
+    }
+    else if(!request_fill(req)) {
+        request_close(req);
+    }
+}
+
+bool request_login(request_s *req)
+{
+    if(!key_equal(req->key, login_key)) {
+        log_warn("Login Attempt failed for [%s]", req->ipstr);
         return false;
     }
-    
-    if(buf[0] != PACKET_INIT) {
-        int count = 0;
-        while(buf[0] != PACKET_INIT) {
-            log_info("val: %d\n", buf[0]);
-            status = write(req->fd, message, sizeof(message));
-            if(status < 0) {
-                log_error("Write failed on socket: %d.", req->fd);
-                return false;
-            }
-            status = read(req->fd, buf, BUF_SIZE);
-            if(status < 0) {
-                log_error("Read failed on socket: %d.", req->fd);
-                return false;
-            }
-            if(count == NINITS) {
-                log_warn("Attempts Exhausted on socket %d for [%s]", req->fd, req->ipstr);
-                return false;
-            }
-            else {
-                count++;
-                memset(buf, 0, sizeof(buf));
-            }
-        }
-        log_info("GOT PACKET_INIT!");
+    log_info("Login Success for [%s]", req->ipstr);
+    if(!tx_new_session_id(req))
+        return false;
+    table_insert(sessions, req->session_id, req);
+    req->state = REQ_ESTABLISHED;
+    if(req->loop) {
+        request_touch(req);
+        evloop_timer_arm(req->loop->evloop, &req->timer, MAX_TIMEOUT);
+        evloop_timer_arm(req->loop->evloop, &req->expiry, SESSION_LIFETIME);
     }
+    return true;
+}
+
+void request_hold(request_s *req, const char *data, size_t len)
+{
+    req->held = del_realloc(req->held, req->heldlen + len);
+    memcpy(&req->held[req->heldlen], data, len);
+    req->heldlen += len;
+}
+
+/*
+ The reply is the new session id followed by the token that resumes it,
+ then the options taken if the PACKET_INIT asked for any. A shared memory
+ channel's descriptors come with the reply, written straight to the socket
+ since nothing else has been, and everything after it goes through the
+ channel.
+ */
+bool tx_new_session_id(request_s *req)
+{
+    uint64_t sid = new_session_id(req);
+    char buf[FRAME_HEADER_MAX + sizeof sid + SESSION_TOKEN_SIZE + 1];
+    size_t len, plen = sizeof sid + SESSION_TOKEN_SIZE + (req->negotiated ? 1 : 0);
+    int fds[SHM_FDS];
+    bool sent;
+ 
+    if(!new_token(req))
+        return false;
+    req->session_id = sid;
+    fds[0] = req->shared ? request_share(req) : -1;
     
-    buf[BUF_SIZE - 1] = '\0';
+    len = frame_header(buf, PACKET_SESSIONID, plen);
+    memcpy(&buf[len], &sid, sizeof sid);
+    memcpy(&buf[len + sizeof sid], req->token, SESSION_TOKEN_SIZE);
+    if(req->negotiated)
+        buf[len + sizeof sid + SESSION_TOKEN_SIZE] = (req->compress ? LOGIN_COMPRESS : 0) | (req->shm ? LOGIN_SHM : 0);
     
-    log_info("Testing Password: %s", &buf[1]);
+    if(req->shm) {
+        fds[1] = req->shm->kick;
+        fds[2] = req->shm->wake;
+        sent = handoff_send(req->fd, buf, len + plen, fds, SHM_FDS);
+        close(fds[0]);
+        if(!sent)
+            log_error("Failed to send the shared memory channel to [%s]. Errno: %d.", req->ipstr, errno);
+        return sent;
+    }
+    if(!request_send(req, buf, len + plen)) {
+        log_error("Failed to send new session id");
+    }
+    return true;
+}
+
+/*
+ Sets up the channel and watches its wake eventfd, returns the memfd to
+ send or -1 to carry on over the socket.
+ */
+int request_share(request_s *req)
+{
+    shm_channel_s *c = del_alloc(sizeof *c);
+    int fd = shm_channel_create(c);
     
-    if(strcmp(PASSWORD, &buf[1])) {
-        log_warn("Failed Authentication Attempt Ocurred from client: [%s].", req->ipstr);
-        for(i = 0; i < NFAILS; i++) {
-            status = write(req->fd, fail, sizeof(fail));
-            if(status < 0) {
-                log_warn("Failed to send authentication failure message - Probably Broken Pipe.");
-                break;
-            }
+    if(fd >= 0) {
+        req->sev.on_event = request_on_shm;
+        if(evloop_add(req->loop->evloop, c->wake, EPOLLIN | EPOLLET, &req->sev)) {
+            req->shm = c;
+            log_info("Client [%s] moved to a shared memory channel.", req->ipstr);
+            return fd;
         }
-        return false;
+        close(fd);
+        shm_channel_destroy(c);
     }
-    else {
-        log_info("Successful Login Occurred");
-        status = write(req->fd, success, sizeof(success));
-        if(status < 0) {
-            log_error("Failed to send authentication success message.");
-        }
-        return true;
+    log_warn("Failed to set up a shared memory channel for [%s]. Errno: %d.", req->ipstr, errno);
+    free(c);
+    return -1;
+}
+
+bool new_token(request_s *req)
+{
+    if(getrandom(req->token, SESSION_TOKEN_SIZE, 0) != SESSION_TOKEN_SIZE) {
+        log_error("Failed to generate a session token. Errno: %d.", errno);
+        return false;
     }
+    return true;
+}
+
+/* Constant time, so a guess can't be refined byte by byte. */
+bool token_equal(const char *a, const char *b)
+{
+    unsigned char diff = 0;
+    int i;
     
+    for(i = 0; i < SESSION_TOKEN_SIZE; i++)
+        diff |= a[i] ^ b[i];
+    return !diff;
 }
 
-void resolve_remote(request_s *req)
+bool key_equal(const char *a, const char *b)
 {
-    ssize_t status;
-    char buf[BUF_SIZE], *bptr;
+    unsigned char diff = 0;
+    int i;
     
-    status = read(req->fd, buf, BUF_SIZE);
-    if(status < 0) {
-        log_error("Failed to read socket %d while attempting to resolve remote server.", req->fd);
-    }
+    for(i = 0; i < LOGIN_KEY_SIZE; i++)
+        diff |= a[i] ^ b[i];
+    return !diff;
+}
+
+/*
+ Thread mode writes straight to the socket. On an event loop the data is
+ queued, and everything queued during an iteration goes out together in a
+ single sendmsg once the iteration's events have been handled.
+ */
+bool request_send(request_s *req, const void *data, size_t len)
+{
+    if(!req->loop)
+        return write(req->fd, data, len) >= 0;
+    if(req->closed)
+        return false;
     
-    while(*bptr && bptr - buf < 256) {
-        bptr++;
+    outq_copy(&req->outq, data, len);
+    if(!req->flushing) {
+        req->flushing = true;
+        evloop_defer(req->loop->evloop, request_on_flush, req);
     }
+    return true;
 }
 
+/*
+ The same by reference for a payload in block, a del_alloc'd buffer, that
+ is large enough to go out with MSG_ZEROCOPY. SO_ZEROCOPY is turned on
+ with the first one. Returns false to leave it to be copied: too small,
+ on a ring, which never sees the error queue, or the socket doesn't do
+ zerocopy, or no longer does.
+ */
+bool request_lend(request_s *req, void *block, const void *data, size_t len)
+{
+    if(len < OUTQ_ZEROCOPY_MIN || !req->loop || req->loop->ring || req->shm || req->closed)
+        return false;
+    if(!outq_zerocopy(&req->outq, req->fd))
+        return false;
+    
+    outq_borrow(&req->outq, data, len, free, block);
+    if(!req->flushing) {
+        req->flushing = true;
+        evloop_defer(req->loop->evloop, request_on_flush, req);
+    }
+    return true;
+}
 
-void table_insert_request(request_s *req)
+/*
+ Never 0, which means no session. The low bits hold the index of the loop
+ that owns the session so a PACKET_REESTAB can be sent straight there.
+ */
+uint64_t new_session_id(request_s *req)
 {
-    pthread_mutex_lock(&table_lock);
-    table_insert_request_(req, reqtable);
-    pthread_mutex_unlock(&table_lock);
+    uint64_t n = atomic_fetch_add_explicit(&session_counter, 1, memory_order_relaxed) + 1;
+    
+    return n << SESSION_LOOP_BITS | (req->loop ? (uint64_t)(req->loop - loops) : 0);
 }
 
-void table_insert_request_(request_s *req, request_s *base[])
+
+void request_attach(evloop_s *evloop, void *arg)
 {
-    request_s **prec =  &base[req->session_id % TABLE_SIZE],
-                        *rec = *prec;
+    request_s *req = arg;
     
-    if(rec) {
-        if(req->session_id == rec->session_id) {
-            log_error("Duplicate session_id detected. Illegal State.");
-        }
-        else {
-            table_insert_request_(req, rec->children);
-        }
-    }
-    else {
-        *prec = rec;
+    req->ev.on_event = request_on_event;
+    if(!evloop_add(evloop, req->fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &req->ev)) {
+        close(req->fd);
+        request_free(evloop, req);
+        return;
     }
+    evloop_timer_arm(evloop, &req->timer, HANDSHAKE_TIMEOUT);
 }
 
-
-void table_delete_request(request_s *req)
+void request_on_event(evloop_s *evloop, evhandler_s *h, uint32_t events)
 {
-    pthread_mutex_lock(&table_lock);
-    table_delete_request_(req, reqtable);
-    pthread_mutex_unlock(&table_lock);
+    request_s *req = CONTAINER_OF(h, request_s, ev);
+    
+    if(req->closed || req->state == REQ_DETACHED)
+        return;
+    if((events & EPOLLERR) && !outq_reap(&req->outq, req->fd)) {
+        if(request_detach(req))
+            return;
+        log_error("An error occured on socket %d for [%s].", req->fd, req->ipstr);
+        goto close;
+    }
+    if(req->shm) {
+        if(!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)))
+            return;
+        log_info("Client [%s] on socket %d disconnected.", req->ipstr, req->fd);
+        goto close;
+    }
+    if(req->state == REQ_RELAY) {
+        relay_run(req);
+        return;
+    }
+    
+    if(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+        if(!request_fill(req))
+            goto close;
+    }
+    if(events & EPOLLOUT) {
+        if(!request_flush(req))
+            goto close;
+    }
+    if(req->state == REQ_CLOSING && outq_empty(&req->outq))
+        goto close;
+    
+    request_touch(req);
+    return;
+    
+close:
+    request_close(req);
 }
 
-void table_delete_request_(request_s *req, request_s *base[])
+/*
+ Reads until the socket would block. Returns false once the peer has
+ gone away or the connection should otherwise be torn down.
+ */
+bool request_fill(request_s *req)
 {
-    int i;
-    request_s **prec =  &base[req->session_id % TABLE_SIZE],
-                        *rec = *prec;
-
-    if(rec) {
-        if(rec->session_id == req->session_id) {
-            for(i = 0; i < TABLE_SIZE; i++) {
-                if(rec->children[i]) {
-                    reparent(rec->children[i]);
-                }
-            }
-            free(rec);
-            *prec = NULL;
+    char buf[BUF_SIZE];
+    ssize_t status;
+    
+    if(req->shm)
+        return request_shm_fill(req);
+    for(;;) {
+        /* Left in the socket for the relay to pick up */
+        if(req->state == REQ_CONNECTING || req->state == REQ_RESUMING || req->state == REQ_AUTHENTICATING)
+            return true;
+        
+        status = read(req->fd, buf, sizeof(buf));
+        if(status > 0) {
+            request_input(req, buf, status);
+            if(req->state == REQ_CLOSING)
+                return true;
         }
-        else {
-            table_delete_request_(req, rec->children);
+        else if(status == 0) {
+            log_info("Client [%s] on socket %d disconnected.", req->ipstr, req->fd);
+            return false;
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return true;
+        }
+        else if(errno != EINTR) {
+            log_error("An error occured while trying to read on socket %d. Errno: %d.", req->fd, errno);
+            return false;
         }
     }
 }
 
-void reparent(request_s *root)
+bool request_flush(request_s *req)
 {
-    int i;
+    if(req->shm)
+        return request_shm_flush(req);
+    if(outq_flush(&req->outq, req->fd))
+        return true;
+    log_error("Write failed on socket: %d.", req->fd);
+    return false;
+}
     
-    for(i = 0; i < TABLE_SIZE; i++) {
-        if(root->children[i]) {
-            reparent(root->children[i]);
-        }
-        root->children[i] = NULL;
+void request_on_flush(evloop_s *evloop, void *arg)
+{
+    request_s *req = arg;
+    bool flushed;
+    
+    req->flushing = false;
+    if(req->closed)
+        return;
+    
+    /* Once relaying, the client socket is on epoll whatever the engine */
+    if(req->loop->ring && !req->relay_live)
+        flushed = request_uring_flush(req);
+    else
+        flushed = request_flush(req);
+    if(!flushed) {
+        request_close(req);
+        return;
+    }
+    if(req->state == REQ_CLOSING && !req->wflight && outq_empty(&req->outq))
+        request_close(req);
+}
+
+/*
+ The channel's counterpart to request_on_event. A kick can mean data to
+ read or room to write, so both are tried.
+ */
+void request_on_shm(evloop_s *evloop, evhandler_s *h, uint32_t events)
+{
+    request_s *req = CONTAINER_OF(h, request_s, sev);
+    
+    if(req->closed)
+        return;
+    shm_ack(req->shm);
+    if(req->state == REQ_RELAY) {
+        relay_run(req);
+        return;
     }
-    table_insert_request(root);
+    
+    if(!request_shm_fill(req) || !request_shm_flush(req)) {
+        request_close(req);
+        return;
+    }
+    if(req->state == REQ_CLOSING && outq_empty(&req->outq))
+        request_close(req);
+    else
+        request_touch(req);
+}
+
+/* request_fill, reading the ring in place. */
+bool request_shm_fill(request_s *req)
+{
+    const char *data;
+    size_t len;
+    
+    while(req->state == REQ_ESTABLISHED || req->state == REQ_MUX) {
+        data = shm_peek(req->shm, &len);
+        if(req->shm->broken) {
+            log_warn("Shared memory channel of [%s] corrupted.", req->ipstr);
+            return false;
+        }
+        if(len) {
+            request_input(req, data, len);
+            shm_consume(req->shm, len);
+        }
+        else if(shm_eof(req->shm)) {
+            log_info("Client [%s] closed its shared memory channel.", req->ipstr);
+            return false;
+        }
+        else if(!shm_wait_read(req->shm)) {
+            return true;
+        }
+    }
+    return true;
+}
+
+/* Copies the output queue into the ring, whatever doesn't fit waits for a kick. */
+bool request_shm_flush(request_s *req)
+{
+    struct iovec *iov;
+    size_t n, sent;
+    unsigned i;
+    bool full;
+    
+    while(!outq_empty(&req->outq)) {
+        outq_prepare(&req->outq);
+        iov = req->outq.msg.msg_iov;
+        for(i = 0, sent = 0, full = false; i < req->outq.msg.msg_iovlen && !full; i++) {
+            n = shm_write(req->shm, iov[i].iov_base, iov[i].iov_len);
+            sent += n;
+            full = n < iov[i].iov_len;
+        }
+        outq_sent(&req->outq, sent, 0);
+        if(req->shm->broken) {
+            log_warn("Shared memory channel of [%s] corrupted.", req->ipstr);
+            return false;
+        }
+        if(full && !shm_wait_write(req->shm))
+            return true;
+    }
+    return true;
+}
+
+void request_close(request_s *req)
+{
+    loopctx_s *ctx = req->loop;
+    
+    if(req->closed)
+        return;
+    req->closed = true;
+    timer_cancel(&req->timer);
+    timer_cancel(&req->expiry);
+    session_remove(req);
+    if(req->relay_live)
+        relay_untrack(req);
+    if(req->mux)
+        mux_close(req->mux);
+    if(req->backend)
+        backend_release(req->backend);
+    
+    if(req->upfd >= 0) {
+        evloop_del(ctx->evloop, req->upfd);
+        close(req->upfd);
+        relay_dir_destroy(&req->up);
+        relay_dir_destroy(&req->down);
+    }
+    
+    /* The client still has the rings mapped and reads what was left in them */
+    if(req->shm) {
+        evloop_del(ctx->evloop, req->shm->wake);
+        shm_channel_destroy(req->shm);
+        free(req->shm);
+        req->shm = NULL;
+    }
+    
+    /* Detached, the client socket is already gone */
+    if(req->fd < 0) {
+        evloop_defer(ctx->evloop, request_free, req);
+        return;
+    }
+    
+    if(ctx->ring) {
+        if(req->relay_live)
+            evloop_del(ctx->evloop, req->fd);
+        if(req->rarmed)
+            uring_cancel(ctx->ring, &req->rop);
+        shutdown(req->fd, SHUT_RDWR);
+        request_release(req);
+        return;
+    }
+    
+    evloop_del(ctx->evloop, req->fd);
+    close(req->fd);
+    /* Otherwise freed when the login job comes back */
+    if(!req->working)
+        evloop_defer(ctx->evloop, request_free, req);
+}
+
+/* Deferred so events later in the same batch can still see req->closed */
+void request_free(evloop_s *evloop, void *arg)
+{
+    request_s *req = arg;
+    
+    outq_destroy(&req->outq);
+    free(req->held);
+    if(req->mux)
+        mux_destroy(req->mux);
+    if(req->loop)
+        atomic_fetch_sub_explicit(&req->loop->live, 1, memory_order_relaxed);
+    slab_free(req->loop ? req->loop->reqs : thread_reqs, req);
+}
+
+/* Only stamps the time, the idle timer catches up when it next fires. */
+void request_touch(request_s *req)
+{
+    req->last_active = evloop_time(req->loop->evloop);
+}
+
+void request_on_timeout(timer_s *t, uint64_t now)
+{
+    request_s *req = CONTAINER_OF(t, request_s, timer);
+    
+    if(req->state == REQ_HANDSHAKE || req->state == REQ_AUTHENTICATING) {
+        log_warn("Handshake with [%s] on socket %d timed out.", req->ipstr, req->fd);
+    }
+    else if(req->state == REQ_DETACHED) {
+        log_info("Session %lu for [%s] was not resumed in time.", (unsigned long)req->session_id, req->ipstr);
+    }
+    else if(now - req->last_active < MAX_TIMEOUT) {
+        evloop_timer_arm(req->loop->evloop, t, MAX_TIMEOUT - (unsigned)(now - req->last_active));
+        return;
+    }
+    else {
+        log_error("Attempt to read on socket %d timed out.", req->fd);
+        if(req->state == REQ_CONNECTING && req->backend)
+            balancer_fail(balancer, req->backend, now);
+    }
+    request_close(req);
+}
+
+void request_on_expiry(timer_s *t, uint64_t now)
+{
+    request_s *req = CONTAINER_OF(t, request_s, expiry);
+    
+    log_info("Session %lu for [%s] expired.", (unsigned long)req->session_id, req->ipstr);
+    request_close(req);
+}
+
+/* Whether a relay error came from the client's side, which is gone for good. */
+bool request_client_lost(request_s *req)
+{
+    struct pollfd pfd = {.fd = req->fd, .events = 0};
+    
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLHUP | POLLERR));
+}
+
+/*
+ Drops the client socket of a relaying session but holds on to the remote,
+ so the client can come back with a PACKET_REESTAB. Returns false if the
+ session can't be held. Whatever was in flight to the old socket is lost,
+ which a compressed stream can't survive.
+ */
+bool request_detach(request_s *req)
+{
+    loopctx_s *ctx = req->loop;
+    
+    if(req->state != REQ_RELAY || !req->relay_live || !req->session_id || req->compress || req->shm)
+        return false;
+    
+    log_info("Client [%s] dropped session %lu, holding it for resumption.", req->ipstr, (unsigned long)req->session_id);
+    evloop_del(ctx->evloop, req->fd);
+    close(req->fd);
+    req->fd = -1;
+    outq_destroy(&req->outq);
+    outq_init(&req->outq, ctx->chunks);
+    req->state = REQ_DETACHED;
+    evloop_timer_arm(ctx->evloop, &req->timer, RESUME_TIMEOUT);
+    return true;
+}
+
+/*
+ Sends a connection that asked to resume over to the loop that owns the
+ session. On io_uring that waits for its recv to be cancelled.
+ */
+void request_migrate(request_s *req)
+{
+    loopctx_s *ctx = req->loop;
+    
+    if(ctx->ring) {
+        if(req->rarmed || req->wflight)
+            return;
+    }
+    else {
+        evloop_del(ctx->evloop, req->fd);
+    }
+    timer_cancel(&req->timer);
+    
+    /* Anything still running this batch may yet look at req */
+    evloop_defer(ctx->evloop, request_handoff, req);
+}
+
+void request_handoff(evloop_s *evloop, void *arg)
+{
+    request_s *req = arg;
+    
+    /* Rejected after all, request_close has it */
+    if(req->closed)
+        return;
+    evloop_post(loops[req->resume_id & (SESSION_MAX_LOOPS - 1)].evloop, request_resume, req);
+}
+
+/*
+ Runs on the session's own loop, the only place its request can be looked
+ at safely. A session that still thinks its client is connected has that
+ connection replaced. The token is rotated on every resumption.
+ */
+void request_resume(evloop_s *evloop, void *arg)
+{
+    request_s *req = arg, *s;
+    char buf[FRAME_HEADER_MAX + SESSION_TOKEN_SIZE];
+    int one = 1;
+    size_t len;
+    
+    s = table_get(sessions, req->resume_id);
+    if(!s || s->closed || !token_equal(s->token, req->token) || (s->state != REQ_DETACHED && !request_detach(s))) {
+        log_warn("Refused to resume session %lu for [%s].", (unsigned long)req->resume_id, req->ipstr);
+        close(req->fd);
+        request_free(evloop, req);
+        return;
+    }
+    
+    s->fd = req->fd;
+    s->client_ip = req->client_ip;
+    memcpy(s->ipstr, req->ipstr, sizeof s->ipstr);
+    s->ev.on_event = request_on_event;
+    s->state = REQ_RELAY;
+    if(req->inlen)
+        relay_carry(&s->up, req->in, req->inlen);
+    request_free(evloop, req);
+    
+    if(!evloop_add(evloop, s->fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &s->ev)) {
+        close(s->fd);
+        s->fd = -1;
+        request_close(s);
+        return;
+    }
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    /* The FIN, if the remote is done, has to be passed on again */
+    s->down.shut = false;
+    
+    if(!new_token(s)) {
+        request_close(s);
+        return;
+    }
+    len = frame_header(buf, PACKET_REESTAB, SESSION_TOKEN_SIZE);
+    memcpy(&buf[len], s->token, SESSION_TOKEN_SIZE);
+    request_send(s, buf, len + SESSION_TOKEN_SIZE);
+    
+    log_info("Resumed session %lu for [%s].", (unsigned long)s->session_id, s->ipstr);
+    request_touch(s);
+    evloop_timer_arm(evloop, &s->timer, MAX_TIMEOUT);
+    relay_run(s);
+}
+
+void upstream_on_event(evloop_s *evloop, evhandler_s *h, uint32_t events)
+{
+    request_s *req = CONTAINER_OF(h, request_s, uev);
+    char ack[FRAME_HEADER_MAX];
+    socklen_t len = sizeof(int);
+    int err = 0, one = 1;
+    
+    if(req->closed)
+        return;
+    if(req->state != REQ_CONNECTING) {
+        relay_run(req);
+        return;
+    }
+    
+    if(getsockopt(req->upfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+    if(err) {
+        log_warn("Failed to connect to remote for [%s]. Errno: %d.", req->ipstr, err);
+        if(req->backend)
+            balancer_fail(balancer, req->backend, evloop_time(evloop));
+        request_close(req);
+        return;
+    }
+    if(!(events & EPOLLOUT))
+        return;
+    if(req->backend && req->connect_at) {
+        balancer_report(balancer, req->backend, (unsigned)(evloop_time(evloop) - req->connect_at), evloop_time(evloop));
+        req->connect_at = 0;
+    }
+    
+    /* Relayed bytes go out as they come in, Nagle would only add delay */
+    setsockopt(req->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(req->upfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    req->state = REQ_RELAY;
+    if(!request_send(req, ack, frame_header(ack, PACKET_TX, 0))) {
+        request_close(req);
+        return;
+    }
+    relay_begin(req);
+}
+
+/*
+ Starts pumping once the remote is connected. On io_uring the client socket
+ is first moved off its multishot recv and into the epoll set, which has to
+ wait for the recv to be cancelled and the acknowledgement to go out.
+ */
+void relay_begin(request_s *req)
+{
+    loopctx_s *ctx = req->loop;
+    
+    if(req->relay_live || req->state != REQ_RELAY)
+        return;
+    
+    if(ctx->ring) {
+        if(req->rarmed || req->wflight || !outq_empty(&req->outq))
+            return;
+        req->ev.on_event = request_on_event;
+        if(!evloop_add(ctx->evloop, req->fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &req->ev)) {
+            request_close(req);
+            return;
+        }
+    }
+    req->relay_live = true;
+    relay_track(req);
+    relay_run(req);
+}
+
+/*
+ Either socket becoming ready can unblock either direction, so both are
+ pumped on every event. Nothing goes down to the client until the
+ acknowledgement has been written.
+ */
+void relay_run(request_s *req)
+{
+    relay_status_e up, down = RELAY_OK;
+    bool lost;
+    
+    if(!req->relay_live || req->state == REQ_DETACHED)
+        return;
+    
+    if(req->shm)
+        up = relay_from_ring(&req->up, req->shm, req->upfd);
+    else
+        up = relay_pump(&req->up, req->fd, req->upfd);
+    if(!outq_empty(&req->outq) && !request_flush(req))
+        up = RELAY_ERROR;
+    if(outq_empty(&req->outq))
+        down = req->shm ? relay_to_ring(&req->down, req->upfd, req->shm) : relay_pump(&req->down, req->upfd, req->fd);
+    if(req->backend && !req->answered)
+        relay_time_backend(req);
+    
+    if(req->up.corrupt) {
+        log_warn("Corrupt compressed stream from [%s] on socket %d.", req->ipstr, req->fd);
+        request_close(req);
+    }
+    else if(req->shm && req->shm->broken) {
+        log_warn("Shared memory channel of [%s] corrupted.", req->ipstr);
+        request_close(req);
+    }
+    else if(up == RELAY_ERROR || down == RELAY_ERROR) {
+        lost = request_client_lost(req);
+        if(lost && request_detach(req))
+            return;
+        if(!lost && req->backend)
+            balancer_fail(balancer, req->backend, evloop_time(req->loop->evloop));
+        log_warn("Relay for [%s] on socket %d failed. Errno: %d.", req->ipstr, req->fd, errno);
+        request_close(req);
+    }
+    else if(up == RELAY_DONE && down == RELAY_DONE) {
+        log_info("Relay for [%s] finished. Sent %lu bytes, received %lu bytes.", req->ipstr,
+                 (unsigned long)req->up.nbytes, (unsigned long)req->down.nbytes);
+        if(req->down.enc)
+            log_info("Compressed %lu bytes down to %lu for [%s].", (unsigned long)req->down.enc->in,
+                     (unsigned long)req->down.enc->out, req->ipstr);
+        request_close(req);
+    }
+    else {
+        request_touch(req);
+    }
+}
+
+/*
+ Time to first byte, from the first bytes the client's side sent up. A
+ backend that speaks first only has its connect timed.
+ */
+void relay_time_backend(request_s *req)
+{
+    uint64_t now = evloop_time(req->loop->evloop);
+    
+    if(!req->ask_at && req->up.nbytes)
+        req->ask_at = now;
+    if(!req->down.nbytes)
+        return;
+    req->answered = true;
+    if(req->ask_at)
+        balancer_report(balancer, req->backend, (unsigned)(now - req->ask_at), now);
+}
+
+void listener_arm(evloop_s *evloop, void *arg)
+{
+    loopctx_s *ctx = arg;
+    
+    if(ctx->udp)
+        udp_relay_arm(ctx->udp);
+    ctx->ulev.on_event = unix_on_event;
+    if(unix_fd >= 0 && !evloop_add(evloop, unix_fd, EPOLLIN | EPOLLET | EPOLLEXCLUSIVE, &ctx->ulev))
+        log_error("Event loop %u can't accept local clients.", evloop_id(evloop));
+    if(ctx->ring) {
+        ctx->aop.on_complete = listener_on_accept;
+        if(!uring_accept_multishot(ctx->ring, ctx->listen_fd, &ctx->aop))
+            log_error("Event loop %u can't accept connections.", evloop_id(evloop));
+        return;
+    }
+    
+    ctx->lev.on_event = listener_on_event;
+    if(!evloop_add(evloop, ctx->listen_fd, EPOLLIN | EPOLLET | (ctx->shared ? EPOLLEXCLUSIVE : 0), &ctx->lev)) {
+        log_error("Event loop %u can't accept connections.", evloop_id(evloop));
+    }
+}
+
+void loop_on_tick(evloop_s *evloop, void *arg)
+{
+    loopctx_s *ctx = arg;
+    
+    slab_log(ctx->reqs);
+    slab_log(ctx->chunks);
+    if(ctx->udp)
+        udp_log(ctx->udp);
+    if(ctx == loops)
+        admit_log();
+}
+
+void listener_on_event(evloop_s *evloop, evhandler_s *h, uint32_t events)
+{
+    loopctx_s *ctx = CONTAINER_OF(h, loopctx_s, lev);
+    request_s *req;
+    struct sockaddr_in client_ip;
+    socklen_t len;
+    int client_fd;
+    
+    for(;;) {
+        len = sizeof(client_ip);
+        client_fd = accept4(ctx->listen_fd, (struct sockaddr *)&client_ip, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(client_fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                log_error("Client failed on Connection Attempt. Errno: %d.", errno);
+            return;
+        }
+        
+        if(!admit_connection(client_fd, &client_ip, evloop_time(evloop)))
+            continue;
+        req = request_s_(ctx, client_fd, &client_ip);
+        
+        log_info("Client [%s] Connected with socket descriptor: %d.", req->ipstr, client_fd);
+        request_attach(evloop, req);
+    }
+}
+
+/*
+ Local clients have no address to limit by, only their logins are charged,
+ all to the same bucket. Accepted through epoll whatever the engine, from
+ there on they are handled like any other connection.
+ */
+void unix_on_event(evloop_s *evloop, evhandler_s *h, uint32_t events)
+{
+    loopctx_s *ctx = CONTAINER_OF(h, loopctx_s, ulev);
+    request_s *req;
+    struct sockaddr_in client_ip;
+    int client_fd;
+    
+    memset(&client_ip, 0, sizeof(client_ip));
+    for(;;) {
+        client_fd = accept4(unix_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(client_fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                log_error("Local client failed on Connection Attempt. Errno: %d.", errno);
+            return;
+        }
+        
+        req = request_s_(ctx, client_fd, &client_ip);
+        req->local = true;
+        strcpy(req->ipstr, "local");
+        
+        log_info("Client [%s] Connected with socket descriptor: %d.", req->ipstr, client_fd);
+        if(ctx->ring) {
+            request_arm_recv(req);
+            evloop_timer_arm(evloop, &req->timer, HANDSHAKE_TIMEOUT);
+        }
+        else {
+            request_attach(evloop, req);
+        }
+    }
+}
+
+void listener_on_accept(uring_s *ring, uring_op_s *op, int res, uint32_t flags)
+{
+    loopctx_s *ctx = CONTAINER_OF(op, loopctx_s, aop);
+    request_s *req;
+    struct sockaddr_in client_ip;
+    socklen_t len = sizeof(client_ip);
+    
+    if(!(flags & IORING_CQE_F_MORE) && isrunning && !ctx->draining && !uring_accept_multishot(ring, ctx->listen_fd, &ctx->aop)) {
+        log_error("Event loop %u stopped accepting connections.", evloop_id(ctx->evloop));
+    }
+    
+    if(res == -ECANCELED)
+        return;
+    if(res < 0) {
+        log_error("Client failed on Connection Attempt. Errno: %d.", -res);
+        return;
+    }
+    
+    memset(&client_ip, 0, sizeof(client_ip));
+    getpeername(res, (struct sockaddr *)&client_ip, &len);
+    
+    if(!admit_connection(res, &client_ip, evloop_time(ctx->evloop)))
+        return;
+    req = request_s_(ctx, res, &client_ip);
+    
+    log_info("Client [%s] Connected with socket descriptor: %d.", req->ipstr, res);
+    request_arm_recv(req);
+    evloop_timer_arm(ctx->evloop, &req->timer, HANDSHAKE_TIMEOUT);
+}
+
+void request_arm_recv(request_s *req)
+{
+    req->rop.on_complete = request_on_recv;
+    req->wop.on_complete = request_on_send;
+    req->rarmed = uring_recv_multishot(req->loop->ring, req->fd, &req->rop);
+}
+
+/*
+ Completions for the multishot recv. Data lands in a provided buffer that
+ goes straight back to the ring once the packet bytes have been consumed.
+ */
+void request_on_recv(uring_s *ring, uring_op_s *op, int res, uint32_t flags)
+{
+    request_s *req = CONTAINER_OF(op, request_s, rop);
+    
+    if(res > 0) {
+        if(!req->closed) {
+            request_input(req, uring_buffer(ring, flags), res);
+            if(req->state == REQ_CLOSING && !req->wflight && !req->flushing && outq_empty(&req->outq))
+                request_close(req);
+        }
+        uring_buffer_release(ring, flags);
+    }
+    else if(res == 0) {
+        if(req->state == REQ_CONNECTING || req->state == REQ_RELAY) {
+            req->up.eof = true;
+        }
+        else if(!req->closed) {
+            log_info("Client [%s] on socket %d disconnected.", req->ipstr, req->fd);
+            request_close(req);
+        }
+    }
+    else if(res != -ENOBUFS && res != -ECANCELED && !req->closed) {
+        log_error("An error occured while trying to read on socket %d. Errno: %d.", req->fd, -res);
+        request_close(req);
+    }
+    
+    if(!(flags & IORING_CQE_F_MORE))
+        req->rarmed = false;
+    
+    if(req->closed) {
+        request_release(req);
+        return;
+    }
+    if(req->state == REQ_CONNECTING || req->state == REQ_RELAY) {
+        if(!req->rarmed)
+            relay_begin(req);
+        return;
+    }
+    if(req->state == REQ_RESUMING) {
+        request_migrate(req);
+        return;
+    }
+    if(req->state == REQ_AUTHENTICATING)
+        return;
+    if(!req->rarmed)
+        request_arm_recv(req);
+    request_touch(req);
+}
+
+void request_on_send(uring_s *ring, uring_op_s *op, int res, uint32_t flags)
+{
+    request_s *req = CONTAINER_OF(op, request_s, wop);
+    
+    /* Never sent with MSG_ZEROCOPY, so nothing gets held back */
+    if(res > 0) {
+        outq_sent(&req->outq, res, 0);
+    }
+    else if(res < 0 && res != -ECANCELED && !req->closed) {
+        log_error("Write failed on socket: %d.", req->fd);
+        request_close(req);
+    }
+    req->wflight--;
+    
+    if(req->closed) {
+        request_release(req);
+        return;
+    }
+    
+    if(!outq_empty(&req->outq)) {
+        if(!request_uring_flush(req))
+            request_close(req);
+    }
+    else if(req->state == REQ_CLOSING)
+        request_close(req);
+    else if(req->state == REQ_RELAY)
+        relay_begin(req);
+}
+
+/*
+ Runs a read through the frame parser, straight out of the buffer it was
+ read into. Frames are only parsed up to the PACKET_TX, everything behind
+ it is the relayed stream.
+ */
+void request_input(request_s *req, const char *buf, size_t len)
+{
+    frame_chunk_s chunk;
+    
+    while(len && (req->state == REQ_HANDSHAKE || req->state == REQ_ESTABLISHED || req->state == REQ_MUX)) {
+        switch(frame_next(&req->parser, &buf, &len, &chunk)) {
+            case FRAME_MORE:
+                break;
+            case FRAME_CHUNK:
+                if(!request_frame(req, &chunk))
+                    req->state = REQ_CLOSING;
+                break;
+            case FRAME_ERROR:
+                log_warn("Malformed frame from [%s] on socket %d.", req->ipstr, req->fd);
+                req->state = REQ_CLOSING;
+                break;
+        }
+    }
+    
+    /* Raced the recv being cancelled or came in right behind the PACKET_TX */
+    if(len && (req->state == REQ_CONNECTING || req->state == REQ_RELAY) && !relay_feed(&req->up, buf, len)) {
+        log_warn("Corrupt compressed stream from [%s] on socket %d.", req->ipstr, req->fd);
+        req->state = REQ_CLOSING;
+    }
+    
+    /* Replayed once the password has been checked */
+    if(len && req->state == REQ_AUTHENTICATING)
+        request_hold(req, buf, len);
+    
+    /* Kept in in for the resumed relay, the client should be waiting on the ack */
+    if(len && req->state == REQ_RESUMING && !request_gather(req, buf, len))
+        req->state = REQ_CLOSING;
+}
+
+/*
+ Sends can't be allowed to overtake each other, so whatever is queued
+ while one is in flight goes out in the next one, from its completion.
+ Returns false if the send couldn't be submitted.
+ */
+bool request_uring_flush(request_s *req)
+{
+    int flags;
+    
+    if(req->wflight || outq_empty(&req->outq))
+        return true;
+    
+    flags = outq_prepare(&req->outq);
+    if(!uring_sendmsg(req->loop->ring, req->fd, &req->outq.msg, flags, &req->wop)) {
+        log_error("Failed to submit a write on socket: %d.", req->fd);
+        return false;
+    }
+    req->wflight++;
+    return true;
+}
+
+void request_release(request_s *req)
+{
+    if(req->rarmed || req->wflight || req->working)
+        return;
+    close(req->fd);
+    evloop_defer(req->loop->evloop, request_free, req);
+}
+
+/*
+ Starts a non-blocking connect to "host:port", with IPv6 hosts in brackets,
+ or to one of the configured backends if the remote is left empty. Only
+ numeric hosts are taken since a name lookup would stall every other
+ connection on the loop. Returns the socket or -1. A backend it went to is
+ left counted in *backend, and pooled says the socket is a spare that is
+ already connected.
+ */
+int open_remote(request_s *req, char *remote, backend_s **backend, bool *pooled)
+{
+    struct addrinfo hints, *res;
+    char *host, *port, label[BUF_SIZE + 2];
+    int status, fd;
+    
+    if(!*remote && balancer) {
+        *backend = balancer_pick(balancer, req->session_id, evloop_time(req->loop->evloop));
+        fd = connect_remote(req, (struct sockaddr *)&(*backend)->addr, (*backend)->addrlen, (*backend)->name, true, pooled);
+        if(fd < 0) {
+            balancer_fail(balancer, *backend, evloop_time(req->loop->evloop));
+            backend_release(*backend);
+            *backend = NULL;
+        }
+        return fd;
+    }
+    
+    if(!split_hostport(remote, &host, &port)) {
+        log_warn("Malformed remote address \"%s\" from [%s].", remote, req->ipstr);
+        return -1;
+    }
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    
+    status = getaddrinfo(host, port, &hints, &res);
+    if(status) {
+        log_warn("Failed to resolve remote %s:%s for [%s]: %s.", host, port, req->ipstr, gai_strerror(status));
+        return -1;
+    }
+    
+    snprintf(label, sizeof label, "%s:%s", host, port);
+    fd = connect_remote(req, res->ai_addr, res->ai_addrlen, label, false, pooled);
+    freeaddrinfo(res);
+    return fd;
+}
+
+int connect_remote(request_s *req, const struct sockaddr *addr, socklen_t addrlen, const char *label, bool backend, bool *pooled)
+{
+    loopctx_s *ctx = req->loop;
+    int fd;
+    
+    /* A pooled spare is already connected and skips straight to the relay */
+    fd = ctx->pool ? pool_get(ctx->pool, addr, addrlen, backend) : -1;
+    *pooled = fd >= 0;
+    if(!*pooled) {
+        fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+        if(fd < 0) {
+            log_error("Failed to create socket to remote for [%s]. Errno: %d.", req->ipstr, errno);
+            return -1;
+        }
+        if(connect(fd, addr, addrlen) < 0 && errno != EINPROGRESS) {
+            log_warn("Failed to connect to remote %s for [%s]. Errno: %d.", label, req->ipstr, errno);
+            close(fd);
+            return -1;
+        }
+    }
+    
+    log_info("Relaying [%s] to %s%s.", req->ipstr, label, *pooled ? " over a pooled connection" : "");
+    return fd;
+}
+
+bool resolve_remote(request_s *req, char *remote)
+{
+    loopctx_s *ctx = req->loop;
+    bool pooled;
+    int fd;
+    
+    fd = open_remote(req, remote, &req->backend, &pooled);
+    if(fd < 0)
+        return false;
+    if(req->backend && !pooled)
+        req->connect_at = evloop_time(ctx->evloop);
+    
+    /* A shared memory channel's rings do the buffering */
+    if(req->shm) {
+        relay_dir_init(&req->up, false, 0, 0);
+        relay_dir_init(&req->down, false, 0, 0);
+    }
+    else {
+        relay_dir_init(&req->up, !req->compress, ctx->hiwat, ctx->lowat);
+        relay_dir_init(&req->down, !req->compress, ctx->hiwat, ctx->lowat);
+    }
+    if(req->compress) {
+        relay_dir_decompress(&req->up);
+        relay_dir_compress(&req->down);
+    }
+    req->upfd = fd;
+    req->uev.on_event = upstream_on_event;
+    if(!evloop_add(ctx->evloop, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &req->uev))
+        return false;
+    
+    if(ctx->ring && req->rarmed)
+        uring_cancel(ctx->ring, &req->rop);
+    
+    req->state = REQ_CONNECTING;
+    return true;
+}
+
+/*
+ The connection stays on the handshake path for good, its streams'
+ remotes are read and written by the mux.
+ */
+bool request_mux(request_s *req, frame_chunk_s *chunk)
+{
+    if(!req->mux) {
+        req->mux = mux_s_(req->loop->evloop, balancer, req, mux_on_send, mux_on_lend, mux_on_connect);
+        req->state = REQ_MUX;
+        log_info("Multiplexing streams for [%s].", req->ipstr);
+    }
+    if(mux_input(req->mux, chunk))
+        return true;
+    log_warn("Stream protocol violated by [%s].", req->ipstr);
+    return false;
+}
+
+bool mux_on_send(void *owner, const void *data, size_t len)
+{
+    request_s *req = owner;
+    
+    request_touch(req);
+    return request_send(req, data, len);
+}
+
+bool mux_on_lend(void *owner, void *block, const void *data, size_t len)
+{
+    request_s *req = owner;
+    
+    if(!request_lend(req, block, data, len))
+        return false;
+    request_touch(req);
+    return true;
+}
+
+int mux_on_connect(void *owner, char *remote, backend_s **backend, bool *pooled)
+{
+    return open_remote(owner, remote, backend, pooled);
+}
+
+void session_remove(request_s *req)
+{
+    if(req->session_id)
+        table_remove(sessions, req->session_id);
+}
+
+/*
+ Binds are charged like logins. The token can only be looked at on the
+ loop that owns the session, the low bits of its id say which.
+ */
+void udp_on_bind(evloop_s *loop, udp_flow_s *flow, uint64_t session_id, const char *token, const struct sockaddr_in *client)
+{
+    udp_check_s *check;
+    
+    if((auth_admit && !admit_take(auth_admit, client->sin_addr.s_addr, evloop_time(loop))) ||
+       (session_id & (SESSION_MAX_LOOPS - 1)) >= nloops) {
+        udp_verified(flow, false);
+        return;
+    }
+    
+    check = del_alloc(sizeof *check);
+    check->flow = flow;
+    check->from = loop;
+    check->session_id = session_id;
+    memcpy(check->token, token, SESSION_TOKEN_SIZE);
+    evloop_post(loops[session_id & (SESSION_MAX_LOOPS - 1)].evloop, udp_check, check);
+}
+
+/* Any logged in session will do, detached ones included. */
+void udp_check(evloop_s *evloop, void *arg)
+{
+    udp_check_s *check = arg;
+    request_s *s = table_get(sessions, check->session_id);
+    
+    check->ok = s && !s->closed && token_equal(s->token, check->token);
+    evloop_post(check->from, udp_on_checked, check);
+}
+
+void udp_on_checked(evloop_s *evloop, void *arg)
+{
+    udp_check_s *check = arg;
+    
+    udp_verified(check->flow, check->ok);
+    free(check);
+}
+
+void relay_track(request_s *req)
+{
+    loopctx_s *ctx = req->loop;
+    
+    req->prev = NULL;
+    req->next = ctx->relays;
+    if(ctx->relays)
+        ctx->relays->prev = req;
+    ctx->relays = req;
+}
+
+void relay_untrack(request_s *req)
+{
+    if(req->prev)
+        req->prev->next = req->next;
+    else
+        req->loop->relays = req->next;
+    if(req->next)
+        req->next->prev = req->prev;
+}
+
+/* The control socket blocks, but never for long */
+void upgrade_timeouts(int fd)
+{
+    struct timeval timeout = {.tv_sec = UPGRADE_TIMEOUT / 1000};
+    
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+/*
+ Receives one control message into msg and its descriptors into fds.
+ Returns how many descriptors came with it, or -1 if the message is
+ malformed or has the wrong number for its type, which are then closed.
+ */
+int upgrade_recv(int fd, upgrade_msg_s *msg, int *fds)
+{
+    unsigned nfds, want, i;
+    ssize_t len = handoff_recv(fd, msg, sizeof *msg, fds, &nfds);
+    
+    if(len != sizeof *msg || msg->version != UPGRADE_VERSION)
+        goto error;
+    switch(msg->type) {
+        case UPGRADE_LISTENER:
+            want = 1;
+            break;
+        case UPGRADE_SESSION:
+            want = msg->detached ? 1 : 2;
+            break;
+        default:
+            want = 0;
+            break;
+    }
+    if(nfds == want)
+        return (int)nfds;
+    
+error:
+    for(i = 0; i < nfds; i++)
+        close(fds[i]);
+    return -1;
+}
+
+/* New process, before the loops start. */
+bool upgrade_take(int fd, upgrade_msg_s *hello, int *lfds)
+{
+    upgrade_msg_s msg = {.version = UPGRADE_VERSION, .type = UPGRADE_TAKE};
+    int fds[HANDOFF_MAX_FDS];
+    unsigned i;
+    
+    upgrade_timeouts(fd);
+    if(!handoff_send(fd, &msg, sizeof msg, NULL, 0))
+        return false;
+    if(upgrade_recv(fd, hello, fds) < 0 || hello->type != UPGRADE_HELLO)
+        return false;
+    if(!hello->nlisteners || hello->nlisteners > SESSION_MAX_LOOPS || hello->nloops > SESSION_MAX_LOOPS)
+        return false;
+    
+    for(i = 0; i < hello->nlisteners; i++) {
+        if(upgrade_recv(fd, &msg, fds) < 0 || msg.type != UPGRADE_LISTENER) {
+            while(i)
+                close(lfds[--i]);
+            return false;
+        }
+        lfds[i] = fds[0];
+    }
+    return true;
+}
+
+/*
+ New process, once the loops are running. Each session is posted to the
+ loop its id names until the old process is done.
+ */
+void upgrade_adopt(int fd)
+{
+    upgrade_session_s *s;
+    upgrade_msg_s msg;
+    int fds[HANDOFF_MAX_FDS], n;
+    unsigned count = 0, idx;
+    
+    for(;;) {
+        n = upgrade_recv(fd, &msg, fds);
+        if(n < 0) {
+            log_warn("Lost the connection to the previous server partway through.");
+            break;
+        }
+        if(msg.type == UPGRADE_DONE)
+            break;
+        if(msg.type != UPGRADE_SESSION) {
+            while(n)
+                close(fds[--n]);
+            continue;
+        }
+        
+        idx = msg.session_id & (SESSION_MAX_LOOPS - 1);
+        if(idx >= nloops) {
+            while(n)
+                close(fds[--n]);
+            continue;
+        }
+        s = del_alloc(sizeof *s);
+        s->msg = msg;
+        s->upfd = fds[0];
+        s->fd = n > 1 ? fds[1] : -1;
+        evloop_post(loops[idx].evloop, request_adopt, s);
+        count++;
+    }
+    close(fd);
+    log_info("Took over %u sessions from the previous server.", count);
+}
+
+void upgrade_listen(const char *path)
+{
+    upgrade_fd = handoff_listen(path);
+    if(upgrade_fd < 0) {
+        log_error("Failed to listen for upgrades on %s. Errno: %d.", path, errno);
+        return;
+    }
+    evloop_post(loops[0].evloop, upgrade_arm, NULL);
+}
+
+void upgrade_arm(evloop_s *evloop, void *arg)
+{
+    upgrade_ev.on_event = upgrade_on_event;
+    if(!evloop_add(evloop, upgrade_fd, EPOLLIN | EPOLLET, &upgrade_ev))
+        log_error("Hot upgrades are unavailable.");
+}
+
+/*
+ Old process, on loop 0. The exchange up to the listeners is short and
+ done blocking, then every loop is told to stop accepting and pass on its
+ relays. The last one to finish starts the drain.
+ */
+void upgrade_on_event(evloop_s *evloop, evhandler_s *h, uint32_t events)
+{
+    upgrade_msg_s msg;
+    int fds[HANDOFF_MAX_FDS];
+    unsigned i;
+    int fd;
+    
+    while(upgrade_fd >= 0 && (fd = accept4(upgrade_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        upgrade_timeouts(fd);
+        if(upgrade_recv(fd, &msg, fds) < 0 || msg.type != UPGRADE_TAKE || !upgrade_give(fd)) {
+            log_warn("Failed to hand the server over.");
+            close(fd);
+            continue;
+        }
+        
+        log_info("Handing the server over to a new process.");
+        evloop_del(evloop, upgrade_fd);
+        close(upgrade_fd);
+        upgrade_fd = -1;
+        upgrade_ctl = fd;
+        atomic_store(&upgrade_left, nloops);
+        for(i = 0; i < nloops; i++)
+            evloop_post(loops[i].evloop, upgrade_loop, &loops[i]);
+    }
+}
+
+bool upgrade_give(int fd)
+{
+    upgrade_msg_s msg;
+    unsigned i;
+    
+    memset(&msg, 0, sizeof msg);
+    msg.version = UPGRADE_VERSION;
+    msg.type = UPGRADE_HELLO;
+    msg.nloops = nloops;
+    msg.shared = loops[0].shared;
+    msg.nlisteners = msg.shared ? 1 : nloops;
+    msg.counter = atomic_load(&session_counter);
+    if(!handoff_send(fd, &msg, sizeof msg, NULL, 0))
+        return false;
+    
+    msg.type = UPGRADE_LISTENER;
+    for(i = 0; i < msg.nlisteners; i++) {
+        if(!handoff_send(fd, &msg, sizeof msg, &loops[i].listen_fd, 1))
+            return false;
+    }
+    return true;
+}
+
+void upgrade_loop(evloop_s *evloop, void *arg)
+{
+    loopctx_s *ctx = arg;
+    request_s *req, *next;
+    unsigned count = 0;
+    upgrade_msg_s msg;
+    
+    ctx->draining = true;
+    if(ctx->ring)
+        uring_cancel(ctx->ring, &ctx->aop);
+    else
+        evloop_del(evloop, ctx->listen_fd);
+    if(unix_fd >= 0)
+        evloop_del(evloop, unix_fd);
+    
+    /* Datagram flows can't be handed over, their clients bind again with the new process */
+    if(ctx->udp)
+        udp_relay_close(ctx->udp);
+    
+    for(req = ctx->relays; req; req = next) {
+        next = req->next;
+        if(!request_transferable(req))
+            continue;
+        if(!request_hand_over(req))
+            break;
+        count++;
+    }
+    log_info("Event loop %u handed %u sessions over.", evloop_id(evloop), count);
+    
+    if(atomic_fetch_sub(&upgrade_left, 1) != 1)
+        return;
+    memset(&msg, 0, sizeof msg);
+    msg.version = UPGRADE_VERSION;
+    msg.type = UPGRADE_DONE;
+    handoff_send(upgrade_ctl, &msg, sizeof msg, NULL, 0);
+    close(upgrade_ctl);
+    upgrade_ctl = -1;
+    evloop_post(loops[0].evloop, drain_start, NULL);
+}
+
+/*
+ Only a relay with nothing buffered on either side can move, so no byte
+ is left behind in this process. The rest drain here, as do compressed
+ relays, their stream history doesn't travel, and shared memory ones.
+ */
+bool request_transferable(request_s *req)
+{
+    if(req->closed || !req->session_id || (req->state != REQ_RELAY && req->state != REQ_DETACHED))
+        return false;
+    if(req->compress || req->shm)
+        return false;
+    if(req->flushing || req->wflight || !outq_empty(&req->outq))
+        return false;
+    if(req->up.eof || req->down.eof || req->up.shut || req->down.shut)
+        return false;
+    return !relay_buffered(&req->up) && !relay_buffered(&req->down);
+}
+
+/* The sockets are only closed here, shutting them down would end the relay for the new process too. */
+bool request_hand_over(request_s *req)
+{
+    loopctx_s *ctx = req->loop;
+    upgrade_msg_s msg;
+    int fds[2] = {req->upfd, req->fd};
+    uint64_t now = evloop_time(ctx->evloop);
+    
+    memset(&msg, 0, sizeof msg);
+    msg.version = UPGRADE_VERSION;
+    msg.type = UPGRADE_SESSION;
+    msg.session_id = req->session_id;
+    memcpy(msg.token, req->token, SESSION_TOKEN_SIZE);
+    msg.client_ip = req->client_ip;
+    msg.sent = req->up.nbytes;
+    msg.received = req->down.nbytes;
+    msg.lifetime = timer_armed(&req->expiry) && req->expiry.expires > now ? req->expiry.expires - now : 0;
+    msg.detached = req->fd < 0;
+    if(!handoff_send(upgrade_ctl, &msg, sizeof msg, fds, msg.detached ? 1 : 2)) {
+        log_error("Failed to hand session %lu over. Errno: %d.", (unsigned long)req->session_id, errno);
+        return false;
+    }
+    
+    evloop_del(ctx->evloop, req->upfd);
+    close(req->upfd);
+    req->upfd = -1;
+    relay_dir_destroy(&req->up);
+    relay_dir_destroy(&req->down);
+    if(req->fd >= 0) {
+        evloop_del(ctx->evloop, req->fd);
+        close(req->fd);
+        req->fd = -1;
+    }
+    request_close(req);
+    return true;
+}
+
+/* Picks a relay up where the previous process left it. */
+void request_adopt(evloop_s *evloop, void *arg)
+{
+    upgrade_session_s *s = arg;
+    loopctx_s *ctx = &loops[s->msg.session_id & (SESSION_MAX_LOOPS - 1)];
+    request_s *req = request_s_(ctx, s->fd, &s->msg.client_ip);
+    struct sockaddr_storage peer;
+    socklen_t peerlen = sizeof peer;
+    uint64_t lifetime = s->msg.lifetime;
+    
+    req->session_id = s->msg.session_id;
+    memcpy(req->token, s->msg.token, SESSION_TOKEN_SIZE);
+    relay_dir_init(&req->up, true, ctx->hiwat, ctx->lowat);
+    relay_dir_init(&req->down, true, ctx->hiwat, ctx->lowat);
+    req->up.nbytes = s->msg.sent;
+    req->down.nbytes = s->msg.received;
+    req->upfd = s->upfd;
+    if(balancer && !getpeername(req->upfd, (struct sockaddr *)&peer, &peerlen))
+        req->backend = balancer_claim(balancer, (struct sockaddr *)&peer, peerlen);
+    req->state = req->fd >= 0 ? REQ_RELAY : REQ_DETACHED;
+    req->relay_live = true;
+    relay_track(req);
+    free(s);
+    
+    req->uev.on_event = upstream_on_event;
+    req->ev.on_event = request_on_event;
+    if(!evloop_add(evloop, req->upfd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &req->uev) ||
+       (req->fd >= 0 && !evloop_add(evloop, req->fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &req->ev))) {
+        req->session_id = 0;
+        request_close(req);
+        return;
+    }
+    table_insert(sessions, req->session_id, req);
+    
+    request_touch(req);
+    evloop_timer_arm(evloop, &req->timer, req->fd >= 0 ? MAX_TIMEOUT : RESUME_TIMEOUT);
+    if(lifetime)
+        evloop_timer_arm(evloop, &req->expiry, (unsigned)lifetime);
+    log_info("Adopted session %lu for [%s].", (unsigned long)req->session_id, req->ipstr);
+    relay_run(req);
+}
+
+void drain_start(evloop_s *evloop, void *arg)
+{
+    drain_deadline = evloop_time(evloop) + DRAIN_TIMEOUT;
+    timer_init(&drain_timer, drain_on_timer);
+    evloop_timer_arm(evloop, &drain_timer, DRAIN_CHECK);
+}
+
+/* Stops every loop once the last connection is gone, or the deadline passes. */
+void drain_on_timer(timer_s *t, uint64_t now)
+{
+    size_t live = 0;
+    unsigned i;
+    
+    for(i = 0; i < nloops; i++)
+        live += atomic_load_explicit(&loops[i].live, memory_order_relaxed);
+    if(live && now < drain_deadline) {
+        evloop_timer_arm(loops[0].evloop, t, DRAIN_CHECK);
+        return;
+    }
+    
+    if(live)
+        log_warn("Gave up draining, dropping %lu connections.", (unsigned long)live);
+    else
+        log_info("Drained, shutting down.");
+    isrunning = false;
+    for(i = 0; i < nloops; i++)
+        evloop_stop(loops[i].evloop);
 }
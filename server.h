@@ -3,10 +3,54 @@
 #define __TCPDelegate__server__
 
 #include "general.h"
+#include "balance.h"
 
-#define MAX_CLIENTS 20
 #define DEFAULT_PORT 13370
+#define DEFAULT_BACKLOG 1024
+#define DEFAULT_NLOOPS 0    /* one per usable cpu */
+#define DEFAULT_HIWAT (256 * 1024)
+#define DEFAULT_LOWAT (64 * 1024)
+#define DEFAULT_CONN_RATE 200       /* connections a second per client address */
+#define DEFAULT_CONN_BURST 1000
+#define DEFAULT_AUTH_RATE 50        /* login and resume attempts a second per client address */
+#define DEFAULT_AUTH_BURST 500
 
-extern void server_start(uint16_t port);
+typedef enum server_mode_e server_mode_e;
+typedef enum server_engine_e server_engine_e;
+typedef struct server_conf_s server_conf_s;
+
+enum server_mode_e {
+    SERVER_MODE_THREAD,     /* legacy: one thread per connection */
+    SERVER_MODE_EVLOOP      /* fixed set of event loops */
+};
+
+enum server_engine_e {
+    SERVER_ENGINE_EPOLL,
+    SERVER_ENGINE_URING     /* falls back to epoll if the kernel can't */
+};
+
+struct server_conf_s {
+    uint16_t port;
+    server_mode_e mode;
+    server_engine_e engine;
+    unsigned nloops;
+    int backlog;
+    bool reuseport;         /* one SO_REUSEPORT listener per loop */
+    bool pin;               /* pin each loop to its own cpu */
+    unsigned pool_warm;     /* spare upstream connections per remote, 0 disables */
+    size_t hiwat, lowat;    /* relay buffering per direction, see relay_dir_s */
+    bool hugepages;         /* back the per-loop slabs with hugepages */
+    unsigned workers;       /* threads for CPU heavy jobs, 0 for one per cpu */
+    unsigned conn_rate, conn_burst;     /* per client address, a rate of 0 disables */
+    unsigned auth_rate, auth_burst;
+    const char *backends;       /* "host:port,..." relayed to when a client names no remote */
+    balance_policy_e balance;
+    const char *upgrade_path;   /* control socket to take over from and hand over on, NULL disables */
+    uint16_t udp_port;          /* datagrams relayed for logged in sessions, 0 disables */
+    const char *unix_path;      /* Unix socket for co-located clients, NULL disables */
+};
+
+extern void server_conf_init(server_conf_s *conf);
+extern void server_start(server_conf_s *conf);
 
 #endif /* defined(__TCPDelegate__Server__) */
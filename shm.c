@@ -0,0 +1,196 @@
+#include "shm.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#define SHM_MASK (SHM_RING_SIZE - 1)
+#define SHM_MAP_SIZE (SHM_HEADER + 2 * (size_t)SHM_RING_SIZE)
+
+static bool shm_map(shm_channel_s *c, int fd, bool server);
+static void shm_kick(shm_channel_s *c, _Atomic uint32_t *waiting);
+
+int shm_channel_create(shm_channel_s *c)
+{
+    int fd;
+    
+    memset(c, 0, sizeof *c);
+    c->wake = c->kick = -1;
+    
+    fd = memfd_create("tcpd-channel", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(fd < 0)
+        return -1;
+    if(ftruncate(fd, SHM_MAP_SIZE) < 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0 ||
+       !shm_map(c, fd, true))
+        goto fail;
+    
+    c->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    c->kick = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(c->wake < 0 || c->kick < 0)
+        goto fail;
+    
+    /* Whichever end writes first kicks the other */
+    atomic_store(&c->rx->reader_waiting, 1);
+    atomic_store(&c->tx->reader_waiting, 1);
+    return fd;
+    
+fail:
+    close(fd);
+    shm_channel_destroy(c);
+    return -1;
+}
+
+bool shm_channel_attach(shm_channel_s *c, const int *fds)
+{
+    struct stat st;
+    bool ok;
+    
+    memset(c, 0, sizeof *c);
+    c->wake = fds[1];
+    c->kick = fds[2];
+    
+    /* A short mapping would fault on the first touch past its end */
+    ok = fstat(fds[0], &st) == 0 && (size_t)st.st_size >= SHM_MAP_SIZE && shm_map(c, fds[0], false);
+    close(fds[0]);
+    if(!ok)
+        return false;
+    c->rxtail = atomic_load(&c->rx->tail);
+    c->txhead = atomic_load(&c->tx->head);
+    return true;
+}
+
+void shm_channel_destroy(shm_channel_s *c)
+{
+    if(c->map)
+        munmap(c->map, SHM_MAP_SIZE);
+    if(c->wake >= 0)
+        close(c->wake);
+    if(c->kick >= 0)
+        close(c->kick);
+    c->map = NULL;
+    c->wake = c->kick = -1;
+}
+
+/* The first ring runs from the server to the client, the second back. */
+bool shm_map(shm_channel_s *c, int fd, bool server)
+{
+    shm_ring_s *down, *up;
+    
+    c->map = mmap(NULL, SHM_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(c->map == MAP_FAILED) {
+        c->map = NULL;
+        return false;
+    }
+    down = (shm_ring_s *)c->map;
+    up = (shm_ring_s *)&c->map[SHM_HEADER / 2];
+    c->tx = server ? down : up;
+    c->rx = server ? up : down;
+    c->txdata = &c->map[SHM_HEADER + (server ? 0 : SHM_RING_SIZE)];
+    c->rxdata = &c->map[SHM_HEADER + (server ? SHM_RING_SIZE : 0)];
+    return true;
+}
+
+size_t shm_write(shm_channel_s *c, const void *data, size_t len)
+{
+    size_t room, n, done = 0;
+    char *p;
+    
+    while(done < len && (p = shm_reserve(c, &room))) {
+        n = len - done < room ? len - done : room;
+        memcpy(p, (const char *)data + done, n);
+        shm_commit(c, n);
+        done += n;
+    }
+    return done;
+}
+
+char *shm_reserve(shm_channel_s *c, size_t *room)
+{
+    uint64_t used = c->txhead - atomic_load_explicit(&c->tx->tail, memory_order_acquire);
+    size_t pos = c->txhead & SHM_MASK;
+    
+    if(used > SHM_RING_SIZE) {
+        c->broken = true;
+        used = SHM_RING_SIZE;
+    }
+    *room = SHM_RING_SIZE - used;
+    if(*room > SHM_RING_SIZE - pos)
+        *room = SHM_RING_SIZE - pos;
+    return *room ? &c->txdata[pos] : NULL;
+}
+
+void shm_commit(shm_channel_s *c, size_t len)
+{
+    c->txhead += len;
+    atomic_store(&c->tx->head, c->txhead);
+    shm_kick(c, &c->tx->reader_waiting);
+}
+
+void shm_close(shm_channel_s *c)
+{
+    atomic_store(&c->tx->closed, 1);
+    shm_kick(c, &c->tx->reader_waiting);
+}
+
+const char *shm_peek(shm_channel_s *c, size_t *len)
+{
+    uint64_t avail = atomic_load_explicit(&c->rx->head, memory_order_acquire) - c->rxtail;
+    size_t pos = c->rxtail & SHM_MASK;
+    
+    if(avail > SHM_RING_SIZE) {
+        c->broken = true;
+        avail = 0;
+    }
+    *len = avail < SHM_RING_SIZE - pos ? avail : SHM_RING_SIZE - pos;
+    return &c->rxdata[pos];
+}
+
+void shm_consume(shm_channel_s *c, size_t len)
+{
+    c->rxtail += len;
+    atomic_store(&c->rx->tail, c->rxtail);
+    shm_kick(c, &c->rx->writer_waiting);
+}
+
+/* closed is read first, the producer sets it only after its last head. */
+bool shm_eof(shm_channel_s *c)
+{
+    return atomic_load(&c->rx->closed) && atomic_load(&c->rx->head) == c->rxtail;
+}
+
+bool shm_wait_read(shm_channel_s *c)
+{
+    atomic_store(&c->rx->reader_waiting, 1);
+    return atomic_load(&c->rx->head) != c->rxtail || atomic_load(&c->rx->closed);
+}
+
+bool shm_wait_write(shm_channel_s *c)
+{
+    atomic_store(&c->tx->writer_waiting, 1);
+    return c->txhead - atomic_load(&c->tx->tail) < SHM_RING_SIZE;
+}
+
+void shm_ack(shm_channel_s *c)
+{
+    uint64_t n;
+    
+    while(read(c->wake, &n, sizeof n) < 0 && errno == EINTR)
+        ;
+}
+
+/*
+ The flag is set before the other end looks at the ring one last time, and
+ the ring was updated before it is looked at here, so at least one of the
+ two sees the other's write.
+ */
+void shm_kick(shm_channel_s *c, _Atomic uint32_t *waiting)
+{
+    uint64_t one = 1;
+    
+    if(atomic_load(waiting) && atomic_exchange(waiting, 0))
+        while(write(c->kick, &one, sizeof one) < 0 && errno == EINTR)
+            ;
+}
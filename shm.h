@@ -0,0 +1,88 @@
+
+#ifndef __TCPDelegate__shm__
+#define __TCPDelegate__shm__
+
+#include "general.h"
+
+#include <stdatomic.h>
+
+#define SHM_RING_SIZE (1 << 20)     /* bytes each way, a power of 2 */
+#define SHM_HEADER 4096             /* both rings' shm_ring_s, ahead of their data */
+#define SHM_FDS 3                   /* passed to the client, see shm_channel_create */
+
+typedef struct shm_ring_s shm_ring_s;
+typedef struct shm_channel_s shm_channel_s;
+
+/*
+ One direction of a channel, single producer and single consumer. head and
+ tail count bytes ever written and read, so the ring is empty when they are
+ equal and full when they are SHM_RING_SIZE apart. Either end asks to be
+ woken by setting its waiting flag and checking the ring once more, the
+ other end only writes to the eventfd when it finds the flag set, so a
+ busy channel makes no system calls at all.
+ */
+struct shm_ring_s {
+    _Alignas(64) _Atomic uint64_t head;     /* advanced by the producer */
+    _Alignas(64) _Atomic uint64_t tail;     /* and by the consumer */
+    _Alignas(64) _Atomic uint32_t reader_waiting;
+    _Atomic uint32_t writer_waiting;
+    _Atomic uint32_t closed;                /* the producer is done, like a FIN */
+};
+
+/*
+ A byte stream each way through memory shared with a co-located client,
+ carrying exactly what the socket would. Each end waits on its own eventfd
+ and kicks the other's. The mapping is sealed against resizing and every
+ index the other end writes is checked before use, a client can garble
+ its own stream but never reach outside the rings.
+ */
+struct shm_channel_s {
+    char *map;
+    shm_ring_s *rx, *tx;        /* the other end's writes, and ours */
+    char *rxdata, *txdata;
+    uint64_t rxtail, txhead;    /* ours, never read back from the shared copies */
+    int wake;                   /* eventfd the other end kicks us on */
+    int kick;
+    bool broken;                /* the other end corrupted a ring's indices */
+};
+
+/*
+ Server end. Returns the memfd to send along with kick and wake, in that
+ order, which the other end passes to shm_channel_attach. The memfd can be
+ closed once sent. Returns -1 on failure.
+ */
+extern int shm_channel_create(shm_channel_s *c);
+
+/* Client end, takes over fds as sent, the memfd is closed once mapped. */
+extern bool shm_channel_attach(shm_channel_s *c, const int *fds);
+
+extern void shm_channel_destroy(shm_channel_s *c);
+
+/* Copies in as much of data as fits, returns how much that was. */
+extern size_t shm_write(shm_channel_s *c, const void *data, size_t len);
+
+/* Free space to read straight into, up to the wrap, committed with shm_commit. */
+extern char *shm_reserve(shm_channel_s *c, size_t *room);
+extern void shm_commit(shm_channel_s *c, size_t len);
+
+/* No more writes, the other end reads EOF once it has the rest. */
+extern void shm_close(shm_channel_s *c);
+
+/* Bytes waiting to be read, up to the wrap, consumed with shm_consume. */
+extern const char *shm_peek(shm_channel_s *c, size_t *len);
+extern void shm_consume(shm_channel_s *c, size_t len);
+
+/* Everything has been read and the other end closed. */
+extern bool shm_eof(shm_channel_s *c);
+
+/*
+ Ask for a kick once there is something to read, or room to write. Return
+ true if there already is, then the caller goes again rather than wait.
+ */
+extern bool shm_wait_read(shm_channel_s *c);
+extern bool shm_wait_write(shm_channel_s *c);
+
+/* Clears the wake eventfd after a kick. */
+extern void shm_ack(shm_channel_s *c);
+
+#endif /* defined(__TCPDelegate__shm__) */
@@ -0,0 +1,180 @@
+#include "slab.h"
+
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+typedef struct slab_obj_s slab_obj_s;
+typedef struct slab_page_s slab_page_s;
+
+struct slab_obj_s {
+    slab_obj_s *next;
+};
+
+/* Sits in the first cache line of every page */
+struct slab_page_s {
+    slab_page_s *next;
+    size_t size;
+};
+
+struct slab_s {
+    const char *name;
+    size_t size;
+    size_t pagesize;
+    bool hugepages;
+    bool huge;
+    bool owned;
+    pthread_t owner;
+    slab_obj_s *free;
+    char *carve, *carve_end;    /* untouched space left in the newest page */
+    slab_page_s *pages;
+    uint64_t allocs, frees, carved;
+    size_t npages, mapped;
+    
+    /* Written by other threads, kept off the owner's cache lines */
+    _Alignas(SLAB_ALIGN) _Atomic(slab_obj_s *) remote;
+    _Atomic uint64_t remote_frees;
+};
+
+static void slab_grow(slab_s *slab);
+static size_t slab_round(size_t size, size_t to);
+
+slab_s *slab_s_(const char *name, size_t size, bool hugepages)
+{
+    slab_s *slab = aligned_alloc(SLAB_ALIGN, slab_round(sizeof *slab, SLAB_ALIGN));
+    
+    if(!slab) {
+        perror("Memory Allocation Error (aligned_alloc)");
+        exit(EXIT_FAILURE);
+    }
+    memset(slab, 0, sizeof *slab);
+    
+    slab->name = name;
+    slab->size = slab_round(size < sizeof(slab_obj_s) ? sizeof(slab_obj_s) : size, SLAB_ALIGN);
+    slab->hugepages = hugepages;
+    slab->pagesize = SLAB_ALIGN + slab->size * SLAB_MIN_OBJS;
+    if(slab->pagesize < SLAB_PAGE)
+        slab->pagesize = SLAB_PAGE;
+    slab->pagesize = slab_round(slab->pagesize, hugepages ? SLAB_HUGEPAGE : 4096);
+    atomic_init(&slab->remote, NULL);
+    atomic_init(&slab->remote_frees, 0);
+    return slab;
+}
+
+void slab_destroy(slab_s *slab)
+{
+    slab_page_s *page;
+    
+    while((page = slab->pages)) {
+        slab->pages = page->next;
+        munmap(page, page->size);
+    }
+    free(slab);
+}
+
+void *slab_alloc(slab_s *slab)
+{
+    slab_obj_s *obj;
+    
+    if(!slab->owned) {
+        slab->owner = pthread_self();
+        slab->owned = true;
+    }
+    
+    if(!slab->free)
+        slab->free = atomic_exchange_explicit(&slab->remote, NULL, memory_order_acquire);
+    
+    if((obj = slab->free)) {
+        slab->free = obj->next;
+    }
+    else {
+        if(slab->carve_end - slab->carve < (ptrdiff_t)slab->size)
+            slab_grow(slab);
+        obj = (slab_obj_s *)slab->carve;
+        slab->carve += slab->size;
+        slab->carved++;
+    }
+    slab->allocs++;
+    return obj;
+}
+
+void slab_free(slab_s *slab, void *p)
+{
+    slab_obj_s *obj = p, *head;
+    
+    if(!obj)
+        return;
+    
+    if(pthread_equal(slab->owner, pthread_self())) {
+        obj->next = slab->free;
+        slab->free = obj;
+        slab->frees++;
+        return;
+    }
+    
+    head = atomic_load_explicit(&slab->remote, memory_order_relaxed);
+    do {
+        obj->next = head;
+    } while(!atomic_compare_exchange_weak_explicit(&slab->remote, &head, obj, memory_order_release, memory_order_relaxed));
+    atomic_fetch_add_explicit(&slab->remote_frees, 1, memory_order_relaxed);
+}
+
+void slab_stats(slab_s *slab, slab_stats_s *stats)
+{
+    stats->allocs = slab->allocs;
+    stats->remote_frees = atomic_load_explicit(&slab->remote_frees, memory_order_relaxed);
+    stats->frees = slab->frees + stats->remote_frees;
+    stats->carved = slab->carved;
+    stats->live = stats->allocs > stats->frees ? stats->allocs - stats->frees : 0;
+    stats->pages = slab->npages;
+    stats->mapped = slab->mapped;
+    stats->huge = slab->huge;
+}
+
+void slab_log(slab_s *slab)
+{
+    slab_stats_s st;
+    
+    slab_stats(slab, &st);
+    log_debug("Slab %s: %lu live of %lu bytes, %lu allocs, %lu frees (%lu remote), %lu pages, %lu KB mapped%s.",
+             slab->name, (unsigned long)st.live, (unsigned long)slab->size, (unsigned long)st.allocs,
+             (unsigned long)st.frees, (unsigned long)st.remote_frees, (unsigned long)st.pages,
+             (unsigned long)(st.mapped / 1024), st.huge ? " on hugepages" : "");
+}
+
+/*
+ The tail of the previous page too small for another object is simply
+ dropped. Pages are touched an object at a time as they're carved, so
+ mapping a whole hugepage up front costs nothing until it's used.
+ */
+void slab_grow(slab_s *slab)
+{
+    slab_page_s *page = MAP_FAILED;
+    
+    if(slab->hugepages) {
+        page = mmap(NULL, slab->pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        slab->huge = page != MAP_FAILED;
+    }
+    if(page == MAP_FAILED) {
+        page = mmap(NULL, slab->pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(page == MAP_FAILED) {
+            perror("Memory Allocation Error (mmap)");
+            exit(EXIT_FAILURE);
+        }
+        if(slab->hugepages)
+            madvise(page, slab->pagesize, MADV_HUGEPAGE);
+    }
+    
+    page->size = slab->pagesize;
+    page->next = slab->pages;
+    slab->pages = page;
+    slab->npages++;
+    slab->mapped += slab->pagesize;
+    slab->carve = (char *)page + SLAB_ALIGN;
+    slab->carve_end = (char *)page + slab->pagesize;
+}
+
+size_t slab_round(size_t size, size_t to)
+{
+    return (size + to - 1) / to * to;
+}
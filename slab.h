@@ -0,0 +1,53 @@
+
+#ifndef __TCPDelegate__slab__
+#define __TCPDelegate__slab__
+
+#include "general.h"
+
+#define SLAB_ALIGN 64                       /* cache line */
+#define SLAB_PAGE (64 * 1024)
+#define SLAB_HUGEPAGE (2 * 1024 * 1024)
+#define SLAB_MIN_OBJS 8                     /* per page, for objects too big for SLAB_PAGE */
+
+typedef struct slab_s slab_s;
+typedef struct slab_stats_s slab_stats_s;
+
+struct slab_stats_s {
+    uint64_t allocs;
+    uint64_t frees;             /* including remote ones */
+    uint64_t remote_frees;      /* handed back by another thread */
+    uint64_t carved;            /* allocations that had to come from fresh page space */
+    size_t live;
+    size_t pages;
+    size_t mapped;              /* bytes */
+    bool huge;                  /* the last page mapped is on hugetlb pages */
+};
+
+/*
+ Allocator for objects of one fixed size, owned by the one thread that
+ allocates from it. Objects are rounded up to a whole number of cache
+ lines and carved out of pages mapped on demand, which are only given
+ back by slab_destroy. Freed objects go on a free list the owner pops
+ from without any locking. Any other thread may free too, those objects
+ are pushed onto a separate atomic list the owner takes over in one go
+ when its own list runs dry.
+
+ With hugepages, pages are mapped from hugetlbfs when the system has any
+ reserved and are otherwise advised to be backed by transparent hugepages.
+ */
+extern slab_s *slab_s_(const char *name, size_t size, bool hugepages);
+
+/* Unmaps every page, objects still out are lost with them. */
+extern void slab_destroy(slab_s *slab);
+
+/* Only ever from the owning thread, which is the first one to call it. */
+extern void *slab_alloc(slab_s *slab);
+
+/* Safe from any thread. */
+extern void slab_free(slab_s *slab, void *p);
+
+/* Exact from the owning thread, a close snapshot from any other. */
+extern void slab_stats(slab_s *slab, slab_stats_s *stats);
+extern void slab_log(slab_s *slab);
+
+#endif /* defined(__TCPDelegate__slab__) */
@@ -0,0 +1,359 @@
+#include "table.h"
+
+#include <string.h>
+#include <stdatomic.h>
+
+#define TABLE_EMPTY 0
+#define TABLE_TOMB UINT64_MAX
+#define TABLE_MIN_SLOTS 16
+#define CACHE_LINE 64
+
+typedef struct slot_s slot_s;
+typedef struct slots_s slots_s;
+typedef struct shard_s shard_s;
+typedef struct reader_s reader_s;
+
+struct slot_s {
+    _Atomic uint64_t key;
+    _Atomic(void *) value;
+};
+
+struct slots_s {
+    size_t mask;
+    uint64_t retired_at;    /* epoch the array was replaced in */
+    slots_s *next;
+    slot_s slot[];
+};
+
+/*
+ used counts tombstones along with live keys, it's what decides when the
+ probe chains have grown long enough to rebuild.
+ */
+struct shard_s {
+    pthread_mutex_t lock;
+    _Atomic(slots_s *) slots;
+    size_t used;
+    _Atomic size_t count;
+    slots_s *retired;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct table_s {
+    unsigned nshards;
+    shard_s *shards;
+};
+
+/*
+ Lookups announce the epoch they started in. An array replaced by a
+ rebuild is only freed once no announced epoch is old enough to have
+ seen it. Records outlive their threads and are recycled.
+ */
+struct reader_s {
+    _Atomic uint64_t epoch;     /* 0 while outside the table */
+    _Atomic bool used;
+    reader_s *next;
+} __attribute__((aligned(CACHE_LINE)));
+
+static _Atomic uint64_t table_epoch = 1;
+static _Atomic(reader_s *) readers;
+static __thread reader_s *reader;
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+
+static uint64_t table_hash(uint64_t key);
+static shard_s *table_shard(table_s *t, uint64_t hash);
+static slots_s *slots_s_(size_t nslots);
+static void table_rebuild(shard_s *shard);
+static void table_reclaim(shard_s *shard);
+static void *aligned_allocz(size_t size);
+static reader_s *reader_get(void);
+static void reader_key_init(void);
+static void reader_release(void *arg);
+
+table_s *table_s_(unsigned nshards, size_t capacity)
+{
+    unsigned i, n = 1;
+    size_t nslots = TABLE_MIN_SLOTS;
+    table_s *t = del_alloc(sizeof *t);
+    
+    while(n < nshards)
+        n <<= 1;
+    capacity = (capacity + n - 1) / n;
+    while(nslots < capacity * 2)
+        nslots <<= 1;
+    
+    t->nshards = n;
+    t->shards = aligned_allocz(n * sizeof *t->shards);
+    for(i = 0; i < n; i++) {
+        pthread_mutex_init(&t->shards[i].lock, NULL);
+        atomic_init(&t->shards[i].slots, slots_s_(nslots));
+        atomic_init(&t->shards[i].count, 0);
+    }
+    return t;
+}
+
+void table_destroy(table_s *t)
+{
+    unsigned i;
+    slots_s *s, *next;
+    
+    for(i = 0; i < t->nshards; i++) {
+        for(s = t->shards[i].retired; s; s = next) {
+            next = s->next;
+            free(s);
+        }
+        free(atomic_load(&t->shards[i].slots));
+        pthread_mutex_destroy(&t->shards[i].lock);
+    }
+    free(t->shards);
+    free(t);
+}
+
+/*
+ The key is checked again after reading the value, since the slot can be
+ deleted and handed to another key in between.
+ */
+void *table_get(table_s *t, uint64_t key)
+{
+    uint64_t hash = table_hash(key), k;
+    shard_s *shard = table_shard(t, hash);
+    reader_s *r = reader_get();
+    void *value = NULL;
+    slots_s *s;
+    size_t i;
+    
+    atomic_store(&r->epoch, atomic_load(&table_epoch));
+    s = atomic_load(&shard->slots);
+    
+    for(i = hash & s->mask;; i = (i + 1) & s->mask) {
+        k = atomic_load_explicit(&s->slot[i].key, memory_order_acquire);
+        if(k == key) {
+            value = atomic_load_explicit(&s->slot[i].value, memory_order_acquire);
+            if(atomic_load_explicit(&s->slot[i].key, memory_order_acquire) != key)
+                value = NULL;
+            break;
+        }
+        if(k == TABLE_EMPTY)
+            break;
+    }
+    
+    atomic_store_explicit(&r->epoch, 0, memory_order_release);
+    return value;
+}
+
+bool table_insert(table_s *t, uint64_t key, void *value)
+{
+    uint64_t hash = table_hash(key), k;
+    shard_s *shard = table_shard(t, hash);
+    slot_s *tomb = NULL, *slot;
+    slots_s *s;
+    size_t i;
+    
+    assert(key != TABLE_EMPTY && key != TABLE_TOMB);
+    
+    pthread_mutex_lock(&shard->lock);
+    s = atomic_load_explicit(&shard->slots, memory_order_relaxed);
+    if((shard->used + 1) * 4 > (s->mask + 1) * 3) {
+        table_rebuild(shard);
+        s = atomic_load_explicit(&shard->slots, memory_order_relaxed);
+    }
+    
+    for(i = hash & s->mask;; i = (i + 1) & s->mask) {
+        k = atomic_load_explicit(&s->slot[i].key, memory_order_relaxed);
+        if(k == key) {
+            pthread_mutex_unlock(&shard->lock);
+            return false;
+        }
+        if(k == TABLE_TOMB && !tomb)
+            tomb = &s->slot[i];
+        if(k == TABLE_EMPTY)
+            break;
+    }
+    
+    if(tomb) {
+        slot = tomb;
+    }
+    else {
+        slot = &s->slot[i];
+        shard->used++;
+    }
+    
+    /* Publishing the key last makes the value visible along with it */
+    atomic_store_explicit(&slot->value, value, memory_order_relaxed);
+    atomic_store_explicit(&slot->key, key, memory_order_release);
+    atomic_fetch_add_explicit(&shard->count, 1, memory_order_relaxed);
+    
+    pthread_mutex_unlock(&shard->lock);
+    return true;
+}
+
+void *table_remove(table_s *t, uint64_t key)
+{
+    uint64_t hash = table_hash(key), k;
+    shard_s *shard = table_shard(t, hash);
+    void *value = NULL;
+    slots_s *s;
+    size_t i;
+    
+    pthread_mutex_lock(&shard->lock);
+    s = atomic_load_explicit(&shard->slots, memory_order_relaxed);
+    
+    for(i = hash & s->mask;; i = (i + 1) & s->mask) {
+        k = atomic_load_explicit(&s->slot[i].key, memory_order_relaxed);
+        if(k == key) {
+            value = atomic_load_explicit(&s->slot[i].value, memory_order_relaxed);
+            atomic_store_explicit(&s->slot[i].value, NULL, memory_order_relaxed);
+            atomic_store_explicit(&s->slot[i].key, TABLE_TOMB, memory_order_release);
+            atomic_fetch_sub_explicit(&shard->count, 1, memory_order_relaxed);
+            break;
+        }
+        if(k == TABLE_EMPTY)
+            break;
+    }
+    
+    pthread_mutex_unlock(&shard->lock);
+    return value;
+}
+
+size_t table_count(table_s *t)
+{
+    unsigned i;
+    size_t count = 0;
+    
+    for(i = 0; i < t->nshards; i++)
+        count += atomic_load_explicit(&t->shards[i].count, memory_order_relaxed);
+    return count;
+}
+
+/* splitmix64's finalizer, session ids are sequential. */
+uint64_t table_hash(uint64_t key)
+{
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+/* Shards take the high half of the hash, slots the low half. */
+shard_s *table_shard(table_s *t, uint64_t hash)
+{
+    return &t->shards[(hash >> 32) & (t->nshards - 1)];
+}
+
+slots_s *slots_s_(size_t nslots)
+{
+    slots_s *s = del_allocz(sizeof *s + nslots * sizeof s->slot[0]);
+    
+    s->mask = nslots - 1;
+    return s;
+}
+
+/*
+ Copies the live keys into a fresh array sized for twice their number,
+ which drops the tombstones too. Readers still on the old array see a
+ consistent snapshot of it until they leave.
+ */
+void table_rebuild(shard_s *shard)
+{
+    slots_s *old = atomic_load_explicit(&shard->slots, memory_order_relaxed), *s;
+    size_t count = atomic_load_explicit(&shard->count, memory_order_relaxed);
+    size_t nslots = TABLE_MIN_SLOTS, i, j;
+    uint64_t key;
+    
+    while(nslots < (count + 1) * 2)
+        nslots <<= 1;
+    
+    s = slots_s_(nslots);
+    for(i = 0; i <= old->mask; i++) {
+        key = atomic_load_explicit(&old->slot[i].key, memory_order_relaxed);
+        if(key == TABLE_EMPTY || key == TABLE_TOMB)
+            continue;
+        for(j = table_hash(key) & s->mask; atomic_load_explicit(&s->slot[j].key, memory_order_relaxed); j = (j + 1) & s->mask)
+            ;
+        atomic_init(&s->slot[j].key, key);
+        atomic_init(&s->slot[j].value, atomic_load_explicit(&old->slot[i].value, memory_order_relaxed));
+    }
+    shard->used = count;
+    
+    atomic_store(&shard->slots, s);
+    old->retired_at = atomic_fetch_add(&table_epoch, 1);
+    old->next = shard->retired;
+    shard->retired = old;
+    table_reclaim(shard);
+}
+
+void table_reclaim(shard_s *shard)
+{
+    uint64_t oldest = UINT64_MAX, epoch;
+    slots_s **ps, *s;
+    reader_s *r;
+    
+    for(r = atomic_load(&readers); r; r = r->next) {
+        epoch = atomic_load(&r->epoch);
+        if(epoch && epoch < oldest)
+            oldest = epoch;
+    }
+    
+    for(ps = &shard->retired; (s = *ps);) {
+        if(s->retired_at < oldest) {
+            *ps = s->next;
+            free(s);
+        }
+        else {
+            ps = &s->next;
+        }
+    }
+}
+
+void *aligned_allocz(size_t size)
+{
+    void *p;
+    
+    if(posix_memalign(&p, CACHE_LINE, size)) {
+        perror("Memory Allocation Error (posix_memalign)");
+        exit(EXIT_FAILURE);
+    }
+    return memset(p, 0, size);
+}
+
+reader_s *reader_get(void)
+{
+    reader_s *r;
+    bool expected;
+    
+    if(reader)
+        return reader;
+    
+    pthread_once(&reader_once, reader_key_init);
+    for(r = atomic_load(&readers); r; r = r->next) {
+        expected = false;
+        if(!atomic_load_explicit(&r->used, memory_order_relaxed) && atomic_compare_exchange_strong(&r->used, &expected, true))
+            break;
+    }
+    
+    if(!r) {
+        r = aligned_allocz(sizeof *r);
+        atomic_init(&r->used, true);
+        r->next = atomic_load(&readers);
+        while(!atomic_compare_exchange_weak(&readers, &r->next, r))
+            ;
+    }
+    
+    pthread_setspecific(reader_key, r);
+    reader = r;
+    return r;
+}
+
+void reader_key_init(void)
+{
+    pthread_key_create(&reader_key, reader_release);
+}
+
+void reader_release(void *arg)
+{
+    reader_s *r = arg;
+    
+    atomic_store(&r->epoch, 0);
+    atomic_store(&r->used, false);
+}
@@ -0,0 +1,31 @@
+
+#ifndef __TCPDelegate__table__
+#define __TCPDelegate__table__
+
+#include "general.h"
+
+#define TABLE_SHARDS 64
+
+typedef struct table_s table_s;
+
+/*
+ Concurrent open addressing hash table keyed by session id. Keys are split
+ across shards that each grow on their own behind a per-shard lock, while
+ lookups take no lock at all. Keys 0 and UINT64_MAX are reserved.
+
+ Values are returned as is, keeping whatever they point at alive is up to
+ the caller.
+ */
+extern table_s *table_s_(unsigned nshards, size_t capacity);
+extern void table_destroy(table_s *t);
+
+extern void *table_get(table_s *t, uint64_t key);
+
+/* Returns false without touching the table if the key is already present. */
+extern bool table_insert(table_s *t, uint64_t key, void *value);
+
+/* Returns the value that was removed, NULL if the key wasn't there. */
+extern void *table_remove(table_s *t, uint64_t key);
+extern size_t table_count(table_s *t);
+
+#endif /* defined(__TCPDelegate__table__) */
@@ -0,0 +1,160 @@
+#include "timer.h"
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_SPAN(level) (1ULL << (TIMER_BITS * (level)))
+
+static void timer_place(timerwheel_s *w, timer_s *t);
+static void timer_link(timer_s *head, timer_s *t);
+static void timer_unlink(timer_s *t);
+static void timerwheel_cascade(timerwheel_s *w, unsigned level);
+
+void timerwheel_init(timerwheel_s *w, uint64_t now)
+{
+    unsigned level, slot;
+    
+    w->now = now;
+    w->count = 0;
+    for(level = 0; level < TIMER_LEVELS; level++) {
+        for(slot = 0; slot < TIMER_SLOTS; slot++)
+            w->slots[level][slot].next = w->slots[level][slot].prev = &w->slots[level][slot];
+    }
+}
+
+void timerwheel_advance(timerwheel_s *w, uint64_t now)
+{
+    timer_s expired, *slot, *t;
+    unsigned level;
+    
+    if(!w->count) {
+        if(now >= w->now)
+            w->now = now + 1;
+        return;
+    }
+    
+    expired.next = expired.prev = &expired;
+    
+    for(; w->now <= now; w->now++) {
+        /* Bring the next slot of each level down as the one below wraps */
+        for(level = 1; level < TIMER_LEVELS; level++) {
+            if(w->now & (TIMER_SPAN(level) - 1))
+                break;
+            timerwheel_cascade(w, level);
+        }
+        
+        slot = &w->slots[0][w->now & TIMER_MASK];
+        if(slot->next != slot) {
+            slot->next->prev = expired.prev;
+            expired.prev->next = slot->next;
+            slot->prev->next = &expired;
+            expired.prev = slot->prev;
+            slot->next = slot->prev = slot;
+        }
+    }
+    
+    /* A callback may cancel any other expired timer, so only ever take the head */
+    while(expired.next != &expired) {
+        t = expired.next;
+        timer_unlink(t);
+        t->wheel = NULL;
+        w->count--;
+        t->on_expire(t, now);
+    }
+}
+
+/*
+ Exact while something sits in level 0, otherwise wakes up for the next
+ cascade, which is never more than TIMER_SLOTS ticks away.
+ */
+int timerwheel_timeout(timerwheel_s *w, uint64_t now)
+{
+    uint64_t tick = w->now;
+    timer_s *slot;
+    
+    if(!w->count)
+        return -1;
+    
+    do {
+        slot = &w->slots[0][tick & TIMER_MASK];
+        if(slot->next != slot)
+            break;
+        tick++;
+    } while(tick & TIMER_MASK);
+    
+    return tick > now ? (int)(tick - now) : 0;
+}
+
+void timer_init(timer_s *t, timer_f on_expire)
+{
+    t->next = t->prev = NULL;
+    t->wheel = NULL;
+    t->on_expire = on_expire;
+}
+
+void timer_arm(timerwheel_s *w, timer_s *t, uint64_t expires)
+{
+    timer_cancel(t);
+    t->expires = expires;
+    t->wheel = w;
+    w->count++;
+    timer_place(w, t);
+}
+
+void timer_cancel(timer_s *t)
+{
+    if(!t->wheel)
+        return;
+    timer_unlink(t);
+    t->wheel->count--;
+    t->wheel = NULL;
+}
+
+bool timer_armed(timer_s *t)
+{
+    return t->wheel != NULL;
+}
+
+/*
+ The level is picked by how far off the timer is, the slot within it by
+ the matching bits of its expiry.
+ */
+void timer_place(timerwheel_s *w, timer_s *t)
+{
+    uint64_t expires = t->expires < w->now ? w->now : t->expires;
+    uint64_t delta = expires - w->now;
+    unsigned level;
+    
+    for(level = 0; level < TIMER_LEVELS - 1; level++) {
+        if(delta < TIMER_SPAN(level + 1))
+            break;
+    }
+    if(delta >= TIMER_SPAN(TIMER_LEVELS))
+        expires = w->now + TIMER_SPAN(TIMER_LEVELS) - 1;
+    
+    timer_link(&w->slots[level][(expires >> (TIMER_BITS * level)) & TIMER_MASK], t);
+}
+
+void timer_link(timer_s *head, timer_s *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+void timer_unlink(timer_s *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+void timerwheel_cascade(timerwheel_s *w, unsigned level)
+{
+    timer_s *slot = &w->slots[level][(w->now >> (TIMER_BITS * level)) & TIMER_MASK], *t;
+    
+    while(slot->next != slot) {
+        t = slot->next;
+        timer_unlink(t);
+        timer_place(w, t);
+    }
+}
@@ -0,0 +1,55 @@
+
+#ifndef __TCPDelegate__timer__
+#define __TCPDelegate__timer__
+
+#include "general.h"
+
+#define TIMER_LEVELS 4
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+
+typedef struct timer_s timer_s;
+typedef struct timerwheel_s timerwheel_s;
+
+typedef void (*timer_f)(timer_s *t, uint64_t now);
+
+/*
+ Embedded in whatever object owns the timeout, which gets itself back in
+ on_expire with CONTAINER_OF. Times are in milliseconds.
+ */
+struct timer_s {
+    timer_s *next, *prev;
+    timerwheel_s *wheel;        /* NULL while not armed */
+    uint64_t expires;
+    timer_f on_expire;
+};
+
+/*
+ Hierarchical timing wheel with TIMER_LEVELS levels of TIMER_SLOTS
+ slots at 1 ms resolution. Arming and cancelling are O(1); a timer only
+ moves down a level when the wheel turns past its slot. Timers further
+ out than the wheel spans sit in the last level until they come in range.
+ Single threaded, each event loop owns one.
+ */
+struct timerwheel_s {
+    uint64_t now;               /* next tick to run */
+    size_t count;
+    timer_s slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+extern void timerwheel_init(timerwheel_s *w, uint64_t now);
+
+/* Runs every timer due at or before now, collected first and fired as one batch. */
+extern void timerwheel_advance(timerwheel_s *w, uint64_t now);
+
+/* Milliseconds until the wheel next needs advancing, -1 if nothing is armed. */
+extern int timerwheel_timeout(timerwheel_s *w, uint64_t now);
+
+extern void timer_init(timer_s *t, timer_f on_expire);
+
+/* Arms or re-arms t to fire at expires. */
+extern void timer_arm(timerwheel_s *w, timer_s *t, uint64_t expires);
+extern void timer_cancel(timer_s *t);
+extern bool timer_armed(timer_s *t);
+
+#endif /* defined(__TCPDelegate__timer__) */
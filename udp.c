@@ -0,0 +1,554 @@
+#include "udp.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+
+#define UDP_TABLE_MIN 64
+#define UDP_SOCKET_BUFFER (4 * 1024 * 1024)  /* rides out a loop iteration spent elsewhere */
+#define UDP_BIND_MIN (sizeof(uint64_t) + SESSION_TOKEN_SIZE)
+
+struct udp_flow_s {
+    udp_relay_s *u;
+    uint64_t key;
+    struct sockaddr_in client;
+    char ipstr[INET_ADDRSTRLEN];
+    uint64_t session_id;
+    int fd;                         /* connected to the remote, -1 until bound */
+    evhandler_s ev;
+    timer_s timer;
+    uint64_t last_active;
+    backend_s *backend;
+    bool verifying;
+    bool closed;
+    udp_flow_s *prev, *next;        /* on the relay's verifying list */
+    char remote[UDP_REMOTE_MAX];
+};
+
+/*
+ The flow table is open addressing with linear probing, keys and flows in
+ separate arrays so a probe only walks the keys. Client addresses can be
+ forged, so the hash is keyed at random.
+ */
+struct udp_relay_s {
+    evloop_s *loop;
+    int fd;
+    evhandler_s ev;
+    balancer_s *balancer;
+    udp_verify_f verify;
+    bool closed;
+    uint64_t hashkey;
+    uint64_t *keys;                 /* 0 for an empty slot */
+    udp_flow_s **flows;
+    size_t capacity, count;
+    udp_flow_s *verifying;
+    uint64_t up, down, dropped;
+    
+    /* One batch, read into bufs and sent straight out of them */
+    struct mmsghdr in[UDP_BATCH], out[UDP_BATCH];
+    struct iovec iniov[UDP_BATCH], outiov[UDP_BATCH];
+    struct sockaddr_in addrs[UDP_BATCH];
+    char bufs[UDP_BATCH][UDP_DATAGRAM_MAX];
+};
+
+static void udp_on_event(evloop_s *evloop, evhandler_s *h, uint32_t events);
+static void udp_forward(udp_relay_s *u, int n);
+static void udp_send_run(udp_relay_s *u, udp_flow_s *flow, int n);
+static void udp_bind(udp_relay_s *u, int i, uint64_t key);
+static void udp_reply(udp_flow_s *flow, bool ok);
+static int udp_prepare(udp_relay_s *u, int fd);
+static bool udp_flow_open(udp_flow_s *flow);
+static void udp_flow_on_event(evloop_s *evloop, evhandler_s *h, uint32_t events);
+static void udp_flow_on_timeout(timer_s *t, uint64_t now);
+static void udp_flow_close(udp_flow_s *flow);
+static void udp_flow_release(udp_flow_s *flow);
+static void udp_flow_free(evloop_s *evloop, void *arg);
+static void udp_unlink(udp_flow_s *flow);
+static uint64_t udp_key(const struct sockaddr_in *addr);
+static size_t udp_slot(udp_relay_s *u, uint64_t key);
+static udp_flow_s *udp_find(udp_relay_s *u, uint64_t key);
+static void udp_insert(udp_relay_s *u, udp_flow_s *flow);
+static void udp_remove(udp_relay_s *u, uint64_t key);
+static void udp_grow(udp_relay_s *u);
+
+udp_relay_s *udp_relay_s_(evloop_s *loop, uint16_t port, balancer_s *balancer, udp_verify_f verify)
+{
+    udp_relay_s *u;
+    struct sockaddr_in addr;
+    int fd, one = 1, i;
+    
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        log_error("Failed to create UDP socket. Errno: %d.", errno);
+        return NULL;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) < 0 || bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+        log_error("Failed to bind UDP port %d. Errno: %d.", port, errno);
+        close(fd);
+        return NULL;
+    }
+    /* Best effort, capped at rmem_max */
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &(int){UDP_SOCKET_BUFFER}, sizeof(int));
+    
+    u = del_allocz(sizeof *u);
+    u->loop = loop;
+    u->fd = fd;
+    u->balancer = balancer;
+    u->verify = verify;
+    if(getrandom(&u->hashkey, sizeof u->hashkey, 0) != sizeof u->hashkey)
+        u->hashkey = (uint64_t)rand() << 32 | (uint64_t)rand();
+    u->hashkey |= 1;
+    u->capacity = UDP_TABLE_MIN;
+    u->keys = del_allocz(u->capacity * sizeof *u->keys);
+    u->flows = del_allocz(u->capacity * sizeof *u->flows);
+    
+    for(i = 0; i < UDP_BATCH; i++) {
+        u->iniov[i].iov_base = u->bufs[i];
+        u->in[i].msg_hdr.msg_iov = &u->iniov[i];
+        u->in[i].msg_hdr.msg_iovlen = 1;
+        u->out[i].msg_hdr.msg_iov = &u->outiov[i];
+        u->out[i].msg_hdr.msg_iovlen = 1;
+    }
+    return u;
+}
+
+void udp_relay_arm(udp_relay_s *u)
+{
+    u->ev.on_event = udp_on_event;
+    if(!evloop_add(u->loop, u->fd, EPOLLIN | EPOLLET, &u->ev))
+        log_error("Event loop %u can't relay datagrams.", evloop_id(u->loop));
+}
+
+void udp_relay_close(udp_relay_s *u)
+{
+    udp_flow_s *flow;
+    size_t i;
+    
+    if(u->closed)
+        return;
+    u->closed = true;
+    evloop_del(u->loop, u->fd);
+    close(u->fd);
+    u->fd = -1;
+    
+    for(i = 0; i < u->capacity; i++) {
+        flow = u->flows[i];
+        if(flow && !flow->verifying) {
+            udp_flow_release(flow);
+            evloop_defer(u->loop, udp_flow_free, flow);
+        }
+        else if(flow) {
+            flow->closed = true;
+        }
+        u->keys[i] = 0;
+        u->flows[i] = NULL;
+    }
+    u->count = 0;
+}
+
+void udp_relay_destroy(udp_relay_s *u)
+{
+    udp_flow_s *flow;
+    
+    udp_relay_close(u);
+    while((flow = u->verifying)) {
+        udp_unlink(flow);
+        free(flow);
+    }
+    free(u->keys);
+    free(u->flows);
+    free(u);
+}
+
+void udp_log(udp_relay_s *u)
+{
+    if(u->up || u->down || u->dropped)
+        log_info("Relayed %lu datagrams up and %lu down over %lu flows, dropped %lu.", (unsigned long)u->up,
+                 (unsigned long)u->down, (unsigned long)u->count, (unsigned long)u->dropped);
+    u->up = u->down = u->dropped = 0;
+}
+
+/* A short batch means the socket ran dry, edge triggering brings us back for more. */
+void udp_on_event(evloop_s *evloop, evhandler_s *h, uint32_t events)
+{
+    udp_relay_s *u = CONTAINER_OF(h, udp_relay_s, ev);
+    int n;
+    
+    do {
+        n = udp_prepare(u, u->fd);
+        if(n > 0)
+            udp_forward(u, n);
+    } while(n == UDP_BATCH && !u->closed);
+}
+
+/*
+ Consecutive datagrams for the same flow are gathered into one run for
+ its socket, and the last key looked up is remembered since a busy client
+ tends to fill a batch by itself.
+ */
+void udp_forward(udp_relay_s *u, int n)
+{
+    udp_flow_s *flow = NULL, *run = NULL;
+    uint64_t key, last = 0;
+    int i, nrun = 0;
+    
+    for(i = 0; i < n; i++) {
+        key = udp_key(&u->addrs[i]);
+        if(key != last) {
+            flow = udp_find(u, key);
+            last = key;
+        }
+        if(!flow) {
+            udp_bind(u, i, key);
+            flow = udp_find(u, key);
+            continue;
+        }
+        if(flow->fd < 0 || (u->in[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+            u->dropped++;
+            continue;
+        }
+        
+        if(flow != run) {
+            udp_send_run(u, run, nrun);
+            run = flow;
+            nrun = 0;
+        }
+        u->outiov[nrun].iov_base = u->bufs[i];
+        u->outiov[nrun].iov_len = u->in[i].msg_len;
+        u->out[nrun].msg_hdr.msg_name = NULL;
+        u->out[nrun].msg_hdr.msg_namelen = 0;
+        nrun++;
+    }
+    udp_send_run(u, run, nrun);
+}
+
+void udp_send_run(udp_relay_s *u, udp_flow_s *flow, int n)
+{
+    int sent;
+    
+    if(!n)
+        return;
+    sent = sendmmsg(flow->fd, u->out, n, MSG_DONTWAIT);
+    if(sent < 0)
+        sent = 0;
+    u->up += sent;
+    u->dropped += n - sent;
+    flow->last_active = evloop_time(u->loop);
+}
+
+/* The first datagram from an address. Anything it sends before the answer is dropped. */
+void udp_bind(udp_relay_s *u, int i, uint64_t key)
+{
+    udp_flow_s *flow;
+    size_t len = u->in[i].msg_len;
+    uint64_t session_id;
+    
+    if(len < UDP_BIND_MIN || len - UDP_BIND_MIN >= UDP_REMOTE_MAX || u->count >= UDP_MAX_FLOWS) {
+        u->dropped++;
+        return;
+    }
+    
+    flow = del_allocz(sizeof *flow);
+    flow->u = u;
+    flow->key = key;
+    flow->client = u->addrs[i];
+    flow->fd = -1;
+    flow->verifying = true;
+    inet_ntop(AF_INET, &flow->client.sin_addr, flow->ipstr, INET_ADDRSTRLEN);
+    memcpy(&session_id, u->bufs[i], sizeof session_id);
+    flow->session_id = session_id;
+    memcpy(flow->remote, &u->bufs[i][UDP_BIND_MIN], len - UDP_BIND_MIN);
+    timer_init(&flow->timer, udp_flow_on_timeout);
+    
+    udp_insert(u, flow);
+    flow->next = u->verifying;
+    if(u->verifying)
+        u->verifying->prev = flow;
+    u->verifying = flow;
+    u->verify(u->loop, flow, session_id, &u->bufs[i][sizeof session_id], &flow->client);
+}
+
+void udp_verified(udp_flow_s *flow, bool ok)
+{
+    udp_relay_s *u = flow->u;
+    
+    udp_unlink(flow);
+    flow->verifying = false;
+    if(flow->closed) {
+        free(flow);
+        return;
+    }
+    
+    if(!ok) {
+        log_warn("Refused to bind datagrams from [%s] to session %lu.", flow->ipstr, (unsigned long)flow->session_id);
+        udp_reply(flow, false);
+        udp_flow_close(flow);
+        return;
+    }
+    if(!udp_flow_open(flow)) {
+        udp_reply(flow, false);
+        udp_flow_close(flow);
+        return;
+    }
+    udp_reply(flow, true);
+    flow->last_active = evloop_time(u->loop);
+    evloop_timer_arm(u->loop, &flow->timer, UDP_IDLE_TIMEOUT);
+}
+
+void udp_reply(udp_flow_s *flow, bool ok)
+{
+    char reply[sizeof flow->session_id + 1];
+    
+    memcpy(reply, &flow->session_id, sizeof flow->session_id);
+    reply[sizeof flow->session_id] = ok;
+    sendto(flow->u->fd, reply, sizeof reply, MSG_DONTWAIT, (struct sockaddr *)&flow->client, sizeof flow->client);
+}
+
+/* Reads a batch from fd into the relay's buffers. Returns how many came, 0 when there were none. */
+int udp_prepare(udp_relay_s *u, int fd)
+{
+    int i, n;
+    
+    for(i = 0; i < UDP_BATCH; i++) {
+        u->iniov[i].iov_len = UDP_DATAGRAM_MAX;
+        u->in[i].msg_hdr.msg_name = &u->addrs[i];
+        u->in[i].msg_hdr.msg_namelen = sizeof u->addrs[i];
+        u->in[i].msg_hdr.msg_flags = 0;
+    }
+    do {
+        n = recvmmsg(fd, u->in, UDP_BATCH, MSG_DONTWAIT, NULL);
+    } while(n < 0 && errno == EINTR);
+    
+    if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED)
+        log_error("Failed to read datagrams on socket %d. Errno: %d.", fd, errno);
+    return n < 0 ? 0 : n;
+}
+
+/*
+ Connects the flow's own socket to its remote, numeric hosts only as for
+ PACKET_TX. A backend's address is taken to serve datagrams as well.
+ */
+bool udp_flow_open(udp_flow_s *flow)
+{
+    udp_relay_s *u = flow->u;
+    struct addrinfo hints, *res = NULL;
+    const struct sockaddr *addr;
+    socklen_t addrlen;
+    char *host, *port, label[UDP_REMOTE_MAX + 2];
+    int status;
+    
+    if(!*flow->remote && u->balancer) {
+        flow->backend = balancer_pick(u->balancer, flow->session_id, evloop_time(u->loop));
+        addr = (struct sockaddr *)&flow->backend->addr;
+        addrlen = flow->backend->addrlen;
+        snprintf(label, sizeof label, "%s", flow->backend->name);
+    }
+    else {
+        if(!split_hostport(flow->remote, &host, &port)) {
+            log_warn("Malformed remote address \"%s\" from [%s].", flow->remote, flow->ipstr);
+            return false;
+        }
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+        status = getaddrinfo(host, port, &hints, &res);
+        if(status) {
+            log_warn("Failed to resolve remote %s:%s for [%s]: %s.", host, port, flow->ipstr, gai_strerror(status));
+            return false;
+        }
+        addr = res->ai_addr;
+        addrlen = res->ai_addrlen;
+        snprintf(label, sizeof label, "%s:%s", host, port);
+    }
+    
+    flow->fd = socket(addr->sa_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(flow->fd < 0 || connect(flow->fd, addr, addrlen) < 0) {
+        log_warn("Failed to open a datagram socket to %s for [%s]. Errno: %d.", label, flow->ipstr, errno);
+        if(res)
+            freeaddrinfo(res);
+        return false;
+    }
+    if(res)
+        freeaddrinfo(res);
+    
+    flow->ev.on_event = udp_flow_on_event;
+    if(!evloop_add(u->loop, flow->fd, EPOLLIN | EPOLLET, &flow->ev))
+        return false;
+    log_info("Relaying datagrams from [%s:%d] to %s.", flow->ipstr, ntohs(flow->client.sin_port), label);
+    return true;
+}
+
+/* Replies from the remote go back to the client a batch at a time. */
+void udp_flow_on_event(evloop_s *evloop, evhandler_s *h, uint32_t events)
+{
+    udp_flow_s *flow = CONTAINER_OF(h, udp_flow_s, ev);
+    udp_relay_s *u = flow->u;
+    int i, n, m, sent;
+    
+    if(flow->closed || u->closed)
+        return;
+    do {
+        n = udp_prepare(u, flow->fd);
+        for(i = m = 0; i < n; i++) {
+            if(u->in[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                u->dropped++;
+                continue;
+            }
+            u->outiov[m].iov_base = u->bufs[i];
+            u->outiov[m].iov_len = u->in[i].msg_len;
+            u->out[m].msg_hdr.msg_name = &flow->client;
+            u->out[m].msg_hdr.msg_namelen = sizeof flow->client;
+            m++;
+        }
+        if(!m)
+            continue;
+        sent = sendmmsg(u->fd, u->out, m, MSG_DONTWAIT);
+        if(sent < 0)
+            sent = 0;
+        u->down += sent;
+        u->dropped += m - sent;
+        flow->last_active = evloop_time(evloop);
+    } while(n == UDP_BATCH);
+}
+
+void udp_flow_on_timeout(timer_s *t, uint64_t now)
+{
+    udp_flow_s *flow = CONTAINER_OF(t, udp_flow_s, timer);
+    
+    if(now - flow->last_active < UDP_IDLE_TIMEOUT) {
+        evloop_timer_arm(flow->u->loop, t, UDP_IDLE_TIMEOUT - (unsigned)(now - flow->last_active));
+        return;
+    }
+    log_info("Datagram flow from [%s:%d] went idle.", flow->ipstr, ntohs(flow->client.sin_port));
+    udp_flow_close(flow);
+}
+
+void udp_flow_close(udp_flow_s *flow)
+{
+    udp_remove(flow->u, flow->key);
+    udp_flow_release(flow);
+    evloop_defer(flow->u->loop, udp_flow_free, flow);
+}
+
+/* Events for the socket may still be waiting in the batch, so the flow itself goes later. */
+void udp_flow_release(udp_flow_s *flow)
+{
+    flow->closed = true;
+    timer_cancel(&flow->timer);
+    if(flow->fd >= 0) {
+        evloop_del(flow->u->loop, flow->fd);
+        close(flow->fd);
+        flow->fd = -1;
+    }
+    if(flow->backend) {
+        backend_release(flow->backend);
+        flow->backend = NULL;
+    }
+}
+
+void udp_flow_free(evloop_s *evloop, void *arg)
+{
+    free(arg);
+}
+
+void udp_unlink(udp_flow_s *flow)
+{
+    if(flow->prev)
+        flow->prev->next = flow->next;
+    else
+        flow->u->verifying = flow->next;
+    if(flow->next)
+        flow->next->prev = flow->prev;
+    flow->prev = flow->next = NULL;
+}
+
+/* Never 0, that marks an empty slot. */
+uint64_t udp_key(const struct sockaddr_in *addr)
+{
+    return 1ull << 48 | (uint64_t)addr->sin_addr.s_addr << 16 | addr->sin_port;
+}
+
+size_t udp_slot(udp_relay_s *u, uint64_t key)
+{
+    return (size_t)((key * u->hashkey) >> 32) & (u->capacity - 1);
+}
+
+udp_flow_s *udp_find(udp_relay_s *u, uint64_t key)
+{
+    size_t mask = u->capacity - 1, i;
+    
+    for(i = udp_slot(u, key); u->keys[i]; i = (i + 1) & mask) {
+        if(u->keys[i] == key)
+            return u->flows[i];
+    }
+    return NULL;
+}
+
+void udp_insert(udp_relay_s *u, udp_flow_s *flow)
+{
+    size_t mask, i;
+    
+    if(2 * (u->count + 1) > u->capacity)
+        udp_grow(u);
+    mask = u->capacity - 1;
+    for(i = udp_slot(u, flow->key); u->keys[i]; i = (i + 1) & mask)
+        ;
+    u->keys[i] = flow->key;
+    u->flows[i] = flow;
+    u->count++;
+}
+
+/* Entries after the hole that probed past it are shifted back, so no tombstones are needed. */
+void udp_remove(udp_relay_s *u, uint64_t key)
+{
+    size_t mask = u->capacity - 1, i, j, home;
+    
+    for(i = udp_slot(u, key); u->keys[i] != key; i = (i + 1) & mask) {
+        if(!u->keys[i])
+            return;
+    }
+    for(j = i;;) {
+        j = (j + 1) & mask;
+        if(!u->keys[j])
+            break;
+        home = udp_slot(u, u->keys[j]);
+        if((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            u->keys[i] = u->keys[j];
+            u->flows[i] = u->flows[j];
+            i = j;
+        }
+    }
+    u->keys[i] = 0;
+    u->flows[i] = NULL;
+    u->count--;
+}
+
+void udp_grow(udp_relay_s *u)
+{
+    uint64_t *keys = u->keys;
+    udp_flow_s **flows = u->flows;
+    size_t capacity = u->capacity, mask, i, j;
+    
+    u->capacity *= 2;
+    u->keys = del_allocz(u->capacity * sizeof *u->keys);
+    u->flows = del_allocz(u->capacity * sizeof *u->flows);
+    mask = u->capacity - 1;
+    for(i = 0; i < capacity; i++) {
+        if(!keys[i])
+            continue;
+        for(j = udp_slot(u, keys[i]); u->keys[j]; j = (j + 1) & mask)
+            ;
+        u->keys[j] = keys[i];
+        u->flows[j] = flows[i];
+    }
+    free(keys);
+    free(flows);
+}
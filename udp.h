@@ -0,0 +1,60 @@
+
+#ifndef __TCPDelegate__udp__
+#define __TCPDelegate__udp__
+
+#include "general.h"
+#include "evloop.h"
+#include "frame.h"
+#include "balance.h"
+
+#include <netinet/in.h>
+
+#define UDP_BATCH 64                /* datagrams per recvmmsg and sendmmsg */
+#define UDP_DATAGRAM_MAX 2048       /* longer ones are dropped */
+#define UDP_REMOTE_MAX 256
+#define UDP_MAX_FLOWS 65536         /* per loop */
+#define UDP_IDLE_TIMEOUT 60000
+
+typedef struct udp_relay_s udp_relay_s;
+typedef struct udp_flow_s udp_flow_s;
+
+/*
+ Asks whether token resumes session_id, for a flow bound from client. The
+ answer has to come back through udp_verified on the relay's loop, and
+ may come from within the call.
+ */
+typedef void (*udp_verify_f)(evloop_s *loop, udp_flow_s *flow, uint64_t session_id, const char *token, const struct sockaddr_in *client);
+
+/*
+ Datagram relay for one event loop, on its own SO_REUSEPORT socket so a
+ client address always lands on the same loop. Flows are keyed by the
+ client's address and port. The first datagram from an address binds its
+ flow to a session logged in over TCP: the session id, in host order,
+ the session's token and then "host:port", or nothing for the backend
+ set. It is answered with the session id and a byte, 1 if the flow was
+ bound and 0 if not. After that every datagram from the address goes to
+ the remote, from a socket of the flow's own, and every datagram the
+ remote sends back goes to the address, until the flow has been idle for
+ UDP_IDLE_TIMEOUT.
+ 
+ Datagrams are read and written UDP_BATCH at a time, and a run of them
+ for the same flow goes out in one sendmmsg. Whatever can't be sent
+ right away is dropped, as the network would.
+ */
+extern udp_relay_s *udp_relay_s_(evloop_s *loop, uint16_t port, balancer_s *balancer, udp_verify_f verify);
+
+/* On the loop's thread, starts reading. */
+extern void udp_relay_arm(udp_relay_s *u);
+
+/* Stops reading and closes every flow. Binds still being verified are dropped when the answer comes. */
+extern void udp_relay_close(udp_relay_s *u);
+
+/* Once the loop has stopped. */
+extern void udp_relay_destroy(udp_relay_s *u);
+
+extern void udp_verified(udp_flow_s *flow, bool ok);
+
+/* Datagrams relayed and dropped since the last call. */
+extern void udp_log(udp_relay_s *u);
+
+#endif /* defined(__TCPDelegate__udp__) */
@@ -0,0 +1,399 @@
+/*
+ Minimal io_uring engine built directly on the raw syscalls, covering
+ just what the server needs: multishot accept, multishot recv into a
+ provided buffer ring, linked sends, multishot poll and cancellation.
+ */
+#include "uring.h"
+
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+
+#define URING_BGID 0
+
+struct uring_s {
+    int fd;
+    
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    
+    unsigned sqe_tail;
+    unsigned to_submit;
+    
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    uint16_t br_tail;
+    char *bufs;
+    unsigned bufsize;
+};
+
+static const uint8_t required_ops[] = {
+    IORING_OP_ACCEPT,
+    IORING_OP_RECV,
+    IORING_OP_SENDMSG,
+    IORING_OP_POLL_ADD,
+    IORING_OP_ASYNC_CANCEL
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p);
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz);
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args);
+static bool uring_probe(uring_s *ring);
+static bool uring_setup_buffers(uring_s *ring);
+static struct io_uring_sqe *uring_get_sqe(uring_s *ring, uring_op_s *op);
+static int uring_submit(uring_s *ring, unsigned min_complete, int timeout);
+
+bool uring_supported(void)
+{
+    uring_s *ring = uring_s_(8, 64);
+    
+    if(!ring)
+        return false;
+    uring_destroy(ring);
+    return true;
+}
+
+uring_s *uring_s_(unsigned entries, unsigned bufsize)
+{
+    struct io_uring_params p;
+    uring_s *ring = del_allocz(sizeof *ring);
+    
+    memset(&p, 0, sizeof p);
+    ring->fd = io_uring_setup(entries, &p);
+    if(ring->fd < 0) {
+        log_warn("io_uring_setup failed. Errno: %d.", errno);
+        free(ring);
+        return NULL;
+    }
+    
+    if(!(p.features & IORING_FEAT_EXT_ARG)) {
+        log_warn("Kernel io_uring lacks IORING_FEAT_EXT_ARG.");
+        goto fail_fd;
+    }
+    
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED)
+        goto fail_fd;
+    
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ring == MAP_FAILED)
+            goto fail_sq;
+    }
+    
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED)
+        goto fail_cq;
+    
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    
+    if(!uring_probe(ring))
+        goto fail_sqes;
+    
+    ring->bufsize = bufsize;
+    if(!uring_setup_buffers(ring))
+        goto fail_sqes;
+    
+    return ring;
+    
+fail_sqes:
+    munmap(ring->sqes, ring->sqes_size);
+fail_cq:
+    if(ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+fail_sq:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+fail_fd:
+    close(ring->fd);
+    free(ring);
+    return NULL;
+}
+
+void uring_destroy(uring_s *ring)
+{
+    munmap(ring->br, ring->br_size);
+    free(ring->bufs);
+    munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring);
+}
+
+bool uring_probe(uring_s *ring)
+{
+    enum {NPROBE_OPS = 256};
+    unsigned i;
+    bool supported = true;
+    struct io_uring_probe *probe;
+    
+    probe = del_allocz(sizeof *probe + NPROBE_OPS * sizeof(struct io_uring_probe_op));
+    if(io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, NPROBE_OPS) < 0) {
+        log_warn("Failed to probe io_uring opcodes. Errno: %d.", errno);
+        free(probe);
+        return false;
+    }
+    
+    for(i = 0; i < sizeof(required_ops); i++) {
+        if(required_ops[i] > probe->last_op || !(probe->ops[required_ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            log_warn("io_uring opcode %u is not supported.", (unsigned)required_ops[i]);
+            supported = false;
+        }
+    }
+    free(probe);
+    return supported;
+}
+
+bool uring_setup_buffers(uring_s *ring)
+{
+    unsigned i;
+    struct io_uring_buf_reg reg;
+    
+    ring->br_size = URING_NBUFS * sizeof(struct io_uring_buf);
+    ring->br = mmap(NULL, ring->br_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(ring->br == MAP_FAILED) {
+        ring->br = NULL;
+        return false;
+    }
+    
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->br;
+    reg.ring_entries = URING_NBUFS;
+    reg.bgid = URING_BGID;
+    if(io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        log_warn("Failed to register provided buffer ring. Errno: %d.", errno);
+        munmap(ring->br, ring->br_size);
+        ring->br = NULL;
+        return false;
+    }
+    
+    ring->bufs = del_alloc((size_t)URING_NBUFS * ring->bufsize);
+    for(i = 0; i < URING_NBUFS; i++) {
+        uring_buffer_release(ring, i << IORING_CQE_BUFFER_SHIFT);
+    }
+    return true;
+}
+
+bool uring_accept_multishot(uring_s *ring, int fd, uring_op_s *op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, op);
+    
+    if(!sqe)
+        return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    return true;
+}
+
+bool uring_recv_multishot(uring_s *ring, int fd, uring_op_s *op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, op);
+    
+    if(!sqe)
+        return false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    return true;
+}
+
+bool uring_poll_multishot(uring_s *ring, int fd, uint32_t events, uring_op_s *op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, op);
+    
+    if(!sqe)
+        return false;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    return true;
+}
+
+bool uring_sendmsg(uring_s *ring, int fd, const struct msghdr *msg, int flags, uring_op_s *op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, op);
+    
+    if(!sqe)
+        return false;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    return true;
+}
+
+bool uring_cancel(uring_s *ring, uring_op_s *op)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, NULL);
+    
+    if(!sqe)
+        return false;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)op;
+    return true;
+}
+
+char *uring_buffer(uring_s *ring, uint32_t flags)
+{
+    return &ring->bufs[(size_t)(flags >> IORING_CQE_BUFFER_SHIFT) * ring->bufsize];
+}
+
+void uring_buffer_release(uring_s *ring, uint32_t flags)
+{
+    uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (URING_NBUFS - 1)];
+    
+    buf->addr = (uint64_t)(uintptr_t)&ring->bufs[(size_t)bid * ring->bufsize];
+    buf->len = ring->bufsize;
+    buf->bid = bid;
+    ring->br_tail++;
+    __atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+int uring_wait(uring_s *ring, int timeout)
+{
+    unsigned ready = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) - *ring->cq_head;
+    
+    return uring_submit(ring, ready ? 0 : 1, timeout) < 0 ? -1 : 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_s *ring, uring_op_s *op)
+{
+    struct io_uring_sqe *sqe;
+    unsigned index;
+    int status;
+    
+    while(ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        if((status = uring_submit(ring, 0, 0)) < 0)
+            return NULL;
+        if(status)
+            continue;
+        /* Nothing was taken, the kernel holds back while the CQ is full and reaping makes room */
+        if(!uring_dispatch(ring)) {
+            log_error("io_uring submission queue stuck full.");
+            return NULL;
+        }
+    }
+    
+    index = ring->sqe_tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+int uring_submit(uring_s *ring, unsigned min_complete, int timeout)
+{
+    int status;
+    unsigned flags = 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    
+    memset(&arg, 0, sizeof arg);
+    arg.sigmask_sz = _NSIG / 8;
+    if(min_complete) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if(timeout >= 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000ll;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+    
+    do {
+        status = io_uring_enter(ring->fd, ring->to_submit, min_complete,
+                                flags | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+    } while(status < 0 && errno == EINTR);
+    
+    if(status >= 0) {
+        ring->to_submit -= (unsigned)status > ring->to_submit ? ring->to_submit : (unsigned)status;
+        return status;
+    }
+    if(errno == ETIME || errno == EBUSY || errno == EAGAIN) {
+        return 0;
+    }
+    log_error("io_uring_enter failed. Errno: %d.", errno);
+    return -1;
+}
+
+int uring_dispatch(uring_s *ring)
+{
+    int n = 0;
+    unsigned head = *ring->cq_head;
+    struct io_uring_cqe cqe;
+    uring_op_s *op;
+    
+    while(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = ring->cqes[head & *ring->cq_mask];
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        
+        op = (uring_op_s *)(uintptr_t)cqe.user_data;
+        if(op) {
+            op->on_complete(ring, op, cqe.res, cqe.flags);
+        }
+        n++;
+    }
+    return n;
+}
+
+int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
@@ -0,0 +1,63 @@
+
+#ifndef __TCPDelegate__uring__
+#define __TCPDelegate__uring__
+
+#include "general.h"
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+
+#define URING_ENTRIES 1024
+#define URING_NBUFS 512
+
+typedef struct uring_s uring_s;
+typedef struct uring_op_s uring_op_s;
+
+typedef void (*uring_complete_f)(uring_s *ring, uring_op_s *op, int res, uint32_t flags);
+
+/*
+ Embedded in the object an operation belongs to. Its address is the
+ user_data of every submission, so multishot operations keep one op
+ for as long as they stay armed.
+ */
+struct uring_op_s {
+    uring_complete_f on_complete;
+};
+
+/* Probes the running kernel for everything uring_s_ relies on. */
+extern bool uring_supported(void);
+
+/*
+ Sets up a ring along with a provided buffer group of URING_NBUFS buffers
+ of bufsize bytes each. Returns NULL if the kernel can't support it.
+ */
+extern uring_s *uring_s_(unsigned entries, unsigned bufsize);
+extern void uring_destroy(uring_s *ring);
+
+/*
+ Operations are only prepared, uring_wait submits them. With the submission
+ queue full they submit early, running whatever completions are ready if
+ the kernel won't take more until there's room for them. False if the
+ ring is stuck or broken.
+ */
+extern bool uring_accept_multishot(uring_s *ring, int fd, uring_op_s *op);
+extern bool uring_recv_multishot(uring_s *ring, int fd, uring_op_s *op);
+extern bool uring_poll_multishot(uring_s *ring, int fd, uint32_t events, uring_op_s *op);
+
+/* msg and everything it points at have to stay put until the completion. */
+extern bool uring_sendmsg(uring_s *ring, int fd, const struct msghdr *msg, int flags, uring_op_s *op);
+extern bool uring_cancel(uring_s *ring, uring_op_s *op);
+
+/* Buffer selected by a completion with IORING_CQE_F_BUFFER set. */
+extern char *uring_buffer(uring_s *ring, uint32_t flags);
+extern void uring_buffer_release(uring_s *ring, uint32_t flags);
+
+/*
+ Submits everything prepared so far and waits up to timeout milliseconds
+ (negative blocks) for a completion, which uring_dispatch then runs along
+ with all the others that are ready.
+ */
+extern int uring_wait(uring_s *ring, int timeout);
+extern int uring_dispatch(uring_s *ring);
+
+#endif /* defined(__TCPDelegate__uring__) */
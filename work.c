@@ -0,0 +1,213 @@
+#include "work.h"
+
+#include <stdatomic.h>
+
+typedef struct worker_s worker_s;
+
+struct worker_s {
+    workpool_s *pool;
+    unsigned id;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    work_s *front, *back;
+    _Atomic unsigned njobs;     /* lets thieves skip empty deques without locking */
+};
+
+struct workpool_s {
+    worker_s *workers;
+    unsigned nworkers;
+    _Atomic unsigned next;      /* worker the next submission goes to */
+    _Atomic unsigned pending;   /* submitted and not yet taken by a worker */
+    _Atomic unsigned sleepers;
+    _Atomic bool running;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;
+};
+
+static void *worker_run(void *arg);
+static work_s *worker_take(worker_s *wk);
+static work_s *worker_steal(worker_s *wk);
+static work_s *worker_pop_front(worker_s *wk);
+static work_s *worker_pop_back(worker_s *wk);
+static void worker_push_back(worker_s *wk, work_s *w);
+static void worker_sleep(worker_s *wk);
+
+workpool_s *workpool_s_(unsigned nworkers)
+{
+    workpool_s *pool = del_allocz(sizeof *pool);
+    unsigned i;
+    
+    pool->nworkers = nworkers ? nworkers : evloop_ncpus();
+    pool->workers = del_allocz(pool->nworkers * sizeof *pool->workers);
+    atomic_init(&pool->next, 0);
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->sleepers, 0);
+    atomic_init(&pool->running, true);
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    
+    for(i = 0; i < pool->nworkers; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+        pthread_mutex_init(&pool->workers[i].lock, NULL);
+        atomic_init(&pool->workers[i].njobs, 0);
+    }
+    for(i = 0; i < pool->nworkers; i++) {
+        if(pthread_create(&pool->workers[i].thread, NULL, worker_run, &pool->workers[i])) {
+            perror("Error creating worker thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    log_info("Started %u worker threads.", pool->nworkers);
+    return pool;
+}
+
+void workpool_destroy(workpool_s *pool)
+{
+    unsigned i;
+    
+    pthread_mutex_lock(&pool->idle_lock);
+    atomic_store(&pool->running, false);
+    pthread_cond_broadcast(&pool->idle);
+    pthread_mutex_unlock(&pool->idle_lock);
+    
+    for(i = 0; i < pool->nworkers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        pthread_mutex_destroy(&pool->workers[i].lock);
+    }
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->workers);
+    free(pool);
+}
+
+/*
+ pending is raised before sleepers is looked at, and a worker raises
+ sleepers before its last look at pending, so either the worker sees the
+ job or the submitter sees the sleeper and wakes it.
+ */
+void workpool_submit(workpool_s *pool, evloop_s *loop, work_s *w, work_f run, evtask_f done)
+{
+    worker_s *wk = &pool->workers[atomic_fetch_add(&pool->next, 1) % pool->nworkers];
+    
+    w->run = run;
+    w->done = done;
+    w->loop = loop;
+    worker_push_back(wk, w);
+    
+    atomic_fetch_add(&pool->pending, 1);
+    if(atomic_load(&pool->sleepers)) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+void *worker_run(void *arg)
+{
+    worker_s *wk = arg;
+    workpool_s *pool = wk->pool;
+    work_s *w;
+    
+    while(atomic_load(&pool->running)) {
+        if(!(w = worker_take(wk))) {
+            worker_sleep(wk);
+            continue;
+        }
+        atomic_fetch_sub(&pool->pending, 1);
+        w->run(w);
+        evloop_post(w->loop, w->done, w);
+    }
+    return NULL;
+}
+
+work_s *worker_take(worker_s *wk)
+{
+    work_s *w;
+    
+    if(atomic_load_explicit(&wk->njobs, memory_order_relaxed)) {
+        pthread_mutex_lock(&wk->lock);
+        w = worker_pop_front(wk);
+        pthread_mutex_unlock(&wk->lock);
+        if(w)
+            return w;
+    }
+    return worker_steal(wk);
+}
+
+/* Victims are tried starting from the next worker along, so thieves spread out. */
+work_s *worker_steal(worker_s *wk)
+{
+    workpool_s *pool = wk->pool;
+    worker_s *victim;
+    work_s *w;
+    unsigned i;
+    
+    for(i = 1; i < pool->nworkers; i++) {
+        victim = &pool->workers[(wk->id + i) % pool->nworkers];
+        if(!atomic_load_explicit(&victim->njobs, memory_order_relaxed))
+            continue;
+        pthread_mutex_lock(&victim->lock);
+        w = worker_pop_back(victim);
+        pthread_mutex_unlock(&victim->lock);
+        if(w)
+            return w;
+    }
+    return NULL;
+}
+
+void worker_sleep(worker_s *wk)
+{
+    workpool_s *pool = wk->pool;
+    
+    pthread_mutex_lock(&pool->idle_lock);
+    atomic_fetch_add(&pool->sleepers, 1);
+    while(!atomic_load(&pool->pending) && atomic_load(&pool->running))
+        pthread_cond_wait(&pool->idle, &pool->idle_lock);
+    atomic_fetch_sub(&pool->sleepers, 1);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+work_s *worker_pop_front(worker_s *wk)
+{
+    work_s *w = wk->front;
+    
+    if(!w)
+        return NULL;
+    wk->front = w->next;
+    if(wk->front)
+        wk->front->prev = NULL;
+    else
+        wk->back = NULL;
+    atomic_fetch_sub_explicit(&wk->njobs, 1, memory_order_relaxed);
+    return w;
+}
+
+work_s *worker_pop_back(worker_s *wk)
+{
+    work_s *w = wk->back;
+    
+    if(!w)
+        return NULL;
+    wk->back = w->prev;
+    if(wk->back)
+        wk->back->next = NULL;
+    else
+        wk->front = NULL;
+    atomic_fetch_sub_explicit(&wk->njobs, 1, memory_order_relaxed);
+    return w;
+}
+
+void worker_push_back(worker_s *wk, work_s *w)
+{
+    w->next = NULL;
+    pthread_mutex_lock(&wk->lock);
+    w->prev = wk->back;
+    if(wk->back)
+        wk->back->next = w;
+    else
+        wk->front = w;
+    wk->back = w;
+    atomic_fetch_add_explicit(&wk->njobs, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&wk->lock);
+}
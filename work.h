@@ -0,0 +1,43 @@
+
+#ifndef __TCPDelegate__work__
+#define __TCPDelegate__work__
+
+#include "general.h"
+#include "evloop.h"
+
+#define DEFAULT_WORKERS 0   /* one per usable cpu */
+
+typedef struct workpool_s workpool_s;
+typedef struct work_s work_s;
+
+typedef void (*work_f)(work_s *w);
+
+/*
+ A job, embedded in whatever object it works on like evhandler_s. run is
+ called on a worker thread, then done on the event loop the job was
+ submitted from, with the work_s as its argument. Until done runs the
+ owner must keep the object alive and leave whatever run touches alone.
+ */
+struct work_s {
+    work_f run;
+    evtask_f done;
+    evloop_s *loop;
+    work_s *prev, *next;
+};
+
+/*
+ Pool of threads for CPU heavy jobs that would otherwise stall an event
+ loop. Every worker has its own deque. Submissions are dealt round robin
+ onto the back of them, a worker runs its own jobs oldest first, and one
+ that runs dry steals the newest job off the back of another's before
+ going to sleep.
+ */
+extern workpool_s *workpool_s_(unsigned nworkers);
+
+/* Waits for the jobs already running, those still queued are dropped. */
+extern void workpool_destroy(workpool_s *pool);
+
+/* From an event loop thread, done is posted back to loop. */
+extern void workpool_submit(workpool_s *pool, evloop_s *loop, work_s *w, work_f run, evtask_f done);
+
+#endif /* defined(__TCPDelegate__work__) */